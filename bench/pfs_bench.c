@@ -0,0 +1,367 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Load generator for the benchmark. Every connection is a thread
+ *  which speaks the postfix policy protocol like smtpd: one request,
+ *  wait for the answer, next request. Messages are drawn from a mix of
+ *  the result classes served by pfs_dnsstub and may have several
+ *  recipients (same instance attribute). At the end it reports the
+ *  throughput and the latency percentiles.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+
+#define BENCH_CLASSES	5
+
+static const char *bench_class[BENCH_CLASSES] = {
+	"pass", "fail", "softfail", "none", "temperror"
+};
+
+/* What came back, by the action postfix would take */
+#define ANS_DUNNO		0
+#define ANS_REJECT		1
+#define ANS_TEMPFAIL	2
+#define ANS_OTHER		3
+#define ANS_COUNT		4
+
+static const char *bench_answer[ANS_COUNT] = {
+	"DUNNO", "REJECT", "450", "other"
+};
+
+typedef
+struct bench_thread_struct {
+	pthread_t			 thread;
+	int					 id;
+	long				 requests;		/* to send */
+	long				 done;
+	double				*latency;		/* seconds, one per request */
+	long				 answers[ANS_COUNT];
+	int					 failed;
+} bench_thread_t;
+
+static const char	*target = "unix:/tmp/policyd-spf-fs.sock";
+static int			 weight[BENCH_CLASSES] = { 40, 20, 10, 20, 10 };
+static int			 weight_total = 100;
+static int			 recipients = 1;
+static int			 ipv6_percent = 20;
+static int			 domains = 1000;
+
+
+static double
+bench_now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_connect(void)
+{
+	struct sockaddr_un	 sun;
+	struct addrinfo		 hints, *res, *ai;
+	char				 host[256];
+	const char			*port;
+	int					 fd = -1;
+
+	if (strncmp(target, "unix:", 5) == 0) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", target + 5);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		return fd;
+	}
+
+	port = strrchr(target, ':');
+	if (port == NULL || (size_t)(port - target) >= sizeof(host))
+		return -1;
+	snprintf(host, sizeof(host), "%.*s", (int)(port - target), target);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port + 1, &hints, &res) != 0)
+		return -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, 0);
+		if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int
+bench_pick_class(unsigned *seed)
+{
+	int		 r = rand_r(seed) % weight_total;
+	int		 i;
+
+	for (i = 0; i < BENCH_CLASSES - 1; i++) {
+		if (r < weight[i])
+			break;
+		r -= weight[i];
+	}
+	return i;
+}
+
+static int
+bench_classify(const char *answer)
+{
+	const char		*action = strstr(answer, "action=");
+
+	/* Skip the PREPEND line, the decision is on the last action */
+	while (action != NULL && strncmp(action, "action=PREPEND", 14) == 0)
+		action = strstr(action + 1, "action=");
+	if (action == NULL)
+		return ANS_OTHER;
+	action += 7;
+	if (strncmp(action, "DUNNO", 5) == 0)
+		return ANS_DUNNO;
+	if (strncmp(action, "REJECT", 6) == 0)
+		return ANS_REJECT;
+	if (strncmp(action, "450", 3) == 0)
+		return ANS_TEMPFAIL;
+	return ANS_OTHER;
+}
+
+/*
+ * Send one request and read up to the empty line ending the answer.
+ * Returns -1 if the connection broke.
+ */
+static int
+bench_request(int fd, const char *req, size_t len, char *answer, size_t size)
+{
+	size_t		 got = 0;
+	ssize_t		 n;
+
+	while (len > 0) {
+		n = write(fd, req, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		req += n;
+		len -= n;
+	}
+
+	for (;;) {
+		n = read(fd, answer + got, size - 1 - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		got += n;
+		answer[got] = '\0';
+		if (got >= 2 && strstr(answer, "\n\n") != NULL)
+			return 0;
+		if (got == size - 1)
+			return -1;
+	}
+}
+
+static void *
+bench_thread(void *arg)
+{
+	bench_thread_t		*t = (bench_thread_t *)arg;
+	unsigned			 seed = 0x5eed + t->id;
+	char				 req[1024], answer[4096], ip[64];
+	int					 fd, cls, dom, r, len;
+	long				 msg = 0;
+	double				 start;
+
+	fd = bench_connect();
+	if (fd < 0) {
+		fprintf(stderr, "Can not connect to %s: %s\n", target, strerror(errno));
+		t->failed = 1;
+		return NULL;
+	}
+
+	while (t->done < t->requests) {
+		cls = bench_pick_class(&seed);
+		dom = rand_r(&seed) % domains;
+		if ((int)(rand_r(&seed) % 100) < ipv6_percent)
+			snprintf(ip, sizeof(ip), "2001:db8:%x::%x", t->id, rand_r(&seed) & 0xffff);
+		else
+			snprintf(ip, sizeof(ip), "10.%d.%d.%d", t->id & 0xff,
+							rand_r(&seed) & 0xff, 1 + rand_r(&seed) % 254);
+		msg++;
+
+		for (r = 0; r < recipients && t->done < t->requests; r++) {
+			len = snprintf(req, sizeof(req),
+							"request=smtpd_access_policy\n"
+							"protocol_state=RCPT\n"
+							"protocol_name=ESMTP\n"
+							"client_address=%s\n"
+							"helo_name=mta%d.%s-%d.bench\n"
+							"sender=user%ld@%s-%d.bench\n"
+							"recipient=rcpt%d@example.net\n"
+							"instance=%x.%lx\n"
+							"\n",
+							ip, t->id, bench_class[cls], dom,
+							msg, bench_class[cls], dom, r, t->id, msg);
+
+			start = bench_now();
+			if (bench_request(fd, req, len, answer, sizeof(answer)) < 0) {
+				fprintf(stderr, "Connection %d broke after %ld requests\n", t->id, t->done);
+				t->failed = 1;
+				close(fd);
+				return NULL;
+			}
+			t->latency[t->done++] = bench_now() - start;
+			t->answers[bench_classify(answer)]++;
+		}
+	}
+
+	close(fd);
+	return NULL;
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double		 x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+bench_percentile(double *sorted, long n, double p)
+{
+	long		 i = (long)(p * n);
+
+	if (i >= n)
+		i = n - 1;
+	return sorted[i] * 1000.0;
+}
+
+/* "pass=40,fail=20,none=40"; classes not named get no weight */
+static int
+bench_parse_mix(char *spec)
+{
+	char		*item, *eq, *save = NULL;
+	int			 i;
+
+	memset(weight, 0, sizeof(weight));
+	weight_total = 0;
+	for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+		if ((eq = strchr(item, '=')) == NULL)
+			return -1;
+		*eq = '\0';
+		for (i = 0; i < BENCH_CLASSES; i++)
+			if (strcmp(item, bench_class[i]) == 0)
+				break;
+		if (i == BENCH_CLASSES)
+			return -1;
+		weight[i] = atoi(eq + 1);
+		weight_total += weight[i];
+	}
+	return weight_total > 0 ? 0 : -1;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s unix:/path|host:port] [-c connections] [-n requests]\n"
+		"          [-m pass=40,fail=20,softfail=10,none=20,temperror=10]\n"
+		"          [-r recipients] [-6 ipv6_percent] [-D domains]\n", prog);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bench_thread_t		*threads;
+	double				*all, start, elapsed;
+	long				 requests = 20000, total = 0, answers[ANS_COUNT];
+	int					 conns = 20, failed = 0;
+	int					 c, i, k;
+
+	while ((c = getopt(argc, argv, "s:c:n:m:r:6:D:")) != -1) {
+		switch (c) {
+			case 's': target = optarg; break;
+			case 'c': conns = atoi(optarg); break;
+			case 'n': requests = atol(optarg); break;
+			case 'm':
+				if (bench_parse_mix(optarg) < 0) {
+					fprintf(stderr, "Bad mix, classes are pass fail softfail none temperror\n");
+					return 2;
+				}
+				break;
+			case 'r': recipients = atoi(optarg); break;
+			case '6': ipv6_percent = atoi(optarg); break;
+			case 'D': domains = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (conns < 1 || requests < conns || recipients < 1 || domains < 1)
+		usage(argv[0]);
+
+	threads = (bench_thread_t *)calloc(conns, sizeof(bench_thread_t));
+	all = (double *)malloc(requests * sizeof(double));
+	for (i = 0; i < conns; i++) {
+		threads[i].id = i;
+		threads[i].requests = requests / conns + (i < requests % conns);
+		threads[i].latency = (double *)malloc(threads[i].requests * sizeof(double));
+	}
+
+	start = bench_now();
+	for (i = 0; i < conns; i++)
+		pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+	memset(answers, 0, sizeof(answers));
+	for (i = 0; i < conns; i++) {
+		pthread_join(threads[i].thread, NULL);
+		memcpy(all + total, threads[i].latency, threads[i].done * sizeof(double));
+		total += threads[i].done;
+		failed += threads[i].failed;
+		for (k = 0; k < ANS_COUNT; k++)
+			answers[k] += threads[i].answers[k];
+		free(threads[i].latency);
+	}
+	elapsed = bench_now() - start;
+
+	if (total == 0) {
+		fprintf(stderr, "No request was answered\n");
+		return 1;
+	}
+	qsort(all, total, sizeof(double), bench_cmp);
+
+	printf("requests   %ld over %d connections, %d recipients per message\n",
+					total, conns, recipients);
+	printf("throughput %.0f req/s in %.2f s\n", total / elapsed, elapsed);
+	printf("latency    p50 %.3f ms  p99 %.3f ms  p999 %.3f ms  max %.3f ms\n",
+					bench_percentile(all, total, 0.50),
+					bench_percentile(all, total, 0.99),
+					bench_percentile(all, total, 0.999),
+					all[total - 1] * 1000.0);
+	printf("answers   ");
+	for (k = 0; k < ANS_COUNT; k++)
+		printf(" %s %ld", bench_answer[k], answers[k]);
+	printf("\n");
+
+	free(all);
+	free(threads);
+	return failed ? 1 : 0;
+}
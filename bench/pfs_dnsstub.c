@@ -0,0 +1,353 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Authoritative stub DNS server for the benchmark. It serves the
+ *  synthetic zone "bench" over UDP on localhost, answering every query
+ *  after a fixed latency:
+ *
+ *    pass-N.bench       v=spf1 +all
+ *    fail-N.bench       v=spf1 -all
+ *    softfail-N.bench   v=spf1 ~all
+ *    none-N.bench       NXDOMAIN
+ *    temperror-N.bench  SERVFAIL
+ *
+ *  With -d depth > 0 the pass, fail and softfail records reach their
+ *  verdict through a chain of that many includes (1.X, 2.X, ...).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define STUB_PKTSIZE	512
+/* Answers waiting for their latency to pass, in the order they are due */
+#define STUB_QUEUE		4096
+
+#define T_TXT_		16
+#define T_SOA_		6
+
+#define RCODE_OK		0
+#define RCODE_SERVFAIL	2
+#define RCODE_NXDOMAIN	3
+
+typedef
+struct stub_answer_struct {
+	struct sockaddr_in	 addr;
+	double				 due;
+	size_t				 len;
+	unsigned char		 pkt[STUB_PKTSIZE];
+} stub_answer_t;
+
+static stub_answer_t	 queue[STUB_QUEUE];
+static unsigned			 queue_head, queue_tail;
+
+static int				 latency_ms = 0;
+static int				 depth = 0;
+static unsigned			 ttl = 300;
+static unsigned long	 queries, dropped;
+
+static volatile sig_atomic_t running = 1;
+
+
+static double
+stub_now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+stub_stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+static unsigned char *
+stub_put16(unsigned char *p, unsigned v)
+{
+	*p++ = v >> 8;
+	*p++ = v;
+	return p;
+}
+
+static unsigned char *
+stub_put32(unsigned char *p, unsigned v)
+{
+	p = stub_put16(p, v >> 16);
+	return stub_put16(p, v & 0xffff);
+}
+
+/* Write a dotted name as labels, no compression */
+static unsigned char *
+stub_put_name(unsigned char *p, const char *name)
+{
+	const char		*dot;
+	size_t			 len;
+
+	while (*name) {
+		dot = strchr(name, '.');
+		len = dot ? (size_t)(dot - name) : strlen(name);
+		*p++ = len;
+		memcpy(p, name, len);
+		p += len;
+		name += len + (dot != NULL);
+	}
+	*p++ = 0;
+	return p;
+}
+
+/*
+ * The TXT record of name, or NULL if there is none; *rcode tells why.
+ * name is lower case and has "bench" already stripped.
+ */
+static const char *
+stub_record(const char *name, int *rcode, char *buf, size_t buflen)
+{
+	const char		*base = name;
+	const char		*dash;
+	int				 level = 0;
+	char			 all;
+
+	/* 1.pass-3 is the first include below pass-3 */
+	if (isdigit((unsigned char)*name)) {
+		level = atoi(name);
+		base = strchr(name, '.');
+		if (base == NULL)
+			goto nxdomain;
+		base++;
+	}
+	if ((dash = strchr(base, '-')) == NULL || strchr(base, '.') != NULL)
+		goto nxdomain;
+
+	if (strncmp(base, "temperror-", 10) == 0) {
+		*rcode = RCODE_SERVFAIL;
+		return NULL;
+	}
+	if (strncmp(base, "pass-", 5) == 0)
+		all = '+';
+	else if (strncmp(base, "fail-", 5) == 0)
+		all = '-';
+	else if (strncmp(base, "softfail-", 9) == 0)
+		all = '~';
+	else
+		goto nxdomain;
+	if (level > depth)
+		goto nxdomain;
+
+	*rcode = RCODE_OK;
+	if (depth == 0)
+		snprintf(buf, buflen, "v=spf1 %call", all);
+	else if (level == depth)
+		/* The include matches only if the end of the chain passes */
+		snprintf(buf, buflen, "v=spf1 %call", all == '+' ? '+' : '-');
+	else
+		snprintf(buf, buflen, "v=spf1 include:%d.%s.bench %call", level + 1,
+						base, level == 0 && all != '+' ? all : '-');
+	return buf;
+
+  nxdomain:
+	*rcode = RCODE_NXDOMAIN;
+	return NULL;
+}
+
+/* Build the answer to the query in pkt, in place. Returns its length or 0 */
+static size_t
+stub_answer(unsigned char *pkt, size_t len)
+{
+	char			 name[256], txt[256];
+	unsigned char	*p = pkt + 12, *end = pkt + len, *out;
+	const char		*record;
+	size_t			 n = 0, tlen;
+	unsigned		 qtype;
+	int				 rcode;
+
+	if (len < 12 || (pkt[2] & 0x80) || pkt[4] != 0 || pkt[5] != 1)
+		return 0;
+
+	while (p < end && *p) {
+		if (*p > 63 || p + 1 + *p >= end || n + *p + 1 >= sizeof(name))
+			return 0;
+		if (n)
+			name[n++] = '.';
+		memcpy(name + n, p + 1, *p);
+		n += *p;
+		p += 1 + *p;
+	}
+	if (p + 5 > end)
+		return 0;
+	name[n] = '\0';
+	for (n = 0; name[n]; n++)
+		name[n] = tolower((unsigned char)name[n]);
+	qtype = (p[1] << 8) | p[2];
+	out = p + 5;
+
+	n = strlen(name);
+	if (n > 6 && strcmp(name + n - 6, ".bench") == 0) {
+		name[n - 6] = '\0';
+		record = stub_record(name, &rcode, txt, sizeof(txt));
+	}
+	else {
+		record = NULL;
+		rcode = RCODE_NXDOMAIN;
+	}
+
+	pkt[2] = 0x84 | (pkt[2] & 0x01);	/* QR, AA, keep RD */
+	pkt[3] = rcode;
+	memset(pkt + 6, 0, 6);
+
+	if (record != NULL && qtype == T_TXT_) {
+		tlen = strlen(record);
+		out = stub_put16(out, 0xc00c);
+		out = stub_put16(out, T_TXT_);
+		out = stub_put16(out, 1);
+		out = stub_put32(out, ttl);
+		out = stub_put16(out, tlen + 1);
+		*out++ = tlen;
+		memcpy(out, record, tlen);
+		out += tlen;
+		pkt[7] = 1;
+	}
+	else if (rcode != RCODE_SERVFAIL) {
+		/* NXDOMAIN or no data: the SOA gives the negative TTL */
+		unsigned char	*rdlen;
+
+		out = stub_put_name(out, "bench");
+		out = stub_put16(out, T_SOA_);
+		out = stub_put16(out, 1);
+		out = stub_put32(out, ttl);
+		rdlen = out;
+		out += 2;
+		out = stub_put_name(out, "ns.bench");
+		out = stub_put_name(out, "hostmaster.bench");
+		out = stub_put32(out, 1);
+		out = stub_put32(out, 3600);
+		out = stub_put32(out, 600);
+		out = stub_put32(out, 86400);
+		out = stub_put32(out, ttl);
+		stub_put16(rdlen, out - rdlen - 2);
+		pkt[9] = 1;
+	}
+	return out - pkt;
+}
+
+static void
+stub_send_due(int fd, double now)
+{
+	stub_answer_t	*a;
+
+	while (queue_head != queue_tail) {
+		a = &queue[queue_head % STUB_QUEUE];
+		if (a->due > now)
+			break;
+		sendto(fd, a->pkt, a->len, 0, (struct sockaddr *)&a->addr, sizeof(a->addr));
+		queue_head++;
+	}
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p port] [-l latency_ms] [-d include_depth] [-t ttl]\n", prog);
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in	 sin;
+	struct pollfd		 pfd;
+	stub_answer_t		*a;
+	socklen_t			 alen;
+	ssize_t				 n;
+	int					 port = 5353;
+	int					 fd, c, timeout;
+	double				 now;
+
+	while ((c = getopt(argc, argv, "p:l:d:t:")) != -1) {
+		switch (c) {
+			case 'p': port = atoi(optarg); break;
+			case 'l': latency_ms = atoi(optarg); break;
+			case 'd': depth = atoi(optarg); break;
+			case 't': ttl = atoi(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (depth < 0 || depth > 9) {
+		fprintf(stderr, "Include depth must be 0..9, SPF allows 10 lookups\n");
+		return 2;
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+		fprintf(stderr, "Can not bind 127.0.0.1:%d: %s\n", port, strerror(errno));
+		return 1;
+	}
+
+	signal(SIGTERM, stub_stop);
+	signal(SIGINT, stub_stop);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (running) {
+		now = stub_now();
+		stub_send_due(fd, now);
+
+		timeout = -1;
+		if (queue_head != queue_tail) {
+			timeout = (queue[queue_head % STUB_QUEUE].due - now) * 1000 + 1;
+			if (timeout < 0)
+				timeout = 0;
+		}
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		for (;;) {
+			if (queue_tail - queue_head == STUB_QUEUE) {
+				/* Full: behave like a congested server */
+				char	 drop[STUB_PKTSIZE];
+
+				if (recv(fd, drop, sizeof(drop), MSG_DONTWAIT) < 0)
+					break;
+				dropped++;
+				continue;
+			}
+			a = &queue[queue_tail % STUB_QUEUE];
+			alen = sizeof(a->addr);
+			n = recvfrom(fd, a->pkt, sizeof(a->pkt), MSG_DONTWAIT,
+							(struct sockaddr *)&a->addr, &alen);
+			if (n < 0)
+				break;
+			queries++;
+			a->len = stub_answer(a->pkt, n);
+			if (a->len == 0)
+				continue;
+			a->due = stub_now() + latency_ms / 1000.0;
+			queue_tail++;
+		}
+	}
+
+	fprintf(stderr, "dnsstub: %lu queries, %lu dropped\n", queries, dropped);
+	return 0;
+}
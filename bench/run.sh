@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# policyd-spf-fs - SPF Policy Deamon for Postfix
+#
+# Run the benchmark: start the stub DNS server and the daemon on
+# private ports, replay the request mix and print the report.
+# Everything is tuned through the environment, e.g.
+#
+#   make bench BENCH_LATENCY=20 BENCH_DEPTH=3 BENCH_WORKERS=4
+#
+
+BENCH_DIR=`dirname "$0"`
+DAEMON=${DAEMON:-$BENCH_DIR/../policyd-spf-fs}
+
+BENCH_REQUESTS=${BENCH_REQUESTS:-20000}
+BENCH_CONNS=${BENCH_CONNS:-20}
+BENCH_MIX=${BENCH_MIX:-pass=40,fail=20,softfail=10,none=20,temperror=10}
+BENCH_RCPTS=${BENCH_RCPTS:-2}
+BENCH_IPV6=${BENCH_IPV6:-20}
+BENCH_DOMAINS=${BENCH_DOMAINS:-1000}
+BENCH_LATENCY=${BENCH_LATENCY:-5}
+BENCH_DEPTH=${BENCH_DEPTH:-0}
+BENCH_WORKERS=${BENCH_WORKERS:-0}
+BENCH_DNS_PORT=${BENCH_DNS_PORT:-15353}
+BENCH_ARGS=${BENCH_ARGS:-}
+
+SOCK=/tmp/pfs-bench.$$.sock
+
+cleanup() {
+	[ -n "$DAEMON_PID" ] && kill $DAEMON_PID 2>/dev/null
+	[ -n "$STUB_PID" ] && kill $STUB_PID 2>/dev/null
+	wait 2>/dev/null
+	rm -f $SOCK
+}
+trap cleanup EXIT INT TERM
+
+$BENCH_DIR/pfs_dnsstub -p $BENCH_DNS_PORT -l $BENCH_LATENCY -d $BENCH_DEPTH &
+STUB_PID=$!
+
+WORKERS=
+[ "$BENCH_WORKERS" -gt 0 ] && WORKERS="--workers $BENCH_WORKERS"
+$DAEMON --listen unix:$SOCK --dns-server 127.0.0.1:$BENCH_DNS_PORT \
+	--name bench.invalid $WORKERS $BENCH_ARGS &
+DAEMON_PID=$!
+
+# Wait for the socket
+i=0
+while [ ! -S $SOCK ]; do
+	i=`expr $i + 1`
+	if [ $i -gt 50 ]; then
+		echo "policyd-spf-fs did not start" >&2
+		exit 1
+	fi
+	sleep 0.1
+done
+
+echo "dns latency ${BENCH_LATENCY} ms, include depth ${BENCH_DEPTH}, workers ${BENCH_WORKERS}, mix ${BENCH_MIX}"
+$BENCH_DIR/pfs_bench -s unix:$SOCK -c $BENCH_CONNS -n $BENCH_REQUESTS \
+	-m $BENCH_MIX -r $BENCH_RCPTS -6 $BENCH_IPV6 -D $BENCH_DOMAINS
@@ -0,0 +1,79 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Request arena
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfs_arena.h"
+
+#define PFS_ARENA_ALIGN(n)	(((n) + 15) & ~(size_t)15)
+
+struct pfs_arena_chunk_struct {
+	pfs_arena_chunk_t	*next;
+	size_t				 pad;		/* keep data 16 byte aligned */
+	char				 data[];
+};
+
+
+void
+pfs_arena_init(pfs_arena_t *arena, void *buf, size_t size)
+{
+	arena->base = (char *)buf;
+	arena->size = size;
+	arena->used = 0;
+	arena->extra = NULL;
+}
+
+void *
+pfs_arena_alloc(pfs_arena_t *arena, size_t size)
+{
+	pfs_arena_chunk_t	*chunk;
+	void				*p;
+
+	size = PFS_ARENA_ALIGN(size);
+	if (arena->size - arena->used >= size) {
+		p = arena->base + arena->used;
+		arena->used += size;
+		return p;
+	}
+
+	/* Rare: a request with huge attributes gets a chunk of its own */
+	chunk = (pfs_arena_chunk_t *)malloc(sizeof(pfs_arena_chunk_t) + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->next = arena->extra;
+	arena->extra = chunk;
+	return chunk->data;
+}
+
+char *
+pfs_arena_strdup(pfs_arena_t *arena, const char *s)
+{
+	size_t		 len = strlen(s) + 1;
+	char		*p;
+
+	p = (char *)pfs_arena_alloc(arena, len);
+	if (p != NULL)
+		memcpy(p, s, len);
+	return p;
+}
+
+void
+pfs_arena_reset(pfs_arena_t *arena)
+{
+	pfs_arena_chunk_t	*chunk;
+
+	while ((chunk = arena->extra) != NULL) {
+		arena->extra = chunk->next;
+		free(chunk);
+	}
+	arena->used = 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Bump allocator for data that lives exactly as long as one request.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_ARENA_H
+#define PFS_ARENA_H
+
+#include <stddef.h>
+
+typedef struct pfs_arena_chunk_struct pfs_arena_chunk_t;
+
+/*
+ * The first block is supplied by the owner, usually embedded in the
+ * structure the data belongs to, so the common case never calls malloc.
+ * Only what does not fit goes to extra chunks, freed by pfs_arena_reset.
+ */
+typedef
+struct pfs_arena_struct {
+	char				*base;
+	size_t				 size;
+	size_t				 used;
+	pfs_arena_chunk_t	*extra;
+} pfs_arena_t;
+
+void pfs_arena_init(pfs_arena_t *arena, void *buf, size_t size);
+void *pfs_arena_alloc(pfs_arena_t *arena, size_t size);
+char *pfs_arena_strdup(pfs_arena_t *arena, const char *s);
+void pfs_arena_reset(pfs_arena_t *arena);
+
+#endif
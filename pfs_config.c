@@ -0,0 +1,367 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Reloadable configuration, read-copy-update style. A reload builds a
+ *  complete new generation aside (settings, address lists, a handle on
+ *  the shared result cache under the new fingerprint) and publishes it
+ *  by bumping the generation number. Engines compare that number before
+ *  each request and only then take a reference on the new generation;
+ *  requests already running finish on the one they started with, which
+ *  goes away with its last reference. The DNS, compiled record and peer
+ *  caches are not part of a generation and are kept as they are; the
+ *  peers tell results apart by a seed taken from the fingerprint. The
+ *  HELO memo, the netblock cache and the flattened records hold texts
+ *  of responses: a new generation takes them over from the current one
+ *  as long as the fingerprint stays the same, and starts empty ones
+ *  otherwise.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_config.h"
+#include "pfs_iplist.h"
+#include "pfs_domain_map.h"
+#include "pfs_helo_memo.h"
+#include "pfs_netblock.h"
+#include "pfs_flatten.h"
+#include "pfs_shm_cache.h"
+#include "pfs_peer.h"
+#include "pfs_log.h"
+
+#define PFS_CONFIG_MAX		(64 * 1024)
+
+#define X_OR_EMPTY(x) ((x) ? (x) : "")
+
+/* Caches shared by the generations of one fingerprint */
+struct pfs_config_caches_struct {
+	char					*fingerprint;
+	int						 refs;
+	pfs_helo_memo_t			*helo_memo;
+	pfs_netblock_t			*netblock;
+	pfs_flatten_t			*flatten;
+};
+
+static SPF_client_options_t	 base;		/* from the command line */
+static pthread_mutex_t		 lock = PTHREAD_MUTEX_INITIALIZER;
+static pfs_config_t			*current;
+static unsigned				 generation;
+
+
+static void
+pfs_config_caches_release(pfs_config_caches_t *caches)
+{
+	if (__atomic_sub_fetch(&caches->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (caches->helo_memo)
+		pfs_helo_memo_free(caches->helo_memo);
+	if (caches->netblock)
+		pfs_netblock_free(caches->netblock);
+	if (caches->flatten)
+		pfs_flatten_free(caches->flatten);
+	free(caches->fingerprint);
+	free(caches);
+}
+
+/*
+ * The caches of the current generation if it has the same fingerprint,
+ * else new ones
+ */
+static pfs_config_caches_t *
+pfs_config_caches(SPF_client_options_t *opts, const char *fingerprint)
+{
+	pfs_config_caches_t	*caches = NULL;
+
+	pthread_mutex_lock(&lock);
+	if (current && strcmp(current->caches->fingerprint, fingerprint) == 0) {
+		caches = current->caches;
+		__atomic_add_fetch(&caches->refs, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&lock);
+	if (caches)
+		return caches;
+
+	caches = (pfs_config_caches_t *)calloc(1, sizeof(pfs_config_caches_t));
+	caches->fingerprint = strdup(fingerprint);
+	caches->refs = 1;
+	caches->helo_memo = pfs_helo_memo_new(PFS_HELO_MEMO_SIZE, PFS_HELO_MEMO_TTL);
+	/* A local policy is evaluated before the domain's terms, for any client */
+	if (opts->localpolicy == NULL && !opts->use_trusted) {
+		caches->netblock = pfs_netblock_new(PFS_NETBLOCK_SIZE);
+		/* Only the engine flattens, in the background */
+		if (opts->listen || opts->file)
+			caches->flatten = pfs_flatten_new(PFS_FLATTEN_SIZE);
+	}
+	return caches;
+}
+
+static void
+pfs_config_free(pfs_config_t *config)
+{
+	if (config->opts.iplist)
+		pfs_iplist_close(config->opts.iplist);
+	if (config->opts.override_map)
+		pfs_domain_map_close(config->opts.override_map);
+	if (config->opts.fallback_map)
+		pfs_domain_map_close(config->opts.fallback_map);
+	if (config->caches)
+		pfs_config_caches_release(config->caches);
+	if (config->opts.result_cache)
+		pfs_shm_cache_close(config->opts.result_cache);
+	free(config->text);
+	free(config);
+}
+
+/* Apply one "name = value" line, names as the long options */
+static int
+pfs_config_set(SPF_client_options_t *opts, const char *name, char *value)
+{
+	if (strcmp(name, "local") == 0)
+		opts->localpolicy = value;
+	else if (strcmp(name, "trusted") == 0)
+		opts->use_trusted = atoi(value);
+	else if (strcmp(name, "guess") == 0)
+		opts->fallback = value;
+	else if (strcmp(name, "default-explanation") == 0)
+		opts->explanation = value;
+	else if (strcmp(name, "max-lookup") == 0)
+		opts->max_lookup = atoi(value);
+	else if (strcmp(name, "sanitize") == 0)
+		opts->sanitize = atoi(value);
+	else if (strcmp(name, "name") == 0)
+		opts->rec_dom = value;
+	else if (strcmp(name, "helo-check") == 0)
+		opts->helo_check = atoi(value);
+	else if (strcmp(name, "deadline-ms") == 0)
+		opts->deadline_ms = atoi(value);
+	else if (strcmp(name, "deadline-action") == 0)
+		opts->deadline_action = value;
+	else
+		return -1;
+	return 0;
+}
+
+static int
+pfs_config_read(pfs_config_t *config, const char *path)
+{
+	FILE			*fp;
+	size_t			 len;
+	char			*line, *next, *eq, *name, *value, *end;
+	int				 lineno = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		pfs_log(LOG_ERR, "Can not read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	config->text = (char *)malloc(PFS_CONFIG_MAX + 1);
+	len = fread(config->text, 1, PFS_CONFIG_MAX + 1, fp);
+	fclose(fp);
+	if (len > PFS_CONFIG_MAX) {
+		pfs_log(LOG_ERR, "%s is larger than %d bytes\n", path, PFS_CONFIG_MAX);
+		return -1;
+	}
+	config->text[len] = '\0';
+
+	for (line = config->text; line != NULL; line = next) {
+		lineno++;
+		if ((next = strchr(line, '\n')) != NULL)
+			*next++ = '\0';
+		for (name = line; isspace((unsigned char)*name); name++)
+			;
+		if (*name == '\0' || *name == '#')
+			continue;
+
+		if ((eq = strchr(name, '=')) == NULL) {
+			pfs_log(LOG_ERR, "%s:%d: expected name = value\n", path, lineno);
+			return -1;
+		}
+		for (end = eq; end > name && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		for (value = eq + 1; isspace((unsigned char)*value); value++)
+			;
+		for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+
+		if (pfs_config_set(&config->opts, name, value) < 0) {
+			pfs_log(LOG_ERR, "%s:%d: %s can not be set here\n", path, lineno, name);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* FNV-1a over s and its NUL, so that no two lists of fields run together */
+static uint64_t
+pfs_config_hash(uint64_t h, const char *s)
+{
+	const char			*p = X_OR_EMPTY(s);
+
+	do
+		h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+	while (*p++ != '\0');
+	return h;
+}
+
+static pfs_config_t *
+pfs_config_build(void)
+{
+	pfs_config_t		*config;
+	SPF_client_options_t	*opts;
+	char				 numbers[128], fingerprint[17];
+	uint64_t			 h;
+
+	config = (pfs_config_t *)calloc(1, sizeof(pfs_config_t));
+	config->opts = base;
+	opts = &config->opts;
+
+	if (base.config_file && pfs_config_read(config, base.config_file) < 0)
+		goto fail;
+
+	if (opts->allowlist_file || opts->denylist_file) {
+		opts->iplist = pfs_iplist_open(opts->allowlist_file, opts->denylist_file);
+		if (opts->iplist == NULL)
+			goto fail;
+	}
+
+	if (opts->override_file
+					&& (opts->override_map = pfs_domain_map_open(opts->override_file)) == NULL)
+		goto fail;
+	if (opts->fallback_file
+					&& (opts->fallback_map = pfs_domain_map_open(opts->fallback_file)) == NULL)
+		goto fail;
+
+	/* Instances with other settings must not share responses, however long they are */
+	snprintf(numbers, sizeof(numbers), "%d|%d|%d|%d|%llx|%llx",
+					opts->use_trusted, opts->max_lookup, opts->sanitize, opts->helo_check,
+					opts->override_map ? (unsigned long long)pfs_domain_map_digest(opts->override_map) : 0ULL,
+					opts->fallback_map ? (unsigned long long)pfs_domain_map_digest(opts->fallback_map) : 0ULL);
+	h = pfs_config_hash(0xcbf29ce484222325ULL, opts->rec_dom);
+	h = pfs_config_hash(h, opts->localpolicy);
+	h = pfs_config_hash(h, opts->explanation);
+	h = pfs_config_hash(h, opts->fallback);
+	h = pfs_config_hash(h, numbers);
+	snprintf(fingerprint, sizeof(fingerprint), "%016llx", (unsigned long long)h);
+	if (opts->peer)
+		opts->peer_seed = pfs_peer_seed(fingerprint);
+
+	/* What was learnt under other settings may not hold any more */
+	config->caches = pfs_config_caches(opts, fingerprint);
+	opts->helo_memo = config->caches->helo_memo;
+	opts->netblock = config->caches->netblock;
+	opts->flatten = config->caches->flatten;
+
+	if (opts->shm_cache) {
+		opts->result_cache = pfs_shm_cache_open(opts->shm_cache, fingerprint);
+		if (opts->result_cache == NULL)
+			pfs_log(LOG_WARNING, "Running without shared cache\n");
+	}
+	return config;
+
+  fail:
+	pfs_config_free(config);
+	return NULL;
+}
+
+static void
+pfs_config_publish(pfs_config_t *config)
+{
+	pfs_config_t		*old;
+
+	pthread_mutex_lock(&lock);
+	old = current;
+	config->refs = 1;		/* held by current */
+	config->generation = generation + 1;
+	current = config;
+	__atomic_store_n(&generation, config->generation, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lock);
+
+	if (old)
+		pfs_config_release(old);
+}
+
+int
+pfs_config_init(SPF_client_options_t *opts)
+{
+	pfs_config_t		*config;
+
+	base = *opts;
+	base.iplist = NULL;
+	base.result_cache = NULL;
+	base.override_map = base.fallback_map = NULL;
+	base.helo_memo = NULL;
+	base.netblock = NULL;
+	base.flatten = NULL;
+	if ((config = pfs_config_build()) == NULL)
+		return -1;
+	pfs_config_publish(config);
+	return 0;
+}
+
+void
+pfs_config_shutdown(void)
+{
+	pfs_config_t		*old;
+
+	pthread_mutex_lock(&lock);
+	old = current;
+	current = NULL;
+	pthread_mutex_unlock(&lock);
+
+	if (old)
+		pfs_config_release(old);
+}
+
+int
+pfs_config_reload(void)
+{
+	pfs_config_t		*config;
+
+	if ((config = pfs_config_build()) == NULL) {
+		pfs_log(LOG_WARNING, "Keeping configuration %u\n", pfs_config_generation());
+		return -1;
+	}
+	pfs_config_publish(config);
+	pfs_log(LOG_INFO, "Configuration %u in use for new requests\n", config->generation);
+	return 0;
+}
+
+unsigned
+pfs_config_generation(void)
+{
+	return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+pfs_config_t *
+pfs_config_acquire(void)
+{
+	pfs_config_t		*config;
+
+	pthread_mutex_lock(&lock);
+	config = current;
+	if (config)
+		__atomic_add_fetch(&config->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&lock);
+	return config;
+}
+
+void
+pfs_config_release(pfs_config_t *config)
+{
+	if (__atomic_sub_fetch(&config->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		pfs_config_free(config);
+}
@@ -0,0 +1,60 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Reloadable configuration: the settings which shape a response,
+ *  from the command line and --config, swapped as a whole on SIGHUP.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_CONFIG_H
+#define PFS_CONFIG_H
+
+#include "policyd-spf-fs.h"
+
+typedef struct pfs_config_caches_struct pfs_config_caches_t;
+
+/*
+ * One generation of the configuration. Nothing in it changes once it
+ * is published; a reload publishes a new one.
+ */
+typedef
+struct pfs_config_struct {
+	SPF_client_options_t	 opts;		/* the settings of this generation */
+	unsigned				 generation;
+	int						 refs;
+	char					*text;		/* --config file, opts point into it */
+	pfs_config_caches_t		*caches;	/* opts point into it too */
+} pfs_config_t;
+
+/*
+ * Publish the first generation: opts as given on the command line, with
+ * the settings from opts->config_file on top, and the address lists and
+ * the shared result cache it needs. opts itself is remembered as the
+ * base of every reload. Returns -1 and logs to syslog on failure.
+ */
+int pfs_config_init(SPF_client_options_t *opts);
+
+/* Drop the current generation; the others go with their last user */
+void pfs_config_shutdown(void);
+
+/*
+ * Build the next generation from the command line and the files as
+ * they are now and publish it. On error the current one stays.
+ */
+int pfs_config_reload(void);
+
+/*
+ * The generation new requests should use. Cheap enough to check before
+ * every request; only take a reference when it differs from the one held.
+ */
+unsigned pfs_config_generation(void);
+
+/* The current generation, kept alive until pfs_config_release */
+pfs_config_t *pfs_config_acquire(void);
+void pfs_config_release(pfs_config_t *config);
+
+#endif
@@ -0,0 +1,847 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Daemon mode: a single long-lived process that accepts policy
+ *  connections from all smtpd processes on a unix or inet socket and
+ *  multiplexes them over one epoll loop. Without --workers the loop
+ *  also drives an evaluation engine, so slow DNS answers for one
+ *  request never hold up the others.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#define _GNU_SOURCE		/* accept4 */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_daemon.h"
+#include "pfs_engine.h"
+#include "pfs_pool.h"
+#include "pfs_metrics.h"
+#include "pfs_config.h"
+#include "pfs_peer.h"
+#include "pfs_log.h"
+
+#define PFS_MAX_EVENTS	64
+#define PFS_READ_CHUNK	4096
+/* Unparsed input allowed per connection before we give up on the client */
+#define PFS_MAX_INPUT	65536
+/* Buckets of the table of evaluations in flight */
+#define PFS_FLIGHT_BUCKETS	1024
+/* ns without shedding before the overload is logged as over */
+#define PFS_SHED_QUIET		(10 * 1000000000ULL)
+
+#define X_OR_EMPTY(x) ((x) ? (x) : "")
+
+#define PFS_WATCH_LISTEN	1
+#define PFS_WATCH_SIGNAL	2
+#define PFS_WATCH_CONN		3
+#define PFS_WATCH_POOL		4
+#define PFS_WATCH_ENGINE	5
+#define PFS_WATCH_PEER		6
+
+typedef
+struct pfs_conn_struct {
+	int			 fd;
+	int			 kind;		/* PFS_WATCH_* */
+
+	char		*in;
+	size_t		 in_len;
+	size_t		 in_size;
+
+	char		*out;
+	size_t		 out_off;
+	size_t		 out_len;
+	size_t		 out_size;
+
+	SPF_client_request_t req;	/* points into in while parsing */
+	SPF_client_memo_t memo;	/* last answered message */
+
+	/* Requests being evaluated, in the order they arrived */
+	pfs_job_t	*jobs_head;
+	pfs_job_t	*jobs_tail;
+	int			 eof;		/* nothing more to read, close once all is answered */
+	int			 closed;	/* fd is gone, free once jobs_head is empty */
+	int			 ready;		/* on the list of connections to collect */
+	struct pfs_conn_struct *ready_next;
+} pfs_conn_t;
+
+typedef
+struct pfs_daemon_struct {
+	SPF_client_options_t	*opts;
+	pfs_engine_t			*engine;	/* without --workers */
+	pfs_pool_t				*pool;
+	int						 epfd;
+	pfs_conn_t				*ready;		/* connections with finished jobs */
+	pfs_job_t				*free_jobs;	/* recycled, arenas included */
+	pfs_job_t				*flights[PFS_FLIGHT_BUCKETS];	/* being evaluated */
+	int						 shed;		/* requests shed since overloaded */
+	uint64_t				 shed_last;	/* when the last one was */
+} pfs_daemon_t;
+
+
+static int
+pfs_listen_unix(const char *path)
+{
+	struct sockaddr_un	 sun;
+	struct stat			 st;
+	int					 fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		pfs_log(LOG_ERR, "Socket path too long: %s\n", path);
+		return -1;
+	}
+
+	/* Remove a stale socket from a previous run, but nothing else */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		pfs_log(LOG_ERR, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		pfs_log(LOG_ERR, "bind %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	/* Access is controlled by the directory, like postfix private/ */
+	chmod(path, 0666);
+
+	return fd;
+}
+
+static int
+pfs_listen_inet(const char *spec)
+{
+	struct addrinfo		 hints, *ai, *aip;
+	char				 host[256];
+	const char			*port;
+	const char			*colon;
+	int					 fd = -1;
+	int					 one = 1;
+	int					 err;
+
+	colon = strrchr(spec, ':');
+	if (colon == NULL || colon - spec >= (int)sizeof(host)) {
+		pfs_log(LOG_ERR, "Invalid inet listen address: %s\n", spec);
+		return -1;
+	}
+	port = colon + 1;
+
+	/* Strip brackets from [ipv6]:port */
+	if (spec[0] == '[' && colon > spec && colon[-1] == ']') {
+		memcpy(host, spec + 1, colon - spec - 2);
+		host[colon - spec - 2] = '\0';
+	}
+	else {
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	err = getaddrinfo((host[0] && strcmp(host, "*")) ? host : NULL, port, &hints, &ai);
+	if (err) {
+		pfs_log(LOG_ERR, "%s: %s\n", spec, gai_strerror(err));
+		return -1;
+	}
+
+	for (aip = ai; aip != NULL; aip = aip->ai_next) {
+		fd = socket(aip->ai_family, aip->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+						aip->ai_protocol);
+		if (fd < 0)
+			continue;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, aip->ai_addr, aip->ai_addrlen) == 0)
+			break;
+		pfs_log(LOG_ERR, "bind %s: %s\n", spec, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai);
+	return fd;
+}
+
+static int
+pfs_listen_open(const char *spec)
+{
+	int		 fd;
+
+	if (strncmp(spec, "unix:", 5) == 0)
+		fd = pfs_listen_unix(spec + 5);
+	else if (strncmp(spec, "inet:", 5) == 0)
+		fd = pfs_listen_inet(spec + 5);
+	else {
+		pfs_log(LOG_ERR, "Listen address must start with unix: or inet: (%s)\n", spec);
+		return -1;
+	}
+
+	if (fd >= 0 && listen(fd, SOMAXCONN) < 0) {
+		pfs_log(LOG_ERR, "listen %s: %s\n", spec, strerror(errno));
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static void
+pfs_conn_free(pfs_conn_t *conn)
+{
+	if (conn->fd >= 0)
+		close(conn->fd);
+	pf_request_reset(&conn->req);
+	pf_memo_reset(&conn->memo);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+/*
+ * Stop serving the connection. If some of its requests are still being
+ * evaluated the memory stays around until the last one comes back.
+ */
+static void
+pfs_conn_close(pfs_daemon_t *d, pfs_conn_t *conn)
+{
+	epoll_ctl(d->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn->fd = -1;
+	conn->closed = 1;
+	if (conn->jobs_head == NULL)
+		pfs_conn_free(conn);
+}
+
+static void
+pfs_conn_append(pfs_conn_t *conn, const char *data, size_t len)
+{
+	if (conn->out_off == conn->out_len)
+		conn->out_off = conn->out_len = 0;
+
+	if (conn->out_len + len > conn->out_size) {
+		conn->out_size = conn->out_len + len + RESPONSESIZE;
+		conn->out = realloc(conn->out, conn->out_size);
+	}
+	memcpy(conn->out + conn->out_len, data, len);
+	conn->out_len += len;
+}
+
+/*
+ * Write as much pending output as the socket takes.
+ * Returns -1 if the connection is broken.
+ */
+static int
+pfs_conn_flush(pfs_conn_t *conn)
+{
+	ssize_t		 n;
+
+	while (conn->out_off < conn->out_len) {
+		n = send(conn->fd, conn->out + conn->out_off,
+						conn->out_len - conn->out_off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		conn->out_off += n;
+	}
+	return 0;
+}
+
+/*
+ * Mark a job finished and note its connection for pfs_daemon_collect.
+ * Collecting frees jobs, so it must wait until all are marked.
+ */
+static void
+pfs_job_ready(pfs_daemon_t *d, pfs_job_t *job)
+{
+	pfs_conn_t			*conn = (pfs_conn_t *)job->owner;
+
+	job->done = 1;
+	if (!conn->ready) {
+		conn->ready = 1;
+		conn->ready_next = d->ready;
+		d->ready = conn;
+	}
+}
+
+/* FNV-1a over what pf_request_same_evaluation compares */
+static pfs_job_t **
+pfs_flight_bucket(pfs_daemon_t *d, SPF_client_request_t *req)
+{
+	const char		*field[3];
+	const char		*p;
+	uint32_t		 h = 2166136261u;
+	int				 i;
+
+	field[0] = req->ip;
+	field[1] = req->sender;
+	field[2] = req->helo;
+	for (i = 0; i < 3; i++) {
+		for (p = field[i]; p != NULL && *p; p++)
+			h = (h ^ (unsigned char)*p) * 16777619u;
+		h = (h ^ 0xff) * 16777619u;
+	}
+	return &d->flights[h % PFS_FLIGHT_BUCKETS];
+}
+
+/*
+ * Ride along with an identical evaluation which is already running,
+ * under the same configuration. Returns 1 if job got attached to
+ * another and must not be submitted.
+ */
+static int
+pfs_flight_join(pfs_daemon_t *d, pfs_job_t *job)
+{
+	pfs_job_t		 *leader;
+
+	for (leader = *pfs_flight_bucket(d, &job->req); leader != NULL;
+					leader = leader->flight_next) {
+		if (leader->generation == job->generation
+						&& pf_request_same_evaluation(&leader->req, &job->req)) {
+			job->next = leader->followers;
+			leader->followers = job;
+			pfs_metrics_count(PFS_C_COALESCED);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Become the evaluation identical requests ride along with */
+static void
+pfs_flight_lead(pfs_daemon_t *d, pfs_job_t *job)
+{
+	pfs_job_t		**bucket = pfs_flight_bucket(d, &job->req);
+
+	job->flight_next = *bucket;
+	*bucket = job;
+}
+
+/*
+ * Admission control: while --shed-inflight checks are running or
+ * waiting, or the oldest waiting one has waited --shed-delay-ms, a new
+ * request is answered right away with a temperror header and the
+ * --shed-action instead of joining the queue. Returns 1 if job was
+ * answered that way.
+ */
+static int
+pfs_daemon_shed(pfs_daemon_t *d, pfs_job_t *job)
+{
+	SPF_client_options_t	*opts = d->opts;
+	const char			*why;
+	uint64_t			 delay = 0;
+	int					 load, counter;
+
+	if (opts->shed_inflight <= 0 && opts->shed_delay_ms <= 0)
+		return 0;
+
+	load = d->pool ? pfs_pool_load(d->pool) : pfs_engine_load(d->engine);
+	if (opts->shed_delay_ms > 0)
+		delay = d->pool ? pfs_pool_delay(d->pool, job->start)
+						: pfs_engine_delay(d->engine, job->start);
+
+	if (opts->shed_inflight > 0 && load >= opts->shed_inflight) {
+		counter = PFS_C_SHED_INFLIGHT;
+		why = "too many checks in flight";
+	}
+	else if (opts->shed_delay_ms > 0 && delay >= (uint64_t)opts->shed_delay_ms * 1000000) {
+		counter = PFS_C_SHED_DELAY;
+		why = "checks wait too long";
+	}
+	else {
+		if (d->shed > 0 && job->start - d->shed_last >= PFS_SHED_QUIET) {
+			pfs_log(LOG_WARNING, "Load back to normal, %d requests were answered unchecked\n",
+							d->shed);
+			d->shed = 0;
+		}
+		return 0;
+	}
+
+	if (d->shed++ == 0)
+		pfs_log(LOG_WARNING, "Overloaded, answering requests unchecked: %d checks in flight, oldest waiting %llu ms\n",
+						load, (unsigned long long)(delay / 1000000));
+	d->shed_last = job->start;
+	pfs_metrics_count(counter);
+	snprintf(job->response, sizeof(job->response), "action=PREPEND X-Received-SPF: temperror (%s: %s) client-ip=%s; envelope-from=%s;\naction=%s\n\n",
+					opts->rec_dom, why, X_OR_EMPTY(job->req.ip), X_OR_EMPTY(job->req.sender),
+					opts->shed_action);
+	if (opts->debug)
+		pfs_log(LOG_INFO, "action=%s overloaded (ip=%s from=%s helo=%s to=%s)\n",
+						opts->shed_action, job->req.ip, job->req.sender, job->req.helo, job->req.rcpt_to);
+	return 1;
+}
+
+/*
+ * A request is complete: start evaluating it and remember its place in
+ * the connection's response order. Another recipient of a message we
+ * already answered, or are still evaluating, is not evaluated again; it
+ * gets the memo once the answers before it are sent. A request which
+ * only matches one in flight on any connection waits for its answer;
+ * any other may be shed under overload.
+ */
+static void
+pfs_conn_request(pfs_daemon_t *d, pfs_conn_t *conn)
+{
+	pfs_job_t	*job;
+	int			 repeat;
+
+	repeat = pf_memo_match(&conn->memo, &conn->req)
+			|| (conn->jobs_tail != NULL
+					&& pf_request_same_message(&conn->jobs_tail->req, &conn->req));
+
+	if ((job = d->free_jobs) != NULL)
+		d->free_jobs = job->next;
+	else
+		job = pfs_job_new();
+	job->next = job->conn_next = NULL;
+	job->flight_next = job->followers = NULL;
+	job->engine = NULL;
+	job->done = job->memo = 0;
+	job->generation = pfs_config_generation();
+	job->start = pfs_metrics_now();
+	job->response[0] = '\0';
+	job->owner = conn;
+	/* The input buffer moves on, the job keeps its own copy */
+	pf_request_copy(&job->req, &conn->req, &job->arena);
+
+	if (conn->jobs_tail)
+		conn->jobs_tail->conn_next = job;
+	else
+		conn->jobs_head = job;
+	conn->jobs_tail = job;
+
+	if (repeat) {
+		pfs_metrics_count(PFS_C_MEMO_HITS);
+		job->memo = 1;
+		pfs_job_ready(d, job);
+		return;
+	}
+
+	if (pfs_flight_join(d, job))
+		return;
+	if (pfs_daemon_shed(d, job)) {
+		pfs_job_ready(d, job);
+		return;
+	}
+	pfs_flight_lead(d, job);
+	if (d->pool)
+		pfs_pool_submit(d->pool, job);
+	else
+		pfs_engine_submit(d->engine, job);
+}
+
+/*
+ * Move finished responses to the output buffer. A response is only sent
+ * once every request before it on the same connection is answered.
+ */
+static void
+pfs_conn_collect(pfs_daemon_t *d, pfs_conn_t *conn)
+{
+	pfs_job_t	*job;
+
+	while ((job = conn->jobs_head) != NULL && job->done) {
+		conn->jobs_head = job->conn_next;
+		if (conn->jobs_head == NULL)
+			conn->jobs_tail = NULL;
+		if (job->memo) {
+			if (!conn->closed)
+				pfs_conn_append(conn, conn->memo.response, strlen(conn->memo.response));
+		}
+		else {
+			if (!conn->closed)
+				pfs_conn_append(conn, job->response, strlen(job->response));
+			pf_memo_store(&conn->memo, &job->req, job->response);
+		}
+		pfs_metrics_since(PFS_H_RESPONSE, job->start);
+		pf_request_reset(&job->req);
+		pfs_arena_reset(&job->arena);
+		job->next = d->free_jobs;
+		d->free_jobs = job;
+	}
+}
+
+/*
+ * Dispatch every complete request in the input buffer. A partial one
+ * stays in the buffer, untouched, and is parsed again after the next read.
+ */
+static void
+pfs_conn_process(pfs_daemon_t *d, pfs_conn_t *conn)
+{
+	size_t		 off = 0;
+	size_t		 used;
+	int			 args;
+
+	for (;;) {
+		pf_request_reset(&conn->req);
+		used = pf_parse_request(d->opts, &conn->req, conn->in + off,
+						conn->in_len - off, &args);
+		if (used == 0)
+			break;
+		off += used;
+		if (args > 0)
+			pfs_conn_request(d, conn);
+	}
+	pf_request_reset(&conn->req);
+
+	memmove(conn->in, conn->in + off, conn->in_len - off);
+	conn->in_len -= off;
+}
+
+/*
+ * Read everything available on the connection.
+ * Returns -1 on EOF or error.
+ */
+static int
+pfs_conn_read(pfs_daemon_t *d, pfs_conn_t *conn)
+{
+	ssize_t		 n;
+
+	for (;;) {
+		if (conn->in_size - conn->in_len < PFS_READ_CHUNK) {
+			if (conn->in_size >= PFS_MAX_INPUT) {
+				pfs_log(LOG_WARNING, "Request too large, closing connection\n");
+				return -1;
+			}
+			conn->in_size += PFS_READ_CHUNK;
+			conn->in = realloc(conn->in, conn->in_size);
+		}
+
+		n = read(conn->fd, conn->in + conn->in_len, conn->in_size - conn->in_len);
+		if (n == 0) {
+			conn->eof = 1;
+			return 0;
+		}
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		conn->in_len += n;
+		pfs_conn_process(d, conn);
+	}
+}
+
+/*
+ * Send what is ready and choose the events to wait for next.
+ */
+static void
+pfs_conn_update(pfs_daemon_t *d, pfs_conn_t *conn)
+{
+	struct epoll_event	 ev;
+
+	if (pfs_conn_flush(conn) < 0) {
+		pfs_conn_close(d, conn);
+		return;
+	}
+	/* A client which half-closed still gets every answer */
+	if (conn->eof && conn->jobs_head == NULL && conn->out_off == conn->out_len) {
+		pfs_conn_close(d, conn);
+		return;
+	}
+
+	/* Only wait for writability while output is pending */
+	ev.events = conn->eof ? 0 : EPOLLIN | EPOLLRDHUP;
+	if (conn->out_off < conn->out_len)
+		ev.events = EPOLLOUT;
+	ev.data.ptr = conn;
+	epoll_ctl(d->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void
+pfs_accept(pfs_daemon_t *d, pfs_conn_t *listener)
+{
+	struct epoll_event	 ev;
+	pfs_conn_t			*conn;
+	int					 fd;
+
+	for (;;) {
+		fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pfs_log(LOG_WARNING, "accept: %s\n", strerror(errno));
+			return;
+		}
+
+		conn = (pfs_conn_t *)malloc(sizeof(pfs_conn_t));
+		memset(conn, 0, sizeof(pfs_conn_t));
+		pf_memo_init(&conn->memo);
+		conn->fd = fd;
+		conn->kind = PFS_WATCH_CONN;
+
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = conn;
+		if (epoll_ctl(d->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			pfs_log(LOG_WARNING, "epoll_ctl: %s\n", strerror(errno));
+			pfs_conn_free(conn);
+		}
+	}
+}
+
+static void
+pfs_conn_event(pfs_daemon_t *d, pfs_conn_t *conn, uint32_t events)
+{
+	if (!conn->eof && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+		if (pfs_conn_read(d, conn) < 0) {
+			/* Answer what we already have */
+			pfs_conn_flush(conn);
+			pfs_conn_close(d, conn);
+			return;
+		}
+	}
+	/* Gone both ways, nobody is left to answer */
+	if (events & (EPOLLHUP | EPOLLERR)) {
+		pfs_conn_flush(conn);
+		pfs_conn_close(d, conn);
+		return;
+	}
+	pfs_conn_update(d, conn);
+}
+
+/*
+ * An evaluation came back: it leaves the in-flight table and its answer
+ * goes to every request that waited for it as well.
+ */
+static void
+pfs_job_done(pfs_job_t *job, void *arg)
+{
+	pfs_daemon_t		*d = (pfs_daemon_t *)arg;
+	pfs_job_t			**pp, *f, *next;
+
+	for (pp = pfs_flight_bucket(d, &job->req); *pp != NULL; pp = &(*pp)->flight_next) {
+		if (*pp == job) {
+			*pp = job->flight_next;
+			break;
+		}
+	}
+	for (f = job->followers; f != NULL; f = next) {
+		next = f->next;
+		f->next = NULL;
+		memcpy(f->response, job->response, sizeof(f->response));
+		pfs_job_ready(d, f);
+	}
+	job->followers = NULL;
+	pfs_job_ready(d, job);
+}
+
+static void
+pfs_daemon_collect(pfs_daemon_t *d)
+{
+	pfs_conn_t			*conn;
+
+	while ((conn = d->ready) != NULL) {
+		d->ready = conn->ready_next;
+		conn->ready = 0;
+		pfs_conn_collect(d, conn);
+		if (!conn->closed)
+			pfs_conn_update(d, conn);
+		else if (conn->jobs_head == NULL)
+			pfs_conn_free(conn);
+	}
+}
+
+static void
+pfs_pool_event(pfs_daemon_t *d)
+{
+	pfs_job_t			*job, *next;
+
+	for (job = pfs_pool_completed(d->pool); job != NULL; job = next) {
+		next = job->next;
+		pfs_job_done(job, d);
+	}
+}
+
+/*
+ * SIGHUP reloads what can be reloaded, anything else stops the daemon.
+ * Returns 0 when it is time to shut down.
+ */
+static int
+pfs_signal_event(pfs_daemon_t *d, pfs_conn_t *sigwatch)
+{
+	struct signalfd_siginfo	 si;
+	int						 running = 1;
+
+	(void)d;
+	while (read(sigwatch->fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGHUP) {
+			pfs_log(LOG_INFO, "Got SIGHUP, reloading\n");
+			pfs_config_reload();
+			continue;
+		}
+		pfs_log(LOG_INFO, "Got signal, shutting down\n");
+		running = 0;
+	}
+	return running;
+}
+
+int
+pfs_daemon_run(SPF_client_options_t *opts)
+{
+	struct epoll_event	 ev, events[PFS_MAX_EVENTS];
+	pfs_daemon_t		 d;
+	pfs_conn_t			 listener, sigwatch, poolwatch, peerwatch;
+	pfs_conn_t			*conn;
+	pfs_job_t			*job;
+	int					 timeout = -1;
+	sigset_t			 mask;
+	int					 running = 1;
+	int					 i, n;
+
+	memset(&d, 0, sizeof(d));
+	memset(&listener, 0, sizeof(listener));
+	memset(&sigwatch, 0, sizeof(sigwatch));
+	memset(&poolwatch, 0, sizeof(poolwatch));
+	memset(&peerwatch, 0, sizeof(peerwatch));
+	d.opts = opts;
+	listener.kind = PFS_WATCH_LISTEN;
+	sigwatch.kind = PFS_WATCH_SIGNAL;
+	poolwatch.kind = PFS_WATCH_POOL;
+	peerwatch.kind = PFS_WATCH_PEER;
+
+	listener.fd = pfs_listen_open(opts->listen);
+	if (listener.fd < 0) {
+		fprintf(stderr, "Can not listen on %s, see syslog\n", opts->listen);
+		return 255;
+	}
+
+	/* Signals are delivered through the event loop */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigwatch.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	d.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (d.epfd < 0 || sigwatch.fd < 0) {
+		pfs_log(LOG_ERR, "Can not set up event loop: %s\n", strerror(errno));
+		return 255;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listener;
+	epoll_ctl(d.epfd, EPOLL_CTL_ADD, listener.fd, &ev);
+	ev.data.ptr = &sigwatch;
+	epoll_ctl(d.epfd, EPOLL_CTL_ADD, sigwatch.fd, &ev);
+
+	if (opts->workers > 0) {
+		d.pool = pfs_pool_new(opts, opts->workers);
+		if (d.pool == NULL) {
+			fprintf(stderr, "Can not start worker threads, see syslog\n");
+			return 255;
+		}
+		poolwatch.fd = pfs_pool_fd(d.pool);
+		ev.data.ptr = &poolwatch;
+		epoll_ctl(d.epfd, EPOLL_CTL_ADD, poolwatch.fd, &ev);
+	}
+	else {
+		d.engine = pfs_engine_new(opts, pfs_job_done, &d);
+		if (d.engine == NULL) {
+			fprintf(stderr, "Can not set up the DNS resolver, see syslog\n");
+			return 255;
+		}
+		poolwatch.kind = PFS_WATCH_ENGINE;
+		poolwatch.fd = pfs_engine_fd(d.engine);
+		ev.data.ptr = &poolwatch;
+		epoll_ctl(d.epfd, EPOLL_CTL_ADD, poolwatch.fd, &ev);
+	}
+
+	/* Other nodes' lookups are answered right here, they only take a lock */
+	if (opts->peer && (peerwatch.fd = pfs_peer_fd(opts->peer)) >= 0) {
+		ev.data.ptr = &peerwatch;
+		epoll_ctl(d.epfd, EPOLL_CTL_ADD, peerwatch.fd, &ev);
+	}
+
+	pfs_log(LOG_INFO, "Listening on %s\n", opts->listen);
+
+	while (running) {
+		if (d.engine)
+			timeout = pfs_engine_timeout(d.engine);
+		n = epoll_wait(d.epfd, events, PFS_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pfs_log(LOG_ERR, "epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			conn = (pfs_conn_t *)events[i].data.ptr;
+			switch (conn->kind) {
+				case PFS_WATCH_LISTEN:
+					pfs_accept(&d, conn);
+					break;
+				case PFS_WATCH_SIGNAL:
+					running = pfs_signal_event(&d, conn);
+					break;
+				case PFS_WATCH_POOL:
+					pfs_pool_event(&d);
+					break;
+				case PFS_WATCH_ENGINE:
+					/* handled below */
+					break;
+				case PFS_WATCH_PEER:
+					pfs_peer_serve(opts->peer);
+					break;
+				default:
+					pfs_conn_event(&d, conn, events[i].events);
+					break;
+			}
+		}
+
+		/* Answers, timeouts and newly read requests all end up here */
+		if (d.engine)
+			pfs_engine_process(d.engine);
+		pfs_daemon_collect(&d);
+	}
+
+	/* Connections still open are simply dropped; smtpd will reconnect */
+	if (d.pool)
+		pfs_pool_free(d.pool);
+	if (d.engine)
+		pfs_engine_free(d.engine);
+	while ((job = d.free_jobs) != NULL) {
+		d.free_jobs = job->next;
+		pfs_job_free(job);
+	}
+	close(listener.fd);
+	close(sigwatch.fd);
+	close(d.epfd);
+	if (strncmp(opts->listen, "unix:", 5) == 0)
+		unlink(opts->listen + 5);
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Daemon mode (--listen)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_DAEMON_H
+#define PFS_DAEMON_H
+
+#include "policyd-spf-fs.h"
+
+/*
+ * Listen on opts->listen ("unix:/path" or "inet:host:port") and serve
+ * policy requests from all connections until SIGTERM or SIGINT.
+ * Returns 0 on a clean shutdown, 255 if the socket could not be set up.
+ */
+int pfs_daemon_run(SPF_client_options_t *opts);
+
+#endif
@@ -0,0 +1,1093 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Non-blocking DNS layer for libspf2. It replaces spf_dns_resolv at
+ *  the bottom of the DNS stack: every query gets its own UDP socket
+ *  (and so a fresh source port), the evaluation which asked for it is
+ *  suspended, and it is resumed once the answer is parsed. Truncated
+ *  answers are repeated over TCP, unanswered queries are retried on
+ *  the next nameserver.
+ *
+ *  With hedging on, a query the first server has not answered within a
+ *  percentile of the recent round trips is sent to the next server as
+ *  well and the first answer wins. An evaluation may carry a deadline:
+ *  its queries are given up when it passes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_dns_rr.h"
+
+#include "pfs_fiber.h"
+#include "pfs_dns_async.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+
+#define PFS_DNS_MAXNS		4
+#define PFS_DNS_PORT		53
+#define PFS_DNS_UDPSIZE		1232	/* EDNS payload size we advertise */
+#define PFS_DNS_BUFSIZE		65536
+#define PFS_DNS_MAX_EVENTS	64
+
+/* resolv.conf defaults */
+#define PFS_DNS_TIMEOUT		5000
+#define PFS_DNS_ATTEMPTS	2
+
+/* Round trips the hedge delay is taken from, and how it starts out */
+#define PFS_DNS_RTT_SAMPLES	256
+#define PFS_DNS_RTT_UPDATE	32
+#define PFS_DNS_HEDGE_DELAY	200
+#define PFS_DNS_HEDGE_MIN	5
+
+typedef struct pfs_dns_query_struct pfs_dns_query_t;
+
+typedef
+struct pfs_dns_async_config_struct {
+	struct sockaddr_storage	 ns[PFS_DNS_MAXNS];
+	socklen_t				 ns_len[PFS_DNS_MAXNS];
+	int						 nns;
+	int						 next_ns;	/* spread load over the servers */
+	int						 timeout;	/* ms per attempt */
+	int						 attempts;	/* per server */
+	int						 hedge;		/* percentile, 0: do not hedge */
+	int						 hedge_delay;	/* ms */
+	int						 rtt[PFS_DNS_RTT_SAMPLES];	/* ms, a ring */
+	unsigned				 nrtt;
+
+	int						 epfd;
+	pfs_dns_query_t			*pending;
+	pfs_dns_query_t			*dropped;	/* hedges to free after the batch */
+	uint64_t				 rand;
+	unsigned char			*buf;		/* UDP receive buffer */
+} pfs_dns_async_config_t;
+
+struct pfs_dns_query_struct {
+	pfs_dns_query_t			*prev;
+	pfs_dns_query_t			*next;
+
+	SPF_dns_server_t		*spf_dns_server;
+	char					*domain;
+	ns_type					 rr_type;
+
+	int						 fd;
+	int						 tcp;
+	int						 edns;
+	int						 ns;		/* first server, attempt n uses ns + n */
+	int						 tries;
+	int64_t					 deadline;	/* of this attempt */
+	int64_t					 sent;
+	int64_t					 hedge_at;	/* 0: no hedge due */
+	int64_t					 limit;		/* of the evaluation, 0: none */
+	pfs_dns_query_t			*hedge;		/* the same query to another server */
+	pfs_dns_query_t			*primary;	/* in a hedge: whom it runs for */
+
+	unsigned char			 query[NS_PACKETSZ + 2];	/* TCP length prefix first */
+	int						 query_len;
+	unsigned char			*answer;	/* TCP answer incl. length prefix */
+	size_t					 io_off;
+
+	SPF_dns_rr_t			*rr;		/* result, set when done */
+	pfs_fiber_t				*waiter;
+
+	int						 wait;		/* not a query: waits for fd of another module */
+	int						 readable;	/* set when done waiting, -1 while waiting */
+};
+
+static inline pfs_dns_async_config_t *
+SPF_voidp2spfhook(void *hook)
+{
+	return (pfs_dns_async_config_t *)hook;
+}
+
+static void pfs_dns_finish(pfs_dns_query_t *q, SPF_dns_rr_t *rr);
+static void pfs_dns_async_free(SPF_dns_server_t *spf_dns_server);
+
+
+static int64_t
+pfs_dns_now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint16_t
+pfs_dns_random(pfs_dns_async_config_t *spfhook)
+{
+	/* xorshift64*, seeded from getrandom */
+	spfhook->rand ^= spfhook->rand >> 12;
+	spfhook->rand ^= spfhook->rand << 25;
+	spfhook->rand ^= spfhook->rand >> 27;
+	return (uint16_t)((spfhook->rand * 2685821657736338717ULL) >> 48);
+}
+
+static int
+pfs_dns_parse_server(const char *spec, struct sockaddr_storage *ss, socklen_t *len)
+{
+	struct sockaddr_in	*sin = (struct sockaddr_in *)ss;
+	struct sockaddr_in6	*sin6 = (struct sockaddr_in6 *)ss;
+	char				 host[INET6_ADDRSTRLEN + 2];
+	const char			*port = NULL;
+	const char			*end;
+
+	memset(ss, 0, sizeof(*ss));
+
+	if (spec[0] == '[') {
+		end = strchr(spec, ']');
+		if (end == NULL || end - spec - 1 >= (int)sizeof(host))
+			return -1;
+		memcpy(host, spec + 1, end - spec - 1);
+		host[end - spec - 1] = '\0';
+		if (end[1] == ':')
+			port = end + 2;
+	}
+	else {
+		end = strchr(spec, ':');
+		/* More than one colon is a bare IPv6 address */
+		if (end != NULL && strchr(end + 1, ':') == NULL) {
+			if (end - spec >= (int)sizeof(host))
+				return -1;
+			memcpy(host, spec, end - spec);
+			host[end - spec] = '\0';
+			port = end + 1;
+		}
+		else {
+			if (strlen(spec) >= sizeof(host))
+				return -1;
+			strcpy(host, spec);
+		}
+	}
+
+	if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port ? atoi(port) : PFS_DNS_PORT);
+		*len = sizeof(struct sockaddr_in);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port ? atoi(port) : PFS_DNS_PORT);
+		*len = sizeof(struct sockaddr_in6);
+		return 0;
+	}
+	return -1;
+}
+
+static void
+pfs_dns_read_resolv_conf(pfs_dns_async_config_t *spfhook)
+{
+	FILE		*fp;
+	char		 line[256];
+	char		*p, *tok;
+
+	fp = fopen(_PATH_RESCONF, "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n#;")] = '\0';
+		if (strncmp(line, "nameserver", 10) == 0 && spfhook->nns < PFS_DNS_MAXNS) {
+			p = line + 10 + strspn(line + 10, " \t");
+			p[strcspn(p, " \t")] = '\0';
+			if (pfs_dns_parse_server(p, &spfhook->ns[spfhook->nns],
+							&spfhook->ns_len[spfhook->nns]) == 0)
+				spfhook->nns++;
+		}
+		else if (strncmp(line, "options", 7) == 0) {
+			for (tok = strtok(line + 7, " \t"); tok; tok = strtok(NULL, " \t")) {
+				if (strncmp(tok, "timeout:", 8) == 0 && atoi(tok + 8) > 0)
+					spfhook->timeout = atoi(tok + 8) * 1000;
+				else if (strncmp(tok, "attempts:", 9) == 0 && atoi(tok + 9) > 0)
+					spfhook->attempts = atoi(tok + 9);
+			}
+		}
+	}
+	fclose(fp);
+}
+
+/*
+ * Build the question. Returns -1 if the name can not be encoded.
+ */
+static int
+pfs_dns_build_query(pfs_dns_query_t *q, uint16_t id)
+{
+	unsigned char	*p = q->query + 2;
+	unsigned char	*end = q->query + sizeof(q->query);
+	const char		*label = q->domain;
+	size_t			 len;
+
+	memset(p, 0, NS_HFIXEDSZ);
+	p[0] = id >> 8;
+	p[1] = id & 0xff;
+	p[2] = 0x01;				/* RD */
+	p[5] = 1;					/* QDCOUNT */
+	p[11] = q->edns ? 1 : 0;	/* ARCOUNT */
+	p += NS_HFIXEDSZ;
+
+	while (*label) {
+		len = strcspn(label, ".");
+		if (len == 0 || len > NS_MAXLABEL || p + len + 1 >= end - 16)
+			return -1;
+		*p++ = len;
+		memcpy(p, label, len);
+		p += len;
+		label += len;
+		if (*label == '.')
+			label++;
+	}
+	*p++ = 0;
+	NS_PUT16(q->rr_type, p);
+	NS_PUT16(ns_c_in, p);
+
+	if (q->edns) {
+		/* OPT pseudo RR: root owner, our UDP size as class */
+		*p++ = 0;
+		NS_PUT16(ns_t_opt, p);
+		NS_PUT16(PFS_DNS_UDPSIZE, p);
+		NS_PUT32(0, p);
+		NS_PUT16(0, p);
+	}
+
+	q->query_len = p - (q->query + 2);
+	q->query[0] = q->query_len >> 8;
+	q->query[1] = q->query_len & 0xff;
+	return 0;
+}
+
+static void
+pfs_dns_close(pfs_dns_query_t *q)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+
+	if (q->fd >= 0) {
+		epoll_ctl(spfhook->epfd, EPOLL_CTL_DEL, q->fd, NULL);
+		close(q->fd);
+		q->fd = -1;
+	}
+	free(q->answer);
+	q->answer = NULL;
+	q->io_off = 0;
+}
+
+static void
+pfs_dns_link(pfs_dns_query_t *q)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+
+	q->prev = NULL;
+	q->next = spfhook->pending;
+	if (q->next)
+		q->next->prev = q;
+	spfhook->pending = q;
+}
+
+static void
+pfs_dns_unlink(pfs_dns_query_t *q)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+
+	pfs_dns_close(q);
+
+	if (q->prev)
+		q->prev->next = q->next;
+	else
+		spfhook->pending = q->next;
+	if (q->next)
+		q->next->prev = q->prev;
+}
+
+/*
+ * The race is over for a hedge, or it failed on its own. The batch of
+ * events at hand may still point to it: it is freed by pfs_dns_reap.
+ */
+static void
+pfs_dns_hedge_drop(pfs_dns_query_t *h)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(h->spf_dns_server->hook);
+
+	pfs_dns_unlink(h);
+	h->primary->hedge = NULL;
+	h->primary = NULL;
+	h->next = spfhook->dropped;
+	spfhook->dropped = h;
+}
+
+static void
+pfs_dns_reap(pfs_dns_async_config_t *spfhook)
+{
+	pfs_dns_query_t		*h;
+
+	while ((h = spfhook->dropped) != NULL) {
+		spfhook->dropped = h->next;
+		free(h);
+	}
+}
+
+static void
+pfs_dns_finish(pfs_dns_query_t *q, SPF_dns_rr_t *rr)
+{
+	pfs_dns_query_t		*primary = q->primary;
+
+	/* A hedge which answers first answers for its primary */
+	if (primary != NULL) {
+		pfs_dns_hedge_drop(q);
+		pfs_dns_finish(primary, rr);
+		return;
+	}
+
+	pfs_dns_unlink(q);
+	if (q->hedge)
+		pfs_dns_hedge_drop(q->hedge);
+
+	q->rr = rr;
+	if (q->waiter)
+		pfs_fiber_wake(q->waiter);
+}
+
+/* A wait is over: the fd is the caller's, it stays open */
+static void
+pfs_dns_wait_done(pfs_dns_query_t *q, int readable)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+
+	epoll_ctl(spfhook->epfd, EPOLL_CTL_DEL, q->fd, NULL);
+	q->fd = -1;
+	pfs_dns_unlink(q);
+	q->readable = readable;
+	pfs_fiber_wake(q->waiter);
+}
+
+static void
+pfs_dns_fail(pfs_dns_query_t *q, SPF_dns_stat_t herrno)
+{
+	if (q->spf_dns_server->debug)
+		pfs_log(LOG_DEBUG, "DNS %s/%d failed: %d\n", q->domain, q->rr_type, herrno);
+	pfs_metrics_count(PFS_C_DNS_FAILURES);
+	pfs_dns_finish(q, SPF_dns_rr_new_init(q->spf_dns_server, q->domain,
+					q->rr_type, 0, herrno));
+}
+
+/*
+ * Send (or resend) the query to the server for the current attempt.
+ * Returns -1 if no server could be reached at all.
+ */
+static int
+pfs_dns_send(pfs_dns_query_t *q, int tcp)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+	struct epoll_event		 ev;
+	struct sockaddr			*sa;
+	int						 ns;
+
+	pfs_dns_close(q);
+
+	ns = (q->ns + q->tries) % spfhook->nns;
+	sa = (struct sockaddr *)&spfhook->ns[ns];
+	q->tcp = tcp;
+	q->sent = pfs_dns_now();
+	q->deadline = q->sent + spfhook->timeout;
+	if (q->limit && q->limit < q->deadline)
+		q->deadline = q->limit;
+	q->hedge_at = 0;
+	if (spfhook->hedge && spfhook->nns > 1 && !tcp
+					&& q->primary == NULL && q->hedge == NULL)
+		q->hedge_at = q->sent + spfhook->hedge_delay;
+
+	if (pfs_dns_build_query(q, pfs_dns_random(spfhook)) < 0)
+		return -1;
+	pfs_metrics_count(PFS_C_DNS_QUERIES);
+
+	q->fd = socket(sa->sa_family, (tcp ? SOCK_STREAM : SOCK_DGRAM)
+					| SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (q->fd < 0) {
+		pfs_log(LOG_WARNING, "DNS socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* A connected UDP socket only accepts datagrams from the server */
+	if (connect(q->fd, sa, spfhook->ns_len[ns]) < 0 && errno != EINPROGRESS) {
+		close(q->fd);
+		q->fd = -1;
+		return -1;
+	}
+
+	if (!tcp && send(q->fd, q->query + 2, q->query_len, 0) < 0) {
+		close(q->fd);
+		q->fd = -1;
+		return -1;
+	}
+
+	/* TCP first waits for the connect, then writes the framed query */
+	ev.events = tcp ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = q;
+	epoll_ctl(spfhook->epfd, EPOLL_CTL_ADD, q->fd, &ev);
+	return 0;
+}
+
+/*
+ * Go on with the next attempt, or give up with a temporary error.
+ * Returns 0 if q is done with, 1 if it waits for another answer.
+ */
+static int
+pfs_dns_retry(pfs_dns_query_t *q)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+
+	/* A hedge gets one try, its primary goes on by itself */
+	if (q->primary != NULL) {
+		pfs_dns_hedge_drop(q);
+		return 0;
+	}
+	while (++q->tries < spfhook->nns * spfhook->attempts) {
+		if (pfs_dns_send(q, 0) == 0)
+			return 1;
+	}
+	pfs_dns_fail(q, TRY_AGAIN);
+	return 0;
+}
+
+/*
+ * Send a copy of q to the server after the one q is waiting for
+ */
+static void
+pfs_dns_hedge(pfs_dns_query_t *q)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+	pfs_dns_query_t			*h;
+
+	q->hedge_at = 0;
+	h = (pfs_dns_query_t *)calloc(1, sizeof(pfs_dns_query_t));
+	if (h == NULL)
+		return;
+	h->spf_dns_server = q->spf_dns_server;
+	h->domain = q->domain;
+	h->rr_type = q->rr_type;
+	h->fd = -1;
+	h->edns = q->edns;
+	h->ns = (q->ns + q->tries + 1) % spfhook->nns;
+	h->limit = q->limit;
+	h->primary = q;
+	q->hedge = h;
+	pfs_dns_link(h);
+
+	if (q->spf_dns_server->debug)
+		pfs_log(LOG_DEBUG, "DNS %s/%d hedged after %d ms\n",
+						q->domain, q->rr_type, spfhook->hedge_delay);
+	pfs_metrics_count(PFS_C_DNS_HEDGES);
+	if (pfs_dns_send(h, 0) < 0)
+		pfs_dns_hedge_drop(h);
+}
+
+static int
+pfs_dns_cmp_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Remember how long an answer took; now and then the hedge delay is
+ * set to the configured percentile of the recent round trips.
+ */
+static void
+pfs_dns_rtt(pfs_dns_async_config_t *spfhook, int ms)
+{
+	int						 sorted[PFS_DNS_RTT_SAMPLES];
+	unsigned				 n, i;
+
+	spfhook->rtt[spfhook->nrtt++ % PFS_DNS_RTT_SAMPLES] = ms;
+	if (!spfhook->hedge || spfhook->nrtt % PFS_DNS_RTT_UPDATE != 0)
+		return;
+
+	n = spfhook->nrtt < PFS_DNS_RTT_SAMPLES ? spfhook->nrtt : PFS_DNS_RTT_SAMPLES;
+	memcpy(sorted, spfhook->rtt, n * sizeof(int));
+	qsort(sorted, n, sizeof(int), pfs_dns_cmp_int);
+	i = n * spfhook->hedge / 100;
+	if (i >= n)
+		i = n - 1;
+	spfhook->hedge_delay = sorted[i];
+	if (spfhook->hedge_delay < PFS_DNS_HEDGE_MIN)
+		spfhook->hedge_delay = PFS_DNS_HEDGE_MIN;
+}
+
+/*
+ * Turn a wire format answer into libspf2's rr structure, the same way
+ * spf_dns_resolv does. Returns NULL if the packet is not an answer to q.
+ */
+static SPF_dns_rr_t *
+pfs_dns_parse(pfs_dns_query_t *q, const unsigned char *msg, int len, int *rcodep)
+{
+	SPF_dns_server_t	*spf_dns_server = q->spf_dns_server;
+	SPF_dns_rr_t		*rr;
+	ns_msg				 handle;
+	ns_rr				 qd, ans;
+	const unsigned char	*rdata;
+	char				 name[NS_MAXDNAME];
+	size_t				 qlen;
+	int					 rcode;
+	int					 ttl = -1;
+	int					 neg_ttl = 0;
+	int					 cnt = 0;
+	int					 i, n, pos;
+
+	if (ns_initparse(msg, len, &handle) < 0)
+		return NULL;
+	if (ns_msg_id(handle) != ((q->query[2] << 8) | q->query[3])
+					|| !ns_msg_getflag(handle, ns_f_qr)
+					|| ns_msg_count(handle, ns_s_qd) != 1)
+		return NULL;
+	if (ns_parserr(&handle, ns_s_qd, 0, &qd) < 0
+					|| ns_rr_type(qd) != q->rr_type)
+		return NULL;
+	qlen = strlen(q->domain);
+	if (qlen > 0 && q->domain[qlen - 1] == '.')
+		qlen--;
+	if (strlen(ns_rr_name(qd)) != qlen
+					|| strncasecmp(ns_rr_name(qd), q->domain, qlen) != 0)
+		return NULL;
+
+	rcode = ns_msg_getflag(handle, ns_f_rcode);
+	*rcodep = rcode;
+	if (rcode == ns_r_nxdomain || rcode == ns_r_noerror) {
+		/* Negative answers live as long as the SOA says */
+		n = ns_msg_count(handle, ns_s_ns);
+		for (i = 0; i < n; i++) {
+			if (ns_parserr(&handle, ns_s_ns, i, &ans) < 0)
+				break;
+			if (ns_rr_type(ans) == ns_t_soa && ns_rr_rdlen(ans) >= 20) {
+				rdata = ns_rr_rdata(ans) + ns_rr_rdlen(ans) - 4;
+				neg_ttl = ns_get32(rdata);
+				if ((int)ns_rr_ttl(ans) < neg_ttl)
+					neg_ttl = ns_rr_ttl(ans);
+			}
+		}
+	}
+	if (rcode == ns_r_nxdomain)
+		return SPF_dns_rr_new_init(spf_dns_server, q->domain, q->rr_type,
+						neg_ttl, HOST_NOT_FOUND);
+	if (rcode != ns_r_noerror)
+		return NULL;
+
+	rr = SPF_dns_rr_new_init(spf_dns_server, q->domain, q->rr_type, 0, NETDB_SUCCESS);
+	if (rr == NULL)
+		return NULL;
+
+	n = ns_msg_count(handle, ns_s_an);
+	for (i = 0; i < n; i++) {
+		if (ns_parserr(&handle, ns_s_an, i, &ans) < 0)
+			break;
+		/* CNAMEs are followed by the recursor, we only want the target */
+		if (ns_rr_type(ans) != q->rr_type)
+			continue;
+		rdata = ns_rr_rdata(ans);
+
+		switch (q->rr_type) {
+			case ns_t_a:
+				if (ns_rr_rdlen(ans) != 4
+						|| SPF_dns_rr_buf_realloc(rr, cnt, sizeof(struct in_addr)))
+					continue;
+				memcpy(&rr->rr[cnt]->a, rdata, 4);
+				break;
+
+			case ns_t_aaaa:
+				if (ns_rr_rdlen(ans) != 16
+						|| SPF_dns_rr_buf_realloc(rr, cnt, sizeof(struct in6_addr)))
+					continue;
+				memcpy(&rr->rr[cnt]->aaaa, rdata, 16);
+				break;
+
+			case ns_t_mx:
+			case ns_t_ptr:
+				if (q->rr_type == ns_t_mx && ns_rr_rdlen(ans) < 3)
+					continue;
+				if (ns_name_uncompress(ns_msg_base(handle), ns_msg_end(handle),
+								rdata + (q->rr_type == ns_t_mx ? 2 : 0),
+								name, sizeof(name)) < 0)
+					continue;
+				if (SPF_dns_rr_buf_realloc(rr, cnt, strlen(name) + 1))
+					continue;
+				strcpy(q->rr_type == ns_t_mx ? rr->rr[cnt]->mx : rr->rr[cnt]->ptr, name);
+				break;
+
+			case ns_t_txt:
+			default:
+				/* The character strings of one record are joined, RFC 4408 3.1.3 */
+				if (SPF_dns_rr_buf_realloc(rr, cnt, ns_rr_rdlen(ans) + 1))
+					continue;
+				pos = 0;
+				while (rdata < ns_rr_rdata(ans) + ns_rr_rdlen(ans)) {
+					size_t slen = *rdata++;
+					if (rdata + slen > ns_rr_rdata(ans) + ns_rr_rdlen(ans))
+						break;
+					memcpy(rr->rr[cnt]->txt + pos, rdata, slen);
+					pos += slen;
+					rdata += slen;
+				}
+				rr->rr[cnt]->txt[pos] = '\0';
+				break;
+		}
+
+		if (ttl < 0 || (int)ns_rr_ttl(ans) < ttl)
+			ttl = ns_rr_ttl(ans);
+		cnt++;
+	}
+
+	rr->num_rr = cnt;
+	if (cnt == 0) {
+		rr->herrno = NO_DATA;
+		rr->ttl = neg_ttl;
+	}
+	else
+		rr->ttl = ttl;
+
+	return rr;
+}
+
+/*
+ * A complete answer arrived on q's socket. Returns 0 if q is done with,
+ * 1 if it waits for another answer.
+ */
+static int
+pfs_dns_answer(pfs_dns_query_t *q, const unsigned char *msg, int len)
+{
+	SPF_dns_rr_t		*rr;
+	int					 rcode = -1;
+
+	if (len >= NS_HFIXEDSZ && !q->tcp && (msg[2] & 0x02)) {
+		/* TC: the answer did not fit, ask the same server over TCP */
+		if (pfs_dns_send(q, 1) < 0)
+			return pfs_dns_retry(q);
+		return 1;
+	}
+
+	rr = pfs_dns_parse(q, msg, len, &rcode);
+	if (rr != NULL) {
+		if (!q->tcp)
+			pfs_dns_rtt(SPF_voidp2spfhook(q->spf_dns_server->hook), pfs_dns_now() - q->sent);
+		if (q->spf_dns_server->debug)
+			pfs_log(LOG_DEBUG, "DNS %s/%d: %d records, ttl %ld, herrno %d\n",
+							q->domain, q->rr_type, rr->num_rr, (long)rr->ttl, rr->herrno);
+		pfs_dns_finish(q, rr);
+		return 0;
+	}
+
+	if (rcode == ns_r_formerr && q->edns) {
+		/* Server from the last century, ask again without EDNS */
+		q->edns = 0;
+		if (pfs_dns_send(q, q->tcp) < 0)
+			return pfs_dns_retry(q);
+		return 1;
+	}
+	if (rcode >= 0) {
+		/* SERVFAIL, REFUSED, ...: maybe another server does better */
+		return pfs_dns_retry(q);
+	}
+	/* Not for us, over UDP keep waiting for the real answer */
+	if (q->tcp)
+		return pfs_dns_retry(q);
+	return 1;
+}
+
+static void
+pfs_dns_tcp_event(pfs_dns_query_t *q, uint32_t events)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(q->spf_dns_server->hook);
+	struct epoll_event		 ev;
+	size_t					 want;
+	ssize_t					 n;
+
+	if (events & EPOLLERR) {
+		pfs_dns_retry(q);
+		return;
+	}
+
+	if (q->answer == NULL && (events & EPOLLOUT)) {
+		n = send(q->fd, q->query + q->io_off, q->query_len + 2 - q->io_off, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN)
+				pfs_dns_retry(q);
+			return;
+		}
+		q->io_off += n;
+		if (q->io_off < (size_t)q->query_len + 2)
+			return;
+
+		q->answer = (unsigned char *)malloc(PFS_DNS_BUFSIZE + 2);
+		q->io_off = 0;
+		ev.events = EPOLLIN;
+		ev.data.ptr = q;
+		epoll_ctl(spfhook->epfd, EPOLL_CTL_MOD, q->fd, &ev);
+		return;
+	}
+
+	if (q->answer == NULL)
+		return;
+
+	/* Two bytes length, then the message */
+	want = q->io_off < 2 ? 2 : 2 + ((q->answer[0] << 8) | q->answer[1]);
+	n = recv(q->fd, q->answer + q->io_off, want - q->io_off, 0);
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN)
+			return;
+		pfs_dns_retry(q);
+		return;
+	}
+	q->io_off += n;
+	if (q->io_off == 2)
+		return;
+	if (q->io_off == want)
+		pfs_dns_answer(q, q->answer + 2, want - 2);
+}
+
+static void
+pfs_dns_udp_event(pfs_dns_query_t *q, unsigned char *buf)
+{
+	ssize_t			 n;
+
+	for (;;) {
+		n = recv(q->fd, buf, PFS_DNS_BUFSIZE, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return;
+			/* ICMP unreachable and friends */
+			pfs_dns_retry(q);
+			return;
+		}
+		/* Over TCP now, the rest comes as events of the new socket */
+		if (!pfs_dns_answer(q, buf, n) || q->tcp)
+			return;
+	}
+}
+
+static SPF_dns_rr_t *
+pfs_dns_async_lookup(SPF_dns_server_t *spf_dns_server,
+				const char *domain, ns_type rr_type, int should_cache)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(spf_dns_server->hook);
+	pfs_dns_query_t			 q;
+	struct pollfd			 pfd;
+	int64_t					*limit = (int64_t *)*pfs_fiber_local(PFS_LOCAL_DEADLINE);
+	uint64_t				 start;
+
+	/* The bottom layer keeps nothing, caching is up to the layers above */
+	(void)should_cache;
+
+	if (limit != NULL && *limit <= pfs_dns_now())
+		return SPF_dns_rr_new_init(spf_dns_server, domain, rr_type, 0, TRY_AGAIN);
+
+	memset(&q, 0, sizeof(q));
+	q.spf_dns_server = spf_dns_server;
+	q.domain = (char *)domain;
+	q.rr_type = rr_type;
+	q.fd = -1;
+	q.edns = 1;
+	q.ns = spfhook->next_ns++ % spfhook->nns;
+	q.limit = limit ? *limit : 0;
+
+	if (q.domain[0] == '\0' || pfs_dns_build_query(&q, 0) < 0)
+		return SPF_dns_rr_new_init(spf_dns_server, domain, rr_type, 0, HOST_NOT_FOUND);
+
+	pfs_dns_link(&q);
+
+	if (spf_dns_server->debug)
+		pfs_log(LOG_DEBUG, "DNS query %s/%d\n", domain, rr_type);
+
+	start = pfs_metrics_now();
+	if (pfs_dns_send(&q, 0) < 0)
+		pfs_dns_retry(&q);
+
+	if ((q.waiter = pfs_fiber_current()) != NULL) {
+		while (q.rr == NULL)
+			pfs_fiber_suspend();
+	}
+	else {
+		/* Not running in a fiber: nothing else to do but wait */
+		pfd.fd = spfhook->epfd;
+		pfd.events = POLLIN;
+		while (q.rr == NULL) {
+			poll(&pfd, 1, pfs_dns_async_timeout(spf_dns_server));
+			pfs_dns_async_process(spf_dns_server);
+		}
+	}
+	pfs_metrics_dns_query(start);
+
+	return q.rr;
+}
+
+int
+pfs_dns_async_fd(SPF_dns_server_t *spf_dns_server)
+{
+	return SPF_voidp2spfhook(spf_dns_server->hook)->epfd;
+}
+
+int
+pfs_dns_async_timeout(SPF_dns_server_t *spf_dns_server)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(spf_dns_server->hook);
+	pfs_dns_query_t			*q;
+	int64_t					 now, first = -1;
+
+	for (q = spfhook->pending; q != NULL; q = q->next) {
+		if (first < 0 || q->deadline < first)
+			first = q->deadline;
+		if (q->hedge_at && q->hedge_at < first)
+			first = q->hedge_at;
+	}
+	if (first < 0)
+		return -1;
+
+	now = pfs_dns_now();
+	return first > now ? (int)(first - now) : 0;
+}
+
+void
+pfs_dns_async_process(SPF_dns_server_t *spf_dns_server)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(spf_dns_server->hook);
+	struct epoll_event		 events[PFS_DNS_MAX_EVENTS];
+	pfs_dns_query_t			*q;
+	int64_t					 now;
+	int						 i, n;
+
+	do {
+		n = epoll_wait(spfhook->epfd, events, PFS_DNS_MAX_EVENTS, 0);
+		for (i = 0; i < n; i++) {
+			q = (pfs_dns_query_t *)events[i].data.ptr;
+			/* Finished or dropped by an earlier event of the batch */
+			if (q->fd < 0)
+				continue;
+			if (q->wait)
+				pfs_dns_wait_done(q, 1);
+			else if (q->tcp)
+				pfs_dns_tcp_event(q, events[i].events);
+			else
+				pfs_dns_udp_event(q, spfhook->buf);
+		}
+		pfs_dns_reap(spfhook);
+	} while (n == PFS_DNS_MAX_EVENTS);
+
+	/*
+	 * Finishing a query also drops its hedge, which may be anywhere in
+	 * the list: start over after each one. Those handled are either
+	 * gone or have a new deadline, so this ends.
+	 */
+	now = pfs_dns_now();
+  again:
+	for (q = spfhook->pending; q != NULL; q = q->next) {
+		if (q->wait) {
+			if (q->deadline <= now) {
+				pfs_dns_wait_done(q, 0);
+				goto again;
+			}
+			continue;
+		}
+		if (q->limit && q->limit <= now) {
+			if (spf_dns_server->debug)
+				pfs_log(LOG_DEBUG, "DNS %s/%d given up, evaluation out of time\n",
+								q->domain, q->rr_type);
+			pfs_dns_finish(q, SPF_dns_rr_new_init(spf_dns_server, q->domain,
+							q->rr_type, 0, TRY_AGAIN));
+			goto again;
+		}
+		if (q->deadline <= now) {
+			if (spf_dns_server->debug)
+				pfs_log(LOG_DEBUG, "DNS %s/%d timed out\n", q->domain, q->rr_type);
+			pfs_dns_retry(q);
+			goto again;
+		}
+		if (q->hedge_at && q->hedge_at <= now) {
+			pfs_dns_hedge(q);
+			goto again;
+		}
+	}
+	pfs_dns_reap(spfhook);
+}
+
+void
+pfs_dns_async_set_hedge(SPF_dns_server_t *spf_dns_server, int percentile)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(spf_dns_server->hook);
+
+	spfhook->hedge = percentile;
+}
+
+void
+pfs_dns_deadline_start(int64_t *deadline, int ms)
+{
+	*deadline = pfs_dns_now() + ms;
+	*pfs_fiber_local(PFS_LOCAL_DEADLINE) = deadline;
+}
+
+void
+pfs_dns_deadline_stop(void)
+{
+	*pfs_fiber_local(PFS_LOCAL_DEADLINE) = NULL;
+}
+
+int
+pfs_dns_deadline_passed(void)
+{
+	int64_t					*deadline = (int64_t *)*pfs_fiber_local(PFS_LOCAL_DEADLINE);
+
+	return deadline != NULL && *deadline <= pfs_dns_now();
+}
+
+int
+pfs_dns_async_wait(SPF_dns_server_t *spf_dns_server, int fd, int ms)
+{
+	pfs_dns_query_t			 q;
+	struct epoll_event		 ev;
+	struct pollfd			 pfd;
+	int64_t					*limit = (int64_t *)*pfs_fiber_local(PFS_LOCAL_DEADLINE);
+	int64_t					 now = pfs_dns_now();
+
+	if (limit != NULL && *limit - now < ms)
+		ms = *limit > now ? (int)(*limit - now) : 0;
+
+	/* Our layer is the bottom one */
+	while (spf_dns_server != NULL && spf_dns_server->destroy != pfs_dns_async_free)
+		spf_dns_server = spf_dns_server->layer_below;
+
+	if (spf_dns_server == NULL || pfs_fiber_current() == NULL) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		while (poll(&pfd, 1, ms) < 0 && errno == EINTR)
+			;
+		return (pfd.revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+	}
+
+	memset(&q, 0, sizeof(q));
+	q.spf_dns_server = spf_dns_server;
+	q.waiter = pfs_fiber_current();
+	q.wait = 1;
+	q.readable = -1;
+	q.fd = fd;
+	q.deadline = now + ms;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &q;
+	if (epoll_ctl(SPF_voidp2spfhook(spf_dns_server->hook)->epfd,
+					EPOLL_CTL_ADD, fd, &ev) < 0)
+		return 0;
+	pfs_dns_link(&q);
+
+	while (q.readable < 0)
+		pfs_fiber_suspend();
+	return q.readable;
+}
+
+static void
+pfs_dns_async_free(SPF_dns_server_t *spf_dns_server)
+{
+	pfs_dns_async_config_t	*spfhook = SPF_voidp2spfhook(spf_dns_server->hook);
+
+	if (spfhook != NULL) {
+		while (spfhook->pending != NULL) {
+			if (spfhook->pending->wait)
+				pfs_dns_wait_done(spfhook->pending, 0);
+			else
+				pfs_dns_fail(spfhook->pending, TRY_AGAIN);
+		}
+		pfs_dns_reap(spfhook);
+		close(spfhook->epfd);
+		free(spfhook->buf);
+		free(spfhook);
+	}
+	free(spf_dns_server);
+}
+
+SPF_dns_server_t *
+pfs_dns_async_new(SPF_dns_server_t *layer_below,
+				const char *name, int debug, const char *servers)
+{
+	SPF_dns_server_t		*spf_dns_server;
+	pfs_dns_async_config_t	*spfhook;
+	char					*list, *tok, *save;
+
+	spf_dns_server = (SPF_dns_server_t *)malloc(sizeof(SPF_dns_server_t));
+	if (spf_dns_server == NULL)
+		return NULL;
+	memset(spf_dns_server, 0, sizeof(SPF_dns_server_t));
+
+	spfhook = (pfs_dns_async_config_t *)malloc(sizeof(pfs_dns_async_config_t));
+	if (spfhook == NULL) {
+		free(spf_dns_server);
+		return NULL;
+	}
+	memset(spfhook, 0, sizeof(pfs_dns_async_config_t));
+
+	spf_dns_server->destroy = pfs_dns_async_free;
+	spf_dns_server->lookup = pfs_dns_async_lookup;
+	spf_dns_server->get_spf = NULL;
+	spf_dns_server->get_exp = NULL;
+	spf_dns_server->add_cache = NULL;
+	spf_dns_server->layer_below = layer_below;
+	spf_dns_server->name = name ? name : "async";
+	spf_dns_server->debug = debug;
+	spf_dns_server->hook = spfhook;
+
+	spfhook->timeout = PFS_DNS_TIMEOUT;
+	spfhook->attempts = PFS_DNS_ATTEMPTS;
+	spfhook->hedge_delay = PFS_DNS_HEDGE_DELAY;
+	pfs_dns_read_resolv_conf(spfhook);
+
+	if (servers != NULL) {
+		spfhook->nns = 0;
+		list = strdup(servers);
+		for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (spfhook->nns == PFS_DNS_MAXNS)
+				break;
+			if (pfs_dns_parse_server(tok, &spfhook->ns[spfhook->nns],
+							&spfhook->ns_len[spfhook->nns]) == 0)
+				spfhook->nns++;
+			else
+				pfs_log(LOG_WARNING, "Ignoring invalid DNS server %s\n", tok);
+		}
+		free(list);
+	}
+	if (spfhook->nns == 0) {
+		/* Same default as the libc resolver */
+		pfs_dns_parse_server("127.0.0.1", &spfhook->ns[0], &spfhook->ns_len[0]);
+		spfhook->nns = 1;
+	}
+
+	if (getrandom(&spfhook->rand, sizeof(spfhook->rand), 0) != sizeof(spfhook->rand))
+		spfhook->rand = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+	spfhook->rand |= 1;
+
+	spfhook->buf = (unsigned char *)malloc(PFS_DNS_BUFSIZE);
+	spfhook->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (spfhook->epfd < 0 || spfhook->buf == NULL) {
+		pfs_log(LOG_ERR, "Can not set up DNS layer: %s\n", strerror(errno));
+		pfs_dns_async_free(spf_dns_server);
+		return NULL;
+	}
+
+	return spf_dns_server;
+}
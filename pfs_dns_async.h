@@ -0,0 +1,61 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Non-blocking DNS layer for libspf2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_DNS_ASYNC_H
+#define PFS_DNS_ASYNC_H
+
+#include <stdint.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+
+/*
+ * Create the bottom DNS layer. servers is a comma separated list of
+ * "ip", "ip:port" or "[ipv6]:port"; NULL uses /etc/resolv.conf.
+ *
+ * A lookup made from inside a fiber sends the query and suspends the
+ * fiber; whoever runs the fibers must watch pfs_dns_async_fd and call
+ * pfs_dns_async_process when it is readable or pfs_dns_async_timeout
+ * milliseconds have passed. A lookup made outside of a fiber waits for
+ * its own answer.
+ */
+SPF_dns_server_t *pfs_dns_async_new(SPF_dns_server_t *layer_below,
+				const char *name, int debug, const char *servers);
+
+int pfs_dns_async_fd(SPF_dns_server_t *spf_dns_server);
+int pfs_dns_async_timeout(SPF_dns_server_t *spf_dns_server);
+void pfs_dns_async_process(SPF_dns_server_t *spf_dns_server);
+
+/*
+ * Wait at most ms milliseconds, and no longer than the evaluation's
+ * deadline, for fd to become readable; 1 if it did, else 0. Inside a
+ * fiber the wait goes through the bottom layer below spf_dns_server
+ * like a query, so other evaluations go on meanwhile.
+ */
+int pfs_dns_async_wait(SPF_dns_server_t *spf_dns_server, int fd, int ms);
+
+/*
+ * Send a query which the server has not answered within this
+ * percentile of the recent round trips to the next server as well.
+ * Needs at least two servers; 0 turns hedging off.
+ */
+void pfs_dns_async_set_hedge(SPF_dns_server_t *spf_dns_server, int percentile);
+
+/*
+ * Give the running evaluation (see pfs_fiber_local) ms milliseconds:
+ * after that its lookups, waiting or new, fail with TRY_AGAIN. deadline
+ * is the evaluation's own storage and must live until the stop.
+ */
+void pfs_dns_deadline_start(int64_t *deadline, int ms);
+void pfs_dns_deadline_stop(void);
+int pfs_dns_deadline_passed(void);
+
+#endif
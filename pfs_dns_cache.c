@@ -0,0 +1,795 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  DNS cache layer. It replaces spf_dns_cache so that one cache can be
+ *  shared by every worker thread and written to disk on exit.
+ *
+ *  Records are kept in one serialized form, both in memory and in the
+ *  snapshot file: a fixed header, the domain, then every answer as a
+ *  length and its bytes. The snapshot adds a hash table of record
+ *  offsets in front, so a fresh process maps the file and looks records
+ *  up there on a miss instead of reading it all at startup. Records
+ *  found in the snapshot move into the memory cache.
+ *
+ *  Records which are asked for often are refreshed ahead of time: a hit
+ *  on a hot record during the last tenth of its lifetime queues it, and
+ *  the evaluation engines resolve the queue in the background, so busy
+ *  domains do not expire in the middle of the request path.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_dns_rr.h"
+
+#include "pfs_dns_cache.h"
+#include "pfs_dns_async.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+
+#define PFS_DNS_CACHE_BUCKETS	16384	/* power of two */
+#define PFS_DNS_CACHE_STRIPES	64
+#define PFS_DNS_CACHE_CHAIN		8		/* longer chains drop their tail */
+#define PFS_DNS_CACHE_MAXTTL	86400
+
+/* Negative answers: RFC 2308 SOA minimum, kept within these bounds */
+#define PFS_DNS_CACHE_NEG_MIN	30
+#define PFS_DNS_CACHE_NEG_MAX	900
+/* Server failures and timeouts, so a dead zone is not asked every time */
+#define PFS_DNS_CACHE_FAIL_TTL	5
+
+/* Refresh ahead: hits in a record's lifetime to count as hot */
+#define PFS_DNS_REFRESH_HITS	4
+#define PFS_DNS_REFRESH_MINTTL	20
+#define PFS_DNS_REFRESH_QUEUE	1024
+
+#define PFS_SNAP_MAGIC			0x50465344	/* "PFSD" */
+#define PFS_SNAP_VERSION		1
+
+/* The serialized record, followed by domain and answers */
+typedef
+struct pfs_dns_rec_struct {
+	uint64_t		 hash;
+	int64_t			 expires;
+	uint32_t		 len;		/* including this header */
+	uint16_t		 rr_type;
+	int16_t			 herrno;
+	uint16_t		 name_len;	/* including the NUL */
+	uint16_t		 num_rr;
+	uint32_t		 ttl;		/* lifetime when fetched */
+} pfs_dns_rec_t;
+
+typedef
+struct pfs_dns_entry_struct {
+	struct pfs_dns_entry_struct	*next;
+	uint32_t		 hits;
+	uint32_t		 queued;	/* waiting for refresh */
+	pfs_dns_rec_t	 rec;
+} pfs_dns_entry_t;
+
+typedef
+struct pfs_dns_refresh_struct {
+	struct pfs_dns_refresh_struct	*next;
+	ns_type			 rr_type;
+	char			 domain[1];
+} pfs_dns_refresh_t;
+
+typedef
+struct pfs_snap_header_struct {
+	uint32_t		 magic;
+	uint32_t		 version;
+	uint64_t		 size;		/* of the whole file */
+	uint64_t		 nbuckets;	/* power of two */
+	uint64_t		 count;
+	int64_t			 created;
+} pfs_snap_header_t;
+
+struct pfs_dns_cache_struct {
+	pthread_mutex_t	 lock[PFS_DNS_CACHE_STRIPES];
+	pfs_dns_entry_t	*bucket[PFS_DNS_CACHE_BUCKETS];
+
+	/* Records to refresh ahead, only used when an engine drains it */
+	pthread_mutex_t	 refresh_lock;
+	pfs_dns_refresh_t	*refresh_head;
+	pfs_dns_refresh_t	*refresh_tail;
+	int				 refresh_count;
+	int				 refresh_enabled;
+
+	/* Read only once mapped */
+	const char		*snap;
+	size_t			 snap_size;
+	const uint64_t	*snap_bucket;
+	uint64_t		 snap_nbuckets;
+};
+
+#define PFS_REC_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+#define PFS_REC_NAME(r)		((const char *)((r) + 1))
+
+
+static uint64_t
+pfs_dns_cache_hash(const char *domain, ns_type rr_type)
+{
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+	size_t			 len = strlen(domain);
+
+	/* FNV-1a over the lower case name without a trailing dot */
+	if (len > 0 && domain[len - 1] == '.')
+		len--;
+	while (len-- > 0) {
+		h ^= (unsigned char)tolower((unsigned char)*domain++);
+		h *= 0x100000001b3ULL;
+	}
+	h ^= rr_type;
+	h *= 0x100000001b3ULL;
+	return h;
+}
+
+static int
+pfs_dns_rec_match(const pfs_dns_rec_t *rec, uint64_t hash,
+				const char *domain, ns_type rr_type)
+{
+	size_t			 len = strlen(domain);
+
+	if (len > 0 && domain[len - 1] == '.')
+		len--;
+	return rec->hash == hash && rec->rr_type == rr_type
+					&& rec->name_len == len + 1
+					&& strncasecmp(PFS_REC_NAME(rec), domain, len) == 0;
+}
+
+static pfs_dns_entry_t *
+pfs_dns_entry_alloc(size_t len)
+{
+	pfs_dns_entry_t	*entry;
+
+	entry = (pfs_dns_entry_t *)malloc(offsetof(pfs_dns_entry_t, rec) + len);
+	if (entry != NULL) {
+		entry->next = NULL;
+		entry->hits = 0;
+		entry->queued = 0;
+	}
+	return entry;
+}
+
+/*
+ * How long to keep an answer, 0 if it should not be cached
+ */
+static int
+pfs_dns_cache_ttl(SPF_dns_rr_t *rr)
+{
+	switch (rr->herrno) {
+		case NETDB_SUCCESS:
+			if (rr->ttl <= 0)
+				return 0;
+			return rr->ttl < PFS_DNS_CACHE_MAXTTL ? rr->ttl : PFS_DNS_CACHE_MAXTTL;
+		case HOST_NOT_FOUND:
+		case NO_DATA:
+			if (rr->ttl < PFS_DNS_CACHE_NEG_MIN)
+				return PFS_DNS_CACHE_NEG_MIN;
+			return rr->ttl < PFS_DNS_CACHE_NEG_MAX ? rr->ttl : PFS_DNS_CACHE_NEG_MAX;
+		case TRY_AGAIN:
+			return PFS_DNS_CACHE_FAIL_TTL;
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Serialize rr into a freshly allocated entry
+ */
+static pfs_dns_entry_t *
+pfs_dns_entry_new(SPF_dns_rr_t *rr, uint64_t hash, time_t now, int ttl)
+{
+	pfs_dns_entry_t	*entry;
+	pfs_dns_rec_t	*rec;
+	size_t			 len, name_len, rlen[256];
+	char			*p;
+	uint16_t		 l16;
+	int				 i;
+
+	if (rr->num_rr > 255)
+		return NULL;
+
+	name_len = strlen(rr->domain);
+	if (name_len > 0 && rr->domain[name_len - 1] == '.')
+		name_len--;
+	len = sizeof(pfs_dns_rec_t) + name_len + 1;
+
+	for (i = 0; i < rr->num_rr; i++) {
+		switch (rr->rr_type) {
+			case ns_t_a:
+				rlen[i] = sizeof(struct in_addr);
+				break;
+			case ns_t_aaaa:
+				rlen[i] = sizeof(struct in6_addr);
+				break;
+			default:
+				/* txt, mx and ptr are strings sharing one union member */
+				rlen[i] = strlen(rr->rr[i]->txt) + 1;
+				break;
+		}
+		if (rlen[i] > 0xffff)
+			return NULL;
+		len += sizeof(l16) + rlen[i];
+	}
+	len = PFS_REC_ALIGN(len);
+
+	entry = pfs_dns_entry_alloc(len);
+	if (entry == NULL)
+		return NULL;
+	rec = &entry->rec;
+	memset(rec, 0, len);
+	rec->hash = hash;
+	rec->expires = now + ttl;
+	rec->ttl = ttl;
+	rec->len = len;
+	rec->rr_type = rr->rr_type;
+	rec->herrno = rr->herrno;
+	rec->name_len = name_len + 1;
+	rec->num_rr = rr->num_rr;
+
+	p = (char *)(rec + 1);
+	memcpy(p, rr->domain, name_len);
+	p += name_len + 1;
+	for (i = 0; i < rr->num_rr; i++) {
+		l16 = rlen[i];
+		memcpy(p, &l16, sizeof(l16));
+		memcpy(p + sizeof(l16), rr->rr[i], rlen[i]);
+		p += sizeof(l16) + rlen[i];
+	}
+
+	return entry;
+}
+
+/*
+ * Build the SPF_dns_rr_t libspf2 expects from a record. Answers are
+ * checked against rec->len, the record may come from a damaged file.
+ */
+static SPF_dns_rr_t *
+pfs_dns_rec_decode(SPF_dns_server_t *spf_dns_server, const pfs_dns_rec_t *rec,
+				const char *domain, time_t now)
+{
+	SPF_dns_rr_t	*rr;
+	const char		*p = (const char *)(rec + 1) + rec->name_len;
+	const char		*end = (const char *)rec + rec->len;
+	uint16_t		 l16;
+	int				 i;
+
+	rr = SPF_dns_rr_new_init(spf_dns_server, domain, rec->rr_type,
+					rec->expires - now, rec->herrno);
+	if (rr == NULL)
+		return NULL;
+
+	for (i = 0; i < rec->num_rr; i++) {
+		if (p + sizeof(l16) > end)
+			break;
+		memcpy(&l16, p, sizeof(l16));
+		p += sizeof(l16);
+		if (p + l16 > end || SPF_dns_rr_buf_realloc(rr, i, l16))
+			break;
+		memcpy(rr->rr[i], p, l16);
+		p += l16;
+	}
+	rr->num_rr = i;
+
+	return rr;
+}
+
+/*
+ * The snapshot record at off, or NULL if the file is damaged there
+ */
+static const pfs_dns_rec_t *
+pfs_snap_rec(pfs_dns_cache_t *cache, uint64_t off)
+{
+	const pfs_dns_rec_t	*rec;
+
+	if (off == 0 || off + sizeof(pfs_dns_rec_t) > cache->snap_size)
+		return NULL;
+	rec = (const pfs_dns_rec_t *)(cache->snap + off);
+	if (rec->len < sizeof(pfs_dns_rec_t) + rec->name_len
+					|| off + rec->len > cache->snap_size
+					|| rec->name_len == 0
+					|| PFS_REC_NAME(rec)[rec->name_len - 1] != '\0')
+		return NULL;
+	return rec;
+}
+
+/*
+ * Find a record in the snapshot. The caller copies what it needs.
+ */
+static const pfs_dns_rec_t *
+pfs_snap_find(pfs_dns_cache_t *cache, uint64_t hash,
+				const char *domain, ns_type rr_type)
+{
+	const pfs_dns_rec_t	*rec;
+	uint64_t			 i, n;
+
+	if (cache->snap == NULL)
+		return NULL;
+
+	for (n = 0; n < cache->snap_nbuckets; n++) {
+		i = (hash + n) & (cache->snap_nbuckets - 1);
+		if ((rec = pfs_snap_rec(cache, cache->snap_bucket[i])) == NULL)
+			return NULL;
+		if (pfs_dns_rec_match(rec, hash, domain, rr_type))
+			return rec;
+	}
+	return NULL;
+}
+
+/*
+ * Insert entry in front of its chain, replacing an older copy.
+ * Called with the stripe locked.
+ */
+static void
+pfs_dns_cache_insert(pfs_dns_cache_t *cache, pfs_dns_entry_t *entry)
+{
+	pfs_dns_entry_t	**pp, *e;
+	uint64_t		 b = entry->rec.hash & (PFS_DNS_CACHE_BUCKETS - 1);
+	int				 n = 1;
+
+	entry->next = cache->bucket[b];
+	cache->bucket[b] = entry;
+
+	for (pp = &entry->next; (e = *pp) != NULL; ) {
+		if (n >= PFS_DNS_CACHE_CHAIN
+					|| (e->rec.hash == entry->rec.hash
+							&& e->rec.rr_type == entry->rec.rr_type
+							&& strcasecmp(PFS_REC_NAME(&e->rec),
+									PFS_REC_NAME(&entry->rec)) == 0)) {
+			*pp = e->next;
+			free(e);
+			continue;
+		}
+		n++;
+		pp = &e->next;
+	}
+}
+
+/*
+ * Cache a fresh answer. Called without locks held.
+ */
+static void
+pfs_dns_cache_store(pfs_dns_cache_t *cache, uint64_t hash, SPF_dns_rr_t *rr)
+{
+	pfs_dns_entry_t		*entry;
+	pthread_mutex_t		*lock = &cache->lock[hash % PFS_DNS_CACHE_STRIPES];
+	int					 ttl;
+
+	if ((ttl = pfs_dns_cache_ttl(rr)) == 0)
+		return;
+	entry = pfs_dns_entry_new(rr, hash, time(NULL), ttl);
+	if (entry != NULL) {
+		pthread_mutex_lock(lock);
+		pfs_dns_cache_insert(cache, entry);
+		pthread_mutex_unlock(lock);
+	}
+}
+
+/*
+ * Note a hit; returns 1 if the entry should be refreshed now.
+ * Called with the stripe locked.
+ */
+static int
+pfs_dns_cache_hot(pfs_dns_cache_t *cache, pfs_dns_entry_t *entry, time_t now)
+{
+	int64_t				 window = entry->rec.ttl / 10;
+
+	entry->hits++;
+	if (!cache->refresh_enabled || entry->queued
+					|| entry->rec.ttl < PFS_DNS_REFRESH_MINTTL
+					|| entry->hits < PFS_DNS_REFRESH_HITS
+					|| entry->rec.expires - now > (window > 2 ? window : 2))
+		return 0;
+	entry->queued = 1;
+	return 1;
+}
+
+static void
+pfs_dns_cache_queue_refresh(pfs_dns_cache_t *cache, const char *domain, ns_type rr_type)
+{
+	pfs_dns_refresh_t	*r;
+
+	r = (pfs_dns_refresh_t *)malloc(sizeof(pfs_dns_refresh_t) + strlen(domain));
+	if (r == NULL)
+		return;
+	r->next = NULL;
+	r->rr_type = rr_type;
+	strcpy(r->domain, domain);
+
+	pthread_mutex_lock(&cache->refresh_lock);
+	if (cache->refresh_count >= PFS_DNS_REFRESH_QUEUE) {
+		/* The entry stays marked and simply expires */
+		pthread_mutex_unlock(&cache->refresh_lock);
+		free(r);
+		return;
+	}
+	if (cache->refresh_tail)
+		cache->refresh_tail->next = r;
+	else
+		cache->refresh_head = r;
+	cache->refresh_tail = r;
+	__atomic_add_fetch(&cache->refresh_count, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache->refresh_lock);
+}
+
+static SPF_dns_rr_t *
+pfs_dns_cache_lookup(SPF_dns_server_t *spf_dns_server,
+				const char *domain, ns_type rr_type, int should_cache)
+{
+	pfs_dns_cache_t		*cache = (pfs_dns_cache_t *)spf_dns_server->hook;
+	pfs_dns_entry_t		*entry, **pp;
+	const pfs_dns_rec_t	*rec;
+	SPF_dns_rr_t		*rr = NULL;
+	uint64_t			 hash;
+	pthread_mutex_t		*lock;
+	time_t				 now = time(NULL);
+	int					 refresh = 0;
+
+	if (!should_cache)
+		return SPF_dns_lookup(spf_dns_server->layer_below, domain, rr_type, should_cache);
+
+	hash = pfs_dns_cache_hash(domain, rr_type);
+	pp = &cache->bucket[hash & (PFS_DNS_CACHE_BUCKETS - 1)];
+	lock = &cache->lock[hash % PFS_DNS_CACHE_STRIPES];
+
+	pthread_mutex_lock(lock);
+	for (; (entry = *pp) != NULL; pp = &entry->next) {
+		if (!pfs_dns_rec_match(&entry->rec, hash, domain, rr_type))
+			continue;
+		if (entry->rec.expires > now) {
+			rr = pfs_dns_rec_decode(spf_dns_server, &entry->rec, domain, now);
+			refresh = pfs_dns_cache_hot(cache, entry, now);
+		}
+		else {
+			*pp = entry->next;
+			free(entry);
+		}
+		break;
+	}
+
+	if (rr == NULL && (rec = pfs_snap_find(cache, hash, domain, rr_type)) != NULL
+					&& rec->expires > now) {
+		rr = pfs_dns_rec_decode(spf_dns_server, rec, domain, now);
+		entry = pfs_dns_entry_alloc(rec->len);
+		if (entry != NULL) {
+			memcpy(&entry->rec, rec, rec->len);
+			pfs_dns_cache_insert(cache, entry);
+		}
+	}
+	pthread_mutex_unlock(lock);
+
+	if (refresh)
+		pfs_dns_cache_queue_refresh(cache, domain, rr_type);
+
+	pfs_metrics_dns_lookup(rr != NULL);
+	if (rr != NULL) {
+		pfs_metrics_dns_ttl(rr->ttl);
+		if (spf_dns_server->debug)
+			pfs_log(LOG_DEBUG, "DNS cache hit %s/%d\n", domain, rr_type);
+		return rr;
+	}
+
+	/* Ask below without holding the lock, this may take a while */
+	rr = SPF_dns_lookup(spf_dns_server->layer_below, domain, rr_type, should_cache);
+	/* Given up for lack of time says nothing about the servers */
+	if (rr != NULL && !(rr->herrno == TRY_AGAIN && pfs_dns_deadline_passed()))
+		pfs_dns_cache_store(cache, hash, rr);
+	/* Results built on it are good for as long as it is kept here */
+	if (rr != NULL)
+		pfs_metrics_dns_ttl(pfs_dns_cache_ttl(rr));
+
+	return rr;
+}
+
+static void
+pfs_dns_cache_layer_free(SPF_dns_server_t *spf_dns_server)
+{
+	free(spf_dns_server);
+}
+
+SPF_dns_server_t *
+pfs_dns_cache_layer_new(SPF_dns_server_t *layer_below,
+				pfs_dns_cache_t *cache, const char *name, int debug)
+{
+	SPF_dns_server_t	*spf_dns_server;
+
+	spf_dns_server = (SPF_dns_server_t *)malloc(sizeof(SPF_dns_server_t));
+	if (spf_dns_server == NULL)
+		return NULL;
+	memset(spf_dns_server, 0, sizeof(SPF_dns_server_t));
+
+	spf_dns_server->destroy = pfs_dns_cache_layer_free;
+	spf_dns_server->lookup = pfs_dns_cache_lookup;
+	spf_dns_server->get_spf = NULL;
+	spf_dns_server->get_exp = NULL;
+	spf_dns_server->add_cache = NULL;
+	spf_dns_server->layer_below = layer_below;
+	spf_dns_server->name = name ? name : "cache";
+	spf_dns_server->debug = debug;
+	spf_dns_server->hook = cache;
+
+	return spf_dns_server;
+}
+
+pfs_dns_cache_t *
+pfs_dns_cache_new(void)
+{
+	pfs_dns_cache_t		*cache;
+	int					 i;
+
+	cache = (pfs_dns_cache_t *)malloc(sizeof(pfs_dns_cache_t));
+	memset(cache, 0, sizeof(pfs_dns_cache_t));
+	for (i = 0; i < PFS_DNS_CACHE_STRIPES; i++)
+		pthread_mutex_init(&cache->lock[i], NULL);
+	pthread_mutex_init(&cache->refresh_lock, NULL);
+	return cache;
+}
+
+void
+pfs_dns_cache_free(pfs_dns_cache_t *cache)
+{
+	pfs_dns_entry_t		*entry;
+	pfs_dns_refresh_t	*r;
+	int					 i;
+
+	while ((r = cache->refresh_head) != NULL) {
+		cache->refresh_head = r->next;
+		free(r);
+	}
+	for (i = 0; i < PFS_DNS_CACHE_BUCKETS; i++) {
+		while ((entry = cache->bucket[i]) != NULL) {
+			cache->bucket[i] = entry->next;
+			free(entry);
+		}
+	}
+	for (i = 0; i < PFS_DNS_CACHE_STRIPES; i++)
+		pthread_mutex_destroy(&cache->lock[i]);
+	pthread_mutex_destroy(&cache->refresh_lock);
+	if (cache->snap)
+		munmap((void *)cache->snap, cache->snap_size);
+	free(cache);
+}
+
+void
+pfs_dns_cache_enable_refresh(pfs_dns_cache_t *cache)
+{
+	cache->refresh_enabled = 1;
+}
+
+int
+pfs_dns_cache_refresh_pending(pfs_dns_cache_t *cache)
+{
+	return __atomic_load_n(&cache->refresh_count, __ATOMIC_RELAXED);
+}
+
+int
+pfs_dns_cache_next_refresh(pfs_dns_cache_t *cache, char *domain, size_t len,
+				ns_type *rr_type)
+{
+	pfs_dns_refresh_t	*r;
+
+	pthread_mutex_lock(&cache->refresh_lock);
+	if ((r = cache->refresh_head) != NULL) {
+		cache->refresh_head = r->next;
+		if (cache->refresh_head == NULL)
+			cache->refresh_tail = NULL;
+		__atomic_sub_fetch(&cache->refresh_count, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&cache->refresh_lock);
+
+	if (r == NULL)
+		return 0;
+	snprintf(domain, len, "%s", r->domain);
+	*rr_type = r->rr_type;
+	free(r);
+	return 1;
+}
+
+void
+pfs_dns_cache_refreshed(pfs_dns_cache_t *cache, const char *domain,
+				ns_type rr_type, SPF_dns_rr_t *rr)
+{
+	pfs_dns_entry_t		*entry;
+	uint64_t			 hash = pfs_dns_cache_hash(domain, rr_type);
+	pthread_mutex_t		*lock = &cache->lock[hash % PFS_DNS_CACHE_STRIPES];
+
+	if (rr != NULL && rr->herrno != TRY_AGAIN) {
+		pfs_dns_cache_store(cache, hash, rr);
+		return;
+	}
+
+	/* Keep serving the old answer until it expires, a later hit may retry */
+	pthread_mutex_lock(lock);
+	for (entry = cache->bucket[hash & (PFS_DNS_CACHE_BUCKETS - 1)];
+					entry != NULL; entry = entry->next) {
+		if (pfs_dns_rec_match(&entry->rec, hash, domain, rr_type)) {
+			entry->queued = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(lock);
+}
+
+int
+pfs_dns_cache_load(pfs_dns_cache_t *cache, const char *path)
+{
+	const pfs_snap_header_t	*hdr;
+	struct stat				 st;
+	void					*base;
+	int						 fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			pfs_log(LOG_WARNING, "open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(pfs_snap_header_t)) {
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		pfs_log(LOG_WARNING, "mmap %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = (const pfs_snap_header_t *)base;
+	if (hdr->magic != PFS_SNAP_MAGIC || hdr->version != PFS_SNAP_VERSION
+					|| hdr->size != (uint64_t)st.st_size
+					|| hdr->nbuckets == 0
+					|| (hdr->nbuckets & (hdr->nbuckets - 1)) != 0
+					|| hdr->nbuckets > (st.st_size - sizeof(*hdr)) / sizeof(uint64_t)) {
+		pfs_log(LOG_WARNING, "Ignoring cache snapshot %s: wrong format\n", path);
+		munmap(base, st.st_size);
+		return -1;
+	}
+
+	cache->snap = (const char *)base;
+	cache->snap_size = st.st_size;
+	cache->snap_bucket = (const uint64_t *)(cache->snap + sizeof(*hdr));
+	cache->snap_nbuckets = hdr->nbuckets;
+
+	pfs_log(LOG_INFO, "Mapped cache snapshot %s, %llu records from %lds ago\n",
+					path, (unsigned long long)hdr->count, (long)(time(NULL) - hdr->created));
+	return 0;
+}
+
+/*
+ * Collect pointers to every record worth saving: live entries first,
+ * then snapshot records which were neither replaced nor expired.
+ */
+static size_t
+pfs_dns_cache_collect(pfs_dns_cache_t *cache, const pfs_dns_rec_t ***listp, time_t now)
+{
+	const pfs_dns_rec_t	**list = NULL;
+	const pfs_dns_rec_t	 *rec;
+	pfs_dns_entry_t		 *entry;
+	size_t				  n = 0, size = 0;
+	uint64_t			  i;
+	int					  live;
+
+	for (i = 0; i < PFS_DNS_CACHE_BUCKETS; i++) {
+		for (entry = cache->bucket[i]; entry != NULL; entry = entry->next) {
+			if (entry->rec.expires <= now)
+				continue;
+			if (n == size) {
+				size = size ? 2 * size : 1024;
+				list = realloc(list, size * sizeof(*list));
+			}
+			list[n++] = &entry->rec;
+		}
+	}
+
+	for (i = 0; cache->snap && i < cache->snap_nbuckets; i++) {
+		rec = pfs_snap_rec(cache, cache->snap_bucket[i]);
+		if (rec == NULL || rec->expires <= now)
+			continue;
+
+		live = 0;
+		for (entry = cache->bucket[rec->hash & (PFS_DNS_CACHE_BUCKETS - 1)];
+						entry != NULL; entry = entry->next) {
+			if (pfs_dns_rec_match(&entry->rec, rec->hash,
+							PFS_REC_NAME(rec), rec->rr_type))
+				live = 1;
+		}
+		if (live)
+			continue;
+
+		if (n == size) {
+			size = size ? 2 * size : 1024;
+			list = realloc(list, size * sizeof(*list));
+		}
+		list[n++] = rec;
+	}
+
+	*listp = list;
+	return n;
+}
+
+int
+pfs_dns_cache_save(pfs_dns_cache_t *cache, const char *path)
+{
+	const pfs_dns_rec_t	**list;
+	pfs_snap_header_t	  hdr;
+	uint64_t			 *bucket;
+	uint64_t			  off, b;
+	char				  tmp[1024];
+	time_t				  now = time(NULL);
+	size_t				  n, i;
+	FILE				 *fp;
+	int					  k, ok;
+
+	/* Called at exit with the workers gone, no locking needed */
+	n = pfs_dns_cache_collect(cache, &list, now);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PFS_SNAP_MAGIC;
+	hdr.version = PFS_SNAP_VERSION;
+	hdr.count = n;
+	hdr.created = now;
+	for (hdr.nbuckets = 64; hdr.nbuckets < 2 * n; hdr.nbuckets <<= 1)
+		;
+
+	bucket = (uint64_t *)calloc(hdr.nbuckets, sizeof(uint64_t));
+	off = sizeof(hdr) + hdr.nbuckets * sizeof(uint64_t);
+	for (i = 0; i < n; i++) {
+		for (k = 0; ; k++) {
+			b = (list[i]->hash + k) & (hdr.nbuckets - 1);
+			if (bucket[b] == 0)
+				break;
+		}
+		bucket[b] = off;
+		off += list[i]->len;
+	}
+	hdr.size = off;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		pfs_log(LOG_WARNING, "Can not write cache snapshot %s: %s\n", tmp, strerror(errno));
+		free(bucket);
+		free(list);
+		return -1;
+	}
+	/* A full disk must not leave a truncated snapshot behind */
+	ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+			&& fwrite(bucket, sizeof(uint64_t), hdr.nbuckets, fp) == hdr.nbuckets;
+	for (i = 0; ok && i < n; i++)
+		ok = fwrite(list[i], list[i]->len, 1, fp) == 1;
+
+	free(bucket);
+	free(list);
+
+	if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0) {
+		pfs_log(LOG_WARNING, "Can not write cache snapshot %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	if (n > 0)
+		pfs_log(LOG_INFO, "Saved %lu DNS records to %s\n", (unsigned long)n, path);
+	return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  DNS cache shared by all evaluation threads, with snapshots that
+ *  survive restarts (--cache-snapshot).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_DNS_CACHE_H
+#define PFS_DNS_CACHE_H
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "policyd-spf-fs.h"
+
+pfs_dns_cache_t *pfs_dns_cache_new(void);
+void pfs_dns_cache_free(pfs_dns_cache_t *cache);
+
+/*
+ * Map a snapshot written by pfs_dns_cache_save. Nothing is read until a
+ * lookup misses the cache, so this takes the same time for any size.
+ * Returns -1 if the file is missing or not a snapshot.
+ */
+int pfs_dns_cache_load(pfs_dns_cache_t *cache, const char *path);
+
+/* Write every unexpired record to path, replacing it atomically */
+int pfs_dns_cache_save(pfs_dns_cache_t *cache, const char *path);
+
+/*
+ * A libspf2 DNS layer answering from cache and asking layer_below on a
+ * miss. Each thread needs its own layer, they may share the cache.
+ */
+SPF_dns_server_t *pfs_dns_cache_layer_new(SPF_dns_server_t *layer_below,
+				pfs_dns_cache_t *cache, const char *name, int debug);
+
+/*
+ * Refresh ahead. Once enabled, hot records close to expiry are queued;
+ * whoever enables it must take them with pfs_dns_cache_next_refresh,
+ * resolve them below the cache and hand the answer (or NULL) back to
+ * pfs_dns_cache_refreshed.
+ */
+void pfs_dns_cache_enable_refresh(pfs_dns_cache_t *cache);
+int pfs_dns_cache_refresh_pending(pfs_dns_cache_t *cache);
+int pfs_dns_cache_next_refresh(pfs_dns_cache_t *cache, char *domain, size_t len,
+				ns_type *rr_type);
+void pfs_dns_cache_refreshed(pfs_dns_cache_t *cache, const char *domain,
+				ns_type rr_type, SPF_dns_rr_t *rr);
+
+#endif
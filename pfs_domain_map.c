@@ -0,0 +1,429 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Override and fallback domain maps. A map is an open addressing hash
+ *  table over the lower case domain names, built once and never changed
+ *  afterwards, so lookups take no lock. Subdomain entries are stored
+ *  with their leading dot, which makes every suffix of a domain that
+ *  starts at a dot a possible key as it is: a lookup is one probe for
+ *  the domain and one per label above it, however many entries there
+ *  are. Records are compiled when the file is loaded and every request
+ *  gets a copy of the compiled blocks, as from the record cache.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_dns_rr.h"
+#include "spf_record.h"
+#include "spf_response.h"
+
+#include "pfs_domain_map.h"
+#include "pfs_metrics.h"
+#include "pfs_netblock.h"
+#include "pfs_log.h"
+
+#define PFS_DOMAIN_MAP_VERSION	"v=spf1"
+
+typedef
+struct pfs_domain_entry_struct {
+	uint64_t		 hash;
+	char			*domain;	/* NULL: free slot */
+	size_t			 len;
+	SPF_record_t	*rec;
+	char			*text;		/* the record as written */
+} pfs_domain_entry_t;
+
+struct pfs_domain_map_struct {
+	pfs_domain_entry_t	*slot;
+	uint32_t			 mask;
+	uint32_t			 count;
+	uint64_t			 digest;
+};
+
+/* The layer and the maps it answers from */
+typedef
+struct pfs_domain_layer_struct {
+	SPF_dns_server_t	 dns;
+	pfs_domain_map_t	*override;
+	pfs_domain_map_t	*fallback;
+} pfs_domain_layer_t;
+
+
+static uint64_t
+pfs_domain_map_hash(const char *s, size_t len)
+{
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+	size_t			 i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static pfs_domain_entry_t *
+pfs_domain_map_find(pfs_domain_map_t *map, const char *key, size_t len)
+{
+	pfs_domain_entry_t	*e;
+	uint64_t			 h = pfs_domain_map_hash(key, len);
+	uint32_t			 i;
+
+	for (i = h & map->mask; (e = &map->slot[i])->domain != NULL; i = (i + 1) & map->mask) {
+		if (e->hash == h && e->len == len && memcmp(e->domain, key, len) == 0)
+			return e;
+	}
+	return e;
+}
+
+/* Grow to keep the table at most half full */
+static void
+pfs_domain_map_grow(pfs_domain_map_t *map)
+{
+	pfs_domain_entry_t	*old = map->slot, *e;
+	uint32_t			 size = map->mask + 1, i;
+
+	map->slot = (pfs_domain_entry_t *)calloc(size * 2, sizeof(pfs_domain_entry_t));
+	if (map->slot == NULL) {
+		pfs_log(LOG_ERR, "Out of memory for the domain map\n");
+		abort();
+	}
+	map->mask = size * 2 - 1;
+	for (i = 0; i < size; i++) {
+		if (old[i].domain == NULL)
+			continue;
+		e = pfs_domain_map_find(map, old[i].domain, old[i].len);
+		*e = old[i];
+	}
+	free(old);
+}
+
+static void
+pfs_domain_map_add(pfs_domain_map_t *map, const char *domain, SPF_record_t *rec,
+				const char *text)
+{
+	pfs_domain_entry_t	*e;
+	size_t				 len = strlen(domain);
+
+	if ((map->count + 1) * 2 > map->mask + 1)
+		pfs_domain_map_grow(map);
+	e = pfs_domain_map_find(map, domain, len);
+	if (e->domain != NULL) {
+		/* The last line for a domain counts */
+		SPF_record_free(e->rec);
+		free(e->text);
+		e->rec = rec;
+		e->text = strdup(text);
+		return;
+	}
+	e->hash = pfs_domain_map_hash(domain, len);
+	e->domain = strdup(domain);
+	e->len = len;
+	e->rec = rec;
+	e->text = strdup(text);
+	map->count++;
+}
+
+static SPF_record_t *
+pfs_domain_map_copy(SPF_server_t *spf_server, const SPF_record_t *src)
+{
+	SPF_record_t		*rec;
+
+	rec = (SPF_record_t *)calloc(1, sizeof(SPF_record_t));
+	if (rec == NULL)
+		return NULL;
+	rec->spf_server = spf_server;
+	rec->version = src->version;
+	rec->num_mech = src->num_mech;
+	rec->num_mod = src->num_mod;
+	rec->num_dns_mech = src->num_dns_mech;
+
+	/* SPF_record_free releases these with free() */
+	if (src->mech_len) {
+		rec->mech_first = (SPF_mech_t *)malloc(src->mech_len);
+		if (rec->mech_first == NULL)
+			goto fail;
+		memcpy(rec->mech_first, src->mech_first, src->mech_len);
+		rec->mech_size = rec->mech_len = src->mech_len;
+	}
+	if (src->mod_len) {
+		rec->mod_first = (SPF_mod_t *)malloc(src->mod_len);
+		if (rec->mod_first == NULL)
+			goto fail;
+		memcpy(rec->mod_first, src->mod_first, src->mod_len);
+		rec->mod_size = rec->mod_len = src->mod_len;
+	}
+	return rec;
+
+  fail:
+	SPF_record_free(rec);
+	return NULL;
+}
+
+/*
+ * The entry for domain itself or its nearest listed parent. Returns
+ * NULL if there is none.
+ */
+static const pfs_domain_entry_t *
+pfs_domain_map_match(pfs_domain_map_t *map, const char *domain)
+{
+	pfs_domain_entry_t	*e;
+	char				 key[256];
+	const char			*p;
+	size_t				 len, i;
+
+	len = strlen(domain);
+	if (len > 0 && domain[len - 1] == '.')
+		len--;
+	if (len == 0 || len >= sizeof(key) || map->count == 0)
+		return NULL;
+	for (i = 0; i < len; i++)
+		key[i] = tolower((unsigned char)domain[i]);
+	key[len] = '\0';
+
+	if ((e = pfs_domain_map_find(map, key, len))->domain != NULL)
+		return e;
+	for (p = strchr(key, '.'); p != NULL; p = strchr(p + 1, '.')) {
+		if ((e = pfs_domain_map_find(map, p, len - (p - key)))->domain != NULL)
+			return e;
+	}
+	return NULL;
+}
+
+pfs_domain_map_t *
+pfs_domain_map_open(const char *path)
+{
+	pfs_domain_map_t	*map;
+	SPF_server_t		*scratch;
+	SPF_response_t		*spf_response;
+	SPF_record_t		*rec;
+	SPF_errcode_t		 err;
+	FILE				*fp;
+	char				 line[4096];
+	char				*domain, *text, *p, *end;
+	int					 lineno = 0, skipped = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		pfs_log(LOG_ERR, "Can not read %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	map = (pfs_domain_map_t *)calloc(1, sizeof(pfs_domain_map_t));
+	map->mask = 15;
+	map->slot = (pfs_domain_entry_t *)calloc(map->mask + 1, sizeof(pfs_domain_entry_t));
+	map->digest = 0xcbf29ce484222325ULL;
+	/* Records only need a server to be compiled, not to be used */
+	scratch = SPF_server_new_dns(NULL, 0);
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		for (domain = line; isspace((unsigned char)*domain); domain++)
+			;
+		for (end = domain + strlen(domain); end > domain && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		if (*domain == '\0' || *domain == '#')
+			continue;
+
+		for (text = domain; *text && !isspace((unsigned char)*text); text++)
+			*text = tolower((unsigned char)*text);
+		if (*text)
+			*text++ = '\0';
+		while (isspace((unsigned char)*text))
+			text++;
+		if ((p = domain + strlen(domain)) > domain && p[-1] == '.')
+			p[-1] = '\0';
+
+		if (strncasecmp(text, PFS_DOMAIN_MAP_VERSION, sizeof(PFS_DOMAIN_MAP_VERSION) - 1) != 0
+						|| *domain == '\0' || strlen(domain) >= 256) {
+			pfs_log(LOG_WARNING, "%s:%d: expected a domain and a v=spf1 record, ignored\n",
+							path, lineno);
+			skipped++;
+			continue;
+		}
+
+		rec = NULL;
+		spf_response = SPF_response_new(NULL);
+		err = SPF_record_compile(scratch, spf_response, &rec, text);
+		SPF_response_free(spf_response);
+		if (err != SPF_E_SUCCESS) {
+			pfs_log(LOG_WARNING, "%s:%d: record for %s does not compile: %s\n",
+							path, lineno, domain, SPF_strerror(err));
+			if (rec)
+				SPF_record_free(rec);
+			skipped++;
+			continue;
+		}
+		rec->spf_server = NULL;
+		pfs_domain_map_add(map, domain, rec, text);
+
+		map->digest = pfs_domain_map_hash(domain, strlen(domain) + 1) ^ (map->digest * 31);
+		map->digest = pfs_domain_map_hash(text, strlen(text)) ^ (map->digest * 31);
+	}
+
+	fclose(fp);
+	SPF_server_free(scratch);
+	pfs_log(LOG_INFO, "%u domains from %s, %d lines skipped\n", map->count, path, skipped);
+	return map;
+}
+
+void
+pfs_domain_map_close(pfs_domain_map_t *map)
+{
+	uint32_t			 i;
+
+	for (i = 0; i <= map->mask; i++) {
+		if (map->slot[i].domain == NULL)
+			continue;
+		free(map->slot[i].domain);
+		free(map->slot[i].text);
+		SPF_record_free(map->slot[i].rec);
+	}
+	free(map->slot);
+	free(map);
+}
+
+uint64_t
+pfs_domain_map_digest(pfs_domain_map_t *map)
+{
+	return map->digest;
+}
+
+const char *
+pfs_domain_map_text(pfs_domain_map_t *map, const char *domain)
+{
+	const pfs_domain_entry_t	*e;
+
+	if ((e = pfs_domain_map_match(map, domain)) == NULL)
+		return NULL;
+	return e->text;
+}
+
+/* Whether domain publishes an SPF record, or may: 0 only if it surely does not */
+static int
+pfs_domain_map_published(SPF_dns_server_t *dns, const char *domain)
+{
+	SPF_dns_rr_t		*rr;
+	int					 i, found = 1;
+	char				 e;
+
+	rr = SPF_dns_lookup(dns, domain, ns_t_txt, TRUE);
+	switch (rr->herrno) {
+		case HOST_NOT_FOUND:
+		case NO_DATA:
+			found = 0;
+			break;
+		case NETDB_SUCCESS:
+			found = 0;
+			for (i = 0; i < rr->num_rr; i++) {
+				if (strncasecmp(rr->rr[i]->txt, PFS_DOMAIN_MAP_VERSION,
+								sizeof(PFS_DOMAIN_MAP_VERSION) - 1) != 0)
+					continue;
+				e = rr->rr[i]->txt[sizeof(PFS_DOMAIN_MAP_VERSION) - 1];
+				if (e == ' ' || e == '\0')
+					found = 1;
+			}
+			break;
+	}
+	SPF_dns_rr_free(rr);
+	return found;
+}
+
+static SPF_errcode_t
+pfs_domain_map_get_spf(SPF_server_t *spf_server, SPF_request_t *spf_request,
+				SPF_response_t *spf_response, SPF_record_t **spf_recordp)
+{
+	SPF_dns_server_t	*self, *below;
+	pfs_domain_layer_t	*layer;
+	const pfs_domain_entry_t	*e;
+	const char			*domain = spf_request->cur_dom;
+
+	/* Find ourselves, and the get_spf we stand in front of */
+	for (self = spf_server->resolver; self != NULL; self = self->layer_below)
+		if (self->get_spf == pfs_domain_map_get_spf)
+			break;
+	for (below = self->layer_below; below->get_spf == NULL; below = below->layer_below)
+		;
+	layer = (pfs_domain_layer_t *)self->hook;
+
+	*spf_recordp = NULL;
+	if (layer->override && (e = pfs_domain_map_match(layer->override, domain)) != NULL) {
+		pfs_metrics_count(PFS_C_OVERRIDDEN);
+		if (self->debug)
+			pfs_log(LOG_DEBUG, "SPF record of %s from %s in the override map\n", domain, e->domain);
+		pfs_metrics_spf_record(pfs_netblock_uses(e->text));
+		*spf_recordp = pfs_domain_map_copy(spf_server, e->rec);
+		return *spf_recordp ? SPF_E_SUCCESS : SPF_E_NO_MEMORY;
+	}
+
+	if (layer->fallback && (e = pfs_domain_map_match(layer->fallback, domain)) != NULL
+					&& !pfs_domain_map_published(self->layer_below, domain)) {
+		pfs_metrics_count(PFS_C_FALLBACK);
+		if (self->debug)
+			pfs_log(LOG_DEBUG, "SPF record of %s from %s in the fallback map\n", domain, e->domain);
+		pfs_metrics_spf_record(pfs_netblock_uses(e->text));
+		*spf_recordp = pfs_domain_map_copy(spf_server, e->rec);
+		return *spf_recordp ? SPF_E_SUCCESS : SPF_E_NO_MEMORY;
+	}
+
+	return below->get_spf(spf_server, spf_request, spf_response, spf_recordp);
+}
+
+static SPF_dns_rr_t *
+pfs_domain_map_lookup(SPF_dns_server_t *spf_dns_server,
+				const char *domain, ns_type rr_type, int should_cache)
+{
+	return SPF_dns_lookup(spf_dns_server->layer_below, domain, rr_type, should_cache);
+}
+
+static void
+pfs_domain_map_layer_free(SPF_dns_server_t *spf_dns_server)
+{
+	free(spf_dns_server->hook);
+}
+
+SPF_dns_server_t *
+pfs_domain_map_layer_new(SPF_dns_server_t *layer_below,
+				pfs_domain_map_t *override, pfs_domain_map_t *fallback,
+				const char *name, int debug)
+{
+	pfs_domain_layer_t	*layer;
+	SPF_dns_server_t	*below;
+
+	for (below = layer_below; below != NULL && below->get_spf == NULL; below = below->layer_below)
+		;
+	if (below == NULL)
+		return NULL;
+
+	layer = (pfs_domain_layer_t *)calloc(1, sizeof(pfs_domain_layer_t));
+	if (layer == NULL)
+		return NULL;
+	layer->override = override;
+	layer->fallback = fallback;
+
+	layer->dns.destroy = pfs_domain_map_layer_free;
+	layer->dns.lookup = pfs_domain_map_lookup;
+	layer->dns.get_spf = pfs_domain_map_get_spf;
+	layer->dns.get_exp = NULL;
+	layer->dns.add_cache = NULL;
+	layer->dns.layer_below = layer_below;
+	layer->dns.name = name ? name : "domain map";
+	layer->dns.debug = debug;
+	layer->dns.hook = layer;
+
+	return &layer->dns;
+}
@@ -0,0 +1,55 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Per domain SPF records from a file (--override, --fallback), used
+ *  instead of or in the absence of the record published in DNS.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_DOMAIN_MAP_H
+#define PFS_DOMAIN_MAP_H
+
+#include <stdint.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "policyd-spf-fs.h"
+
+/*
+ * Load a map from a file with one "domain record" per line, e.g.
+ *
+ *   example.com    v=spf1 ip4:192.0.2.0/24 -all
+ *   .example.com   v=spf1 include:example.com -all
+ *
+ * A domain stands for itself, a leading dot for all its subdomains; the
+ * entry for the longest match wins. Records are compiled while loading,
+ * lines which do not compile are logged and skipped. '#' starts a
+ * comment line. Returns NULL and logs to syslog if the file can not
+ * be read.
+ */
+pfs_domain_map_t *pfs_domain_map_open(const char *path);
+void pfs_domain_map_close(pfs_domain_map_t *map);
+
+/* Hash of the entries, for telling maps with other contents apart */
+uint64_t pfs_domain_map_digest(pfs_domain_map_t *map);
+
+/* The text of the record map has for domain, NULL if none applies */
+const char *pfs_domain_map_text(pfs_domain_map_t *map, const char *domain);
+
+/*
+ * A libspf2 DNS layer which answers SPF_server_get_record for domains
+ * in override without any lookup, and for domains in fallback which
+ * have no SPF record; everything else goes to the next layer below
+ * with a get_spf of its own (the compiled record cache), which there
+ * must be. Either map may be NULL. Returns NULL on failure.
+ */
+SPF_dns_server_t *pfs_domain_map_layer_new(SPF_dns_server_t *layer_below,
+				pfs_domain_map_t *override, pfs_domain_map_t *fallback,
+				const char *name, int debug);
+
+#endif
@@ -0,0 +1,372 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Evaluation engine. Every job runs pf_evaluate on its own fiber; when
+ *  libspf2 asks the DNS layer for a record the fiber is parked until the
+ *  answer arrives, so up to --max-inflight evaluations overlap their DNS
+ *  latency on one thread and one SPF_server_t. After a configuration
+ *  reload the engine sets up a new SPF_server_t on the same DNS stack
+ *  for new jobs; the old one stays until its last job is done. The room
+ *  requests leave goes to refreshing hot DNS records and flattening the
+ *  records of hot sender domains.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_engine.h"
+#include "pfs_fiber.h"
+#include "pfs_dns_async.h"
+#include "pfs_dns_cache.h"
+#include "pfs_log.h"
+#include "pfs_metrics.h"
+#include "pfs_config.h"
+#include "pfs_flatten.h"
+
+/* libspf2 keeps its buffers on the heap, this is plenty */
+#define PFS_FIBER_STACK		(256 * 1024)
+
+/* A hot DNS record being refreshed ahead of its expiry */
+typedef
+struct pfs_refresh_struct {
+	pfs_engine_t			*engine;
+	ns_type					 rr_type;
+	char					 domain[256];
+} pfs_refresh_t;
+
+/* The SPF server for one configuration generation */
+typedef
+struct pfs_engine_server_struct {
+	pfs_config_t			*config;
+	SPF_server_t			*spf_server;
+	int						 jobs;		/* evaluating or flattening on it */
+} pfs_engine_server_t;
+
+/* A hot sender domain being flattened */
+typedef
+struct pfs_engine_flatten_struct {
+	pfs_engine_t			*engine;
+	pfs_engine_server_t		*server;
+	char					 domain[256];
+} pfs_engine_flatten_t;
+
+struct pfs_engine_struct {
+	SPF_client_options_t	*opts;		/* as on the command line */
+	pfs_engine_server_t		*server;	/* for new jobs */
+	SPF_dns_server_t		*dns;		/* top of the servers' DNS stack */
+	SPF_dns_server_t		*resolver;	/* bottom of the servers' DNS stack */
+	pfs_sched_t				*sched;
+
+	pfs_job_t				*backlog_head;
+	pfs_job_t				*backlog_tail;
+	uint64_t				 waiting_since;	/* start of backlog_head, 0: none; atomic */
+	int						 load;
+
+	pfs_engine_done_t		 done;
+	void					*done_arg;
+};
+
+
+static void
+pfs_engine_server_put(pfs_engine_t *engine, pfs_engine_server_t *server)
+{
+	if (server->jobs > 0 || server == engine->server)
+		return;
+	pf_server_free_dns(server->spf_server, engine->dns);
+	pfs_config_release(server->config);
+	free(server);
+}
+
+/* The server for a job starting now, set up anew after a reload */
+static pfs_engine_server_t *
+pfs_engine_server(pfs_engine_t *engine)
+{
+	pfs_engine_server_t	*server = engine->server, *old;
+
+	if (server != NULL && server->config->generation == pfs_config_generation())
+		return server;
+
+	server = (pfs_engine_server_t *)malloc(sizeof(pfs_engine_server_t));
+	server->config = pfs_config_acquire();
+	server->spf_server = pf_server_new_dns(&server->config->opts, engine->dns);
+	server->jobs = 0;
+
+	old = engine->server;
+	engine->server = server;
+	if (old)
+		pfs_engine_server_put(engine, old);
+	return server;
+}
+
+static void
+pfs_engine_fiber(void *arg)
+{
+	pfs_job_t			*job = (pfs_job_t *)arg;
+	pfs_engine_t		*engine = job->engine;
+	pfs_engine_server_t	*server = pfs_engine_server(engine);
+	uint64_t			 start = pfs_metrics_now();
+
+	server->jobs++;
+	pf_evaluate(&server->config->opts, server->spf_server, &job->req,
+					job->response, sizeof(job->response));
+	server->jobs--;
+	pfs_engine_server_put(engine, server);
+	job->elapsed = pfs_metrics_now() - start;
+	engine->load--;
+	engine->done(job, engine->done_arg);
+}
+
+static void
+pfs_engine_refresh(void *arg)
+{
+	pfs_refresh_t		*r = (pfs_refresh_t *)arg;
+	pfs_engine_t		*engine = r->engine;
+	SPF_dns_rr_t		*rr;
+
+	/* Straight to the resolver, the cache would answer from itself */
+	rr = SPF_dns_lookup(engine->resolver, r->domain, r->rr_type, TRUE);
+	pfs_dns_cache_refreshed(engine->opts->dns_cache, r->domain, r->rr_type, rr);
+	if (rr)
+		SPF_dns_rr_free(rr);
+	free(r);
+}
+
+/*
+ * Start refreshing hot DNS records while there is room besides the
+ * requests. Returns 1 if one was started.
+ */
+static int
+pfs_engine_start_refresh(pfs_engine_t *engine)
+{
+	pfs_refresh_t		*r;
+
+	if (pfs_sched_count(engine->sched) >= engine->opts->max_inflight
+					|| !pfs_dns_cache_refresh_pending(engine->opts->dns_cache))
+		return 0;
+
+	r = (pfs_refresh_t *)malloc(sizeof(pfs_refresh_t));
+	r->engine = engine;
+	if (!pfs_dns_cache_next_refresh(engine->opts->dns_cache, r->domain,
+					sizeof(r->domain), &r->rr_type)) {
+		free(r);
+		return 0;
+	}
+	if (engine->opts->debug > 1)
+		pfs_log(LOG_DEBUG, "Refreshing %s/%d ahead\n", r->domain, r->rr_type);
+	if (pfs_sched_spawn(engine->sched, pfs_engine_refresh, r) < 0) {
+		pfs_dns_cache_refreshed(engine->opts->dns_cache, r->domain, r->rr_type, NULL);
+		free(r);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+pfs_engine_flatten(void *arg)
+{
+	pfs_engine_flatten_t	*f = (pfs_engine_flatten_t *)arg;
+	pfs_engine_server_t	*server = f->server;
+
+	pfs_flatten_compile(server->config->opts.flatten, &server->config->opts,
+					server->spf_server->resolver, f->domain);
+	server->jobs--;
+	pfs_engine_server_put(f->engine, server);
+	free(f);
+}
+
+/* Whether the current generation has domains to flatten */
+static int
+pfs_engine_flatten_pending(pfs_engine_t *engine)
+{
+	pfs_engine_server_t	*server = engine->server;
+
+	return server != NULL && server->config->opts.flatten != NULL
+					&& pfs_flatten_pending(server->config->opts.flatten);
+}
+
+/*
+ * Start flattening hot sender domains while there is room besides the
+ * requests. Returns 1 if one was started.
+ */
+static int
+pfs_engine_start_flatten(pfs_engine_t *engine)
+{
+	pfs_engine_flatten_t	*f;
+	pfs_engine_server_t	*server;
+
+	if (pfs_sched_count(engine->sched) >= engine->opts->max_inflight
+					|| !pfs_engine_flatten_pending(engine))
+		return 0;
+
+	server = pfs_engine_server(engine);
+	f = (pfs_engine_flatten_t *)malloc(sizeof(pfs_engine_flatten_t));
+	f->engine = engine;
+	f->server = server;
+	if (server->config->opts.flatten == NULL
+					|| !pfs_flatten_next(server->config->opts.flatten, f->domain, sizeof(f->domain))) {
+		free(f);
+		return 0;
+	}
+	if (engine->opts->debug > 1)
+		pfs_log(LOG_DEBUG, "Flattening %s\n", f->domain);
+	server->jobs++;
+	if (pfs_sched_spawn(engine->sched, pfs_engine_flatten, f) < 0) {
+		/* Out of memory for stacks: flatten right here */
+		pfs_engine_flatten(f);
+	}
+	return 1;
+}
+
+pfs_job_t *
+pfs_job_new(void)
+{
+	pfs_job_t			*job;
+
+	job = (pfs_job_t *)malloc(sizeof(pfs_job_t));
+	if (job == NULL) {
+		pfs_log(LOG_ERR, "Out of memory for a job\n");
+		abort();
+	}
+	pfs_arena_init(&job->arena, job->arena_space, sizeof(job->arena_space));
+	return job;
+}
+
+void
+pfs_job_free(pfs_job_t *job)
+{
+	pfs_arena_reset(&job->arena);
+	free(job);
+}
+
+pfs_engine_t *
+pfs_engine_new(SPF_client_options_t *opts, pfs_engine_done_t done, void *arg)
+{
+	pfs_engine_t		*engine;
+
+	engine = (pfs_engine_t *)malloc(sizeof(pfs_engine_t));
+	memset(engine, 0, sizeof(pfs_engine_t));
+	engine->opts = opts;
+	engine->done = done;
+	engine->done_arg = arg;
+
+	engine->resolver = pfs_dns_async_new(NULL, "async",
+					opts->debug > 2 ? opts->debug-2 : 0, opts->dns_servers);
+	if (engine->resolver == NULL) {
+		free(engine);
+		return NULL;
+	}
+	pfs_dns_async_set_hedge(engine->resolver, opts->dns_hedge);
+	engine->dns = pf_dns_new(opts, engine->resolver);
+	engine->sched = pfs_sched_new(PFS_FIBER_STACK);
+	pfs_dns_cache_enable_refresh(opts->dns_cache);
+
+	return engine;
+}
+
+void
+pfs_engine_free(pfs_engine_t *engine)
+{
+	pfs_engine_server_t	*server;
+	pfs_job_t			*job;
+
+	while ((job = engine->backlog_head) != NULL) {
+		engine->backlog_head = job->next;
+		pfs_job_free(job);
+	}
+	if ((server = engine->server) != NULL) {
+		engine->server = NULL;
+		pfs_engine_server_put(engine, server);
+	}
+	SPF_dns_free(engine->dns);
+	pfs_sched_free(engine->sched);
+	free(engine);
+}
+
+void
+pfs_engine_submit(pfs_engine_t *engine, pfs_job_t *job)
+{
+	job->engine = engine;
+	job->next = NULL;
+	engine->load++;
+
+	if (engine->backlog_tail)
+		engine->backlog_tail->next = job;
+	else {
+		engine->backlog_head = job;
+		__atomic_store_n(&engine->waiting_since, job->start, __ATOMIC_RELAXED);
+	}
+	engine->backlog_tail = job;
+}
+
+int
+pfs_engine_fd(pfs_engine_t *engine)
+{
+	return pfs_dns_async_fd(engine->resolver);
+}
+
+int
+pfs_engine_timeout(pfs_engine_t *engine)
+{
+	return pfs_dns_async_timeout(engine->resolver);
+}
+
+void
+pfs_engine_process(pfs_engine_t *engine)
+{
+	pfs_job_t			*job;
+
+	/* Wake the fibers whose answers came in, then start new ones */
+	pfs_dns_async_process(engine->resolver);
+
+	/*
+	 * Fibers answered from cache finish without ever waiting for DNS,
+	 * so keep going until the backlog is empty or --max-inflight are
+	 * really waiting; nothing else would wake us up for the rest.
+	 * Refreshes and flattening only take what room the requests leave.
+	 */
+	do {
+		while ((job = engine->backlog_head) != NULL
+						&& pfs_sched_count(engine->sched) < engine->opts->max_inflight) {
+			engine->backlog_head = job->next;
+			if (engine->backlog_head == NULL)
+				engine->backlog_tail = NULL;
+			if (pfs_sched_spawn(engine->sched, pfs_engine_fiber, job) < 0) {
+				/* Out of memory for stacks: evaluate right here */
+				pfs_engine_fiber(job);
+			}
+		}
+		__atomic_store_n(&engine->waiting_since,
+						engine->backlog_head ? engine->backlog_head->start : 0, __ATOMIC_RELAXED);
+		while (pfs_engine_start_refresh(engine))
+			;
+		while (pfs_engine_start_flatten(engine))
+			;
+
+		pfs_sched_run(engine->sched);
+	} while ((engine->backlog_head != NULL
+					|| pfs_dns_cache_refresh_pending(engine->opts->dns_cache)
+					|| pfs_engine_flatten_pending(engine))
+				&& pfs_sched_count(engine->sched) < engine->opts->max_inflight);
+}
+
+int
+pfs_engine_load(pfs_engine_t *engine)
+{
+	return engine->load;
+}
+
+uint64_t
+pfs_engine_delay(pfs_engine_t *engine, uint64_t now)
+{
+	uint64_t			 since = __atomic_load_n(&engine->waiting_since, __ATOMIC_RELAXED);
+
+	return since != 0 && now > since ? now - since : 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Evaluation engine: one SPF server with its DNS stack, evaluating
+ *  many requests at once on fibers.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_ENGINE_H
+#define PFS_ENGINE_H
+
+#include <stdint.h>
+
+#include "policyd-spf-fs.h"
+
+typedef struct pfs_engine_struct pfs_engine_t;
+
+typedef
+struct pfs_job_struct {
+	struct pfs_job_struct	*next;		/* queue / completion list */
+	struct pfs_job_struct	*conn_next;	/* per connection order */
+	struct pfs_job_struct	*flight_next;	/* in-flight table chain */
+	struct pfs_job_struct	*followers;	/* identical requests, linked by next */
+	void					*owner;		/* connection which sent the request */
+	pfs_engine_t			*engine;
+	int						 done;
+	int						 memo;		/* answered from the connection's memo */
+	unsigned				 generation;	/* of the configuration when it came in */
+	uint64_t				 start;		/* when the request was complete */
+	uint64_t				 elapsed;	/* ns in pf_evaluate, DNS waits included */
+	SPF_client_request_t	 req;		/* values live in arena */
+	char					 response[RESPONSESIZE];
+	pfs_arena_t				 arena;
+	char					 arena_space[1024];
+} pfs_job_t;
+
+/* A job with an empty arena; never fails */
+pfs_job_t *pfs_job_new(void);
+void pfs_job_free(pfs_job_t *job);
+
+typedef void (*pfs_engine_done_t)(pfs_job_t *job, void *arg);
+
+/*
+ * An engine and everything it owns must only be used from the thread
+ * which drives it. done is called from that thread for every finished job.
+ */
+pfs_engine_t *pfs_engine_new(SPF_client_options_t *opts,
+				pfs_engine_done_t done, void *arg);
+void pfs_engine_free(pfs_engine_t *engine);
+
+/* Start evaluating job, or queue it if --max-inflight are running */
+void pfs_engine_submit(pfs_engine_t *engine, pfs_job_t *job);
+
+/*
+ * Drive the engine: watch pfs_engine_fd for input and call
+ * pfs_engine_process when it is readable, after pfs_engine_timeout
+ * milliseconds (-1: no timer) and after submitting jobs.
+ */
+int pfs_engine_fd(pfs_engine_t *engine);
+int pfs_engine_timeout(pfs_engine_t *engine);
+void pfs_engine_process(pfs_engine_t *engine);
+
+/* Jobs submitted and not yet done */
+int pfs_engine_load(pfs_engine_t *engine);
+
+/*
+ * ns the oldest job waiting for room under --max-inflight has waited
+ * as of now, 0 if none waits. Unlike the rest it may be called from
+ * any thread.
+ */
+uint64_t pfs_engine_delay(pfs_engine_t *engine, uint64_t now);
+
+#endif
@@ -0,0 +1,212 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Cooperative fibers on top of ucontext. libspf2 evaluates a request
+ *  with plain function calls down into the DNS layer; running every
+ *  evaluation on its own stack lets the DNS layer park it while the
+ *  answer is on the wire and run other evaluations meanwhile.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "pfs_fiber.h"
+#include "pfs_log.h"
+
+/* Stacks of finished fibers kept for reuse */
+#define PFS_FIBER_SPARE		32
+
+struct pfs_fiber_struct {
+	pfs_fiber_t			*next;		/* run queue or spare list */
+	pfs_sched_t			*sched;
+	ucontext_t			 ctx;
+	void				*stack;		/* mapping including guard page */
+	size_t				 stack_len;
+	void				(*fn)(void *);
+	void				*arg;
+	void				*local[PFS_FIBER_LOCALS];	/* see pfs_fiber_local */
+	int					 finished;
+};
+
+struct pfs_sched_struct {
+	ucontext_t			 ctx;		/* the context pfs_sched_run came from */
+	size_t				 stack_size;
+	pfs_fiber_t			*run_head;
+	pfs_fiber_t			*run_tail;
+	pfs_fiber_t			*spare;
+	int					 nspare;
+	int					 count;
+};
+
+static __thread pfs_fiber_t		*current;
+static __thread void			*thread_local_slot[PFS_FIBER_LOCALS];
+
+
+static void
+pfs_fiber_destroy(pfs_fiber_t *fiber)
+{
+	munmap(fiber->stack, fiber->stack_len);
+	free(fiber);
+}
+
+static void
+pfs_fiber_trampoline(void)
+{
+	pfs_fiber_t		*fiber = current;
+
+	fiber->fn(fiber->arg);
+	fiber->finished = 1;
+	/* uc_link is not used, return to the scheduler explicitly */
+	swapcontext(&fiber->ctx, &fiber->sched->ctx);
+}
+
+static void
+pfs_sched_enqueue(pfs_sched_t *sched, pfs_fiber_t *fiber)
+{
+	fiber->next = NULL;
+	if (sched->run_tail)
+		sched->run_tail->next = fiber;
+	else
+		sched->run_head = fiber;
+	sched->run_tail = fiber;
+}
+
+pfs_sched_t *
+pfs_sched_new(size_t stack_size)
+{
+	pfs_sched_t		*sched;
+	size_t			 page = sysconf(_SC_PAGESIZE);
+
+	sched = (pfs_sched_t *)malloc(sizeof(pfs_sched_t));
+	memset(sched, 0, sizeof(pfs_sched_t));
+	sched->stack_size = (stack_size + page - 1) / page * page;
+	return sched;
+}
+
+void
+pfs_sched_free(pfs_sched_t *sched)
+{
+	pfs_fiber_t		*fiber;
+
+	/* Fibers still suspended lose their stack; callers drain first */
+	while ((fiber = sched->spare) != NULL) {
+		sched->spare = fiber->next;
+		pfs_fiber_destroy(fiber);
+	}
+	while ((fiber = sched->run_head) != NULL) {
+		sched->run_head = fiber->next;
+		pfs_fiber_destroy(fiber);
+	}
+	free(sched);
+}
+
+int
+pfs_sched_spawn(pfs_sched_t *sched, void (*fn)(void *), void *arg)
+{
+	pfs_fiber_t		*fiber;
+	size_t			 page = sysconf(_SC_PAGESIZE);
+
+	if ((fiber = sched->spare) != NULL) {
+		sched->spare = fiber->next;
+		sched->nspare--;
+	}
+	else {
+		fiber = (pfs_fiber_t *)malloc(sizeof(pfs_fiber_t));
+		memset(fiber, 0, sizeof(pfs_fiber_t));
+		fiber->sched = sched;
+		fiber->stack_len = sched->stack_size + page;
+		/* Untouched stack pages cost nothing, the guard page catches overflows */
+		fiber->stack = mmap(NULL, fiber->stack_len, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		if (fiber->stack == MAP_FAILED) {
+			pfs_log(LOG_ERR, "Can not allocate fiber stack\n");
+			free(fiber);
+			return -1;
+		}
+		mprotect(fiber->stack, page, PROT_NONE);
+	}
+
+	getcontext(&fiber->ctx);
+	fiber->ctx.uc_stack.ss_sp = (char *)fiber->stack + page;
+	fiber->ctx.uc_stack.ss_size = sched->stack_size;
+	fiber->ctx.uc_link = NULL;
+	makecontext(&fiber->ctx, pfs_fiber_trampoline, 0);
+	fiber->fn = fn;
+	fiber->arg = arg;
+	memset(fiber->local, 0, sizeof(fiber->local));
+	fiber->finished = 0;
+
+	sched->count++;
+	pfs_sched_enqueue(sched, fiber);
+	return 0;
+}
+
+void
+pfs_sched_run(pfs_sched_t *sched)
+{
+	pfs_fiber_t		*fiber;
+
+	while ((fiber = sched->run_head) != NULL) {
+		sched->run_head = fiber->next;
+		if (sched->run_head == NULL)
+			sched->run_tail = NULL;
+		fiber->next = NULL;
+
+		current = fiber;
+		swapcontext(&sched->ctx, &fiber->ctx);
+		current = NULL;
+
+		if (fiber->finished) {
+			sched->count--;
+			if (sched->nspare < PFS_FIBER_SPARE) {
+				fiber->next = sched->spare;
+				sched->spare = fiber;
+				sched->nspare++;
+			}
+			else
+				pfs_fiber_destroy(fiber);
+		}
+	}
+}
+
+int
+pfs_sched_count(pfs_sched_t *sched)
+{
+	return sched->count;
+}
+
+pfs_fiber_t *
+pfs_fiber_current(void)
+{
+	return current;
+}
+
+void **
+pfs_fiber_local(int slot)
+{
+	return current ? &current->local[slot] : &thread_local_slot[slot];
+}
+
+void
+pfs_fiber_suspend(void)
+{
+	pfs_fiber_t		*fiber = current;
+
+	swapcontext(&fiber->ctx, &fiber->sched->ctx);
+}
+
+void
+pfs_fiber_wake(pfs_fiber_t *fiber)
+{
+	pfs_sched_enqueue(fiber->sched, fiber);
+}
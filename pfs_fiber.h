@@ -0,0 +1,55 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Cooperative fibers, so a synchronous libspf2 evaluation can be
+ *  suspended while its DNS query is outstanding.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_FIBER_H
+#define PFS_FIBER_H
+
+#include <stddef.h>
+
+typedef struct pfs_fiber_struct pfs_fiber_t;
+typedef struct pfs_sched_struct pfs_sched_t;
+
+/*
+ * A scheduler belongs to the thread which created it; all calls below
+ * must come from that thread.
+ */
+pfs_sched_t *pfs_sched_new(size_t stack_size);
+void pfs_sched_free(pfs_sched_t *sched);
+
+/* Create a fiber running fn(arg). It starts at the next pfs_sched_run. */
+int pfs_sched_spawn(pfs_sched_t *sched, void (*fn)(void *), void *arg);
+
+/* Run runnable fibers until each has finished or suspended itself */
+void pfs_sched_run(pfs_sched_t *sched);
+
+/* Number of fibers not yet finished */
+int pfs_sched_count(pfs_sched_t *sched);
+
+/* The running fiber, or NULL when called outside of any fiber */
+pfs_fiber_t *pfs_fiber_current(void);
+
+/* Slots of pfs_fiber_local */
+#define PFS_LOCAL_METRICS	0	/* pfs_metrics_eval_t */
+#define PFS_LOCAL_DEADLINE	1	/* int64_t, see pfs_dns_async.h */
+#define PFS_FIBER_LOCALS	2
+
+/*
+ * A pointer slot of the running fiber, for state that must follow one
+ * evaluation across suspensions. Outside of fibers it is per thread.
+ */
+void **pfs_fiber_local(int slot);
+
+/* Give up the CPU until someone calls pfs_fiber_wake on us */
+void pfs_fiber_suspend(void);
+void pfs_fiber_wake(pfs_fiber_t *fiber);
+
+#endif
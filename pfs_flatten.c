@@ -0,0 +1,748 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Flattened records. Every request counts its sender domain in a set
+ *  associative table whose counts halve each minute; a domain which
+ *  gets to PFS_FLATTEN_HOT is queued, and the engine flattens it on a
+ *  fiber of its own with what room the requests leave.
+ *
+ *  Flattening walks the whole tree once, like the netblock cache walks
+ *  one path through it: each family is a partition of its address space
+ *  into ranges, all undecided at first. ip4:, ip6: and all decide the
+ *  undecided part they cover, an include: decides where the included
+ *  tree passes, a redirect= leaves the rest to its tree, and what is
+ *  left at the end is the default neutral. A tree with any other
+ *  mechanism, a macro, too many lookups or too many ranges is not
+ *  flattened. The ranges hold until the first record of the tree
+ *  expires; the domain is flattened anew after that if it is still hot.
+ *
+ *  The responses are kept as templates per result, learnt from libspf2
+ *  evaluating the first request of a domain with that result; until
+ *  then those requests still go to libspf2.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "pfs_flatten.h"
+#include "pfs_netblock.h"
+#include "pfs_template.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+
+#define PFS_FLATTEN_WAYS		8
+#define PFS_FLATTEN_STRIPES		16
+#define PFS_FLATTEN_EPOCH		60		/* seconds a count lasts at full */
+#define PFS_FLATTEN_QUEUE		64
+#define PFS_FLATTEN_TEXT		768		/* both templates */
+#define PFS_FLATTEN_RECORD		2048	/* longest record flattened */
+
+/* Values of ranges: an SPF result, with the flag if no term decided it */
+#define PFS_FLATTEN_UNDECIDED	0
+#define PFS_FLATTEN_DEFAULT		8
+#define PFS_FLATTEN_SLOTS		16
+
+/* States of entries */
+#define PFS_FLATTEN_COUNTING	0
+#define PFS_FLATTEN_QUEUED		1
+#define PFS_FLATTEN_FLAT		2
+#define PFS_FLATTEN_FAILED		3
+
+typedef unsigned __int128 pfs_flatten_addr_t;
+
+/* From start up to the start of the next */
+typedef
+struct pfs_flatten_range_struct {
+	pfs_flatten_addr_t	 start;
+	unsigned char		 value;
+} pfs_flatten_range_t;
+
+typedef
+struct pfs_flatten_map_struct {
+	pfs_flatten_range_t	*range;
+	int					 n;
+	int					 size;
+	pfs_flatten_addr_t	 last;		/* highest address of the family */
+} pfs_flatten_map_t;
+
+/* The ranges of one domain: IPv4 in map[0], IPv6 in map[1] */
+typedef
+struct pfs_flatten_set_struct {
+	pfs_flatten_map_t	 map[2];
+	int					 has_exp;
+} pfs_flatten_set_t;
+
+typedef
+struct pfs_flatten_text_struct {
+	uint16_t			 received_len;
+	uint16_t			 comment_len;
+	char				 data[PFS_FLATTEN_TEXT];
+} pfs_flatten_text_t;
+
+typedef
+struct pfs_flatten_entry_struct {
+	uint64_t			 hash;		/* of the domain, 0: unused */
+	uint32_t			 epoch;		/* of count */
+	uint32_t			 count;
+	int					 state;
+	time_t				 expires;	/* FLAT: the ranges, FAILED: until retried */
+	pfs_flatten_set_t	*set;
+	pfs_flatten_text_t	*text[PFS_FLATTEN_SLOTS];
+	char				 domain[PFS_NETBLOCK_DOMAIN];
+} pfs_flatten_entry_t;
+
+struct pfs_flatten_struct {
+	pthread_mutex_t		 lock[PFS_FLATTEN_STRIPES];
+	pfs_flatten_entry_t	*entry;
+	int					 sets;		/* a power of two */
+	int					 flat;		/* entries QUEUED or FLAT */
+
+	pthread_mutex_t		 queue_lock;
+	char				 queue[PFS_FLATTEN_QUEUE][PFS_NETBLOCK_DOMAIN];
+	int					 queue_head;
+	int					 queue_len;
+};
+
+/* One flattening of a domain's tree */
+typedef
+struct pfs_flatten_walk_struct {
+	SPF_client_options_t	*opts;
+	SPF_dns_server_t		*dns;
+	int				 lookups;
+	int				 has_exp;
+	long			 ttl;		/* of the records seen so far */
+} pfs_flatten_walk_t;
+
+
+/* The lower case domain of the sender; 0 if there is none */
+static int
+pfs_flatten_domain(const char *sender, char *domain, uint64_t *hash)
+{
+	const char		*at;
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+	size_t			 i, len;
+
+	if (sender == NULL || (at = strrchr(sender, '@')) == NULL)
+		return 0;
+	len = strlen(at + 1);
+	if (len == 0 || len >= PFS_NETBLOCK_DOMAIN)
+		return 0;
+	/* FNV-1a */
+	for (i = 0; i <= len; i++) {
+		domain[i] = tolower((unsigned char)at[1 + i]);
+		h = (h ^ (unsigned char)domain[i]) * 0x100000001b3ULL;
+	}
+	*hash = h ? h : 1;
+	return 1;
+}
+
+static pfs_flatten_addr_t
+pfs_flatten_bytes(const unsigned char *b, int bits)
+{
+	pfs_flatten_addr_t	 a = 0;
+	int					 i;
+
+	for (i = 0; i < bits / 8; i++)
+		a = (a << 8) | b[i];
+	return a;
+}
+
+/*
+ * The client address and its family, 0 for IPv4 and 1 for IPv6; -1 if
+ * it is none we can work with. libspf2 passes loopback clients anyway.
+ */
+static int
+pfs_flatten_addr(const char *ip, pfs_flatten_addr_t *addr)
+{
+	struct in6_addr		 a6;
+	unsigned char		 a4[4];
+
+	if (ip == NULL)
+		return -1;
+	if (inet_pton(AF_INET, ip, a4) == 1) {
+		if (a4[0] == 127)
+			return -1;
+		*addr = pfs_flatten_bytes(a4, 32);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, ip, &a6) == 1 && !IN6_IS_ADDR_V4MAPPED(&a6)
+					&& !IN6_IS_ADDR_LOOPBACK(&a6)) {
+		*addr = pfs_flatten_bytes(a6.s6_addr, 128);
+		return 1;
+	}
+	return -1;
+}
+
+/* The range addr is in */
+static int
+pfs_flatten_find(const pfs_flatten_map_t *m, pfs_flatten_addr_t addr)
+{
+	int				 lo = 0, hi = m->n - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (m->range[mid].start <= addr)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+static int
+pfs_flatten_map_init(pfs_flatten_map_t *m, int bits)
+{
+	m->size = 16;
+	m->range = (pfs_flatten_range_t *)malloc(m->size * sizeof(pfs_flatten_range_t));
+	if (m->range == NULL)
+		return -1;
+	m->n = 1;
+	m->range[0].start = 0;
+	m->range[0].value = PFS_FLATTEN_UNDECIDED;
+	m->last = bits == 128 ? ~(pfs_flatten_addr_t)0 : 0xffffffffU;
+	return 0;
+}
+
+/* A range starting at addr; -1 if there would be too many */
+static int
+pfs_flatten_split(pfs_flatten_map_t *m, pfs_flatten_addr_t addr)
+{
+	pfs_flatten_range_t	*range;
+	int					 i = pfs_flatten_find(m, addr);
+
+	if (m->range[i].start == addr)
+		return 0;
+	if (m->n == m->size) {
+		if (m->size >= PFS_FLATTEN_RANGES)
+			return -1;
+		range = (pfs_flatten_range_t *)realloc(m->range,
+						2 * m->size * sizeof(pfs_flatten_range_t));
+		if (range == NULL)
+			return -1;
+		m->range = range;
+		m->size *= 2;
+	}
+	memmove(&m->range[i + 2], &m->range[i + 1], (m->n - i - 1) * sizeof(pfs_flatten_range_t));
+	m->range[i + 1].start = addr;
+	m->range[i + 1].value = m->range[i].value;
+	m->n++;
+	return 0;
+}
+
+/* Decide the undecided part of lo..hi */
+static int
+pfs_flatten_paint(pfs_flatten_map_t *m, pfs_flatten_addr_t lo, pfs_flatten_addr_t hi,
+				int value)
+{
+	int				 i, j, o;
+
+	if (pfs_flatten_split(m, lo) < 0 || (hi < m->last && pfs_flatten_split(m, hi + 1) < 0))
+		return -1;
+	i = pfs_flatten_find(m, lo);
+	j = hi < m->last ? pfs_flatten_find(m, hi + 1) : m->n;
+	for (; i < j; i++)
+		if (m->range[i].value == PFS_FLATTEN_UNDECIDED)
+			m->range[i].value = value;
+
+	/* Neighbours with the same value are one range */
+	for (i = o = 1; i < m->n; i++)
+		if (m->range[i].value != m->range[o - 1].value)
+			m->range[o++] = m->range[i];
+	m->n = o;
+	return 0;
+}
+
+/*
+ * Paint what inner decided into m: with qualifier where it passes for
+ * an include:, as it is for a redirect=, the default where it is still
+ * undecided.
+ */
+static int
+pfs_flatten_merge(pfs_flatten_map_t *m, const pfs_flatten_map_t *inner,
+				int include, int qualifier)
+{
+	pfs_flatten_addr_t	 hi;
+	int					 i, value;
+
+	for (i = 0; i < inner->n; i++) {
+		value = inner->range[i].value;
+		if (include)
+			value = value == SPF_RESULT_PASS ? qualifier : PFS_FLATTEN_UNDECIDED;
+		else if (value == PFS_FLATTEN_UNDECIDED)
+			value = SPF_RESULT_NEUTRAL | PFS_FLATTEN_DEFAULT;
+		if (value == PFS_FLATTEN_UNDECIDED)
+			continue;
+		hi = i + 1 < inner->n ? inner->range[i + 1].start - 1 : inner->last;
+		if (pfs_flatten_paint(m, inner->range[i].start, hi, value) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* What no term decided is the default */
+static void
+pfs_flatten_settle(pfs_flatten_map_t *m)
+{
+	int				 i, o;
+
+	for (i = o = 0; i < m->n; i++) {
+		if (m->range[i].value == PFS_FLATTEN_UNDECIDED)
+			m->range[i].value = SPF_RESULT_NEUTRAL | PFS_FLATTEN_DEFAULT;
+		if (o == 0 || m->range[i].value != m->range[o - 1].value)
+			m->range[o++] = m->range[i];
+	}
+	m->n = o;
+}
+
+static void
+pfs_flatten_set_free(pfs_flatten_set_t *set)
+{
+	free(set->map[0].range);
+	free(set->map[1].range);
+	free(set);
+}
+
+static pfs_flatten_set_t *
+pfs_flatten_set_new(void)
+{
+	pfs_flatten_set_t	*set;
+
+	set = (pfs_flatten_set_t *)calloc(1, sizeof(pfs_flatten_set_t));
+	if (set == NULL)
+		return NULL;
+	if (pfs_flatten_map_init(&set->map[0], 32) < 0
+					|| pfs_flatten_map_init(&set->map[1], 128) < 0) {
+		pfs_flatten_set_free(set);
+		return NULL;
+	}
+	return set;
+}
+
+/* Decide what the tree of domain decides into set; -1 if it cannot be done */
+static int
+pfs_flatten_walk(pfs_flatten_walk_t *w, const char *domain, int depth,
+				pfs_flatten_set_t *set)
+{
+	char			 text[PFS_FLATTEN_RECORD];
+	char			 redirect[PFS_NETBLOCK_DOMAIN];
+	char			*p;
+	pfs_netblock_term_t	 t;
+	pfs_flatten_set_t	*inner;
+	pfs_flatten_addr_t	 lo, mask;
+	int				 f, all = FALSE, ok = 0;
+
+	if (depth > PFS_NETBLOCK_DEPTH
+					|| pfs_netblock_record(w->opts, w->dns, domain, text, sizeof(text), &w->ttl) < 0)
+		return -1;
+
+	redirect[0] = '\0';
+	for (p = text; ok == 0 && (p = pfs_netblock_parse(p, &t)) != NULL; ) {
+		switch (t.type) {
+			case PFS_TERM_NET:
+				/* Terms after all are never evaluated, but must be valid */
+				if (all)
+					break;
+				f = t.bits == 128;
+				mask = t.cidr == 0 ? 0 : set->map[f].last << (t.bits - t.cidr);
+				lo = pfs_flatten_bytes(t.net, t.bits) & mask;
+				ok = pfs_flatten_paint(&set->map[f], lo, lo | (~mask & set->map[f].last),
+								t.qualifier);
+				break;
+			case PFS_TERM_ALL:
+				if (all)
+					break;
+				all = TRUE;
+				if (pfs_flatten_paint(&set->map[0], 0, set->map[0].last, t.qualifier) < 0
+								|| pfs_flatten_paint(&set->map[1], 0, set->map[1].last, t.qualifier) < 0)
+					ok = -1;
+				break;
+			case PFS_TERM_INCLUDE:
+				if (all)
+					break;
+				if (++w->lookups > PFS_NETBLOCK_MAX_LOOKUP(w->opts)
+								|| (inner = pfs_flatten_set_new()) == NULL)
+					return -1;
+				if (pfs_flatten_walk(w, t.target, depth + 1, inner) < 0
+								|| pfs_flatten_merge(&set->map[0], &inner->map[0], TRUE, t.qualifier) < 0
+								|| pfs_flatten_merge(&set->map[1], &inner->map[1], TRUE, t.qualifier) < 0)
+					ok = -1;
+				pfs_flatten_set_free(inner);
+				break;
+			case PFS_TERM_REDIRECT:
+				strcpy(redirect, t.target);
+				break;
+			case PFS_TERM_EXP:
+				w->has_exp = TRUE;
+				break;
+			case PFS_TERM_MODIFIER:
+				break;
+			default:
+				return -1;
+		}
+	}
+	if (ok < 0)
+		return -1;
+
+	/* Ignored if there is an all */
+	if (redirect[0] && !all) {
+		if (++w->lookups > PFS_NETBLOCK_MAX_LOOKUP(w->opts)
+						|| (inner = pfs_flatten_set_new()) == NULL)
+			return -1;
+		if (pfs_flatten_walk(w, redirect, depth + 1, inner) < 0
+						|| pfs_flatten_merge(&set->map[0], &inner->map[0], FALSE, 0) < 0
+						|| pfs_flatten_merge(&set->map[1], &inner->map[1], FALSE, 0) < 0)
+			ok = -1;
+		pfs_flatten_set_free(inner);
+	}
+	return ok;
+}
+
+pfs_flatten_t *
+pfs_flatten_new(int entries)
+{
+	pfs_flatten_t		*fl;
+	int					 i;
+
+	fl = (pfs_flatten_t *)calloc(1, sizeof(pfs_flatten_t));
+	fl->sets = PFS_FLATTEN_STRIPES;
+	while (fl->sets * PFS_FLATTEN_WAYS < entries)
+		fl->sets <<= 1;
+	fl->entry = (pfs_flatten_entry_t *)calloc(fl->sets * PFS_FLATTEN_WAYS,
+					sizeof(pfs_flatten_entry_t));
+	if (fl->entry == NULL) {
+		pfs_log(LOG_ERR, "Out of memory for flattened records\n");
+		abort();
+	}
+	for (i = 0; i < PFS_FLATTEN_STRIPES; i++)
+		pthread_mutex_init(&fl->lock[i], NULL);
+	pthread_mutex_init(&fl->queue_lock, NULL);
+	return fl;
+}
+
+/* Forget the ranges of e, the stripe locked */
+static void
+pfs_flatten_drop(pfs_flatten_t *fl, pfs_flatten_entry_t *e)
+{
+	if (e->state == PFS_FLATTEN_QUEUED || e->state == PFS_FLATTEN_FLAT)
+		__atomic_sub_fetch(&fl->flat, 1, __ATOMIC_RELAXED);
+	if (e->set) {
+		pfs_flatten_set_free(e->set);
+		e->set = NULL;
+	}
+	e->state = PFS_FLATTEN_COUNTING;
+}
+
+/* And the responses, which outlive the ranges of one TTL */
+static void
+pfs_flatten_forget(pfs_flatten_t *fl, pfs_flatten_entry_t *e)
+{
+	int					 i;
+
+	pfs_flatten_drop(fl, e);
+	for (i = 0; i < PFS_FLATTEN_SLOTS; i++) {
+		free(e->text[i]);
+		e->text[i] = NULL;
+	}
+}
+
+void
+pfs_flatten_free(pfs_flatten_t *fl)
+{
+	int					 i;
+
+	for (i = 0; i < fl->sets * PFS_FLATTEN_WAYS; i++)
+		pfs_flatten_forget(fl, &fl->entry[i]);
+	for (i = 0; i < PFS_FLATTEN_STRIPES; i++)
+		pthread_mutex_destroy(&fl->lock[i]);
+	pthread_mutex_destroy(&fl->queue_lock);
+	free(fl->entry);
+	free(fl);
+}
+
+/* The count of e as of epoch, halved for every minute it was not counted */
+static uint32_t
+pfs_flatten_count(pfs_flatten_entry_t *e, uint32_t epoch)
+{
+	if (e->epoch != epoch) {
+		e->count = epoch - e->epoch < 32 ? e->count >> (epoch - e->epoch) : 0;
+		e->epoch = epoch;
+	}
+	return e->count;
+}
+
+/* The entry of domain, the stripe locked; NULL if there is none */
+static pfs_flatten_entry_t *
+pfs_flatten_lookup(pfs_flatten_t *fl, const char *domain, uint64_t hash)
+{
+	pfs_flatten_entry_t	*e = &fl->entry[(hash & (fl->sets - 1)) * PFS_FLATTEN_WAYS];
+	int					 i;
+
+	for (i = 0; i < PFS_FLATTEN_WAYS; i++)
+		if (e[i].hash == hash && strcmp(e[i].domain, domain) == 0)
+			return &e[i];
+	return NULL;
+}
+
+/* An entry for domain in place of the least counted of its set */
+static pfs_flatten_entry_t *
+pfs_flatten_insert(pfs_flatten_t *fl, const char *domain, uint64_t hash, uint32_t epoch)
+{
+	pfs_flatten_entry_t	*e = &fl->entry[(hash & (fl->sets - 1)) * PFS_FLATTEN_WAYS];
+	pfs_flatten_entry_t	*victim = e;
+	int					 i;
+
+	for (i = 0; i < PFS_FLATTEN_WAYS && victim->hash != 0; i++)
+		if (e[i].hash == 0 || pfs_flatten_count(&e[i], epoch) < pfs_flatten_count(victim, epoch))
+			victim = &e[i];
+	pfs_flatten_forget(fl, victim);
+	victim->hash = hash;
+	victim->epoch = epoch;
+	victim->count = 0;
+	strcpy(victim->domain, domain);
+	return victim;
+}
+
+static int
+pfs_flatten_enqueue(pfs_flatten_t *fl, const char *domain)
+{
+	int					 ok = 0;
+
+	pthread_mutex_lock(&fl->queue_lock);
+	if (fl->queue_len < PFS_FLATTEN_QUEUE) {
+		strcpy(fl->queue[(fl->queue_head + fl->queue_len) % PFS_FLATTEN_QUEUE], domain);
+		fl->queue_len++;
+		ok = 1;
+	}
+	pthread_mutex_unlock(&fl->queue_lock);
+	return ok;
+}
+
+int
+pfs_flatten_get(pfs_flatten_t *fl, SPF_client_request_t *req,
+				char *received_spf, char *comment, size_t len)
+{
+	pfs_flatten_entry_t	*e;
+	pfs_flatten_text_t	*text;
+	pfs_flatten_addr_t	 addr;
+	pthread_mutex_t		*lock;
+	const char			*fields[PFS_TEMPLATE_FIELDS];
+	char				 domain[PFS_NETBLOCK_DOMAIN];
+	uint64_t			 hash;
+	time_t				 now = time(NULL);
+	uint32_t			 epoch = now / PFS_FLATTEN_EPOCH;
+	int					 f, value, result = -1;
+
+	if (!pfs_flatten_domain(req->sender, domain, &hash))
+		return -1;
+	f = pfs_flatten_addr(req->ip, &addr);
+	lock = &fl->lock[hash & (PFS_FLATTEN_STRIPES - 1)];
+
+	pthread_mutex_lock(lock);
+	if ((e = pfs_flatten_lookup(fl, domain, hash)) == NULL)
+		e = pfs_flatten_insert(fl, domain, hash, epoch);
+	pfs_flatten_count(e, epoch);
+	e->count++;
+
+	if (e->state == PFS_FLATTEN_FLAT && e->expires <= now)
+		pfs_flatten_drop(fl, e);
+	if (e->state == PFS_FLATTEN_FAILED && e->expires <= now)
+		e->state = PFS_FLATTEN_COUNTING;
+	if (e->state == PFS_FLATTEN_COUNTING && e->count >= PFS_FLATTEN_HOT
+					&& __atomic_load_n(&fl->flat, __ATOMIC_RELAXED) < PFS_FLATTEN_DOMAINS
+					&& pfs_flatten_enqueue(fl, domain)) {
+		__atomic_add_fetch(&fl->flat, 1, __ATOMIC_RELAXED);
+		e->state = PFS_FLATTEN_QUEUED;
+	}
+
+	if (e->state == PFS_FLATTEN_FLAT && f >= 0) {
+		value = e->set->map[f].range[pfs_flatten_find(&e->set->map[f], addr)].value;
+		if ((text = e->text[value]) != NULL) {
+			fields[PFS_NETBLOCK_SENDER] = req->sender;
+			fields[PFS_NETBLOCK_HELO] = req->helo ? req->helo : "";
+			fields[PFS_NETBLOCK_IP] = req->ip;
+			pfs_template_expand(text->data, text->received_len, fields, PFS_TEMPLATE_FIELDS,
+							received_spf, len);
+			pfs_template_expand(text->data + text->received_len, text->comment_len, fields,
+							PFS_TEMPLATE_FIELDS, comment, len);
+			result = value & ~PFS_FLATTEN_DEFAULT;
+		}
+	}
+	pthread_mutex_unlock(lock);
+
+	pfs_metrics_count(result >= 0 ? PFS_C_FLAT_HITS : PFS_C_FLAT_MISSES);
+	return result;
+}
+
+void
+pfs_flatten_learn(pfs_flatten_t *fl, SPF_client_options_t *opts,
+				SPF_client_request_t *req, int result, SPF_reason_t reason,
+				const char *received_spf, const char *comment)
+{
+	pfs_flatten_entry_t	*e;
+	pfs_flatten_text_t	*text;
+	pfs_flatten_addr_t	 addr;
+	pthread_mutex_t		*lock;
+	struct in6_addr		 a6;
+	const char			*fields[PFS_TEMPLATE_FIELDS];
+	static const int	 most[PFS_TEMPLATE_FIELDS] = PFS_NETBLOCK_MOST;
+	char				 domain[PFS_NETBLOCK_DOMAIN];
+	char				 canonical[INET6_ADDRSTRLEN];
+	uint64_t			 hash;
+	int					 f, rlen, clen, value;
+
+	if (result != SPF_RESULT_PASS && result != SPF_RESULT_FAIL
+					&& result != SPF_RESULT_SOFTFAIL && result != SPF_RESULT_NEUTRAL)
+		return;
+	if (reason != SPF_REASON_MECH && reason != SPF_REASON_DEFAULT)
+		return;
+	if (!pfs_flatten_domain(req->sender, domain, &hash)
+					|| (f = pfs_flatten_addr(req->ip, &addr)) < 0)
+		return;
+	/* libspf2 writes the client address as inet_ntop does */
+	if (f == 1 && (inet_pton(AF_INET6, req->ip, &a6) != 1
+					|| inet_ntop(AF_INET6, &a6, canonical, sizeof(canonical)) == NULL
+					|| strcmp(canonical, req->ip) != 0))
+		return;
+	/* Every client of a slot must get the same explanation */
+	if (result == SPF_RESULT_FAIL && !pfs_netblock_explanation_fits(opts->explanation, 128))
+		return;
+
+	text = (pfs_flatten_text_t *)malloc(sizeof(pfs_flatten_text_t));
+	if (text == NULL)
+		return;
+	fields[PFS_NETBLOCK_SENDER] = req->sender;
+	fields[PFS_NETBLOCK_HELO] = req->helo ? req->helo : "";
+	fields[PFS_NETBLOCK_IP] = req->ip;
+	rlen = pfs_template_make(received_spf ? received_spf : "", fields, most,
+					PFS_TEMPLATE_FIELDS, text->data, sizeof(text->data));
+	clen = rlen < 0 ? -1 : pfs_template_make(comment ? comment : "", fields, most,
+					PFS_TEMPLATE_FIELDS, text->data + rlen, sizeof(text->data) - rlen);
+	if (clen < 0) {
+		free(text);
+		return;
+	}
+	text->received_len = rlen;
+	text->comment_len = clen;
+
+	lock = &fl->lock[hash & (PFS_FLATTEN_STRIPES - 1)];
+	pthread_mutex_lock(lock);
+	if ((e = pfs_flatten_lookup(fl, domain, hash)) != NULL && e->state == PFS_FLATTEN_FLAT
+					&& e->expires > time(NULL)
+					&& (result != SPF_RESULT_FAIL || !e->set->has_exp)) {
+		value = e->set->map[f].range[pfs_flatten_find(&e->set->map[f], addr)].value;
+		/* Only if libspf2 and the ranges agree */
+		if (value == (result | (reason == SPF_REASON_DEFAULT ? PFS_FLATTEN_DEFAULT : 0))
+						&& e->text[value] == NULL) {
+			e->text[value] = text;
+			text = NULL;
+		}
+	}
+	pthread_mutex_unlock(lock);
+	free(text);
+}
+
+int
+pfs_flatten_pending(pfs_flatten_t *fl)
+{
+	return __atomic_load_n(&fl->queue_len, __ATOMIC_RELAXED) > 0;
+}
+
+int
+pfs_flatten_next(pfs_flatten_t *fl, char *domain, size_t len)
+{
+	int					 ok = 0;
+
+	pthread_mutex_lock(&fl->queue_lock);
+	if (fl->queue_len > 0) {
+		snprintf(domain, len, "%s", fl->queue[fl->queue_head]);
+		fl->queue_head = (fl->queue_head + 1) % PFS_FLATTEN_QUEUE;
+		fl->queue_len--;
+		ok = 1;
+	}
+	pthread_mutex_unlock(&fl->queue_lock);
+	return ok;
+}
+
+void
+pfs_flatten_compile(pfs_flatten_t *fl, SPF_client_options_t *opts,
+				SPF_dns_server_t *dns, const char *domain)
+{
+	pfs_flatten_walk_t	 w;
+	pfs_flatten_set_t	*set;
+	pfs_flatten_entry_t	*e;
+	pthread_mutex_t		*lock;
+	char				 sender[PFS_NETBLOCK_DOMAIN + 1];
+	char				 key[PFS_NETBLOCK_DOMAIN];
+	uint64_t			 hash;
+	time_t				 now;
+
+	memset(&w, 0, sizeof(w));
+	w.opts = opts;
+	w.dns = dns;
+	w.ttl = PFS_NETBLOCK_MAXTTL;
+	snprintf(sender, sizeof(sender), "@%s", domain);
+	if (!pfs_flatten_domain(sender, key, &hash))
+		return;
+
+	if ((set = pfs_flatten_set_new()) != NULL) {
+		if (pfs_flatten_walk(&w, domain, 0, set) < 0) {
+			pfs_flatten_set_free(set);
+			set = NULL;
+		}
+		else {
+			pfs_flatten_settle(&set->map[0]);
+			pfs_flatten_settle(&set->map[1]);
+			set->has_exp = w.has_exp;
+		}
+	}
+	if (opts->debug > 1) {
+		if (set)
+			pfs_log(LOG_DEBUG, "Flattened %s to %d+%d ranges, %ld seconds\n", domain,
+							set->map[0].n, set->map[1].n, w.ttl);
+		else
+			pfs_log(LOG_DEBUG, "Could not flatten %s\n", domain);
+	}
+
+	now = time(NULL);
+	lock = &fl->lock[hash & (PFS_FLATTEN_STRIPES - 1)];
+	pthread_mutex_lock(lock);
+	/* It may have made room for another domain in the meantime */
+	if ((e = pfs_flatten_lookup(fl, key, hash)) != NULL && e->state == PFS_FLATTEN_QUEUED) {
+		if (set) {
+			/* A failure may come with an explanation of its own now */
+			if (set->has_exp) {
+				free(e->text[SPF_RESULT_FAIL]);
+				free(e->text[SPF_RESULT_FAIL | PFS_FLATTEN_DEFAULT]);
+				e->text[SPF_RESULT_FAIL] = e->text[SPF_RESULT_FAIL | PFS_FLATTEN_DEFAULT] = NULL;
+			}
+			e->set = set;
+			e->state = PFS_FLATTEN_FLAT;
+			e->expires = now + w.ttl;
+			set = NULL;
+		}
+		else {
+			pfs_flatten_drop(fl, e);
+			e->state = PFS_FLATTEN_FAILED;
+			e->expires = now + PFS_FLATTEN_RETRY;
+		}
+	}
+	pthread_mutex_unlock(lock);
+	if (set)
+		pfs_flatten_set_free(set);
+}
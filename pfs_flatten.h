@@ -0,0 +1,66 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Flattened records: the include tree of the most frequent sender
+ *  domains resolved ahead into sorted IPv4 and IPv6 ranges, each with
+ *  the SPF result for the clients in it, so that their requests are
+ *  answered by a binary search instead of libspf2 walking the tree.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_FLATTEN_H
+#define PFS_FLATTEN_H
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "policyd-spf-fs.h"
+
+/* Sender domains counted, in sets of 8 */
+#define PFS_FLATTEN_SIZE		1024
+/* At most this many of them are flattened at a time */
+#define PFS_FLATTEN_DOMAINS		256
+/* Requests within a minute which make a domain worth flattening */
+#define PFS_FLATTEN_HOT			16
+/* Ranges of one address family; a tree with more is left to libspf2 */
+#define PFS_FLATTEN_RANGES		4096
+/* Seconds before a tree which could not be flattened is tried again */
+#define PFS_FLATTEN_RETRY		600
+
+pfs_flatten_t *pfs_flatten_new(int entries);
+void pfs_flatten_free(pfs_flatten_t *fl);
+
+/*
+ * Count req's sender domain. If the domain is flattened and a response
+ * for the range req's client is in has been seen, the Received-SPF text
+ * and the comment are filled in for req and the SPF result is returned,
+ * otherwise -1. A domain which got hot is queued for flattening.
+ */
+int pfs_flatten_get(pfs_flatten_t *fl, SPF_client_request_t *req,
+				char *received_spf, char *comment, size_t len);
+
+/*
+ * libspf2 came to result for req for the given reason: keep the texts
+ * as the response for every client of the same range, if req's domain
+ * is flattened and the range says the same.
+ */
+void pfs_flatten_learn(pfs_flatten_t *fl, SPF_client_options_t *opts,
+				SPF_client_request_t *req, int result, SPF_reason_t reason,
+				const char *received_spf, const char *comment);
+
+/*
+ * The queue of domains to flatten, for the engine. pfs_flatten_next
+ * takes the first of them; it must be passed to pfs_flatten_compile,
+ * which reads the tree through dns (the top of a server's layers) and
+ * the domain maps of opts. That may take a while, on a fiber.
+ */
+int pfs_flatten_pending(pfs_flatten_t *fl);
+int pfs_flatten_next(pfs_flatten_t *fl, char *domain, size_t len);
+void pfs_flatten_compile(pfs_flatten_t *fl, SPF_client_options_t *opts,
+				SPF_dns_server_t *dns, const char *domain);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  HELO memo. An SMTP session sends all its messages and recipients
+ *  with the same client address and HELO name, and the requests of
+ *  one session end up on any worker. The memo is split into stripes by
+ *  hash, each with its own lock, a fixed array of entries chained into
+ *  hash buckets and an LRU list by index, so it never allocates after
+ *  it is set up and a lookup holds a lock for a few compares.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pfs_helo_memo.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+
+#define PFS_HELO_STRIPES	16
+#define PFS_HELO_KEY		320		/* address, blank, HELO name */
+#define PFS_HELO_NONE		-1
+
+typedef
+struct pfs_helo_entry_struct {
+	uint64_t		 hash;
+	time_t			 expires;
+	int32_t			 next;		/* bucket chain */
+	int32_t			 lru_prev;
+	int32_t			 lru_next;
+	char			 key[PFS_HELO_KEY];
+	pfs_helo_t		 helo;
+} pfs_helo_entry_t;
+
+typedef
+struct pfs_helo_stripe_struct {
+	pthread_mutex_t	 lock;
+	pfs_helo_entry_t *entry;
+	int32_t			*bucket;
+	int32_t			 size;		/* entries and buckets, a power of two */
+	int32_t			 used;
+	int32_t			 lru_head;	/* most recently used */
+	int32_t			 lru_tail;
+} pfs_helo_stripe_t;
+
+struct pfs_helo_memo_struct {
+	pfs_helo_stripe_t stripe[PFS_HELO_STRIPES];
+	int				 ttl;
+};
+
+
+/* "ip helo" in lower case; 0 if it does not fit */
+static size_t
+pfs_helo_key(const char *ip, const char *helo, char *key, uint64_t *hash)
+{
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+	size_t			 i;
+	int				 n;
+
+	n = snprintf(key, PFS_HELO_KEY, "%s %s", ip, helo);
+	if (n < 0 || n >= PFS_HELO_KEY)
+		return 0;
+	/* FNV-1a */
+	for (i = 0; i < (size_t)n; i++) {
+		key[i] = tolower((unsigned char)key[i]);
+		h = (h ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+	}
+	*hash = h;
+	return n;
+}
+
+static void
+pfs_helo_lru_unlink(pfs_helo_stripe_t *s, int32_t i)
+{
+	pfs_helo_entry_t	*e = &s->entry[i];
+
+	if (e->lru_prev != PFS_HELO_NONE)
+		s->entry[e->lru_prev].lru_next = e->lru_next;
+	else
+		s->lru_head = e->lru_next;
+	if (e->lru_next != PFS_HELO_NONE)
+		s->entry[e->lru_next].lru_prev = e->lru_prev;
+	else
+		s->lru_tail = e->lru_prev;
+}
+
+static void
+pfs_helo_lru_push(pfs_helo_stripe_t *s, int32_t i)
+{
+	pfs_helo_entry_t	*e = &s->entry[i];
+
+	e->lru_prev = PFS_HELO_NONE;
+	e->lru_next = s->lru_head;
+	if (s->lru_head != PFS_HELO_NONE)
+		s->entry[s->lru_head].lru_prev = i;
+	else
+		s->lru_tail = i;
+	s->lru_head = i;
+}
+
+static void
+pfs_helo_unchain(pfs_helo_stripe_t *s, int32_t i)
+{
+	int32_t			*p;
+
+	for (p = &s->bucket[(s->entry[i].hash >> 4) & (s->size - 1)]; *p != PFS_HELO_NONE;
+					p = &s->entry[*p].next) {
+		if (*p == i) {
+			*p = s->entry[i].next;
+			return;
+		}
+	}
+}
+
+/* The entry for key, with the stripe locked; PFS_HELO_NONE if none */
+static int32_t
+pfs_helo_find(pfs_helo_stripe_t *s, const char *key, uint64_t hash)
+{
+	int32_t			 i;
+
+	for (i = s->bucket[(hash >> 4) & (s->size - 1)]; i != PFS_HELO_NONE; i = s->entry[i].next) {
+		if (s->entry[i].hash == hash && strcmp(s->entry[i].key, key) == 0)
+			return i;
+	}
+	return PFS_HELO_NONE;
+}
+
+pfs_helo_memo_t *
+pfs_helo_memo_new(int entries, int ttl)
+{
+	pfs_helo_memo_t		*memo;
+	pfs_helo_stripe_t	*s;
+	int32_t				 size = 1;
+	int					 i, j;
+
+	while (size * PFS_HELO_STRIPES < entries)
+		size <<= 1;
+
+	memo = (pfs_helo_memo_t *)calloc(1, sizeof(pfs_helo_memo_t));
+	memo->ttl = ttl;
+	for (i = 0; i < PFS_HELO_STRIPES; i++) {
+		s = &memo->stripe[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->size = size;
+		s->entry = (pfs_helo_entry_t *)calloc(size, sizeof(pfs_helo_entry_t));
+		s->bucket = (int32_t *)malloc(size * sizeof(int32_t));
+		if (s->entry == NULL || s->bucket == NULL) {
+			pfs_log(LOG_ERR, "Out of memory for the HELO memo\n");
+			abort();
+		}
+		for (j = 0; j < size; j++)
+			s->bucket[j] = PFS_HELO_NONE;
+		s->lru_head = s->lru_tail = PFS_HELO_NONE;
+	}
+	return memo;
+}
+
+void
+pfs_helo_memo_free(pfs_helo_memo_t *memo)
+{
+	int					 i;
+
+	for (i = 0; i < PFS_HELO_STRIPES; i++) {
+		pthread_mutex_destroy(&memo->stripe[i].lock);
+		free(memo->stripe[i].entry);
+		free(memo->stripe[i].bucket);
+	}
+	free(memo);
+}
+
+int
+pfs_helo_memo_get(pfs_helo_memo_t *memo, const char *ip, const char *helo,
+				pfs_helo_t *out)
+{
+	pfs_helo_stripe_t	*s;
+	char				 key[PFS_HELO_KEY];
+	uint64_t			 hash;
+	int32_t				 i;
+	int					 found = 0;
+
+	if (pfs_helo_key(ip, helo, key, &hash) == 0)
+		return 0;
+	s = &memo->stripe[hash % PFS_HELO_STRIPES];
+
+	pthread_mutex_lock(&s->lock);
+	if ((i = pfs_helo_find(s, key, hash)) != PFS_HELO_NONE) {
+		if (s->entry[i].expires > time(NULL)) {
+			pfs_helo_lru_unlink(s, i);
+			pfs_helo_lru_push(s, i);
+			*out = s->entry[i].helo;
+			found = 1;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pfs_metrics_count(found ? PFS_C_HELO_HITS : PFS_C_HELO_MISSES);
+	return found;
+}
+
+void
+pfs_helo_memo_put(pfs_helo_memo_t *memo, const char *ip, const char *helo,
+				const pfs_helo_t *helo_info)
+{
+	pfs_helo_stripe_t	*s;
+	pfs_helo_entry_t	*e;
+	char				 key[PFS_HELO_KEY];
+	uint64_t			 hash;
+	int32_t				 i, *p;
+
+	if (pfs_helo_key(ip, helo, key, &hash) == 0)
+		return;
+	s = &memo->stripe[hash % PFS_HELO_STRIPES];
+
+	pthread_mutex_lock(&s->lock);
+	if ((i = pfs_helo_find(s, key, hash)) != PFS_HELO_NONE)
+		pfs_helo_lru_unlink(s, i);
+	else {
+		if (s->used < s->size)
+			i = s->used++;
+		else {
+			/* Full: the least recently used makes room */
+			i = s->lru_tail;
+			pfs_helo_lru_unlink(s, i);
+			pfs_helo_unchain(s, i);
+		}
+		e = &s->entry[i];
+		e->hash = hash;
+		strcpy(e->key, key);
+		p = &s->bucket[(hash >> 4) & (s->size - 1)];
+		e->next = *p;
+		*p = i;
+	}
+	e = &s->entry[i];
+	e->expires = time(NULL) + memo->ttl;
+	e->helo = *helo_info;
+	pfs_helo_lru_push(s, i);
+	pthread_mutex_unlock(&s->lock);
+}
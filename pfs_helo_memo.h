@@ -0,0 +1,48 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  HELO memo: what was found out about a client's HELO name, kept for
+ *  the rest of its SMTP session.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_HELO_MEMO_H
+#define PFS_HELO_MEMO_H
+
+#include "policyd-spf-fs.h"
+
+/* Configuration generations with the same settings share one memo this size */
+#define PFS_HELO_MEMO_SIZE	1024
+#define PFS_HELO_MEMO_TTL	60		/* seconds, about one SMTP session */
+
+#define PFS_HELO_TEXT		512
+
+/* What is known about one (client address, HELO name) */
+typedef
+struct pfs_helo_struct {
+	int				 valid;		/* libspf2 took the HELO name */
+	int				 result;	/* of the HELO identity, -1: not checked */
+	char			 received_spf[PFS_HELO_TEXT];
+	char			 comment[PFS_HELO_TEXT];
+} pfs_helo_t;
+
+/*
+ * A memo of up to entries HELO names, each kept for ttl seconds; the
+ * least recently used go first when it is full.
+ */
+pfs_helo_memo_t *pfs_helo_memo_new(int entries, int ttl);
+void pfs_helo_memo_free(pfs_helo_memo_t *memo);
+
+/* Copy what is known about (ip, helo) to out; 0 if nothing is */
+int pfs_helo_memo_get(pfs_helo_memo_t *memo, const char *ip, const char *helo,
+				pfs_helo_t *out);
+
+/* Remember helo for (ip, helo), replacing what was known */
+void pfs_helo_memo_put(pfs_helo_memo_t *memo, const char *ip, const char *helo,
+				const pfs_helo_t *helo_info);
+
+#endif
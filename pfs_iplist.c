@@ -0,0 +1,309 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Allow and deny lists of client networks. Both lists go into one
+ *  path compressed binary (Patricia) trie over 128 bit addresses, IPv4
+ *  mapped into ::ffff:0:0/96, with the list as value of a node; the
+ *  most specific network wins. Nodes are kept in one array and refer to
+ *  each other by index, so a trie is a single block of memory: cheap to
+ *  walk, to build aside and to throw away, and it could be mapped from
+ *  a file as it is. Tens of thousands of networks take about 2 nodes
+ *  each and a lookup touches at most one node per distinct prefix
+ *  length on the way down.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_iplist.h"
+#include "pfs_log.h"
+
+#define PFS_IPLIST_BITS		128
+
+typedef
+struct pfs_iplist_node_struct {
+	uint8_t			 addr[16];	/* masked to plen */
+	uint8_t			 plen;
+	uint8_t			 value;		/* PFS_IPLIST_* */
+	uint32_t		 child[2];	/* 0: none, node 0 is the root */
+} pfs_iplist_node_t;
+
+typedef
+struct pfs_iplist_trie_struct {
+	pfs_iplist_node_t	*node;
+	uint32_t		 count;
+	uint32_t		 size;
+} pfs_iplist_trie_t;
+
+struct pfs_iplist_struct {
+	char				*path[2];	/* allow, deny */
+	pfs_iplist_trie_t	*trie;
+};
+
+
+static int
+pfs_iplist_bit(const uint8_t *addr, int n)
+{
+	return (addr[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/* Number of leading bits a and b have in common, up to max */
+static int
+pfs_iplist_common(const uint8_t *a, const uint8_t *b, int max)
+{
+	int				 n = 0;
+	uint8_t			 x;
+
+	while (n < max) {
+		x = a[n >> 3] ^ b[n >> 3];
+		if (x == 0) {
+			n += 8;
+			continue;
+		}
+		while (!(x & 0x80)) {
+			x <<= 1;
+			n++;
+		}
+		break;
+	}
+	return n < max ? n : max;
+}
+
+static uint32_t
+pfs_iplist_node_new(pfs_iplist_trie_t *t, const uint8_t *addr, int plen, int value)
+{
+	pfs_iplist_node_t	*node;
+	int					 i;
+
+	if (t->count == t->size) {
+		t->size = t->size ? t->size * 2 : 1024;
+		t->node = (pfs_iplist_node_t *)realloc(t->node, t->size * sizeof(pfs_iplist_node_t));
+		if (t->node == NULL) {
+			pfs_log(LOG_ERR, "Out of memory for the address lists\n");
+			abort();
+		}
+	}
+	node = &t->node[t->count];
+	memset(node, 0, sizeof(pfs_iplist_node_t));
+	for (i = 0; i < plen; i += 8)
+		node->addr[i >> 3] = addr[i >> 3];
+	if (plen & 7)
+		node->addr[plen >> 3] &= 0xff << (8 - (plen & 7));
+	node->plen = plen;
+	node->value = value;
+	return t->count++;
+}
+
+static pfs_iplist_trie_t *
+pfs_iplist_trie_new(void)
+{
+	pfs_iplist_trie_t	*t;
+	uint8_t				 any[16];
+
+	t = (pfs_iplist_trie_t *)calloc(1, sizeof(pfs_iplist_trie_t));
+	memset(any, 0, sizeof(any));
+	pfs_iplist_node_new(t, any, 0, PFS_IPLIST_NONE);
+	return t;
+}
+
+static void
+pfs_iplist_trie_free(pfs_iplist_trie_t *t)
+{
+	if (t == NULL)
+		return;
+	free(t->node);
+	free(t);
+}
+
+static void
+pfs_iplist_insert(pfs_iplist_trie_t *t, const uint8_t *addr, int plen, int value)
+{
+	uint32_t		 n = 0, c, leaf, glue;
+	int				 b, common;
+
+	for (;;) {
+		if (t->node[n].plen == plen) {
+			if (value > t->node[n].value)
+				t->node[n].value = value;
+			return;
+		}
+
+		b = pfs_iplist_bit(addr, t->node[n].plen);
+		c = t->node[n].child[b];
+		if (c == 0) {
+			leaf = pfs_iplist_node_new(t, addr, plen, value);
+			t->node[n].child[b] = leaf;
+			return;
+		}
+
+		common = pfs_iplist_common(addr, t->node[c].addr,
+						plen < t->node[c].plen ? plen : t->node[c].plen);
+		if (common == t->node[c].plen) {
+			n = c;
+			continue;
+		}
+
+		/* addr leaves the path to c early: put a node where they part */
+		if (common == plen) {
+			leaf = pfs_iplist_node_new(t, addr, plen, value);
+			t->node[leaf].child[pfs_iplist_bit(t->node[c].addr, plen)] = c;
+			t->node[n].child[b] = leaf;
+			return;
+		}
+		glue = pfs_iplist_node_new(t, addr, common, PFS_IPLIST_NONE);
+		leaf = pfs_iplist_node_new(t, addr, plen, value);
+		t->node[glue].child[pfs_iplist_bit(t->node[c].addr, common)] = c;
+		t->node[glue].child[pfs_iplist_bit(addr, common)] = leaf;
+		t->node[n].child[b] = glue;
+		return;
+	}
+}
+
+static int
+pfs_iplist_lookup(pfs_iplist_trie_t *t, const uint8_t *addr)
+{
+	pfs_iplist_node_t	*node = &t->node[0];
+	uint32_t			 c;
+	int					 value = node->value;
+
+	while (node->plen < PFS_IPLIST_BITS) {
+		c = node->child[pfs_iplist_bit(addr, node->plen)];
+		if (c == 0)
+			break;
+		node = &t->node[c];
+		if (pfs_iplist_common(addr, node->addr, node->plen) < node->plen)
+			break;
+		if (node->value != PFS_IPLIST_NONE)
+			value = node->value;
+	}
+	return value;
+}
+
+/*
+ * Parse an address into 16 bytes, IPv4 as ::ffff:a.b.c.d. Returns the
+ * number of bits of the address, or -1.
+ */
+static int
+pfs_iplist_addr(const char *s, uint8_t *addr)
+{
+	memset(addr, 0, 16);
+	if (inet_pton(AF_INET, s, addr + 12) == 1) {
+		addr[10] = addr[11] = 0xff;
+		return 32;
+	}
+	if (inet_pton(AF_INET6, s, addr) == 1)
+		return 128;
+	return -1;
+}
+
+static int
+pfs_iplist_load(pfs_iplist_trie_t *t, const char *path, int value)
+{
+	FILE			*fp;
+	char			 line[256];
+	char			*p, *end, *slash;
+	uint8_t			 addr[16];
+	int				 bits, plen, lineno = 0, count = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		pfs_log(LOG_ERR, "Can not read %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		for (end = p + strlen(p); end > p && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+		if (*p == '\0')
+			continue;
+
+		if ((slash = strchr(p, '/')) != NULL)
+			*slash++ = '\0';
+		bits = pfs_iplist_addr(p, addr);
+		plen = bits;
+		if (bits > 0 && slash != NULL) {
+			plen = strtol(slash, &end, 10);
+			if (*slash == '\0' || *end != '\0' || plen < 0 || plen > bits)
+				bits = -1;
+		}
+		if (bits < 0) {
+			pfs_log(LOG_WARNING, "%s:%d: not an address or network, ignored\n", path, lineno);
+			continue;
+		}
+
+		pfs_iplist_insert(t, addr, plen + (PFS_IPLIST_BITS - bits), value);
+		count++;
+	}
+
+	fclose(fp);
+	pfs_log(LOG_INFO, "%d networks from %s\n", count, path);
+	return 0;
+}
+
+static pfs_iplist_trie_t *
+pfs_iplist_build(pfs_iplist_t *list)
+{
+	pfs_iplist_trie_t	*t = pfs_iplist_trie_new();
+
+	if ((list->path[0] && pfs_iplist_load(t, list->path[0], PFS_IPLIST_ALLOW) < 0)
+					|| (list->path[1] && pfs_iplist_load(t, list->path[1], PFS_IPLIST_DENY) < 0)) {
+		pfs_iplist_trie_free(t);
+		return NULL;
+	}
+	return t;
+}
+
+pfs_iplist_t *
+pfs_iplist_open(const char *allow_path, const char *deny_path)
+{
+	pfs_iplist_t		*list;
+
+	list = (pfs_iplist_t *)calloc(1, sizeof(pfs_iplist_t));
+	list->path[0] = allow_path ? strdup(allow_path) : NULL;
+	list->path[1] = deny_path ? strdup(deny_path) : NULL;
+
+	list->trie = pfs_iplist_build(list);
+	if (list->trie == NULL) {
+		pfs_iplist_close(list);
+		return NULL;
+	}
+	return list;
+}
+
+void
+pfs_iplist_close(pfs_iplist_t *list)
+{
+	pfs_iplist_trie_free(list->trie);
+	free(list->path[0]);
+	free(list->path[1]);
+	free(list);
+}
+
+int
+pfs_iplist_check(pfs_iplist_t *list, const char *ip)
+{
+	uint8_t				 addr[16];
+
+	if (ip == NULL || pfs_iplist_addr(ip, addr) < 0)
+		return PFS_IPLIST_NONE;
+
+	return pfs_iplist_lookup(list->trie, addr);
+}
@@ -0,0 +1,37 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Client address allow and deny lists (--allowlist-file,
+ *  --denylist-file), checked before any SPF work is done.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_IPLIST_H
+#define PFS_IPLIST_H
+
+#include "policyd-spf-fs.h"
+
+#define PFS_IPLIST_NONE		0
+#define PFS_IPLIST_ALLOW	1
+#define PFS_IPLIST_DENY		2
+
+/*
+ * Load the lists from files with one address or CIDR network per line
+ * (IPv4 or IPv6, '#' starts a comment); either path may be NULL.
+ * Returns NULL and logs to syslog if a file can not be read. The lists
+ * never change; a reload opens new ones (see pfs_config.h).
+ */
+pfs_iplist_t *pfs_iplist_open(const char *allow_path, const char *deny_path);
+void pfs_iplist_close(pfs_iplist_t *list);
+
+/*
+ * The list the most specific network containing ip is on; a network on
+ * both lists counts as denied. PFS_IPLIST_NONE for unparsable addresses.
+ */
+int pfs_iplist_check(pfs_iplist_t *list, const char *ip);
+
+#endif
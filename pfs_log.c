@@ -0,0 +1,191 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Asynchronous logging. The ring is a bounded multi producer queue as
+ *  described by Dmitry Vyukov: every slot carries a sequence number
+ *  which tells producers whether it is free for their position and the
+ *  consumer whether it is filled, so claiming a slot is one compare and
+ *  swap on the head and nobody ever waits for a lock. The drain thread
+ *  is the only consumer; when it finds the ring empty it sleeps a
+ *  little rather than having every producer wake it up.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "pfs_log.h"
+#include "pfs_metrics.h"
+
+#define PFS_LOG_LINE		(512 - 16)
+/* How long the drain thread sleeps on an empty ring */
+#define PFS_LOG_IDLE_NS		(10 * 1000 * 1000)
+
+typedef
+struct pfs_log_slot_struct {
+	uint64_t		 seq;
+	int				 priority;
+	char			 line[PFS_LOG_LINE];
+} pfs_log_slot_t;
+
+static pfs_log_slot_t	*ring;
+static uint64_t			 ring_mask;
+static uint64_t			 ring_head;		/* next position to claim */
+static uint64_t			 ring_tail;		/* next position to drain */
+static uint64_t			 dropped;
+
+static pthread_t		 drainer;
+static int				 running;
+static int				 stopping;
+
+
+/* Take one message off the ring into out; 0 if it was empty */
+static int
+pfs_log_take(pfs_log_slot_t *out)
+{
+	pfs_log_slot_t		*slot = &ring[ring_tail & ring_mask];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring_tail + 1)
+		return 0;
+	out->priority = slot->priority;
+	memcpy(out->line, slot->line, sizeof(out->line));
+	/* Free for the producer one lap ahead */
+	__atomic_store_n(&slot->seq, ring_tail + ring_mask + 1, __ATOMIC_RELEASE);
+	ring_tail++;
+	return 1;
+}
+
+static void
+pfs_log_drain(uint64_t *reported)
+{
+	pfs_log_slot_t		 msg;
+	uint64_t			 lost;
+
+	while (pfs_log_take(&msg))
+		syslog(msg.priority, "%s", msg.line);
+
+	lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (lost != *reported) {
+		syslog(LOG_WARNING, "Log buffer full, %llu messages dropped\n",
+						(unsigned long long)(lost - *reported));
+		*reported = lost;
+	}
+}
+
+static void *
+pfs_log_main(void *arg)
+{
+	struct timespec		 idle = { 0, PFS_LOG_IDLE_NS };
+	uint64_t			 reported = 0;
+
+	(void)arg;
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		pfs_log_drain(&reported);
+		nanosleep(&idle, NULL);
+	}
+	pfs_log_drain(&reported);
+	return NULL;
+}
+
+int
+pfs_log_start(int slots)
+{
+	sigset_t			 all, old;
+	uint64_t			 n = 1;
+	int					 err;
+
+	if (running)
+		return 0;
+	while (n < (uint64_t)slots)
+		n <<= 1;
+
+	ring = (pfs_log_slot_t *)malloc(n * sizeof(pfs_log_slot_t));
+	if (ring == NULL) {
+		syslog(LOG_ERR, "Out of memory for the log buffer\n");
+		return -1;
+	}
+	for (ring_mask = 0; ring_mask < n; ring_mask++)
+		ring[ring_mask].seq = ring_mask;
+	ring_mask = n - 1;
+	ring_head = ring_tail = 0;
+	stopping = 0;
+
+	/* Signals are for the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&drainer, NULL, pfs_log_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		syslog(LOG_ERR, "Can not start the log thread: %s\n", strerror(err));
+		free(ring);
+		ring = NULL;
+		return -1;
+	}
+
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void
+pfs_log_stop(void)
+{
+	if (!running)
+		return;
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(drainer, NULL);
+	free(ring);
+	ring = NULL;
+}
+
+void
+pfs_log(int priority, const char *format, ...)
+{
+	pfs_log_slot_t		*slot;
+	uint64_t			 pos, seq;
+	va_list				 ap;
+
+	va_start(ap, format);
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		vsyslog(priority, format, ap);
+		va_end(ap);
+		return;
+	}
+
+	pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &ring[pos & ring_mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			/* pos now holds the head someone else moved on */
+		}
+		else if ((int64_t)(seq - pos) < 0) {
+			/* Still filled from the previous lap: full */
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			pfs_metrics_count(PFS_C_LOG_DROPPED);
+			va_end(ap);
+			return;
+		}
+		else
+			pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+	}
+
+	slot->priority = priority;
+	vsnprintf(slot->line, sizeof(slot->line), format, ap);
+	va_end(ap);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
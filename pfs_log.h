@@ -0,0 +1,39 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Logging. With --async-log messages are formatted into a ring buffer
+ *  and handed to syslog by a thread of its own, so a slow syslog socket
+ *  never holds up a request; otherwise pfs_log is plain syslog.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_LOG_H
+#define PFS_LOG_H
+
+#include <syslog.h>
+
+/* Messages the ring holds by default, 512 bytes each */
+#define PFS_LOG_SLOTS	4096
+
+/*
+ * Start the drain thread with a ring of slots messages (rounded up to
+ * a power of two). Messages which do not fit while the ring is full
+ * are counted and dropped. Returns -1 if the thread can not be started.
+ */
+int pfs_log_start(int slots);
+
+/*
+ * Log what is still in the ring and go back to plain syslog. Only call
+ * this once no other thread logs any more.
+ */
+void pfs_log_stop(void);
+
+/* Like syslog; never blocks once pfs_log_start succeeded */
+void pfs_log(int priority, const char *format, ...)
+				__attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,447 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Counters and latency histograms, published for Prometheus.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "spf.h"
+
+#include "pfs_metrics.h"
+#include "pfs_fiber.h"
+#include "pfs_log.h"
+
+/* How often the file is rewritten */
+#define PFS_METRICS_INTERVAL	10
+
+__thread pfs_metrics_block_t	*pfs_metrics_self;
+
+/* Every block ever handed out; blocks outlive their threads */
+static pfs_metrics_block_t		*blocks;
+static pthread_mutex_t			 blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t				 publisher;
+static int						 publisher_running;
+static int						 publisher_stop;
+static int						 listen_fd = -1;
+static char						*path;
+
+static const struct {
+	int			 counter;
+	const char	*name;
+	const char	*labels;
+} pfs_metrics_counters[] = {
+	{ PFS_C_REQUESTS,			"requests_total",		"" },
+	{ PFS_C_RESULT_PASS,		"results_total",		"result=\"pass\"" },
+	{ PFS_C_RESULT_FAIL,		"results_total",		"result=\"fail\"" },
+	{ PFS_C_RESULT_SOFTFAIL,	"results_total",		"result=\"softfail\"" },
+	{ PFS_C_RESULT_NEUTRAL,		"results_total",		"result=\"neutral\"" },
+	{ PFS_C_RESULT_NONE,		"results_total",		"result=\"none\"" },
+	{ PFS_C_RESULT_TEMPERROR,	"results_total",		"result=\"temperror\"" },
+	{ PFS_C_RESULT_PERMERROR,	"results_total",		"result=\"permerror\"" },
+	{ PFS_C_RESULT_INVALID,		"results_total",		"result=\"invalid\"" },
+	{ PFS_C_RESULT_UNCHECKED,	"results_total",		"result=\"unchecked\"" },
+	{ PFS_C_ALLOWLISTED,		"list_hits_total",		"list=\"allow\"" },
+	{ PFS_C_DENYLISTED,			"list_hits_total",		"list=\"deny\"" },
+	{ PFS_C_OVERRIDDEN,			"domain_map_hits_total",	"map=\"override\"" },
+	{ PFS_C_FALLBACK,			"domain_map_hits_total",	"map=\"fallback\"" },
+	{ PFS_C_MEMO_HITS,			"cache_hits_total",		"cache=\"memo\"" },
+	{ PFS_C_SHM_HITS,			"cache_hits_total",		"cache=\"shm\"" },
+	{ PFS_C_DNS_CACHE_HITS,		"cache_hits_total",		"cache=\"dns\"" },
+	{ PFS_C_RECORD_HITS,		"cache_hits_total",		"cache=\"record\"" },
+	{ PFS_C_HELO_HITS,			"cache_hits_total",		"cache=\"helo\"" },
+	{ PFS_C_NETBLOCK_HITS,		"cache_hits_total",		"cache=\"netblock\"" },
+	{ PFS_C_FLAT_HITS,			"cache_hits_total",		"cache=\"flat\"" },
+	{ PFS_C_PEER_HITS,			"cache_hits_total",		"cache=\"peer\"" },
+	{ PFS_C_SHM_MISSES,			"cache_misses_total",	"cache=\"shm\"" },
+	{ PFS_C_DNS_CACHE_MISSES,	"cache_misses_total",	"cache=\"dns\"" },
+	{ PFS_C_RECORD_MISSES,		"cache_misses_total",	"cache=\"record\"" },
+	{ PFS_C_HELO_MISSES,		"cache_misses_total",	"cache=\"helo\"" },
+	{ PFS_C_NETBLOCK_MISSES,	"cache_misses_total",	"cache=\"netblock\"" },
+	{ PFS_C_FLAT_MISSES,		"cache_misses_total",	"cache=\"flat\"" },
+	{ PFS_C_PEER_MISSES,		"cache_misses_total",	"cache=\"peer\"" },
+	{ PFS_C_DNS_QUERIES,		"dns_queries_total",	"" },
+	{ PFS_C_DNS_FAILURES,		"dns_failures_total",	"" },
+	{ PFS_C_DNS_HEDGES,			"dns_hedged_total",		"" },
+	{ PFS_C_DEADLINE_EXCEEDED,	"deadline_exceeded_total",	"" },
+	{ PFS_C_SHED_INFLIGHT,		"shed_total",			"reason=\"inflight\"" },
+	{ PFS_C_SHED_DELAY,			"shed_total",			"reason=\"delay\"" },
+	{ PFS_C_LOG_DROPPED,		"log_dropped_total",	"" },
+	{ PFS_C_COALESCED,			"coalesced_total",		"" },
+};
+
+static const struct {
+	const char	*name;
+	int			 seconds;	/* values are ns, else plain counts */
+} pfs_metrics_hists[PFS_H_COUNT] = {
+	{ "parse_seconds",			1 },
+	{ "evaluate_seconds",		1 },
+	{ "response_seconds",		1 },
+	{ "dns_lookups_per_request", 0 },
+};
+
+
+pfs_metrics_block_t *
+pfs_metrics_block_new(void)
+{
+	pfs_metrics_block_t	*b;
+
+	b = (pfs_metrics_block_t *)calloc(1, sizeof(pfs_metrics_block_t));
+	if (b == NULL) {
+		pfs_log(LOG_ERR, "Out of memory for metrics\n");
+		abort();
+	}
+	pthread_mutex_lock(&blocks_lock);
+	b->next = blocks;
+	blocks = b;
+	pthread_mutex_unlock(&blocks_lock);
+	pfs_metrics_self = b;
+	return b;
+}
+
+static int
+pfs_metrics_bucket(uint64_t v)
+{
+	int			 msb;
+
+	if (v < 8)
+		return v;
+	if (v >> PFS_HIST_MAX_BITS)
+		return PFS_HIST_BUCKETS - 1;
+	msb = 63 - __builtin_clzll(v);
+	return (msb - 2) * 8 + ((v >> (msb - 3)) & 7);
+}
+
+/* The smallest value above bucket i */
+static uint64_t
+pfs_metrics_bucket_limit(int i)
+{
+	int			 msb;
+
+	if (i < 8)
+		return i + 1;
+	msb = i / 8 + 2;
+	return (uint64_t)(8 + i % 8 + 1) << (msb - 3);
+}
+
+void
+pfs_metrics_record(int hist, uint64_t value)
+{
+	pfs_metrics_block_t	*b = pfs_metrics_block();
+
+	pfs_metrics_add(&b->hist[hist][pfs_metrics_bucket(value)], 1);
+	pfs_metrics_add(&b->hist_sum[hist], value);
+}
+
+void
+pfs_metrics_result(int spf_result)
+{
+	int			 c;
+
+	switch (spf_result) {
+		case SPF_RESULT_PASS:		c = PFS_C_RESULT_PASS; break;
+		case SPF_RESULT_FAIL:		c = PFS_C_RESULT_FAIL; break;
+		case SPF_RESULT_SOFTFAIL:	c = PFS_C_RESULT_SOFTFAIL; break;
+		case SPF_RESULT_NEUTRAL:	c = PFS_C_RESULT_NEUTRAL; break;
+		case SPF_RESULT_NONE:		c = PFS_C_RESULT_NONE; break;
+		case SPF_RESULT_TEMPERROR:	c = PFS_C_RESULT_TEMPERROR; break;
+		case SPF_RESULT_PERMERROR:	c = PFS_C_RESULT_PERMERROR; break;
+		case SPF_RESULT_INVALID:	c = PFS_C_RESULT_INVALID; break;
+		default:					c = PFS_C_RESULT_UNCHECKED; break;
+	}
+	pfs_metrics_count(c);
+}
+
+void
+pfs_metrics_eval_begin(pfs_metrics_eval_t *eval)
+{
+	eval->start = pfs_metrics_now();
+	eval->dns_lookups = 0;
+	eval->dns_queries = 0;
+	eval->dns_wait = 0;
+	eval->records = 0;
+	eval->ttl = -1;
+	*pfs_fiber_local(PFS_LOCAL_METRICS) = eval;
+}
+
+void
+pfs_metrics_eval_end(pfs_metrics_eval_t *eval)
+{
+	*pfs_fiber_local(PFS_LOCAL_METRICS) = NULL;
+	pfs_metrics_since(PFS_H_EVALUATE, eval->start);
+	pfs_metrics_record(PFS_H_DNS_LOOKUPS, eval->dns_lookups);
+}
+
+void
+pfs_metrics_dns_lookup(int hit)
+{
+	pfs_metrics_eval_t	*eval = (pfs_metrics_eval_t *)*pfs_fiber_local(PFS_LOCAL_METRICS);
+
+	if (eval != NULL)
+		eval->dns_lookups++;
+	pfs_metrics_count(hit ? PFS_C_DNS_CACHE_HITS : PFS_C_DNS_CACHE_MISSES);
+}
+
+void
+pfs_metrics_dns_query(uint64_t start)
+{
+	pfs_metrics_eval_t	*eval = (pfs_metrics_eval_t *)*pfs_fiber_local(PFS_LOCAL_METRICS);
+
+	if (eval != NULL) {
+		eval->dns_queries++;
+		eval->dns_wait += pfs_metrics_now() - start;
+	}
+}
+
+void
+pfs_metrics_dns_ttl(long ttl)
+{
+	pfs_metrics_eval_t	*eval = (pfs_metrics_eval_t *)*pfs_fiber_local(PFS_LOCAL_METRICS);
+
+	if (eval != NULL && (eval->ttl < 0 || ttl < eval->ttl))
+		eval->ttl = ttl;
+}
+
+void
+pfs_metrics_spf_record(unsigned uses)
+{
+	pfs_metrics_eval_t	*eval = (pfs_metrics_eval_t *)*pfs_fiber_local(PFS_LOCAL_METRICS);
+
+	if (eval != NULL)
+		eval->records |= uses;
+}
+
+/* Sum the blocks of all threads */
+static void
+pfs_metrics_collect(pfs_metrics_block_t *sum)
+{
+	pfs_metrics_block_t	*b;
+	int					 i, h;
+
+	memset(sum, 0, sizeof(*sum));
+	pthread_mutex_lock(&blocks_lock);
+	for (b = blocks; b != NULL; b = b->next) {
+		for (i = 0; i < PFS_C_COUNT; i++)
+			sum->counter[i] += __atomic_load_n(&b->counter[i], __ATOMIC_RELAXED);
+		for (h = 0; h < PFS_H_COUNT; h++) {
+			for (i = 0; i < PFS_HIST_BUCKETS; i++)
+				sum->hist[h][i] += __atomic_load_n(&b->hist[h][i], __ATOMIC_RELAXED);
+			sum->hist_sum[h] += __atomic_load_n(&b->hist_sum[h], __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&blocks_lock);
+}
+
+/*
+ * Histograms are reported at the powers of two; finer buckets only make
+ * the quantiles computed from them more exact.
+ */
+static void
+pfs_metrics_write_hist(FILE *f, pfs_metrics_block_t *sum, int h)
+{
+	const char			*name = pfs_metrics_hists[h].name;
+	uint64_t			 count = 0, limit;
+	int					 i;
+
+	fprintf(f, "# TYPE policyd_spf_%s histogram\n", name);
+	for (i = 0; i < PFS_HIST_BUCKETS; i++) {
+		count += sum->hist[h][i];
+		limit = pfs_metrics_bucket_limit(i);
+		if (limit & (limit - 1))
+			continue;
+		if (pfs_metrics_hists[h].seconds) {
+			/* from a microsecond to a minute */
+			if (limit < 1024 || limit > ((uint64_t)1 << 36))
+				continue;
+			fprintf(f, "policyd_spf_%s_bucket{le=\"%.9g\"} %llu\n",
+							name, limit / 1e9, (unsigned long long)count);
+		}
+		else {
+			if (limit > 1024)
+				continue;
+			fprintf(f, "policyd_spf_%s_bucket{le=\"%llu\"} %llu\n",
+							name, (unsigned long long)limit - 1, (unsigned long long)count);
+		}
+	}
+	fprintf(f, "policyd_spf_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+	if (pfs_metrics_hists[h].seconds)
+		fprintf(f, "policyd_spf_%s_sum %.9f\n", name, sum->hist_sum[h] / 1e9);
+	else
+		fprintf(f, "policyd_spf_%s_sum %llu\n", name, (unsigned long long)sum->hist_sum[h]);
+	fprintf(f, "policyd_spf_%s_count %llu\n", name, (unsigned long long)count);
+}
+
+static void
+pfs_metrics_write(FILE *f)
+{
+	pfs_metrics_block_t	*sum;
+	const char			*last = "";
+	size_t				 i;
+	int					 h;
+
+	sum = (pfs_metrics_block_t *)malloc(sizeof(pfs_metrics_block_t));
+	if (sum == NULL)
+		return;
+	pfs_metrics_collect(sum);
+
+	for (i = 0; i < sizeof(pfs_metrics_counters) / sizeof(pfs_metrics_counters[0]); i++) {
+		if (strcmp(last, pfs_metrics_counters[i].name) != 0) {
+			last = pfs_metrics_counters[i].name;
+			fprintf(f, "# TYPE policyd_spf_%s counter\n", last);
+		}
+		if (*pfs_metrics_counters[i].labels)
+			fprintf(f, "policyd_spf_%s{%s} %llu\n", pfs_metrics_counters[i].name,
+							pfs_metrics_counters[i].labels,
+							(unsigned long long)sum->counter[pfs_metrics_counters[i].counter]);
+		else
+			fprintf(f, "policyd_spf_%s %llu\n", pfs_metrics_counters[i].name,
+							(unsigned long long)sum->counter[pfs_metrics_counters[i].counter]);
+	}
+	for (h = 0; h < PFS_H_COUNT; h++)
+		pfs_metrics_write_hist(f, sum, h);
+
+	free(sum);
+}
+
+static void
+pfs_metrics_write_file(void)
+{
+	char		 tmp[1024];
+	FILE		*f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		pfs_log(LOG_WARNING, "Can not write %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	pfs_metrics_write(f);
+	if (fclose(f) == 0)
+		rename(tmp, path);
+	else
+		unlink(tmp);
+}
+
+static void
+pfs_metrics_serve(void)
+{
+	FILE		*f;
+	int			 fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		f = fdopen(fd, "w");
+		if (f == NULL) {
+			close(fd);
+			continue;
+		}
+		pfs_metrics_write(f);
+		fclose(f);
+	}
+}
+
+static void *
+pfs_metrics_thread(void *arg)
+{
+	struct pollfd		 pfd;
+	int					 waited = 0;
+
+	(void)arg;
+	pfd.fd = listen_fd;
+	pfd.events = POLLIN;
+	/* Wake up every second to notice pfs_metrics_stop */
+	while (!__atomic_load_n(&publisher_stop, __ATOMIC_ACQUIRE)) {
+		if (listen_fd >= 0) {
+			if (poll(&pfd, 1, 1000) > 0)
+				pfs_metrics_serve();
+			continue;
+		}
+		sleep(1);
+		if (++waited >= PFS_METRICS_INTERVAL) {
+			pfs_metrics_write_file();
+			waited = 0;
+		}
+	}
+	return NULL;
+}
+
+int
+pfs_metrics_start(const char *spec)
+{
+	struct sockaddr_un	 sun;
+	struct stat			 st;
+	sigset_t			 all, old;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		path = strdup(spec + 5);
+		if (strlen(path) >= sizeof(sun.sun_path)) {
+			pfs_log(LOG_ERR, "Socket path too long: %s\n", path);
+			return -1;
+		}
+		if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(path);
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, path);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+						|| listen(listen_fd, 16) < 0) {
+			pfs_log(LOG_ERR, "stats socket %s: %s\n", path, strerror(errno));
+			if (listen_fd >= 0)
+				close(listen_fd);
+			listen_fd = -1;
+			return -1;
+		}
+	}
+	else
+		path = strdup(spec);
+
+	/* Signals are for the main thread, the publisher inherits the mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&publisher, NULL, pfs_metrics_thread, NULL) != 0) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		pfs_log(LOG_ERR, "Can not start the stats thread\n");
+		return -1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	publisher_running = 1;
+	return 0;
+}
+
+void
+pfs_metrics_stop(void)
+{
+	if (publisher_running) {
+		__atomic_store_n(&publisher_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(publisher, NULL);
+		publisher_running = 0;
+	}
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(path);
+		listen_fd = -1;
+	}
+	else if (path != NULL)
+		/* The final numbers */
+		pfs_metrics_write_file();
+	free(path);
+	path = NULL;
+}
@@ -0,0 +1,160 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Counters and latency histograms (--stats). Every thread counts into
+ *  a block of its own, so counting is a plain increment without locks
+ *  or shared cache lines; a report sums the blocks of all threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_METRICS_H
+#define PFS_METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+enum {
+	PFS_C_REQUESTS,
+	/* results, as pf_response maps them */
+	PFS_C_RESULT_PASS,
+	PFS_C_RESULT_FAIL,
+	PFS_C_RESULT_SOFTFAIL,
+	PFS_C_RESULT_NEUTRAL,
+	PFS_C_RESULT_NONE,
+	PFS_C_RESULT_TEMPERROR,
+	PFS_C_RESULT_PERMERROR,
+	PFS_C_RESULT_INVALID,
+	PFS_C_RESULT_UNCHECKED,	/* answered before asking libspf2 */
+	PFS_C_ALLOWLISTED,
+	PFS_C_DENYLISTED,
+	PFS_C_OVERRIDDEN,		/* SPF record from the override map */
+	PFS_C_FALLBACK,			/* SPF record from the fallback map */
+	/* caches */
+	PFS_C_MEMO_HITS,
+	PFS_C_COALESCED,		/* answered by an identical evaluation in flight */
+	PFS_C_SHM_HITS,
+	PFS_C_SHM_MISSES,
+	PFS_C_DNS_CACHE_HITS,
+	PFS_C_DNS_CACHE_MISSES,
+	PFS_C_RECORD_HITS,
+	PFS_C_RECORD_MISSES,
+	PFS_C_HELO_HITS,
+	PFS_C_HELO_MISSES,
+	PFS_C_NETBLOCK_HITS,
+	PFS_C_NETBLOCK_MISSES,
+	PFS_C_FLAT_HITS,
+	PFS_C_FLAT_MISSES,
+	PFS_C_PEER_HITS,
+	PFS_C_PEER_MISSES,
+	/* upstream DNS */
+	PFS_C_DNS_QUERIES,
+	PFS_C_DNS_FAILURES,
+	PFS_C_DNS_HEDGES,
+	PFS_C_DEADLINE_EXCEEDED,
+	PFS_C_SHED_INFLIGHT,	/* answered unchecked under overload */
+	PFS_C_SHED_DELAY,
+	PFS_C_LOG_DROPPED,
+	PFS_C_COUNT
+};
+
+enum {
+	PFS_H_PARSE,			/* ns to parse a request */
+	PFS_H_EVALUATE,			/* ns in pf_evaluate, DNS waits included */
+	PFS_H_RESPONSE,			/* ns from parsed request to queued answer */
+	PFS_H_DNS_LOOKUPS,		/* DNS lookups of one evaluation */
+	PFS_H_COUNT
+};
+
+/*
+ * Log-linear buckets as in HdrHistogram: values below 8 exactly, above
+ * that 8 buckets per power of two, so every bucket is within 12.5%.
+ */
+#define PFS_HIST_MAX_BITS	40
+#define PFS_HIST_BUCKETS	((PFS_HIST_MAX_BITS - 2) * 8)
+
+typedef
+struct pfs_metrics_block_struct {
+	struct pfs_metrics_block_struct *next;
+	uint64_t			 counter[PFS_C_COUNT];
+	uint64_t			 hist[PFS_H_COUNT][PFS_HIST_BUCKETS];
+	uint64_t			 hist_sum[PFS_H_COUNT];
+} pfs_metrics_block_t;
+
+/* Per evaluation, found through pfs_fiber_local */
+typedef
+struct pfs_metrics_eval_struct {
+	uint64_t			 start;
+	unsigned			 dns_lookups;
+	unsigned			 dns_queries;	/* sent upstream */
+	uint64_t			 dns_wait;	/* ns waiting for their answers */
+	unsigned			 records;	/* PFS_NETBLOCK_USES_* of the SPF records read */
+	long				 ttl;		/* shortest of the DNS answers, -1: none */
+} pfs_metrics_eval_t;
+
+extern __thread pfs_metrics_block_t *pfs_metrics_self;
+pfs_metrics_block_t *pfs_metrics_block_new(void);
+
+static inline pfs_metrics_block_t *
+pfs_metrics_block(void)
+{
+	return pfs_metrics_self ? pfs_metrics_self : pfs_metrics_block_new();
+}
+
+/* Only the owning thread writes, readers may see a count late but whole */
+static inline void
+pfs_metrics_add(uint64_t *c, uint64_t n)
+{
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void
+pfs_metrics_count(int counter)
+{
+	pfs_metrics_add(&pfs_metrics_block()->counter[counter], 1);
+}
+
+static inline uint64_t
+pfs_metrics_now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void pfs_metrics_record(int hist, uint64_t value);
+
+/* Record the time since start (from pfs_metrics_now) in hist */
+static inline void
+pfs_metrics_since(int hist, uint64_t start)
+{
+	pfs_metrics_record(hist, pfs_metrics_now() - start);
+}
+
+/* The SPF result of pf_response, or 255 */
+void pfs_metrics_result(int spf_result);
+
+/* Around one evaluation; lookups in between are counted for it */
+void pfs_metrics_eval_begin(pfs_metrics_eval_t *eval);
+void pfs_metrics_eval_end(pfs_metrics_eval_t *eval);
+void pfs_metrics_dns_lookup(int hit);
+/* A query upstream, answered after start */
+void pfs_metrics_dns_query(uint64_t start);
+/* A DNS answer was used which holds for ttl more seconds */
+void pfs_metrics_dns_ttl(long ttl);
+/* An SPF record was read, using uses (see pfs_netblock_uses) */
+void pfs_metrics_spf_record(unsigned uses);
+
+/*
+ * Publish the metrics in the Prometheus text format: "unix:PATH" serves
+ * them to whoever connects to the socket, anything else is a file
+ * rewritten every 10 seconds. Runs on a thread of its own.
+ */
+int pfs_metrics_start(const char *spec);
+void pfs_metrics_stop(void);
+
+#endif
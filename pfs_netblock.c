@@ -0,0 +1,638 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Netblock result cache. Large senders send from thousands of
+ *  addresses, so a cache keyed by client address rarely sees the same
+ *  one twice, while their records are mostly lists of networks. After
+ *  libspf2 has evaluated a request the records are walked once more
+ *  from their text (straight from the caches): every ip4: and ip6: term
+ *  before the deciding one narrows the network around the client until
+ *  none of them reaches into it, the deciding term narrows it to itself.
+ *  The result then holds for every address of that network, and only
+ *  when it is the result libspf2 came to is it kept.
+ *
+ *  Entries are keyed by sender domain and live in striped hash chains
+ *  with an LRU list each, like the HELO memo; a domain has as many
+ *  entries as networks were learnt for it. The texts are templates with
+ *  the sender, HELO name and client address cut out.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_dns_rr.h"
+
+#include "pfs_netblock.h"
+#include "pfs_domain_map.h"
+#include "pfs_template.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+
+#define PFS_NETBLOCK_STRIPES	16
+#define PFS_NETBLOCK_TEXT		768		/* both templates */
+#define PFS_NETBLOCK_RECORD		2048	/* longest record walked */
+#define PFS_NETBLOCK_NONE		-1
+
+#define PFS_NETBLOCK_VERSION	"v=spf1"
+
+typedef
+struct pfs_netblock_entry_struct {
+	uint64_t		 hash;		/* of the domain */
+	time_t			 expires;
+	int32_t			 next;		/* bucket chain */
+	int32_t			 lru_prev;
+	int32_t			 lru_next;
+	unsigned char	 bits;		/* 32 or 128 */
+	unsigned char	 plen;
+	unsigned char	 result;
+	unsigned char	 net[16];
+	uint16_t		 received_len;
+	uint16_t		 comment_len;
+	char			 domain[PFS_NETBLOCK_DOMAIN];
+	char			 data[PFS_NETBLOCK_TEXT];
+} pfs_netblock_entry_t;
+
+typedef
+struct pfs_netblock_stripe_struct {
+	pthread_mutex_t	 lock;
+	pfs_netblock_entry_t *entry;
+	int32_t			*bucket;
+	int32_t			 size;		/* entries and buckets, a power of two */
+	int32_t			 used;
+	int32_t			 lru_head;	/* most recently used */
+	int32_t			 lru_tail;
+} pfs_netblock_stripe_t;
+
+struct pfs_netblock_struct {
+	pfs_netblock_stripe_t stripe[PFS_NETBLOCK_STRIPES];
+};
+
+/* One walk through the records of a domain for one client */
+typedef
+struct pfs_netblock_walk_struct {
+	SPF_client_options_t	*opts;
+	SPF_dns_server_t		*dns;
+	unsigned char	 ip[16];
+	int				 bits;		/* 32 or 128 */
+	int				 plen;		/* the network so far */
+	int				 lookups;
+	long			 ttl;		/* of the records seen so far */
+} pfs_netblock_walk_t;
+
+
+/*
+ * The client address; bits is 0 if it is none we can work with. libspf2
+ * passes loopback clients whatever the record says.
+ */
+static int
+pfs_netblock_addr(const char *ip, unsigned char *addr)
+{
+	struct in6_addr		 a6;
+
+	if (ip == NULL)
+		return 0;
+	if (inet_pton(AF_INET, ip, addr) == 1)
+		return addr[0] == 127 ? 0 : 32;
+	if (inet_pton(AF_INET6, ip, &a6) == 1 && !IN6_IS_ADDR_V4MAPPED(&a6)
+					&& !IN6_IS_ADDR_LOOPBACK(&a6)) {
+		memcpy(addr, &a6, 16);
+		return 128;
+	}
+	return 0;
+}
+
+#define PFS_NETBLOCK_BIT(a, i)	(((a)[(i) / 8] >> (7 - (i) % 8)) & 1)
+
+/* Whether addr is in net/plen */
+static int
+pfs_netblock_contains(const unsigned char *net, int plen, const unsigned char *addr)
+{
+	int				 i;
+
+	for (i = 0; i < plen; i++)
+		if (PFS_NETBLOCK_BIT(net, i) != PFS_NETBLOCK_BIT(addr, i))
+			return 0;
+	return 1;
+}
+
+/* The lower case domain of the sender; 0 if there is none */
+static int
+pfs_netblock_domain(SPF_client_request_t *req, char *domain, uint64_t *hash)
+{
+	const char		*at;
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+	size_t			 i, len;
+
+	if (req->sender == NULL || (at = strrchr(req->sender, '@')) == NULL)
+		return 0;
+	len = strlen(at + 1);
+	if (len == 0 || len >= PFS_NETBLOCK_DOMAIN)
+		return 0;
+	/* FNV-1a */
+	for (i = 0; i <= len; i++) {
+		domain[i] = tolower((unsigned char)at[1 + i]);
+		h = (h ^ (unsigned char)domain[i]) * 0x100000001b3ULL;
+	}
+	*hash = h;
+	return 1;
+}
+
+static void
+pfs_netblock_lru_unlink(pfs_netblock_stripe_t *s, int32_t i)
+{
+	pfs_netblock_entry_t	*e = &s->entry[i];
+
+	if (e->lru_prev != PFS_NETBLOCK_NONE)
+		s->entry[e->lru_prev].lru_next = e->lru_next;
+	else
+		s->lru_head = e->lru_next;
+	if (e->lru_next != PFS_NETBLOCK_NONE)
+		s->entry[e->lru_next].lru_prev = e->lru_prev;
+	else
+		s->lru_tail = e->lru_prev;
+}
+
+static void
+pfs_netblock_lru_push(pfs_netblock_stripe_t *s, int32_t i)
+{
+	pfs_netblock_entry_t	*e = &s->entry[i];
+
+	e->lru_prev = PFS_NETBLOCK_NONE;
+	e->lru_next = s->lru_head;
+	if (s->lru_head != PFS_NETBLOCK_NONE)
+		s->entry[s->lru_head].lru_prev = i;
+	else
+		s->lru_tail = i;
+	s->lru_head = i;
+}
+
+static void
+pfs_netblock_unchain(pfs_netblock_stripe_t *s, int32_t i)
+{
+	int32_t			*p;
+
+	for (p = &s->bucket[(s->entry[i].hash >> 4) & (s->size - 1)]; *p != PFS_NETBLOCK_NONE;
+					p = &s->entry[*p].next) {
+		if (*p == i) {
+			*p = s->entry[i].next;
+			return;
+		}
+	}
+}
+
+pfs_netblock_t *
+pfs_netblock_new(int entries)
+{
+	pfs_netblock_t		*nb;
+	pfs_netblock_stripe_t	*s;
+	int32_t				 size = 1;
+	int					 i, j;
+
+	while (size * PFS_NETBLOCK_STRIPES < entries)
+		size <<= 1;
+
+	nb = (pfs_netblock_t *)calloc(1, sizeof(pfs_netblock_t));
+	for (i = 0; i < PFS_NETBLOCK_STRIPES; i++) {
+		s = &nb->stripe[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->size = size;
+		s->entry = (pfs_netblock_entry_t *)calloc(size, sizeof(pfs_netblock_entry_t));
+		s->bucket = (int32_t *)malloc(size * sizeof(int32_t));
+		if (s->entry == NULL || s->bucket == NULL) {
+			pfs_log(LOG_ERR, "Out of memory for the netblock cache\n");
+			abort();
+		}
+		for (j = 0; j < size; j++)
+			s->bucket[j] = PFS_NETBLOCK_NONE;
+		s->lru_head = s->lru_tail = PFS_NETBLOCK_NONE;
+	}
+	return nb;
+}
+
+void
+pfs_netblock_free(pfs_netblock_t *nb)
+{
+	int					 i;
+
+	for (i = 0; i < PFS_NETBLOCK_STRIPES; i++) {
+		pthread_mutex_destroy(&nb->stripe[i].lock);
+		free(nb->stripe[i].entry);
+		free(nb->stripe[i].bucket);
+	}
+	free(nb);
+}
+
+int
+pfs_netblock_get(pfs_netblock_t *nb, SPF_client_request_t *req,
+				char *received_spf, char *comment, size_t len)
+{
+	pfs_netblock_stripe_t	*s;
+	pfs_netblock_entry_t	*e;
+	const char			*fields[PFS_TEMPLATE_FIELDS];
+	char				 domain[PFS_NETBLOCK_DOMAIN];
+	unsigned char		 addr[16];
+	uint64_t			 hash;
+	time_t				 now = time(NULL);
+	int32_t				 i;
+	int					 bits, result = -1;
+
+	if ((bits = pfs_netblock_addr(req->ip, addr)) == 0
+					|| !pfs_netblock_domain(req, domain, &hash))
+		return -1;
+	fields[PFS_NETBLOCK_SENDER] = req->sender;
+	fields[PFS_NETBLOCK_HELO] = req->helo ? req->helo : "";
+	fields[PFS_NETBLOCK_IP] = req->ip;
+	s = &nb->stripe[hash % PFS_NETBLOCK_STRIPES];
+
+	pthread_mutex_lock(&s->lock);
+	for (i = s->bucket[(hash >> 4) & (s->size - 1)]; i != PFS_NETBLOCK_NONE; i = e->next) {
+		e = &s->entry[i];
+		if (e->hash != hash || e->bits != bits || e->expires <= now
+						|| strcmp(e->domain, domain) != 0
+						|| !pfs_netblock_contains(e->net, e->plen, addr))
+			continue;
+		pfs_netblock_lru_unlink(s, i);
+		pfs_netblock_lru_push(s, i);
+		pfs_template_expand(e->data, e->received_len, fields, PFS_TEMPLATE_FIELDS,
+						received_spf, len);
+		pfs_template_expand(e->data + e->received_len, e->comment_len, fields,
+						PFS_TEMPLATE_FIELDS, comment, len);
+		result = e->result;
+		break;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	pfs_metrics_count(result >= 0 ? PFS_C_NETBLOCK_HITS : PFS_C_NETBLOCK_MISSES);
+	return result;
+}
+
+static void
+pfs_netblock_put(pfs_netblock_t *nb, const char *domain, uint64_t hash,
+				const unsigned char *addr, int bits, int plen, int result,
+				time_t expires, const char *data, int received_len, int comment_len)
+{
+	pfs_netblock_stripe_t	*s = &nb->stripe[hash % PFS_NETBLOCK_STRIPES];
+	pfs_netblock_entry_t	*e;
+	int32_t				 i, *p;
+
+	pthread_mutex_lock(&s->lock);
+	/* The same network learnt again, by another thread or after expiry */
+	for (i = s->bucket[(hash >> 4) & (s->size - 1)]; i != PFS_NETBLOCK_NONE; i = e->next) {
+		e = &s->entry[i];
+		if (e->hash == hash && e->bits == bits && e->plen == plen
+						&& strcmp(e->domain, domain) == 0
+						&& pfs_netblock_contains(e->net, plen, addr))
+			break;
+	}
+	if (i != PFS_NETBLOCK_NONE)
+		pfs_netblock_lru_unlink(s, i);
+	else {
+		if (s->used < s->size)
+			i = s->used++;
+		else {
+			/* Full: the least recently used makes room */
+			i = s->lru_tail;
+			pfs_netblock_lru_unlink(s, i);
+			pfs_netblock_unchain(s, i);
+		}
+		e = &s->entry[i];
+		e->hash = hash;
+		strcpy(e->domain, domain);
+		p = &s->bucket[(hash >> 4) & (s->size - 1)];
+		e->next = *p;
+		*p = i;
+	}
+	e = &s->entry[i];
+	e->expires = expires;
+	e->bits = bits;
+	e->plen = plen;
+	e->result = result;
+	/* The network itself, host bits cleared */
+	memset(e->net, 0, sizeof(e->net));
+	memcpy(e->net, addr, plen / 8);
+	if (plen % 8)
+		e->net[plen / 8] = addr[plen / 8] & (0xff << (8 - plen % 8));
+	e->received_len = received_len;
+	e->comment_len = comment_len;
+	memcpy(e->data, data, received_len + comment_len);
+	pfs_netblock_lru_push(s, i);
+	pthread_mutex_unlock(&s->lock);
+}
+
+int
+pfs_netblock_explanation_fits(const char *exp, int bits)
+{
+	const char		*p;
+	int				 c;
+
+	for (p = exp; p && (p = strstr(p, "%{")) != NULL; p += 2) {
+		c = tolower((unsigned char)p[2]);
+		if (c == 'd' || c == 'o' || c == 'r' || c == 'v')
+			continue;
+		if (p[3] != '}')
+			return 0;
+		if (c == 's' || c == 'h' || c == 'c')
+			continue;
+		if (c == 'i' && bits == 32)
+			continue;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * The ip4: or ip6: term net/cidr: whether it matches the client, and
+ * the network narrowed so that it is either all in the term or none
+ */
+static int
+pfs_netblock_term(pfs_netblock_walk_t *w, const unsigned char *net, int cidr)
+{
+	int				 i;
+
+	for (i = 0; i < cidr; i++)
+		if (PFS_NETBLOCK_BIT(net, i) != PFS_NETBLOCK_BIT(w->ip, i))
+			break;
+	if (i == cidr) {
+		if (cidr > w->plen)
+			w->plen = cidr;
+		return 1;
+	}
+	/* Keep the first bit in which the client differs from the term */
+	if (i + 1 > w->plen)
+		w->plen = i + 1;
+	return 0;
+}
+
+int
+pfs_netblock_record(SPF_client_options_t *opts, SPF_dns_server_t *dns,
+				const char *domain, char *text, size_t len, long *ttl)
+{
+	SPF_dns_rr_t		*rr;
+	const char			*found = NULL;
+	int					 i, num_found = 0, ok = -1;
+	char				 e;
+
+	if (opts->override_map
+					&& (found = pfs_domain_map_text(opts->override_map, domain)) != NULL)
+		return snprintf(text, len, "%s", found + sizeof(PFS_NETBLOCK_VERSION) - 1) < (int)len ? 0 : -1;
+
+	rr = SPF_dns_lookup(dns, domain, ns_t_txt, TRUE);
+	switch (rr->herrno) {
+		case NETDB_SUCCESS:
+			for (i = 0; i < rr->num_rr; i++) {
+				if (strncasecmp(rr->rr[i]->txt, PFS_NETBLOCK_VERSION,
+								sizeof(PFS_NETBLOCK_VERSION) - 1) != 0)
+					continue;
+				e = rr->rr[i]->txt[sizeof(PFS_NETBLOCK_VERSION) - 1];
+				if (e == ' ' || e == '\0') {
+					num_found++;
+					found = rr->rr[i]->txt;
+				}
+			}
+			if (num_found > 1 || rr->ttl <= 0)
+				break;
+			if (num_found == 1) {
+				if (rr->ttl < *ttl)
+					*ttl = rr->ttl;
+				ok = snprintf(text, len, "%s", found + sizeof(PFS_NETBLOCK_VERSION) - 1) < (int)len ? 0 : -1;
+				break;
+			}
+			/* FALLTHROUGH */
+		case HOST_NOT_FOUND:
+		case NO_DATA:
+			if (opts->fallback_map
+							&& (found = pfs_domain_map_text(opts->fallback_map, domain)) != NULL) {
+				/* Until the domain publishes a record */
+				if (rr->ttl > 0 && rr->ttl < *ttl)
+					*ttl = rr->ttl;
+				ok = snprintf(text, len, "%s", found + sizeof(PFS_NETBLOCK_VERSION) - 1) < (int)len ? 0 : -1;
+			}
+			break;
+	}
+	SPF_dns_rr_free(rr);
+	return ok;
+}
+
+static int
+pfs_netblock_qualifier(char c)
+{
+	switch (c) {
+		case '-': return SPF_RESULT_FAIL;
+		case '~': return SPF_RESULT_SOFTFAIL;
+		case '?': return SPF_RESULT_NEUTRAL;
+		default:  return SPF_RESULT_PASS;
+	}
+}
+
+char *
+pfs_netblock_parse(char *text, pfs_netblock_term_t *t)
+{
+	char			*term, *next, *slash, *end;
+
+	for (term = text; *term == ' '; term++)
+		;
+	if (*term == '\0')
+		return NULL;
+	if ((next = strchr(term, ' ')) != NULL)
+		*next++ = '\0';
+	else
+		next = term + strlen(term);
+
+	memset(t, 0, sizeof(*t));
+	t->qualifier = pfs_netblock_qualifier(*term);
+	if (strchr("+-~?", *term))
+		term++;
+
+	if (strncasecmp(term, "ip4:", 4) == 0 || strncasecmp(term, "ip6:", 4) == 0) {
+		t->type = PFS_TERM_NET;
+		t->bits = term[2] == '4' ? 32 : 128;
+		if ((slash = strchr(term, '/')) != NULL)
+			*slash++ = '\0';
+		t->cidr = slash ? (int)strtol(slash, &end, 10) : t->bits;
+		if ((slash && (*end != '\0' || end == slash)) || t->cidr < 0 || t->cidr > t->bits
+						|| inet_pton(t->bits == 32 ? AF_INET : AF_INET6, term + 4, t->net) != 1)
+			t->type = PFS_TERM_OTHER;
+	}
+	else if (strcasecmp(term, "all") == 0)
+		t->type = PFS_TERM_ALL;
+	else if (strncasecmp(term, "include:", 8) == 0) {
+		t->type = PFS_TERM_INCLUDE;
+		t->target = term + 8;
+	}
+	else if (strncasecmp(term, "redirect=", 9) == 0) {
+		t->type = PFS_TERM_REDIRECT;
+		t->target = term + 9;
+	}
+	else if (strncasecmp(term, "exp=", 4) == 0)
+		t->type = PFS_TERM_EXP;
+	else if (strchr(term, '=') != NULL && strchr(term, ':') == NULL)
+		t->type = PFS_TERM_MODIFIER;
+	else
+		t->type = PFS_TERM_OTHER;	/* a, mx, ptr, exists or something unknown */
+
+	/* Targets with macros depend on the request */
+	if (t->target && (*t->target == '\0' || strchr(t->target, '%') != NULL
+					|| strlen(t->target) >= PFS_NETBLOCK_DOMAIN))
+		t->type = PFS_TERM_OTHER;
+	return next;
+}
+
+/*
+ * Evaluate the record of domain for the client as far as it can be done
+ * without DNS of the client. Returns the SPF result, or -1 if it takes
+ * anything else.
+ */
+static int
+pfs_netblock_walk(pfs_netblock_walk_t *w, const char *domain, int depth)
+{
+	char			 text[PFS_NETBLOCK_RECORD];
+	char			 redirect[PFS_NETBLOCK_DOMAIN];
+	char			*p;
+	pfs_netblock_term_t	 t;
+	int				 r;
+
+	if (depth > PFS_NETBLOCK_DEPTH
+					|| pfs_netblock_record(w->opts, w->dns, domain, text, sizeof(text), &w->ttl) < 0)
+		return -1;
+
+	redirect[0] = '\0';
+	for (p = text; (p = pfs_netblock_parse(p, &t)) != NULL; ) {
+		switch (t.type) {
+			case PFS_TERM_NET:
+				/* A term of the other address family never matches */
+				if (t.bits == w->bits && pfs_netblock_term(w, t.net, t.cidr))
+					return t.qualifier;
+				break;
+			case PFS_TERM_ALL:
+				return t.qualifier;
+			case PFS_TERM_INCLUDE:
+				if (++w->lookups > PFS_NETBLOCK_MAX_LOOKUP(w->opts))
+					return -1;
+				r = pfs_netblock_walk(w, t.target, depth + 1);
+				if (r == SPF_RESULT_PASS)
+					return t.qualifier;
+				if (r != SPF_RESULT_FAIL && r != SPF_RESULT_SOFTFAIL && r != SPF_RESULT_NEUTRAL)
+					return -1;
+				break;
+			case PFS_TERM_REDIRECT:
+				strcpy(redirect, t.target);
+				break;
+			case PFS_TERM_EXP:
+			case PFS_TERM_MODIFIER:
+				/* Modifiers do not change the result */
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	if (redirect[0]) {
+		if (++w->lookups > PFS_NETBLOCK_MAX_LOOKUP(w->opts))
+			return -1;
+		return pfs_netblock_walk(w, redirect, depth + 1);
+	}
+	return SPF_RESULT_NEUTRAL;
+}
+
+unsigned
+pfs_netblock_uses(const char *text)
+{
+	const char		*p, *m, *end;
+	unsigned		 uses = 0;
+	int				 c;
+
+	/* Terms after all are never evaluated, exp= still counts */
+	for (p = text; p && *p; p = end) {
+		p += strspn(p, " ");
+		end = p + strcspn(p, " ");
+		if (strncasecmp(p, "exp=", 4) == 0) {
+			uses |= PFS_NETBLOCK_USES_EXP;
+			continue;
+		}
+		for (m = p; (m = strstr(m, "%{")) != NULL && m < end; m += 2) {
+			c = tolower((unsigned char)m[2]);
+			if (c == 's' || c == 'l')
+				uses |= PFS_NETBLOCK_USES_SENDER;
+		}
+	}
+	return uses;
+}
+
+int
+pfs_netblock_shared(SPF_client_options_t *opts, SPF_client_request_t *req,
+				int result, unsigned records)
+{
+	if (records & PFS_NETBLOCK_USES_SENDER)
+		return FALSE;
+	if (result != SPF_RESULT_FAIL)
+		return TRUE;
+	return !(records & PFS_NETBLOCK_USES_EXP)
+					&& pfs_netblock_explanation_fits(opts->explanation,
+							req->ip && strchr(req->ip, ':') ? 128 : 32);
+}
+
+void
+pfs_netblock_learn(pfs_netblock_t *nb, SPF_client_options_t *opts,
+				SPF_dns_server_t *dns, SPF_client_request_t *req, int result,
+				unsigned records, const char *received_spf, const char *comment)
+{
+	pfs_netblock_walk_t	 w;
+	const char			*fields[PFS_TEMPLATE_FIELDS];
+	static const int	 most[PFS_TEMPLATE_FIELDS] = PFS_NETBLOCK_MOST;
+	char				 domain[PFS_NETBLOCK_DOMAIN];
+	char				 data[PFS_NETBLOCK_TEXT];
+	uint64_t			 hash;
+	int					 rlen, clen;
+
+	if (result != SPF_RESULT_PASS && result != SPF_RESULT_FAIL
+					&& result != SPF_RESULT_SOFTFAIL && result != SPF_RESULT_NEUTRAL)
+		return;
+
+	memset(&w, 0, sizeof(w));
+	w.opts = opts;
+	w.dns = dns;
+	w.ttl = PFS_NETBLOCK_MAXTTL;
+	if ((w.bits = pfs_netblock_addr(req->ip, w.ip)) == 0
+					|| !pfs_netblock_domain(req, domain, &hash))
+		return;
+	if (pfs_netblock_walk(&w, domain, 0) != result)
+		return;
+	if (result == SPF_RESULT_FAIL
+					&& ((records & PFS_NETBLOCK_USES_EXP)
+						|| !pfs_netblock_explanation_fits(opts->explanation, w.bits)))
+		return;
+
+	fields[PFS_NETBLOCK_SENDER] = req->sender;
+	fields[PFS_NETBLOCK_HELO] = req->helo ? req->helo : "";
+	fields[PFS_NETBLOCK_IP] = req->ip;
+	rlen = pfs_template_make(received_spf ? received_spf : "", fields, most,
+					PFS_TEMPLATE_FIELDS, data, sizeof(data));
+	if (rlen < 0)
+		return;
+	clen = pfs_template_make(comment ? comment : "", fields, most,
+					PFS_TEMPLATE_FIELDS, data + rlen, sizeof(data) - rlen);
+	if (clen < 0)
+		return;
+
+	if (opts->debug > 1)
+		pfs_log(LOG_DEBUG, "%s is %s for %s/%d, %ld seconds\n", domain,
+						SPF_strresult(result), req->ip, w.plen, w.ttl);
+	pfs_netblock_put(nb, domain, hash, w.ip, w.bits, w.plen, result,
+					time(NULL) + w.ttl, data, rlen, clen);
+}
@@ -0,0 +1,134 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Netblock result cache: a result which was decided by ip4:, ip6: or
+ *  all holds for every client in the network that mechanism names, and
+ *  is kept for the sender domain and that network instead of the one
+ *  client address.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_NETBLOCK_H
+#define PFS_NETBLOCK_H
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "policyd-spf-fs.h"
+
+/* Configuration generations with the same settings share one cache this size */
+#define PFS_NETBLOCK_SIZE	4096
+/* Longest a result is kept, records with a longer TTL included */
+#define PFS_NETBLOCK_MAXTTL	3600
+
+#define PFS_NETBLOCK_DOMAIN	256
+#define PFS_NETBLOCK_DEPTH	10
+/* Includes and redirects followed, libspf2's default unless --max-lookup */
+#define PFS_NETBLOCK_MAX_LOOKUP(opts)	((opts)->max_lookup > 0 ? (opts)->max_lookup : 10)
+
+/* Fields of the response templates */
+#define PFS_NETBLOCK_SENDER	0
+#define PFS_NETBLOCK_HELO	1
+#define PFS_NETBLOCK_IP		2
+/*
+ * Times each may occur in one text: the HELO name is not part of the
+ * key, a client must not choose it to stand for anything but helo=
+ */
+#define PFS_NETBLOCK_MOST	{ 0, 1, 0 }
+
+/* What the terms of a record use, see pfs_netblock_uses */
+#define PFS_NETBLOCK_USES_EXP	0x1	/* exp=, which may use any macro */
+#define PFS_NETBLOCK_USES_SENDER	0x2	/* %{s} or %{l} in any other term */
+
+/* Terms of a record, as far as they can be evaluated without the client */
+#define PFS_TERM_OTHER		0	/* needs the client, a macro, or broken */
+#define PFS_TERM_NET		1	/* ip4: or ip6: */
+#define PFS_TERM_ALL		2
+#define PFS_TERM_INCLUDE	3
+#define PFS_TERM_REDIRECT	4
+#define PFS_TERM_EXP		5
+#define PFS_TERM_MODIFIER	6	/* any other, which changes nothing */
+
+typedef
+struct pfs_netblock_term_struct {
+	int				 type;
+	int				 qualifier;	/* SPF result on a match */
+	int				 bits;		/* PFS_TERM_NET: 32 or 128 */
+	int				 cidr;
+	unsigned char	 net[16];
+	const char		*target;	/* PFS_TERM_INCLUDE and _REDIRECT */
+} pfs_netblock_term_t;
+
+pfs_netblock_t *pfs_netblock_new(int entries);
+void pfs_netblock_free(pfs_netblock_t *nb);
+
+/*
+ * Look for a network of req's sender domain which req's client is in.
+ * On a hit the Received-SPF text and the comment are filled in for req
+ * and the SPF result is returned, otherwise -1.
+ */
+int pfs_netblock_get(pfs_netblock_t *nb, SPF_client_request_t *req,
+				char *received_spf, char *comment, size_t len);
+
+/*
+ * libspf2 came to result for req: read the records it went through
+ * again from dns (the top of the server's layers, so all of them are
+ * cached) and the domain maps of opts. If only ip4:, ip6:, include:,
+ * all and redirect= decided the result, remember it for the largest
+ * network around the client in which all of them give the same answer,
+ * until the first of the records expires. Anything else, a macro or a
+ * mechanism needing the client's DNS, and nothing is remembered; nor is
+ * a fail if records (see pfs_metrics_spf_record) had exp=. opts
+ * must not have a local policy (--local, --trusted), which libspf2
+ * puts in front of the domain's own terms.
+ */
+void pfs_netblock_learn(pfs_netblock_t *nb, SPF_client_options_t *opts,
+				SPF_dns_server_t *dns, SPF_client_request_t *req, int result,
+				unsigned records, const char *received_spf, const char *comment);
+
+/*
+ * The terms of the SPF record of domain as libspf2 gets it: from the
+ * override map of opts, from dns, or from the fallback map if DNS has
+ * none. *ttl is lowered to the record's TTL. Returns -1 if there is no
+ * single record.
+ */
+int pfs_netblock_record(SPF_client_options_t *opts, SPF_dns_server_t *dns,
+				const char *domain, char *text, size_t len, long *ttl);
+
+/*
+ * Split the next term off text, which it modifies, into t. Returns
+ * where the term after it starts, NULL at the end of text.
+ */
+char *pfs_netblock_parse(char *text, pfs_netblock_term_t *t);
+
+/*
+ * Explanations only ever differ in the sender, the HELO name and the
+ * client address, which the templates take care of, if these are all
+ * the macros they use. The client address only as it was given, for a
+ * client of bits.
+ */
+int pfs_netblock_explanation_fits(const char *exp, int bits);
+
+/*
+ * PFS_NETBLOCK_USES_* of the record text. The layers which hand SPF
+ * records to libspf2 pass it to pfs_metrics_spf_record, so that an
+ * evaluation knows what the records it went through used.
+ */
+unsigned pfs_netblock_uses(const char *text);
+
+/*
+ * Whether the texts libspf2 gave for result can be kept for any sender
+ * of req's domain, client address and HELO name, as the shared result
+ * cache and the peers do; records are what the evaluation read. Not
+ * if a record looked at the sender's local part, and for a fail only if
+ * its explanation fits and comes from --default-explanation rather than
+ * from exp=.
+ */
+int pfs_netblock_shared(SPF_client_options_t *opts, SPF_client_request_t *req,
+				int result, unsigned records);
+
+#endif
@@ -0,0 +1,715 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Peer cache. Every peer has PFS_PEER_VNODES points on a ring of 64
+ *  bit hashes; a key belongs to the first point at or after its own
+ *  hash, so adding or removing a peer only moves the keys next to its
+ *  points. Nodes talk in single UDP datagrams, a text line followed by
+ *  the Received-SPF and comment templates, as in the shared memory
+ *  cache:
+ *
+ *	PFS1 L <id> <seed> <ip> <domain> <helo>		lookup
+ *	PFS1 A <id> <result> <rlen> <clen>		hit, then the templates
+ *	PFS1 N <id>					miss
+ *	PFS1 P <seed> <result> <ttl> <rlen> <clen> <ip> <domain> <helo>
+ *							publish, then the templates
+ *
+ *  A lookup has its own connected socket, like a DNS query, and waits
+ *  for the answer on the evaluation's fiber; a publish is not answered.
+ *  An owner which does not answer in time is skipped for 1, 2, 4 ...
+ *  up to PFS_PEER_BACKOFF seconds: its keys are then checked locally,
+ *  they do not move to another peer. Datagrams are only taken from the
+ *  hosts of the peer list, which over UDP is no proof of where they
+ *  came from: the port belongs on a network only the peers reach.
+ *  Templates with control bytes besides the markers are refused, they
+ *  end up in the policy answer.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_peer.h"
+#include "pfs_dns_async.h"
+#include "pfs_template.h"
+#include "pfs_log.h"
+
+#define PFS_PEER_WAYS		8
+/* Templates larger than this are not shared, a message stays one datagram */
+#define PFS_PEER_DATA		1152
+#define PFS_PEER_MSG		(PFS_PEER_DATA + 320)
+
+typedef
+struct pfs_peer_node_struct {
+	struct sockaddr_storage	 addr;
+	socklen_t				 addr_len;
+	char					 name[INET6_ADDRSTRLEN + 8];	/* addr:port */
+	int						 self;
+	int						 fails;		/* lookups in a row not answered; atomic */
+	int64_t					 down_until;	/* ms, not asked before; atomic */
+} pfs_peer_node_t;
+
+typedef
+struct pfs_peer_point_struct {
+	uint64_t				 hash;
+	int						 node;
+} pfs_peer_point_t;
+
+typedef
+struct pfs_peer_entry_struct {
+	uint64_t				 hash;		/* 0: empty */
+	uint64_t				 seed;
+	time_t					 expires;
+	uint16_t				 key_len;
+	uint16_t				 received_len;
+	uint16_t				 comment_len;
+	uint8_t					 result;
+	char					*data;		/* key, then the two templates */
+} pfs_peer_entry_t;
+
+struct pfs_peer_struct {
+	pfs_peer_node_t			 nodes[PFS_PEER_MAX];
+	int						 nnodes;
+	pfs_peer_point_t		*ring;		/* sorted by hash */
+	int						 npoints;
+	int						 timeout;	/* ms */
+	int						 fd;		/* bound to self, -1: none */
+	int						 send_fd[2];	/* publishing, IPv4 and IPv6 */
+	uint32_t				 next_id;	/* atomic */
+
+	pthread_mutex_t			 lock;		/* entries */
+	pfs_peer_entry_t		*entries;	/* NULL without self */
+	uint32_t				 nsets;
+};
+
+
+static uint64_t
+pfs_peer_hash(uint64_t h, const char *s, size_t len)
+{
+	size_t		 i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	/* Similar keys must land far apart on the ring */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int64_t
+pfs_peer_now(void)
+{
+	struct timespec		 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+pfs_peer_parse(const char *spec, struct sockaddr_storage *ss, socklen_t *len)
+{
+	struct addrinfo		 hints, *ai;
+	char				 host[256];
+	const char			*colon;
+	int					 err;
+
+	colon = strrchr(spec, ':');
+	if (colon == NULL || colon - spec >= (int)sizeof(host))
+		return -1;
+
+	/* Strip brackets from [ipv6]:port */
+	if (spec[0] == '[' && colon > spec && colon[-1] == ']') {
+		memcpy(host, spec + 1, colon - spec - 2);
+		host[colon - spec - 2] = '\0';
+	}
+	else {
+		memcpy(host, spec, colon - spec);
+		host[colon - spec] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	err = getaddrinfo(host, colon + 1, &hints, &ai);
+	if (err) {
+		pfs_log(LOG_ERR, "%s: %s\n", spec, gai_strerror(err));
+		return -1;
+	}
+	memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+	*len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 0;
+}
+
+/* Whether a and b are the same host, ports aside */
+static int
+pfs_peer_same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 0;
+	if (a->ss_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_addr.s_addr
+						== ((struct sockaddr_in *)b)->sin_addr.s_addr;
+	if (a->ss_family == AF_INET6)
+		return memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+						&((struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+	return 0;
+}
+
+static int
+pfs_peer_same(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (!pfs_peer_same_host(a, b))
+		return 0;
+	if (a->ss_family == AF_INET)
+		return ((struct sockaddr_in *)a)->sin_port == ((struct sockaddr_in *)b)->sin_port;
+	return ((struct sockaddr_in6 *)a)->sin6_port == ((struct sockaddr_in6 *)b)->sin6_port;
+}
+
+static int
+pfs_peer_known(pfs_peer_t *peer, const struct sockaddr_storage *from)
+{
+	int					 i;
+
+	for (i = 0; i < peer->nnodes; i++) {
+		if (pfs_peer_same_host(&peer->nodes[i].addr, from))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Name the peer by its address, so that every node puts it on the
+ * same points however the list spells it
+ */
+static void
+pfs_peer_name(pfs_peer_node_t *node)
+{
+	char				 ip[INET6_ADDRSTRLEN];
+
+	if (node->addr.ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((struct sockaddr_in *)&node->addr)->sin_addr, ip, sizeof(ip));
+		snprintf(node->name, sizeof(node->name), "%s:%u", ip,
+						ntohs(((struct sockaddr_in *)&node->addr)->sin_port));
+	}
+	else {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&node->addr)->sin6_addr, ip, sizeof(ip));
+		snprintf(node->name, sizeof(node->name), "[%s]:%u", ip,
+						ntohs(((struct sockaddr_in6 *)&node->addr)->sin6_port));
+	}
+}
+
+static int
+pfs_peer_cmp_point(const void *a, const void *b)
+{
+	const pfs_peer_point_t	*pa = (const pfs_peer_point_t *)a;
+	const pfs_peer_point_t	*pb = (const pfs_peer_point_t *)b;
+
+	if (pa->hash != pb->hash)
+		return pa->hash < pb->hash ? -1 : 1;
+	return pa->node - pb->node;
+}
+
+/*
+ * Build the lookup key "ip domain helo", lower case.
+ * Returns its length, or 0 if it does not fit or there is no sender.
+ */
+static size_t
+pfs_peer_key(SPF_client_request_t *req, char *key, size_t keylen)
+{
+	const char	*domain;
+	size_t		 i;
+	int			 n;
+
+	if (req->ip == NULL || req->sender == NULL
+					|| (domain = strrchr(req->sender, '@')) == NULL)
+		return 0;
+
+	n = snprintf(key, keylen, "%s %s %s", req->ip, domain + 1,
+					req->helo ? req->helo : "");
+	if (n < 0 || (size_t)n >= keylen)
+		return 0;
+	for (i = 0; i < (size_t)n; i++)
+		key[i] = tolower((unsigned char)key[i]);
+	return n;
+}
+
+static pfs_peer_node_t *
+pfs_peer_owner(pfs_peer_t *peer, const char *key, size_t klen)
+{
+	uint64_t			 hash = pfs_peer_hash(0xcbf29ce484222325ULL, key, klen);
+	int					 lo = 0, hi = peer->npoints, mid;
+
+	/* The first point at or after hash, around the ring */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (peer->ring[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &peer->nodes[peer->ring[lo % peer->npoints].node];
+}
+
+/*
+ * Copy the templates kept for key to data, at most PFS_PEER_DATA bytes.
+ * Returns the result, or -1 if there is none.
+ */
+static int
+pfs_peer_lookup(pfs_peer_t *peer, uint64_t seed, const char *key, size_t klen,
+				char *data, unsigned *rlen, unsigned *clen)
+{
+	pfs_peer_entry_t	*set, *e;
+	uint64_t			 hash = pfs_peer_hash(0xcbf29ce484222325ULL ^ seed, key, klen) | 1;
+	int					 i, res = -1;
+
+	pthread_mutex_lock(&peer->lock);
+	set = &peer->entries[(hash >> 1) % peer->nsets * PFS_PEER_WAYS];
+	for (i = 0; i < PFS_PEER_WAYS; i++) {
+		e = &set[i];
+		if (e->hash != hash || e->seed != seed || e->key_len != klen
+						|| e->expires <= time(NULL)
+						|| memcmp(e->data, key, klen) != 0)
+			continue;
+		memcpy(data, e->data + klen, e->received_len + e->comment_len);
+		*rlen = e->received_len;
+		*clen = e->comment_len;
+		res = e->result;
+		break;
+	}
+	pthread_mutex_unlock(&peer->lock);
+	return res;
+}
+
+static void
+pfs_peer_store(pfs_peer_t *peer, uint64_t seed, const char *key, size_t klen,
+				int result, long ttl, const char *data, unsigned rlen, unsigned clen)
+{
+	pfs_peer_entry_t	*set, *e = NULL;
+	uint64_t			 hash = pfs_peer_hash(0xcbf29ce484222325ULL ^ seed, key, klen) | 1;
+	char				*copy;
+	int					 i;
+
+	copy = (char *)malloc(klen + rlen + clen);
+	if (copy == NULL)
+		return;
+	memcpy(copy, key, klen);
+	memcpy(copy + klen, data, rlen + clen);
+
+	pthread_mutex_lock(&peer->lock);
+	set = &peer->entries[(hash >> 1) % peer->nsets * PFS_PEER_WAYS];
+	/* Same key, else the one expiring first */
+	for (i = 0; i < PFS_PEER_WAYS; i++) {
+		if (set[i].hash == hash && set[i].seed == seed && set[i].key_len == klen
+						&& memcmp(set[i].data, key, klen) == 0) {
+			e = &set[i];
+			break;
+		}
+		if (e == NULL || set[i].expires < e->expires)
+			e = &set[i];
+	}
+	free(e->data);
+	e->hash = hash;
+	e->seed = seed;
+	e->expires = time(NULL) + ttl;
+	e->key_len = klen;
+	e->received_len = rlen;
+	e->comment_len = clen;
+	e->result = result;
+	e->data = copy;
+	pthread_mutex_unlock(&peer->lock);
+}
+
+static int
+pfs_peer_down(pfs_peer_node_t *node)
+{
+	return __atomic_load_n(&node->down_until, __ATOMIC_RELAXED) > pfs_peer_now();
+}
+
+static void
+pfs_peer_failed(pfs_peer_node_t *node)
+{
+	int					 fails, backoff;
+
+	fails = __atomic_add_fetch(&node->fails, 1, __ATOMIC_RELAXED);
+	backoff = fails > 5 ? PFS_PEER_BACKOFF : 1 << (fails - 1);
+	if (backoff > PFS_PEER_BACKOFF)
+		backoff = PFS_PEER_BACKOFF;
+	__atomic_store_n(&node->down_until, pfs_peer_now() + backoff * 1000, __ATOMIC_RELAXED);
+	if (fails == 1)
+		pfs_log(LOG_WARNING, "Peer %s does not answer, checking its keys locally\n",
+						node->name);
+}
+
+static void
+pfs_peer_answered(pfs_peer_node_t *node)
+{
+	if (__atomic_exchange_n(&node->fails, 0, __ATOMIC_RELAXED) > 0)
+		pfs_log(LOG_INFO, "Peer %s answers again\n", node->name);
+}
+
+/* Whether the templates are text a policy answer may carry */
+static int
+pfs_peer_clean(const char *data, size_t len)
+{
+	size_t				 i;
+	unsigned char		 c;
+
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)data[i];
+		/* 1 and 2 mark the sender, see pfs_template.c */
+		if ((c < ' ' && c != 1 && c != 2) || c == 0x7f)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Parse an answer to lookup id. Returns the result, -1 for a miss or
+ * -2 if msg is something else.
+ */
+static int
+pfs_peer_answer(char *msg, size_t len, unsigned id,
+				char *data, unsigned *rlen, unsigned *clen)
+{
+	char				*nl;
+	unsigned			 got;
+	int					 res;
+
+	if ((nl = (char *)memchr(msg, '\n', len)) == NULL)
+		return -2;
+	*nl++ = '\0';
+	if (sscanf(msg, "PFS1 N %u", &got) == 1)
+		return got == id ? -1 : -2;
+	if (sscanf(msg, "PFS1 A %u %d %u %u", &got, &res, rlen, clen) != 4
+					|| got != id || res < 0 || res > SPF_RESULT_PERMERROR
+					|| *rlen > PFS_PEER_DATA || *clen > PFS_PEER_DATA - *rlen
+					|| *rlen + *clen != len - (nl - msg)
+					|| !pfs_peer_clean(nl, *rlen + *clen))
+		return -2;
+	memcpy(data, nl, *rlen + *clen);
+	return res;
+}
+
+/* Ask node for key; see pfs_peer_answer for the return value */
+static int
+pfs_peer_ask(pfs_peer_t *peer, pfs_peer_node_t *node, uint64_t seed,
+				SPF_dns_server_t *dns, const char *key, size_t klen,
+				char *data, unsigned *rlen, unsigned *clen)
+{
+	char				 msg[PFS_PEER_MSG];
+	unsigned			 id = __atomic_add_fetch(&peer->next_id, 1, __ATOMIC_RELAXED);
+	int64_t				 now, deadline;
+	ssize_t				 n;
+	int					 fd, res = -2;
+
+	fd = socket(node->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -2;
+	n = snprintf(msg, sizeof(msg), "PFS1 L %u %016llx %.*s\n",
+					id, (unsigned long long)seed, (int)klen, key);
+	/* A connected socket only takes datagrams from the peer */
+	if (connect(fd, (struct sockaddr *)&node->addr, node->addr_len) < 0
+					|| send(fd, msg, n, 0) < 0) {
+		close(fd);
+		return -2;
+	}
+
+	deadline = pfs_peer_now() + peer->timeout;
+	for (;;) {
+		n = recv(fd, msg, sizeof(msg) - 1, 0);
+		if (n >= 0) {
+			/* Anything but our answer is a leftover, keep waiting */
+			if ((res = pfs_peer_answer(msg, n, id, data, rlen, clen)) != -2)
+				break;
+			continue;
+		}
+		/* ICMP unreachable: nobody listens there */
+		if (errno != EAGAIN && errno != EINTR)
+			break;
+		now = pfs_peer_now();
+		if (now >= deadline || !pfs_dns_async_wait(dns, fd, deadline - now))
+			break;
+	}
+	close(fd);
+	return res;
+}
+
+pfs_peer_t *
+pfs_peer_new(const char *peers, const char *self, int timeout_ms)
+{
+	pfs_peer_t			*peer;
+	pfs_peer_node_t		*node;
+	struct sockaddr_storage	 self_addr;
+	socklen_t			 self_len;
+	char				*list, *tok, *save, name[INET6_ADDRSTRLEN + 16];
+	int					 i, v, nself = 0;
+
+	peer = (pfs_peer_t *)calloc(1, sizeof(pfs_peer_t));
+	peer->fd = peer->send_fd[0] = peer->send_fd[1] = -1;
+	peer->timeout = timeout_ms > 0 ? timeout_ms : PFS_PEER_TIMEOUT;
+	pthread_mutex_init(&peer->lock, NULL);
+
+	if (self != NULL && pfs_peer_parse(self, &self_addr, &self_len) < 0) {
+		pfs_log(LOG_ERR, "Invalid peer address %s\n", self);
+		goto fail;
+	}
+
+	list = strdup(peers);
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		if (peer->nnodes == PFS_PEER_MAX) {
+			pfs_log(LOG_WARNING, "Only the first %d peers are used\n", PFS_PEER_MAX);
+			break;
+		}
+		node = &peer->nodes[peer->nnodes];
+		if (pfs_peer_parse(tok, &node->addr, &node->addr_len) < 0) {
+			pfs_log(LOG_ERR, "Invalid peer address %s\n", tok);
+			free(list);
+			goto fail;
+		}
+		pfs_peer_name(node);
+		if (self != NULL && pfs_peer_same(&node->addr, &self_addr)) {
+			node->self = 1;
+			nself++;
+		}
+		peer->nnodes++;
+	}
+	free(list);
+
+	if (peer->nnodes == 0) {
+		pfs_log(LOG_ERR, "No peers in %s\n", peers);
+		goto fail;
+	}
+	if (self != NULL && nself == 0) {
+		pfs_log(LOG_ERR, "Peer address %s is not in the peer list\n", self);
+		goto fail;
+	}
+
+	peer->ring = (pfs_peer_point_t *)malloc(peer->nnodes * PFS_PEER_VNODES
+					* sizeof(pfs_peer_point_t));
+	for (i = 0; i < peer->nnodes; i++) {
+		for (v = 0; v < PFS_PEER_VNODES; v++) {
+			snprintf(name, sizeof(name), "%s#%d", peer->nodes[i].name, v);
+			peer->ring[peer->npoints].hash = pfs_peer_hash(0xcbf29ce484222325ULL,
+							name, strlen(name));
+			peer->ring[peer->npoints].node = i;
+			peer->npoints++;
+		}
+	}
+	qsort(peer->ring, peer->npoints, sizeof(pfs_peer_point_t), pfs_peer_cmp_point);
+
+	if (self != NULL) {
+		peer->fd = socket(self_addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (peer->fd < 0 || bind(peer->fd, (struct sockaddr *)&self_addr, self_len) < 0) {
+			pfs_log(LOG_ERR, "bind %s: %s\n", self, strerror(errno));
+			goto fail;
+		}
+		peer->nsets = PFS_PEER_ENTRIES / PFS_PEER_WAYS;
+		peer->entries = (pfs_peer_entry_t *)calloc(PFS_PEER_ENTRIES, sizeof(pfs_peer_entry_t));
+	}
+	peer->send_fd[0] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	peer->send_fd[1] = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	pfs_log(LOG_INFO, "Sharing results with %d peers\n", peer->nnodes - nself);
+	return peer;
+
+  fail:
+	pfs_peer_free(peer);
+	return NULL;
+}
+
+void
+pfs_peer_free(pfs_peer_t *peer)
+{
+	uint32_t			 i;
+
+	if (peer->fd >= 0)
+		close(peer->fd);
+	if (peer->send_fd[0] >= 0)
+		close(peer->send_fd[0]);
+	if (peer->send_fd[1] >= 0)
+		close(peer->send_fd[1]);
+	if (peer->entries) {
+		for (i = 0; i < PFS_PEER_ENTRIES; i++)
+			free(peer->entries[i].data);
+		free(peer->entries);
+	}
+	free(peer->ring);
+	pthread_mutex_destroy(&peer->lock);
+	free(peer);
+}
+
+uint64_t
+pfs_peer_seed(const char *fingerprint)
+{
+	return pfs_peer_hash(0xcbf29ce484222325ULL, fingerprint, strlen(fingerprint));
+}
+
+int
+pfs_peer_get(pfs_peer_t *peer, uint64_t seed, SPF_dns_server_t *dns,
+				SPF_client_request_t *req, char *received_spf, char *comment,
+				size_t len)
+{
+	pfs_peer_node_t		*node;
+	char				 key[256], data[PFS_PEER_DATA];
+	unsigned			 rlen, clen;
+	size_t				 klen;
+	int					 res;
+
+	klen = pfs_peer_key(req, key, sizeof(key));
+	if (klen == 0)
+		return -1;
+
+	node = pfs_peer_owner(peer, key, klen);
+	if (node->self)
+		res = pfs_peer_lookup(peer, seed, key, klen, data, &rlen, &clen);
+	else if (pfs_peer_down(node))
+		return -1;
+	else if ((res = pfs_peer_ask(peer, node, seed, dns, key, klen,
+					data, &rlen, &clen)) == -2) {
+		/* Out of time for the evaluation is not the peer's fault */
+		if (!pfs_dns_deadline_passed())
+			pfs_peer_failed(node);
+		return -1;
+	}
+	else
+		pfs_peer_answered(node);
+	if (res < 0)
+		return -1;
+
+	pfs_template_expand(data, rlen, (const char **)&req->sender, 1, received_spf, len);
+	pfs_template_expand(data + rlen, clen, (const char **)&req->sender, 1, comment, len);
+	return res;
+}
+
+void
+pfs_peer_put(pfs_peer_t *peer, uint64_t seed, SPF_client_request_t *req,
+				int result, long ttl, const char *received_spf, const char *comment)
+{
+	pfs_peer_node_t		*node;
+	char				 key[256], data[PFS_PEER_DATA], msg[PFS_PEER_MSG];
+	size_t				 klen;
+	int					 rlen, clen, n;
+
+	if (ttl == 0)
+		return;
+	if (ttl < 0 || ttl > PFS_PEER_TTL)
+		ttl = PFS_PEER_TTL;
+	klen = pfs_peer_key(req, key, sizeof(key));
+	if (klen == 0)
+		return;
+	rlen = pfs_template_make(received_spf ? received_spf : "",
+					(const char **)&req->sender, NULL, 1, data, sizeof(data));
+	if (rlen < 0)
+		return;
+	clen = pfs_template_make(comment ? comment : "",
+					(const char **)&req->sender, NULL, 1, data + rlen, sizeof(data) - rlen);
+	if (clen < 0)
+		return;
+
+	node = pfs_peer_owner(peer, key, klen);
+	if (node->self) {
+		pfs_peer_store(peer, seed, key, klen, result, ttl, data, rlen, clen);
+		return;
+	}
+	if (pfs_peer_down(node))
+		return;
+
+	n = snprintf(msg, sizeof(msg), "PFS1 P %016llx %d %ld %d %d %.*s\n",
+					(unsigned long long)seed, result, ttl, rlen, clen, (int)klen, key);
+	if (n < 0 || n + rlen + clen > (int)sizeof(msg))
+		return;
+	memcpy(msg + n, data, rlen + clen);
+	sendto(peer->send_fd[node->addr.ss_family == AF_INET6], msg, n + rlen + clen,
+					MSG_DONTWAIT, (struct sockaddr *)&node->addr, node->addr_len);
+}
+
+int
+pfs_peer_fd(pfs_peer_t *peer)
+{
+	return peer->fd;
+}
+
+void
+pfs_peer_serve(pfs_peer_t *peer)
+{
+	struct sockaddr_storage	 from;
+	socklen_t			 fromlen;
+	char				 msg[PFS_PEER_MSG], reply[PFS_PEER_MSG], data[PFS_PEER_DATA];
+	char				*nl, *key;
+	unsigned long long	 seed;
+	unsigned			 id, rlen, clen;
+	long				 ttl;
+	ssize_t				 n;
+	size_t				 klen;
+	int					 off, res, m;
+
+	for (;;) {
+		fromlen = sizeof(from);
+		n = recvfrom(peer->fd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &fromlen);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (!pfs_peer_known(peer, &from)
+						|| (nl = (char *)memchr(msg, '\n', n)) == NULL)
+			continue;
+		*nl = '\0';
+
+		off = 0;
+		if (sscanf(msg, "PFS1 L %u %llx %n", &id, &seed, &off) == 2 && off > 0) {
+			key = msg + off;
+			klen = nl - key;
+			if (klen == 0 || klen >= 256)
+				continue;
+			res = pfs_peer_lookup(peer, seed, key, klen, data, &rlen, &clen);
+			if (res < 0)
+				m = snprintf(reply, sizeof(reply), "PFS1 N %u\n", id);
+			else {
+				m = snprintf(reply, sizeof(reply), "PFS1 A %u %d %u %u\n", id, res, rlen, clen);
+				memcpy(reply + m, data, rlen + clen);
+				m += rlen + clen;
+			}
+			sendto(peer->fd, reply, m, MSG_DONTWAIT, (struct sockaddr *)&from, fromlen);
+			continue;
+		}
+
+		off = 0;
+		if (sscanf(msg, "PFS1 P %llx %d %ld %u %u %n", &seed, &res, &ttl, &rlen, &clen,
+								&off) == 5 && off > 0) {
+			key = msg + off;
+			klen = nl - key;
+			if (klen == 0 || klen >= 256 || res < 0 || res > SPF_RESULT_PERMERROR
+							|| ttl <= 0 || ttl > PFS_PEER_TTL
+							|| rlen > PFS_PEER_DATA || clen > PFS_PEER_DATA - rlen
+							|| (ssize_t)(rlen + clen) != n - (nl + 1 - msg)
+							|| !pfs_peer_clean(nl + 1, rlen + clen))
+				continue;
+			pfs_peer_store(peer, seed, key, klen, res, ttl, nl + 1, rlen, clen);
+		}
+	}
+}
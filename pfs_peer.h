@@ -0,0 +1,75 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Peer cache (--peers): the daemons of a cluster of MX hosts share
+ *  their results. Every key (ip, sender domain, helo) is owned by one
+ *  of the peers, chosen by consistent hashing; a node asks the owner
+ *  before checking a request itself and tells it the result after.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_PEER_H
+#define PFS_PEER_H
+
+#include <stdint.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "policyd-spf-fs.h"
+
+#define PFS_PEER_MAX		64
+/* Points on the ring per peer, for an even share of the keys */
+#define PFS_PEER_VNODES		64
+/* Results a peer keeps for the others, in sets of 8 */
+#define PFS_PEER_ENTRIES	65536
+/* Longest a result is reused, as in the shared memory cache */
+#define PFS_PEER_TTL		300
+/* Default ms to wait for the owner's answer */
+#define PFS_PEER_TIMEOUT	20
+/* Longest s a peer which stopped answering is left alone */
+#define PFS_PEER_BACKOFF	30
+
+/*
+ * peers is a comma separated list of "ip:port" or "[ipv6]:port", the
+ * same on every node. self, if not NULL, is the address of this node
+ * in that list: a UDP socket is bound to it, pfs_peer_fd, and the
+ * keys this node owns are looked up here. Returns NULL and logs to
+ * syslog on failure.
+ */
+pfs_peer_t *pfs_peer_new(const char *peers, const char *self, int timeout_ms);
+void pfs_peer_free(pfs_peer_t *peer);
+
+/* Results are shared between nodes whose options give the same seed */
+uint64_t pfs_peer_seed(const char *fingerprint);
+
+/*
+ * Ask the owner of req's key. On a hit the Received-SPF text and the
+ * comment are filled in for req's sender and the SPF result is
+ * returned, otherwise -1. Waits through dns (any layer of the stack
+ * above pfs_dns_async) at most timeout_ms; an owner which does not
+ * answer in time is not asked again for a while.
+ */
+int pfs_peer_get(pfs_peer_t *peer, uint64_t seed, SPF_dns_server_t *dns,
+				SPF_client_request_t *req, char *received_spf, char *comment,
+				size_t len);
+
+/*
+ * Hand a result to the owner of req's key, to be kept for ttl seconds
+ * as in pfs_shm_cache_put; never waits
+ */
+void pfs_peer_put(pfs_peer_t *peer, uint64_t seed, SPF_client_request_t *req,
+				int result, long ttl, const char *received_spf, const char *comment);
+
+/*
+ * The socket other nodes talk to, -1 without self. When it is readable,
+ * pfs_peer_serve answers what came in.
+ */
+int pfs_peer_fd(pfs_peer_t *peer);
+void pfs_peer_serve(pfs_peer_t *peer);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Worker pool: the event loop parses requests and hands them to a
+ *  fixed number of threads. Every worker drives its own evaluation
+ *  engine, with a private SPF_server_t and DNS layer, so workers never
+ *  contend on libspf2 state. New jobs go to the least loaded worker.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_engine.h"
+#include "pfs_pool.h"
+#include "pfs_log.h"
+
+typedef
+struct pfs_worker_struct {
+	pthread_t			 thread;
+	pfs_pool_t			*pool;
+	pfs_engine_t		*engine;
+
+	pthread_mutex_t		 lock;
+	pfs_job_t			*queue_head;
+	pfs_job_t			*queue_tail;
+	int					 event_fd;	/* new jobs or stop */
+	int					 load;		/* queued or running, atomic */
+} pfs_worker_t;
+
+struct pfs_pool_struct {
+	SPF_client_options_t	*opts;
+
+	pthread_mutex_t		 lock;
+	pfs_job_t			*completed;
+	int					 event_fd;
+	int					 stop;
+
+	int					 nworkers;
+	pfs_worker_t		*workers;
+};
+
+
+static void
+pfs_eventfd_signal(int fd)
+{
+	uint64_t			 one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		pfs_log(LOG_WARNING, "eventfd write: %s\n", strerror(errno));
+}
+
+static void
+pfs_eventfd_clear(int fd)
+{
+	uint64_t			 count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		pfs_log(LOG_WARNING, "eventfd read: %s\n", strerror(errno));
+}
+
+/*
+ * Engine callback, runs on the worker thread
+ */
+static void
+pfs_worker_done(pfs_job_t *job, void *arg)
+{
+	pfs_worker_t		*worker = (pfs_worker_t *)arg;
+	pfs_pool_t			*pool = worker->pool;
+
+	__atomic_sub_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&pool->lock);
+	job->next = pool->completed;
+	pool->completed = job;
+	pthread_mutex_unlock(&pool->lock);
+
+	pfs_eventfd_signal(pool->event_fd);
+}
+
+static void *
+pfs_worker_main(void *arg)
+{
+	pfs_worker_t		*worker = (pfs_worker_t *)arg;
+	pfs_pool_t			*pool = worker->pool;
+	struct epoll_event	 ev, events[2];
+	pfs_job_t			*job, *next;
+	int					 epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.fd = worker->event_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, worker->event_fd, &ev);
+	ev.data.fd = pfs_engine_fd(worker->engine);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+
+	for (;;) {
+		if (epoll_wait(epfd, events, 2, pfs_engine_timeout(worker->engine)) < 0
+						&& errno != EINTR) {
+			pfs_log(LOG_ERR, "worker epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		pfs_eventfd_clear(worker->event_fd);
+		if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		pthread_mutex_lock(&worker->lock);
+		job = worker->queue_head;
+		worker->queue_head = worker->queue_tail = NULL;
+		pthread_mutex_unlock(&worker->lock);
+
+		for (; job != NULL; job = next) {
+			next = job->next;
+			pfs_engine_submit(worker->engine, job);
+		}
+		pfs_engine_process(worker->engine);
+	}
+
+	close(epfd);
+	return NULL;
+}
+
+pfs_pool_t *
+pfs_pool_new(SPF_client_options_t *opts, int nworkers)
+{
+	pfs_pool_t			*pool;
+	pfs_worker_t		*worker;
+	sigset_t			 all, old;
+	int					 i;
+
+	pool = (pfs_pool_t *)malloc(sizeof(pfs_pool_t));
+	memset(pool, 0, sizeof(pfs_pool_t));
+	pool->opts = opts;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	pool->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool->event_fd < 0) {
+		pfs_log(LOG_ERR, "eventfd: %s\n", strerror(errno));
+		free(pool);
+		return NULL;
+	}
+
+	pool->workers = (pfs_worker_t *)malloc(nworkers * sizeof(pfs_worker_t));
+	memset(pool->workers, 0, nworkers * sizeof(pfs_worker_t));
+
+	/* Signals belong to the event loop, workers must not take them */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < nworkers; i++) {
+		worker = &pool->workers[pool->nworkers];
+		worker->pool = pool;
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		worker->engine = pfs_engine_new(opts, pfs_worker_done, worker);
+		if (worker->event_fd < 0 || worker->engine == NULL
+						|| pthread_create(&worker->thread, NULL,
+								pfs_worker_main, worker) != 0) {
+			pfs_log(LOG_ERR, "Can not start worker %d\n", i);
+			if (worker->engine)
+				pfs_engine_free(worker->engine);
+			if (worker->event_fd >= 0)
+				close(worker->event_fd);
+			pthread_mutex_destroy(&worker->lock);
+			break;
+		}
+		pool->nworkers++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pool->nworkers == 0) {
+		pfs_pool_free(pool);
+		return NULL;
+	}
+
+	pfs_log(LOG_INFO, "Started %d workers\n", pool->nworkers);
+	return pool;
+}
+
+void
+pfs_pool_free(pfs_pool_t *pool)
+{
+	pfs_worker_t		*worker;
+	pfs_job_t			*job;
+	int					 i;
+
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < pool->nworkers; i++)
+		pfs_eventfd_signal(pool->workers[i].event_fd);
+
+	for (i = 0; i < pool->nworkers; i++) {
+		worker = &pool->workers[i];
+		pthread_join(worker->thread, NULL);
+		pfs_engine_free(worker->engine);
+		close(worker->event_fd);
+		pthread_mutex_destroy(&worker->lock);
+
+		/* Jobs which never ran still belong to the pool */
+		while ((job = worker->queue_head) != NULL) {
+			worker->queue_head = job->next;
+			pfs_job_free(job);
+		}
+	}
+
+	close(pool->event_fd);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool);
+}
+
+void
+pfs_pool_submit(pfs_pool_t *pool, pfs_job_t *job)
+{
+	pfs_worker_t		*worker = &pool->workers[0];
+	int					 i, load, best;
+
+	/* A worker stuck on slow domains gets no new work */
+	best = __atomic_load_n(&worker->load, __ATOMIC_RELAXED);
+	for (i = 1; i < pool->nworkers && best > 0; i++) {
+		load = __atomic_load_n(&pool->workers[i].load, __ATOMIC_RELAXED);
+		if (load < best) {
+			best = load;
+			worker = &pool->workers[i];
+		}
+	}
+
+	__atomic_add_fetch(&worker->load, 1, __ATOMIC_RELAXED);
+	job->next = NULL;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->queue_tail)
+		worker->queue_tail->next = job;
+	else
+		worker->queue_head = job;
+	worker->queue_tail = job;
+	pthread_mutex_unlock(&worker->lock);
+
+	pfs_eventfd_signal(worker->event_fd);
+}
+
+int
+pfs_pool_load(pfs_pool_t *pool)
+{
+	int					 i, load = 0;
+
+	for (i = 0; i < pool->nworkers; i++)
+		load += __atomic_load_n(&pool->workers[i].load, __ATOMIC_RELAXED);
+	return load;
+}
+
+uint64_t
+pfs_pool_delay(pfs_pool_t *pool, uint64_t now)
+{
+	uint64_t			 delay, longest = 0;
+	int					 i;
+
+	for (i = 0; i < pool->nworkers; i++) {
+		delay = pfs_engine_delay(pool->workers[i].engine, now);
+		if (delay > longest)
+			longest = delay;
+	}
+	return longest;
+}
+
+int
+pfs_pool_fd(pfs_pool_t *pool)
+{
+	return pool->event_fd;
+}
+
+pfs_job_t *
+pfs_pool_completed(pfs_pool_t *pool)
+{
+	pfs_job_t			*list;
+
+	pfs_eventfd_clear(pool->event_fd);
+
+	pthread_mutex_lock(&pool->lock);
+	list = pool->completed;
+	pool->completed = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	return list;
+}
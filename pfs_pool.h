@@ -0,0 +1,42 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Worker pool for the daemon mode (--workers)
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_POOL_H
+#define PFS_POOL_H
+
+#include "policyd-spf-fs.h"
+#include "pfs_engine.h"
+
+typedef struct pfs_pool_struct pfs_pool_t;
+
+/*
+ * Start nworkers threads, each with its own evaluation engine built
+ * from opts.
+ */
+pfs_pool_t *pfs_pool_new(SPF_client_options_t *opts, int nworkers);
+void pfs_pool_free(pfs_pool_t *pool);
+
+/* Queue a parsed request. The job comes back through pfs_pool_completed. */
+void pfs_pool_submit(pfs_pool_t *pool, pfs_job_t *job);
+
+/*
+ * Readable whenever evaluated jobs are waiting; pfs_pool_completed
+ * clears it and returns the finished jobs as a list linked by next.
+ */
+int pfs_pool_fd(pfs_pool_t *pool);
+pfs_job_t *pfs_pool_completed(pfs_pool_t *pool);
+
+/* Jobs submitted and not yet completed, over all workers */
+int pfs_pool_load(pfs_pool_t *pool);
+/* The longest pfs_engine_delay of the workers */
+uint64_t pfs_pool_delay(pfs_pool_t *pool, uint64_t now);
+
+#endif
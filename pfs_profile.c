@@ -0,0 +1,342 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Cost profile. Every evaluation is charged to its MAIL FROM domain
+ *  ("<>" for bounces) with its wall time, and the domains are ranked by
+ *  the time charged. Counting every domain would take unbounded memory,
+ *  so a space-saving summary keeps PFS_PROFILE_SLACK times as many as
+ *  are reported: a domain not tracked takes over the entry with the
+ *  least time, which is found at the top of a min-heap, and inherits
+ *  that time as its possible error. Any domain which took more than
+ *  1/size of the total time is sure to be tracked. Domains are reported
+ *  by the time they surely took, since they were tracked, so that one
+ *  taking over a long tail of cheap ones does not rank high on the
+ *  tail's time; DNS queries and waits are summed over that time too.
+ *
+ *  All threads charge one summary under a lock, only while the
+ *  profile is on.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_profile.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+
+typedef
+struct pfs_profile_entry_struct {
+	char					 domain[256];
+	uint64_t				 cost;		/* ns of wall time, err included */
+	uint64_t				 err;		/* what the entry had when taken over */
+	uint64_t				 dns_wait;	/* ns */
+	uint32_t				 checks;
+	uint32_t				 dns_queries;
+	int						 next;		/* hash chain, -1: end */
+	int						 heap;		/* position in the heap */
+} pfs_profile_entry_t;
+
+struct pfs_profile_struct {
+	pthread_mutex_t			 lock;
+	int						 top;		/* reported */
+	int						 size;		/* tracked */
+	int						 used;
+	pfs_profile_entry_t		*entries;
+	int						*heap;		/* entries, least cost first */
+	int						*buckets;	/* hash chains */
+	unsigned				 mask;
+	uint64_t				 checks;	/* all of them since the last report */
+	uint64_t				 cost;
+	uint64_t				 since;
+
+	pthread_t				 reporter;
+	int						 running;
+	int						 stop;		/* atomic */
+};
+
+
+static unsigned
+pfs_profile_hash(const char *s)
+{
+	unsigned		 h = 2166136261u;
+
+	/* FNV-1a */
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static void
+pfs_profile_swap(pfs_profile_t *profile, int a, int b)
+{
+	int				 t = profile->heap[a];
+
+	profile->heap[a] = profile->heap[b];
+	profile->heap[b] = t;
+	profile->entries[profile->heap[a]].heap = a;
+	profile->entries[profile->heap[b]].heap = b;
+}
+
+/* The entry at i got more expensive: move it down below cheaper ones */
+static void
+pfs_profile_sift(pfs_profile_t *profile, int i)
+{
+	int				 child;
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= profile->used)
+			return;
+		if (child + 1 < profile->used
+						&& profile->entries[profile->heap[child + 1]].cost
+							< profile->entries[profile->heap[child]].cost)
+			child++;
+		if (profile->entries[profile->heap[i]].cost
+						<= profile->entries[profile->heap[child]].cost)
+			return;
+		pfs_profile_swap(profile, i, child);
+		i = child;
+	}
+}
+
+static void
+pfs_profile_unchain(pfs_profile_t *profile, int e)
+{
+	int				*p;
+
+	p = &profile->buckets[pfs_profile_hash(profile->entries[e].domain) & profile->mask];
+	while (*p != e)
+		p = &profile->entries[*p].next;
+	*p = profile->entries[e].next;
+}
+
+static void
+pfs_profile_reset(pfs_profile_t *profile)
+{
+	memset(profile->buckets, 0xff, (profile->mask + 1) * sizeof(int));
+	profile->used = 0;
+	profile->checks = 0;
+	profile->cost = 0;
+	profile->since = pfs_metrics_now();
+}
+
+pfs_profile_t *
+pfs_profile_new(int top)
+{
+	pfs_profile_t		*profile;
+	unsigned			 nbuckets = 1;
+
+	if (top <= 0)
+		top = PFS_PROFILE_TOP;
+	if (top > PFS_PROFILE_TOP_MAX)
+		top = PFS_PROFILE_TOP_MAX;
+
+	profile = (pfs_profile_t *)calloc(1, sizeof(pfs_profile_t));
+	profile->top = top;
+	profile->size = top * PFS_PROFILE_SLACK;
+	while (nbuckets < 2 * (unsigned)profile->size)
+		nbuckets <<= 1;
+	profile->mask = nbuckets - 1;
+	profile->entries = (pfs_profile_entry_t *)calloc(profile->size, sizeof(pfs_profile_entry_t));
+	profile->heap = (int *)calloc(profile->size, sizeof(int));
+	profile->buckets = (int *)malloc(nbuckets * sizeof(int));
+	pthread_mutex_init(&profile->lock, NULL);
+	pfs_profile_reset(profile);
+	return profile;
+}
+
+void
+pfs_profile_free(pfs_profile_t *profile)
+{
+	pthread_mutex_destroy(&profile->lock);
+	free(profile->entries);
+	free(profile->heap);
+	free(profile->buckets);
+	free(profile);
+}
+
+void
+pfs_profile_add(pfs_profile_t *profile, SPF_client_request_t *req,
+				pfs_metrics_eval_t *eval)
+{
+	pfs_profile_entry_t	*entry;
+	const char			*at;
+	char				 domain[256];
+	uint64_t			 wall = pfs_metrics_now() - eval->start;
+	unsigned			 b;
+	int					 e, i;
+
+	if (req->sender != NULL && (at = strrchr(req->sender, '@')) != NULL && at[1] != '\0')
+		snprintf(domain, sizeof(domain), "%s", at + 1);
+	else if (req->sender == NULL || req->sender[0] == '\0')
+		strcpy(domain, "<>");
+	else
+		return;
+	for (i = 0; domain[i]; i++)
+		domain[i] = tolower((unsigned char)domain[i]);
+	b = pfs_profile_hash(domain) & profile->mask;
+
+	pthread_mutex_lock(&profile->lock);
+	for (e = profile->buckets[b]; e >= 0; e = profile->entries[e].next) {
+		if (strcmp(profile->entries[e].domain, domain) == 0)
+			break;
+	}
+	if (e < 0) {
+		if (profile->used < profile->size) {
+			/* Cost 0 is the least, it belongs at the top */
+			e = profile->used++;
+			entry = &profile->entries[e];
+			entry->cost = entry->err = 0;
+			entry->heap = profile->used - 1;
+			profile->heap[entry->heap] = e;
+			while (entry->heap > 0)
+				pfs_profile_swap(profile, entry->heap, (entry->heap - 1) / 2);
+		}
+		else {
+			/* Take over the cheapest, its time may have been ours */
+			e = profile->heap[0];
+			entry = &profile->entries[e];
+			pfs_profile_unchain(profile, e);
+			entry->err = entry->cost;
+		}
+		strcpy(entry->domain, domain);
+		entry->dns_wait = 0;
+		entry->checks = entry->dns_queries = 0;
+		entry->next = profile->buckets[b];
+		profile->buckets[b] = e;
+	}
+
+	entry = &profile->entries[e];
+	entry->cost += wall;
+	entry->dns_wait += eval->dns_wait;
+	entry->checks++;
+	entry->dns_queries += eval->dns_queries;
+	pfs_profile_sift(profile, entry->heap);
+	profile->checks++;
+	profile->cost += wall;
+	pthread_mutex_unlock(&profile->lock);
+}
+
+static int
+pfs_profile_cmp(const void *a, const void *b)
+{
+	const pfs_profile_entry_t	*ea = (const pfs_profile_entry_t *)a;
+	const pfs_profile_entry_t	*eb = (const pfs_profile_entry_t *)b;
+
+	if (ea->cost - ea->err != eb->cost - eb->err)
+		return ea->cost - ea->err > eb->cost - eb->err ? -1 : 1;
+	return strcmp(ea->domain, eb->domain);
+}
+
+void
+pfs_profile_report(pfs_profile_t *profile, FILE *f)
+{
+	pfs_profile_entry_t	*copy, *entry;
+	char				 line[512];
+	uint64_t			 checks, cost, since;
+	int					 used, i, n;
+
+	copy = (pfs_profile_entry_t *)malloc(profile->size * sizeof(pfs_profile_entry_t));
+	if (copy == NULL)
+		return;
+
+	pthread_mutex_lock(&profile->lock);
+	used = profile->used;
+	memcpy(copy, profile->entries, used * sizeof(pfs_profile_entry_t));
+	checks = profile->checks;
+	cost = profile->cost;
+	since = profile->since;
+	pfs_profile_reset(profile);
+	pthread_mutex_unlock(&profile->lock);
+
+	if (checks == 0) {
+		free(copy);
+		return;
+	}
+	qsort(copy, used, sizeof(pfs_profile_entry_t), pfs_profile_cmp);
+
+	snprintf(line, sizeof(line), "Most expensive sender domains of %llu checks taking %.0f ms in %.1f s:\n",
+					(unsigned long long)checks, cost / 1e6,
+					(pfs_metrics_now() - since) / 1e9);
+	if (f)
+		fputs(line, f);
+	else
+		pfs_log(LOG_INFO, "%s", line);
+
+	for (i = 0; i < used && i < profile->top; i++) {
+		entry = &copy[i];
+		n = snprintf(line, sizeof(line), "%3d. %s: %.0f ms in %u checks, %u DNS queries, %.0f ms waiting for DNS",
+						i + 1, entry->domain, (entry->cost - entry->err) / 1e6, entry->checks,
+						entry->dns_queries, entry->dns_wait / 1e6);
+		if (entry->err > 0 && n > 0 && n < (int)sizeof(line))
+			snprintf(line + n, sizeof(line) - n, ", maybe %.0f ms more before it was tracked",
+							entry->err / 1e6);
+		if (f)
+			fprintf(f, "%s\n", line);
+		else
+			pfs_log(LOG_INFO, "%s\n", line);
+	}
+	free(copy);
+}
+
+static void *
+pfs_profile_thread(void *arg)
+{
+	pfs_profile_t		*profile = (pfs_profile_t *)arg;
+	int					 waited = 0;
+
+	/* Wake up every second to notice pfs_profile_stop */
+	while (!__atomic_load_n(&profile->stop, __ATOMIC_ACQUIRE)) {
+		sleep(1);
+		if (++waited >= PFS_PROFILE_INTERVAL) {
+			pfs_profile_report(profile, NULL);
+			waited = 0;
+		}
+	}
+	return NULL;
+}
+
+int
+pfs_profile_start(pfs_profile_t *profile)
+{
+	sigset_t			 all, old;
+
+	/* Signals are for the main thread, the reporter inherits the mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&profile->reporter, NULL, pfs_profile_thread, profile) != 0) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		pfs_log(LOG_ERR, "Can not start the profile thread\n");
+		return -1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	profile->running = 1;
+	return 0;
+}
+
+void
+pfs_profile_stop(pfs_profile_t *profile)
+{
+	if (!profile->running)
+		return;
+	__atomic_store_n(&profile->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(profile->reporter, NULL);
+	profile->running = 0;
+	/* What the last interval had so far */
+	pfs_profile_report(profile, NULL);
+}
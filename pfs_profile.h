@@ -0,0 +1,49 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Cost profile (--top-domains): the sender domains the checks spend
+ *  their time and DNS queries on, reported every few minutes.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_PROFILE_H
+#define PFS_PROFILE_H
+
+#include <stdio.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_metrics.h"
+
+/* Seconds covered by one report */
+#define PFS_PROFILE_INTERVAL	300
+/* Domains reported by default, and at most */
+#define PFS_PROFILE_TOP			20
+#define PFS_PROFILE_TOP_MAX		1000
+/* Domains tracked per domain reported */
+#define PFS_PROFILE_SLACK		8
+
+pfs_profile_t *pfs_profile_new(int top);
+void pfs_profile_free(pfs_profile_t *profile);
+
+/* Charge the evaluation of req, which has just ended, to its sender domain */
+void pfs_profile_add(pfs_profile_t *profile, SPF_client_request_t *req,
+				pfs_metrics_eval_t *eval);
+
+/*
+ * Write the most expensive domains since the last report to f, or to
+ * syslog if f is NULL, and start over.
+ */
+void pfs_profile_report(pfs_profile_t *profile, FILE *f);
+
+/*
+ * Report to syslog every PFS_PROFILE_INTERVAL seconds from a thread of
+ * its own; pfs_profile_stop reports once more.
+ */
+int pfs_profile_start(pfs_profile_t *profile);
+void pfs_profile_stop(pfs_profile_t *profile);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Batch mode. Recorded requests are read as fast as the workers take
+ *  them: the same thread pool, engines and shared caches as in daemon
+ *  mode evaluate them, so a replay of production traffic shows what
+ *  the daemon would do with it. Answers are written in input order;
+ *  requests may run ahead of the oldest unanswered one by a window of
+ *  twice what the workers evaluate at once.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#define _GNU_SOURCE		/* getline */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_engine.h"
+#include "pfs_pool.h"
+#include "pfs_replay.h"
+#include "pfs_metrics.h"
+#include "pfs_profile.h"
+#include "pfs_log.h"
+
+/* Processes whose logged requests may be in the middle at one time */
+#define PFS_REPLAY_PROCS	64
+
+#define X_OR_DASH(x) ((x) ? (x) : "-")
+
+/* Lines of one request collected so far */
+typedef
+struct pfs_replay_text_struct {
+	char			 key[32];	/* [pid] of logged lines */
+	char			*buf;
+	size_t			 len;
+	size_t			 size;
+	unsigned long	 used;		/* line last added */
+} pfs_replay_text_t;
+
+typedef
+struct pfs_replay_slot_struct {
+	pfs_job_t		*job;
+	int				 done;
+} pfs_replay_slot_t;
+
+typedef
+struct pfs_replay_struct {
+	SPF_client_options_t	*opts;
+	pfs_pool_t			*pool;
+	FILE				*fp;
+	int					 eof;
+	int					 logged;	/* input is a log: skip other lines */
+	unsigned long		 lines;
+
+	pfs_replay_text_t	 raw;
+	pfs_replay_text_t	 procs[PFS_REPLAY_PROCS];
+	int					 nprocs;
+
+	pfs_replay_slot_t	*window;
+	unsigned long		 nwindow;
+	unsigned long		 submitted;
+	unsigned long		 written;
+	unsigned long		 skipped;
+
+	uint32_t			*times;		/* us per evaluation */
+	size_t				 ntimes;
+	size_t				 times_size;
+} pfs_replay_t;
+
+
+static void
+pfs_replay_append(pfs_replay_text_t *t, const char *s, size_t len)
+{
+	if (t->len + len + 2 > t->size) {
+		t->size = t->len + len + 2 + 256;
+		t->buf = (char *)realloc(t->buf, t->size);
+		if (t->buf == NULL) {
+			pfs_log(LOG_ERR, "Out of memory for a request\n");
+			abort();
+		}
+	}
+	memcpy(t->buf + t->len, s, len);
+	t->len += len;
+	t->buf[t->len++] = '\n';
+}
+
+/*
+ * The lines collected in t make a request: parse it and hand it to
+ * the workers. Returns 1 if a request was submitted.
+ */
+static int
+pfs_replay_submit(pfs_replay_t *r, pfs_replay_text_t *t)
+{
+	SPF_client_request_t	 req;
+	pfs_replay_slot_t		*slot;
+	pfs_job_t				*job;
+	int						 args = 0;
+
+	if (t->len == 0)
+		return 0;
+	/* The empty line which ends it */
+	pfs_replay_append(t, "", 0);
+
+	memset(&req, 0, sizeof(req));
+	if (pf_parse_request(r->opts, &req, t->buf, t->len, &args) == 0 || args == 0) {
+		r->skipped++;
+		t->len = 0;
+		return 0;
+	}
+
+	job = pfs_job_new();
+	job->next = job->conn_next = NULL;
+	job->flight_next = job->followers = NULL;
+	job->engine = NULL;
+	job->done = job->memo = 0;
+	job->start = pfs_metrics_now();
+	job->response[0] = '\0';
+	pf_request_copy(&job->req, &req, &job->arena);
+	t->len = 0;
+
+	slot = &r->window[r->submitted % r->nwindow];
+	slot->job = job;
+	slot->done = 0;
+	job->owner = slot;
+	r->submitted++;
+	pfs_pool_submit(r->pool, job);
+	return 1;
+}
+
+/* The collector for logged lines of the process tagged key */
+static pfs_replay_text_t *
+pfs_replay_proc(pfs_replay_t *r, const char *key, size_t len)
+{
+	pfs_replay_text_t	*t;
+	int					 i, j;
+
+	if (len >= sizeof(t->key))
+		len = sizeof(t->key) - 1;
+	for (i = 0; i < r->nprocs; i++) {
+		t = &r->procs[i];
+		if (strlen(t->key) == len && memcmp(t->key, key, len) == 0)
+			return t;
+	}
+	/* Reuse one which is between requests, or take a new one */
+	for (i = 0; i < r->nprocs && r->procs[i].len > 0; i++)
+		;
+	if (i == PFS_REPLAY_PROCS) {
+		/* All busy: the one quiet longest lost the end of its request */
+		for (i = 0, j = 1; j < r->nprocs; j++)
+			if (r->procs[j].used < r->procs[i].used)
+				i = j;
+		r->procs[i].len = 0;
+		r->skipped++;
+	}
+	if (i == r->nprocs)
+		r->nprocs++;
+	t = &r->procs[i];
+	memcpy(t->key, key, len);
+	t->key[len] = '\0';
+	return t;
+}
+
+/*
+ * Read lines until a request is complete and submitted, or the input
+ * ends. A line carrying "--> " is a logged request line, anything else
+ * a line of a plain request until the first logged one is seen. At the
+ * end of the input each call submits one of the requests left
+ * unfinished, and r->eof is set once there are none.
+ */
+static void
+pfs_replay_read(pfs_replay_t *r)
+{
+	static char			*line;
+	static size_t		 line_size;
+	pfs_replay_text_t	*t;
+	ssize_t				 n;
+	char				*text, *mark, *open, *close;
+	int					 i;
+
+	while ((n = getline(&line, &line_size, r->fp)) >= 0) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+
+		t = &r->raw;
+		text = line;
+		mark = strstr(line, "-->");
+		if (mark != NULL && (mark[3] == ' ' || mark[3] == '\0')) {
+			/* "... policyd-spf-fs[1234]: --> sender=..." */
+			open = NULL;
+			for (close = mark; close > line && close[-1] != ']'; close--)
+				;
+			if (close > line) {
+				for (open = close - 1; open > line && open[-1] != '['; open--)
+					;
+				if (open == line)
+					open = NULL;
+			}
+			t = open ? pfs_replay_proc(r, open, close - 1 - open)
+						: pfs_replay_proc(r, "", 0);
+			text = mark[3] ? mark + 4 : mark + 3;
+			r->logged = 1;
+		}
+		else if (r->logged)
+			continue;
+
+		t->used = ++r->lines;
+		if (*text != '\0')
+			pfs_replay_append(t, text, strlen(text));
+		else if (pfs_replay_submit(r, t))
+			return;
+	}
+
+	/*
+	 * Whatever is left without its empty line still counts, one request
+	 * a call like the others, so that the window is not overrun
+	 */
+	if (pfs_replay_submit(r, &r->raw))
+		return;
+	for (i = 0; i < r->nprocs; i++) {
+		if (pfs_replay_submit(r, &r->procs[i]))
+			return;
+	}
+	r->eof = 1;
+	free(line);
+	line = NULL;
+}
+
+static void
+pfs_replay_print(pfs_replay_t *r, unsigned long n, pfs_job_t *job)
+{
+	SPF_client_request_t	*req = &job->req;
+	const char				*action = "", *p, *result = "-";
+	int						 action_len = 0, result_len = 1, i;
+	static const char		*results[] = { "pass", "fail", "softfail", "neutral",
+							"none", "temperror", "permerror", NULL };
+
+	for (p = job->response; (p = strstr(p, "action=")) != NULL; p += 7)
+		action = p + 7;
+	action_len = strcspn(action, "\n");
+	/* Other X-Received-SPF headers explain why SPF was not checked */
+	if ((p = strstr(job->response, "PREPEND X-Received-SPF: ")) != NULL) {
+		p += 24;
+		for (i = 0; results[i]; i++) {
+			if (strncmp(p, results[i], strlen(results[i])) == 0
+							&& p[strlen(results[i])] == ' ') {
+				result = results[i];
+				result_len = strlen(result);
+				break;
+			}
+		}
+	}
+
+	printf("%lu\t%.3f\t%s\t%s\t%s\t%.*s\t%.*s\n", n, job->elapsed / 1e6,
+					X_OR_DASH(req->ip), X_OR_DASH(req->sender), X_OR_DASH(req->helo),
+					result_len, result, action_len, action);
+
+	if (r->ntimes == r->times_size) {
+		r->times_size = r->times_size ? r->times_size * 2 : 65536;
+		r->times = (uint32_t *)realloc(r->times, r->times_size * sizeof(uint32_t));
+	}
+	if (r->times != NULL)
+		r->times[r->ntimes++] = job->elapsed / 1000;
+}
+
+/* Print the answers which are next in input order */
+static void
+pfs_replay_write(pfs_replay_t *r)
+{
+	pfs_replay_slot_t	*slot;
+
+	while (r->written < r->submitted
+					&& (slot = &r->window[r->written % r->nwindow])->done) {
+		r->written++;
+		pfs_replay_print(r, r->written, slot->job);
+		pfs_job_free(slot->job);
+		slot->job = NULL;
+	}
+}
+
+static int
+pfs_replay_cmp(const void *a, const void *b)
+{
+	uint32_t			 x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+pfs_replay_pct(pfs_replay_t *r, int pct)
+{
+	size_t				 i = r->ntimes * pct / 100;
+
+	if (i >= r->ntimes)
+		i = r->ntimes - 1;
+	return r->times[i] / 1e3;
+}
+
+static void
+pfs_replay_summary(pfs_replay_t *r, int workers, uint64_t start)
+{
+	double				 secs = (pfs_metrics_now() - start) / 1e9;
+
+	fprintf(stderr, "%lu requests (%lu skipped) in %.2f s, %.0f per second on %d threads\n",
+					r->written, r->skipped, secs, secs > 0 ? r->written / secs : 0.0, workers);
+	if (r->ntimes == 0)
+		return;
+	qsort(r->times, r->ntimes, sizeof(uint32_t), pfs_replay_cmp);
+	fprintf(stderr, "evaluation ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+					pfs_replay_pct(r, 50), pfs_replay_pct(r, 90),
+					pfs_replay_pct(r, 99), r->times[r->ntimes - 1] / 1e3);
+}
+
+int
+pfs_replay_run(SPF_client_options_t *opts, const char *path)
+{
+	pfs_replay_t		 r;
+	struct pollfd		 pfd;
+	pfs_job_t			*job, *next;
+	uint64_t			 start = pfs_metrics_now();
+	int					 workers, i;
+
+	memset(&r, 0, sizeof(r));
+	r.opts = opts;
+
+	if (strcmp(path, "-") == 0)
+		r.fp = stdin;
+	else if ((r.fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "Can not read %s: %s\n", path, strerror(errno));
+		return 255;
+	}
+
+	workers = opts->workers;
+	if (workers <= 0)
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers <= 0)
+		workers = 1;
+	r.pool = pfs_pool_new(opts, workers);
+	if (r.pool == NULL) {
+		fprintf(stderr, "Can not start worker threads, see syslog\n");
+		if (r.fp != stdin)
+			fclose(r.fp);
+		return 255;
+	}
+	r.nwindow = 2UL * workers * opts->max_inflight;
+	r.window = (pfs_replay_slot_t *)calloc(r.nwindow, sizeof(pfs_replay_slot_t));
+
+	pfd.fd = pfs_pool_fd(r.pool);
+	pfd.events = POLLIN;
+
+	while (!r.eof || r.written < r.submitted) {
+		while (!r.eof && r.submitted - r.written < r.nwindow)
+			pfs_replay_read(&r);
+		if (r.written == r.submitted)
+			continue;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		for (job = pfs_pool_completed(r.pool); job != NULL; job = next) {
+			next = job->next;
+			((pfs_replay_slot_t *)job->owner)->done = 1;
+		}
+		pfs_replay_write(&r);
+	}
+	fflush(stdout);
+
+	pfs_replay_summary(&r, workers, start);
+	if (opts->profile)
+		pfs_profile_report(opts->profile, stderr);
+
+	pfs_pool_free(r.pool);
+	for (i = 0; i < (int)r.nwindow; i++) {
+		if (r.window[i].job != NULL)
+			pfs_job_free(r.window[i].job);
+	}
+	free(r.window);
+	free(r.times);
+	free(r.raw.buf);
+	for (i = 0; i < r.nprocs; i++)
+		free(r.procs[i].buf);
+	if (r.fp != stdin)
+		fclose(r.fp);
+	return 0;
+}
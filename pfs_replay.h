@@ -0,0 +1,32 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Batch mode (--file): evaluate recorded requests offline.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_REPLAY_H
+#define PFS_REPLAY_H
+
+#include "policyd-spf-fs.h"
+
+/*
+ * Evaluate every request in path ("-" for stdin) on --workers threads
+ * (default: one per CPU) and print one line per request to stdout, in
+ * input order:
+ *
+ *   number  ms  client_address  sender  helo_name  spf-result  action
+ *
+ * fields separated by tabs, ms being the time the evaluation took. A
+ * summary goes to stderr. The file holds policy requests as postfix
+ * sends them, or the "--> " lines logged with --debug=2 (syslog lines
+ * of different processes are kept apart by their [pid]).
+ * Returns the exit code.
+ */
+int pfs_replay_run(SPF_client_options_t *opts, const char *path);
+
+#endif
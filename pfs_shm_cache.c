@@ -0,0 +1,355 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Shared memory result cache. The file is mapped by every instance,
+ *  spawned by postfix or running as daemon, and holds a fixed number of
+ *  slots grouped in sets of PFS_SHM_WAYS. A slot carries a sequence
+ *  number: readers never lock, they copy the slot and retry when the
+ *  sequence changed under them. A writer claims a slot by making the
+ *  sequence odd and gives up if someone else holds it, so a process
+ *  dying in the middle of a write costs one slot for a few seconds and
+ *  never blocks the others. The time of the claim shares one word with
+ *  the sequence, so that a slot is claimed or taken over from a dead
+ *  writer in one step, and a writer only ends a claim still its own.
+ *
+ *  The sender's local part is not part of the key. It does show up in
+ *  the Received-SPF text and in explanations, so those are stored with
+ *  the sender replaced by a marker and filled in again on a hit. The
+ *  caller keeps results of records which look at it out of the cache.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_shm_cache.h"
+#include "pfs_template.h"
+#include "pfs_log.h"
+
+#define PFS_SHM_MAGIC		0x50465343	/* "PFSC" */
+#define PFS_SHM_VERSION		2
+#define PFS_SHM_HEADER		4096
+#define PFS_SHM_SLOT		1024
+#define PFS_SHM_WAYS		4
+#define PFS_SHM_DEFAULT		(16 * 1024 * 1024)
+/* A writer holding a slot longer than this has died */
+#define PFS_SHM_STALE		5
+
+/* The lock word of a slot: sequence below, time of the claim above */
+#define PFS_SHM_SEQ(l)		((uint32_t)(l))
+#define PFS_SHM_CLAIMED(l)	((uint32_t)((l) >> 32))
+#define PFS_SHM_LOCK(seq, t)	(((uint64_t)(uint32_t)(t) << 32) | (uint32_t)(seq))
+
+typedef
+struct pfs_shm_header_struct {
+	uint32_t		 magic;
+	uint32_t		 version;
+	uint32_t		 slot_size;
+	uint32_t		 nslots;
+} pfs_shm_header_t;
+
+typedef
+struct pfs_shm_slot_struct {
+	uint64_t		 lock;		/* sequence, odd while being written */
+	uint64_t		 hash;		/* 0: empty */
+	int64_t			 expires;
+	uint16_t		 key_len;
+	uint16_t		 received_len;
+	uint16_t		 comment_len;
+	uint8_t			 result;
+	uint8_t			 pad;
+	char			 data[PFS_SHM_SLOT - 32];
+} pfs_shm_slot_t;
+
+struct pfs_shm_cache_struct {
+	char			*base;
+	size_t			 size;
+	uint32_t		 nsets;
+	uint64_t		 seed;		/* hash of the fingerprint */
+	pfs_shm_slot_t	*slots;
+};
+
+
+static uint64_t
+pfs_shm_hash(uint64_t h, const char *s, size_t len)
+{
+	size_t		 i;
+
+	/* FNV-1a */
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static size_t
+pfs_shm_parse_size(const char *s)
+{
+	char		*end;
+	size_t		 size;
+
+	size = strtoul(s, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': size <<= 10; break;
+		case 'm': case 'M': size <<= 20; break;
+		case 'g': case 'G': size <<= 30; break;
+	}
+	return size;
+}
+
+/*
+ * Build the lookup key "ip domain helo", lower case.
+ * Returns its length, or 0 if it does not fit or there is no sender.
+ */
+static size_t
+pfs_shm_key(SPF_client_request_t *req, char *key, size_t keylen)
+{
+	const char	*domain;
+	size_t		 i;
+	int			 n;
+
+	if (req->ip == NULL || req->sender == NULL
+					|| (domain = strrchr(req->sender, '@')) == NULL)
+		return 0;
+
+	n = snprintf(key, keylen, "%s %s %s", req->ip, domain + 1,
+					req->helo ? req->helo : "");
+	if (n < 0 || (size_t)n >= keylen)
+		return 0;
+	for (i = 0; i < (size_t)n; i++)
+		key[i] = tolower((unsigned char)key[i]);
+	return n;
+}
+
+pfs_shm_cache_t *
+pfs_shm_cache_open(const char *spec, const char *fingerprint)
+{
+	pfs_shm_cache_t		*cache;
+	pfs_shm_header_t	*hdr;
+	struct stat			 st;
+	char				 path[1024];
+	const char			*comma;
+	size_t				 size = PFS_SHM_DEFAULT;
+	uint32_t			 nslots;
+	int					 fd;
+	void				*base;
+
+	comma = strchr(spec, ',');
+	if (comma) {
+		size = pfs_shm_parse_size(comma + 1);
+		snprintf(path, sizeof(path), "%.*s", (int)(comma - spec), spec);
+	}
+	else
+		snprintf(path, sizeof(path), "%s", spec);
+
+	if (size < PFS_SHM_HEADER + PFS_SHM_WAYS * PFS_SHM_SLOT) {
+		pfs_log(LOG_ERR, "Shared cache size too small: %s\n", spec);
+		return NULL;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		pfs_log(LOG_ERR, "open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	/* One process sets the file up, the others wait for it */
+	flock(fd, LOCK_EX);
+
+	if (fstat(fd, &st) < 0) {
+		pfs_log(LOG_ERR, "fstat %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+	/* An existing cache keeps its size, whoever created it */
+	if ((size_t)st.st_size >= PFS_SHM_HEADER + PFS_SHM_WAYS * PFS_SHM_SLOT)
+		size = st.st_size;
+	else if (ftruncate(fd, size) < 0) {
+		pfs_log(LOG_ERR, "ftruncate %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		pfs_log(LOG_ERR, "mmap %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	nslots = (size - PFS_SHM_HEADER) / PFS_SHM_SLOT;
+	nslots -= nslots % PFS_SHM_WAYS;
+
+	hdr = (pfs_shm_header_t *)base;
+	if (hdr->magic != PFS_SHM_MAGIC || hdr->version != PFS_SHM_VERSION
+					|| hdr->slot_size != PFS_SHM_SLOT || hdr->nslots != nslots) {
+		memset(base, 0, size);
+		hdr->version = PFS_SHM_VERSION;
+		hdr->slot_size = PFS_SHM_SLOT;
+		hdr->nslots = nslots;
+		__atomic_store_n(&hdr->magic, PFS_SHM_MAGIC, __ATOMIC_RELEASE);
+		pfs_log(LOG_INFO, "Initialized shared cache %s, %u entries\n", path, nslots);
+	}
+
+	flock(fd, LOCK_UN);
+	close(fd);
+
+	cache = (pfs_shm_cache_t *)malloc(sizeof(pfs_shm_cache_t));
+	memset(cache, 0, sizeof(pfs_shm_cache_t));
+	cache->base = base;
+	cache->size = size;
+	cache->nsets = nslots / PFS_SHM_WAYS;
+	cache->slots = (pfs_shm_slot_t *)((char *)base + PFS_SHM_HEADER);
+	cache->seed = pfs_shm_hash(0xcbf29ce484222325ULL, fingerprint, strlen(fingerprint));
+	return cache;
+
+  fail:
+	flock(fd, LOCK_UN);
+	close(fd);
+	return NULL;
+}
+
+void
+pfs_shm_cache_close(pfs_shm_cache_t *cache)
+{
+	munmap(cache->base, cache->size);
+	free(cache);
+}
+
+int
+pfs_shm_cache_get(pfs_shm_cache_t *cache, SPF_client_request_t *req,
+				char *received_spf, char *comment, size_t len)
+{
+	char			 key[256];
+	pfs_shm_slot_t	 copy, *set, *slot;
+	uint64_t		 hash, lock;
+	size_t			 klen;
+	int				 i, tries;
+
+	klen = pfs_shm_key(req, key, sizeof(key));
+	if (klen == 0)
+		return -1;
+	hash = pfs_shm_hash(cache->seed, key, klen) | 1;
+	set = &cache->slots[(hash >> 1) % cache->nsets * PFS_SHM_WAYS];
+
+	for (i = 0; i < PFS_SHM_WAYS; i++) {
+		slot = &set[i];
+		if (__atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash)
+			continue;
+
+		for (tries = 0; tries < 3; tries++) {
+			lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+			if (PFS_SHM_SEQ(lock) & 1)
+				break;
+			memcpy(&copy, slot, sizeof(copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == lock)
+				break;
+		}
+		if ((PFS_SHM_SEQ(lock) & 1) || tries == 3)
+			continue;
+
+		if (copy.hash != hash || copy.expires <= time(NULL)
+						|| copy.key_len != klen
+						|| (size_t)copy.key_len + copy.received_len + copy.comment_len
+									> sizeof(copy.data)
+						|| memcmp(copy.data, key, klen) != 0)
+			continue;
+
+		pfs_template_expand(copy.data + klen, copy.received_len,
+						(const char **)&req->sender, 1, received_spf, len);
+		pfs_template_expand(copy.data + klen + copy.received_len, copy.comment_len,
+						(const char **)&req->sender, 1, comment, len);
+		return copy.result;
+	}
+
+	return -1;
+}
+
+void
+pfs_shm_cache_put(pfs_shm_cache_t *cache, SPF_client_request_t *req,
+				int result, long ttl, const char *received_spf, const char *comment)
+{
+	char			 key[256];
+	char			 data[sizeof(((pfs_shm_slot_t *)0)->data)];
+	pfs_shm_slot_t	*set, *slot = NULL;
+	uint64_t		 hash, lock, claim;
+	uint32_t		 seq;
+	time_t			 now = time(NULL);
+	size_t			 klen;
+	int				 rlen, clen;
+	int				 i;
+
+	if (ttl == 0)
+		return;
+	if (ttl < 0 || ttl > PFS_SHM_CACHE_TTL)
+		ttl = PFS_SHM_CACHE_TTL;
+	klen = pfs_shm_key(req, key, sizeof(key));
+	if (klen == 0)
+		return;
+	memcpy(data, key, klen);
+	rlen = pfs_template_make(received_spf ? received_spf : "",
+					(const char **)&req->sender, NULL, 1, data + klen, sizeof(data) - klen);
+	if (rlen < 0)
+		return;
+	clen = pfs_template_make(comment ? comment : "",
+					(const char **)&req->sender, NULL, 1, data + klen + rlen, sizeof(data) - klen - rlen);
+	if (clen < 0)
+		return;
+
+	hash = pfs_shm_hash(cache->seed, key, klen) | 1;
+	set = &cache->slots[(hash >> 1) % cache->nsets * PFS_SHM_WAYS];
+
+	/* Same key, else an expired slot, else the one expiring first */
+	for (i = 0; i < PFS_SHM_WAYS; i++) {
+		if (__atomic_load_n(&set[i].hash, __ATOMIC_RELAXED) == hash) {
+			slot = &set[i];
+			break;
+		}
+		if (slot == NULL || set[i].expires < slot->expires)
+			slot = &set[i];
+	}
+
+	lock = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+	seq = PFS_SHM_SEQ(lock);
+	if (seq & 1) {
+		if ((uint32_t)now - PFS_SHM_CLAIMED(lock) < PFS_SHM_STALE)
+			return;
+		/* The writer is gone, take over and stay odd */
+		claim = PFS_SHM_LOCK(seq + 2, now);
+	}
+	else
+		claim = PFS_SHM_LOCK(seq + 1, now);
+	if (!__atomic_compare_exchange_n(&slot->lock, &lock, claim, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->hash = hash;
+	slot->expires = now + ttl;
+	slot->key_len = klen;
+	slot->received_len = rlen;
+	slot->comment_len = clen;
+	slot->result = result;
+	memcpy(slot->data, data, klen + rlen + clen);
+
+	/* Unless someone took it over, thinking we were gone */
+	__atomic_compare_exchange_n(&slot->lock, &claim,
+					PFS_SHM_LOCK(PFS_SHM_SEQ(claim) + 1, now), 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
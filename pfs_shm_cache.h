@@ -0,0 +1,47 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Result cache in shared memory (--shm-cache), shared by every
+ *  policyd-spf-fs process on the machine.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_SHM_CACHE_H
+#define PFS_SHM_CACHE_H
+
+#include "policyd-spf-fs.h"
+
+/* Longest a result is reused, the DNS answers behind it may expire sooner */
+#define PFS_SHM_CACHE_TTL	300
+
+/*
+ * Map the cache described by spec ("/dev/shm/name[,size]", size may end
+ * in k, M or G), creating the file if needed. Results stored under a
+ * different fingerprint (the options which shape a response) are not
+ * seen. Returns NULL and logs to syslog on failure.
+ */
+pfs_shm_cache_t *pfs_shm_cache_open(const char *spec, const char *fingerprint);
+void pfs_shm_cache_close(pfs_shm_cache_t *cache);
+
+/*
+ * Look up the result for (ip, sender domain, helo) of req. On a hit the
+ * Received-SPF text and the comment are filled in for req's sender and
+ * the SPF result is returned, otherwise -1.
+ */
+int pfs_shm_cache_get(pfs_shm_cache_t *cache, SPF_client_request_t *req,
+				char *received_spf, char *comment, size_t len);
+
+/*
+ * Store a result for ttl seconds, the shortest TTL of the DNS answers it
+ * was made from (-1 if there were none), at most PFS_SHM_CACHE_TTL.
+ * Never waits: if another process is writing the same slot the result
+ * is simply not cached.
+ */
+void pfs_shm_cache_put(pfs_shm_cache_t *cache, SPF_client_request_t *req,
+				int result, long ttl, const char *received_spf, const char *comment);
+
+#endif
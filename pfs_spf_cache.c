@@ -0,0 +1,425 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Compiled SPF record cache. libspf2 compiles the text of a record
+ *  into mechanism and modifier blocks every time SPF_server_get_record
+ *  is called, for the sender domain and again for every include: and
+ *  redirect= target. This layer takes over get_spf: it fetches the TXT
+ *  record as libspf2 would, then looks for the compiled blocks under a
+ *  hash of domain and record text. The text is part of the key, so a
+ *  changed record is compiled afresh as soon as the DNS cache has it.
+ *
+ *  Entries live until the TTL of the TXT record they were compiled
+ *  from, and every stripe keeps its share of the memory budget by
+ *  dropping its least recently used entries.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+#include "spf_dns_rr.h"
+#include "spf_record.h"
+#include "spf_response.h"
+
+#include "pfs_spf_cache.h"
+#include "pfs_metrics.h"
+#include "pfs_netblock.h"
+#include "pfs_log.h"
+
+#define PFS_SPF_CACHE_BUCKETS	4096	/* power of two */
+#define PFS_SPF_CACHE_STRIPES	16
+
+#define PFS_SPF_VERSION			"v=spf1"
+
+typedef
+struct pfs_spf_entry_struct {
+	struct pfs_spf_entry_struct	*next;		/* hash chain */
+	struct pfs_spf_entry_struct	*lru_prev;
+	struct pfs_spf_entry_struct	*lru_next;
+	uint64_t		 hash;
+	time_t			 expires;
+	size_t			 size;		/* of the whole entry */
+
+	/* The compiled record, blocks follow the entry */
+	unsigned char	 version;
+	unsigned char	 num_mech;
+	unsigned char	 num_mod;
+	unsigned char	 num_dns_mech;
+	size_t			 mech_len;
+	size_t			 mod_len;
+	size_t			 text_len;
+	char			 data[];		/* mechanisms, modifiers, text */
+} pfs_spf_entry_t;
+
+typedef
+struct pfs_spf_stripe_struct {
+	pthread_mutex_t	 lock;
+	pfs_spf_entry_t	*lru_head;		/* most recently used */
+	pfs_spf_entry_t	*lru_tail;
+	size_t			 bytes;
+} pfs_spf_stripe_t;
+
+struct pfs_spf_cache_struct {
+	pfs_spf_stripe_t stripe[PFS_SPF_CACHE_STRIPES];
+	pfs_spf_entry_t	*bucket[PFS_SPF_CACHE_BUCKETS];
+	size_t			 stripe_budget;
+};
+
+
+static uint64_t
+pfs_spf_cache_hash(const char *domain, const char *text)
+{
+	uint64_t		 h = 0xcbf29ce484222325ULL;
+
+	/* Domains are case insensitive, the record text is not */
+	for (; *domain; domain++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*domain)) * 0x100000001b3ULL;
+	h = (h ^ 0) * 0x100000001b3ULL;
+	for (; *text; text++)
+		h = (h ^ (unsigned char)*text) * 0x100000001b3ULL;
+	return h;
+}
+
+static void
+pfs_spf_lru_unlink(pfs_spf_stripe_t *s, pfs_spf_entry_t *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		s->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		s->lru_tail = e->lru_prev;
+}
+
+static void
+pfs_spf_lru_push(pfs_spf_stripe_t *s, pfs_spf_entry_t *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = s->lru_head;
+	if (s->lru_head)
+		s->lru_head->lru_prev = e;
+	else
+		s->lru_tail = e;
+	s->lru_head = e;
+}
+
+/* Unlink e from its chain and the LRU list; with the stripe locked */
+static void
+pfs_spf_cache_drop(pfs_spf_cache_t *cache, pfs_spf_stripe_t *s, pfs_spf_entry_t *e)
+{
+	pfs_spf_entry_t		**pp;
+
+	for (pp = &cache->bucket[e->hash & (PFS_SPF_CACHE_BUCKETS - 1)]; *pp; pp = &(*pp)->next) {
+		if (*pp == e) {
+			*pp = e->next;
+			break;
+		}
+	}
+	pfs_spf_lru_unlink(s, e);
+	s->bytes -= e->size;
+	free(e);
+}
+
+static SPF_record_t *
+pfs_spf_cache_copy(SPF_server_t *spf_server, const pfs_spf_entry_t *e)
+{
+	SPF_record_t		*rec;
+
+	rec = (SPF_record_t *)calloc(1, sizeof(SPF_record_t));
+	if (rec == NULL)
+		return NULL;
+	rec->spf_server = spf_server;
+	rec->version = e->version;
+	rec->num_mech = e->num_mech;
+	rec->num_mod = e->num_mod;
+	rec->num_dns_mech = e->num_dns_mech;
+
+	/* SPF_record_free releases these with free() */
+	if (e->mech_len) {
+		rec->mech_first = (SPF_mech_t *)malloc(e->mech_len);
+		if (rec->mech_first == NULL)
+			goto fail;
+		memcpy(rec->mech_first, e->data, e->mech_len);
+		rec->mech_size = rec->mech_len = e->mech_len;
+	}
+	if (e->mod_len) {
+		rec->mod_first = (SPF_mod_t *)malloc(e->mod_len);
+		if (rec->mod_first == NULL)
+			goto fail;
+		memcpy(rec->mod_first, e->data + e->mech_len, e->mod_len);
+		rec->mod_size = rec->mod_len = e->mod_len;
+	}
+	return rec;
+
+  fail:
+	SPF_record_free(rec);
+	return NULL;
+}
+
+static SPF_record_t *
+pfs_spf_cache_get(pfs_spf_cache_t *cache, SPF_server_t *spf_server,
+				uint64_t hash, const char *text)
+{
+	pfs_spf_stripe_t	*s = &cache->stripe[hash % PFS_SPF_CACHE_STRIPES];
+	pfs_spf_entry_t		*e;
+	SPF_record_t		*rec = NULL;
+	size_t				 text_len = strlen(text);
+	time_t				 now = time(NULL);
+
+	pthread_mutex_lock(&s->lock);
+	for (e = cache->bucket[hash & (PFS_SPF_CACHE_BUCKETS - 1)]; e; e = e->next) {
+		if (e->hash != hash || e->text_len != text_len
+						|| memcmp(e->data + e->mech_len + e->mod_len, text, text_len) != 0)
+			continue;
+		if (e->expires <= now) {
+			pfs_spf_cache_drop(cache, s, e);
+			break;
+		}
+		pfs_spf_lru_unlink(s, e);
+		pfs_spf_lru_push(s, e);
+		rec = pfs_spf_cache_copy(spf_server, e);
+		break;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return rec;
+}
+
+static void
+pfs_spf_cache_put(pfs_spf_cache_t *cache, uint64_t hash, const char *text,
+				SPF_record_t *rec, time_t expires)
+{
+	pfs_spf_stripe_t	*s = &cache->stripe[hash % PFS_SPF_CACHE_STRIPES];
+	pfs_spf_entry_t		*e, **pp;
+	size_t				 text_len = strlen(text);
+	size_t				 size;
+
+	size = sizeof(pfs_spf_entry_t) + rec->mech_len + rec->mod_len + text_len;
+	if (size > cache->stripe_budget)
+		return;
+	e = (pfs_spf_entry_t *)malloc(size);
+	if (e == NULL)
+		return;
+
+	e->hash = hash;
+	e->expires = expires;
+	e->size = size;
+	e->version = rec->version;
+	e->num_mech = rec->num_mech;
+	e->num_mod = rec->num_mod;
+	e->num_dns_mech = rec->num_dns_mech;
+	e->mech_len = rec->mech_len;
+	e->mod_len = rec->mod_len;
+	e->text_len = text_len;
+	if (rec->mech_len)
+		memcpy(e->data, rec->mech_first, rec->mech_len);
+	if (rec->mod_len)
+		memcpy(e->data + rec->mech_len, rec->mod_first, rec->mod_len);
+	memcpy(e->data + rec->mech_len + rec->mod_len, text, text_len);
+
+	pthread_mutex_lock(&s->lock);
+	/* Another thread may have compiled the same record meanwhile */
+	for (pp = &cache->bucket[hash & (PFS_SPF_CACHE_BUCKETS - 1)]; *pp; pp = &(*pp)->next) {
+		if ((*pp)->hash == hash && (*pp)->text_len == text_len) {
+			pfs_spf_cache_drop(cache, s, *pp);
+			break;
+		}
+	}
+	while (s->bytes + size > cache->stripe_budget && s->lru_tail)
+		pfs_spf_cache_drop(cache, s, s->lru_tail);
+
+	pp = &cache->bucket[hash & (PFS_SPF_CACHE_BUCKETS - 1)];
+	e->next = *pp;
+	*pp = e;
+	pfs_spf_lru_push(s, e);
+	s->bytes += size;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * SPF_server_get_record, with the compile step cached. The DNS part
+ * follows libspf2, except that only TXT is asked: the SPF RR type is
+ * obsolete (RFC 7208) and would cost a second query per domain.
+ */
+static SPF_errcode_t
+pfs_spf_cache_get_spf(SPF_server_t *spf_server, SPF_request_t *spf_request,
+				SPF_response_t *spf_response, SPF_record_t **spf_recordp)
+{
+	SPF_dns_server_t	*layer;
+	SPF_dns_rr_t		*rr;
+	SPF_errcode_t		 err;
+	const char			*domain = spf_request->cur_dom;
+	const char			*text = NULL;
+	uint64_t			 hash;
+	int					 num_found = 0;
+	int					 i;
+	char				 e;
+
+	/* Find ourselves, there may be layers with their own get_spf above */
+	for (layer = spf_server->resolver; layer != NULL; layer = layer->layer_below)
+		if (layer->get_spf == pfs_spf_cache_get_spf)
+			break;
+
+	*spf_recordp = NULL;
+	rr = SPF_dns_lookup(layer->layer_below, domain, ns_t_txt, TRUE);
+
+	switch (rr->herrno) {
+		case HOST_NOT_FOUND:
+		case NO_DATA:
+			SPF_dns_rr_free(rr);
+			spf_response->result = SPF_RESULT_NONE;
+			spf_response->reason = SPF_REASON_FAILURE;
+			return SPF_response_add_error(spf_response, SPF_E_NOT_SPF,
+							"Host '%s' not found.", domain);
+		case TRY_AGAIN:
+			SPF_dns_rr_free(rr);
+			spf_response->result = SPF_RESULT_TEMPERROR;
+			spf_response->reason = SPF_REASON_FAILURE;
+			return SPF_response_add_error(spf_response, SPF_E_DNS_ERROR,
+							"Temporary DNS failure for '%s'.", domain);
+		case NO_RECOVERY:
+			SPF_dns_rr_free(rr);
+			spf_response->result = SPF_RESULT_PERMERROR;
+			spf_response->reason = SPF_REASON_FAILURE;
+			return SPF_response_add_error(spf_response, SPF_E_DNS_ERROR,
+							"Unrecoverable DNS failure for '%s'.", domain);
+		case NETDB_SUCCESS:
+			break;
+		default:
+			SPF_dns_rr_free(rr);
+			return SPF_response_add_error(spf_response, SPF_E_DNS_ERROR,
+							"Unknown DNS failure for '%s'.", domain);
+	}
+
+	for (i = 0; i < rr->num_rr; i++) {
+		if (strncasecmp(rr->rr[i]->txt, PFS_SPF_VERSION, sizeof(PFS_SPF_VERSION) - 1) != 0)
+			continue;
+		e = rr->rr[i]->txt[sizeof(PFS_SPF_VERSION) - 1];
+		if (e == ' ' || e == '\0') {
+			num_found++;
+			text = rr->rr[i]->txt;
+		}
+	}
+	if (num_found == 0) {
+		SPF_dns_rr_free(rr);
+		spf_response->result = SPF_RESULT_NONE;
+		spf_response->reason = SPF_REASON_FAILURE;
+		return SPF_response_add_error(spf_response, SPF_E_NOT_SPF,
+						"No SPF records for '%s'", domain);
+	}
+	if (num_found > 1) {
+		SPF_dns_rr_free(rr);
+		spf_response->result = SPF_RESULT_PERMERROR;
+		spf_response->reason = SPF_REASON_FAILURE;
+		return SPF_response_add_error(spf_response, SPF_E_MULTIPLE_RECORDS,
+						"Multiple SPF records for '%s'", domain);
+	}
+
+	pfs_metrics_spf_record(pfs_netblock_uses(text));
+	hash = pfs_spf_cache_hash(domain, text);
+	*spf_recordp = pfs_spf_cache_get((pfs_spf_cache_t *)layer->hook, spf_server, hash, text);
+	if (*spf_recordp != NULL) {
+		pfs_metrics_count(PFS_C_RECORD_HITS);
+		SPF_dns_rr_free(rr);
+		return SPF_E_SUCCESS;
+	}
+	pfs_metrics_count(PFS_C_RECORD_MISSES);
+
+	err = SPF_record_compile(spf_server, spf_response, spf_recordp, text);
+	if (err != SPF_E_SUCCESS) {
+		SPF_dns_rr_free(rr);
+		return SPF_response_add_error(spf_response, SPF_E_NOT_SPF,
+						"Failed to compile SPF record for '%s'", domain);
+	}
+	if (rr->ttl > 0)
+		pfs_spf_cache_put((pfs_spf_cache_t *)layer->hook, hash, text,
+						*spf_recordp, time(NULL) + rr->ttl);
+	if (layer->debug)
+		pfs_log(LOG_DEBUG, "Compiled SPF record of %s\n", domain);
+	SPF_dns_rr_free(rr);
+	return SPF_E_SUCCESS;
+}
+
+static SPF_dns_rr_t *
+pfs_spf_cache_lookup(SPF_dns_server_t *spf_dns_server,
+				const char *domain, ns_type rr_type, int should_cache)
+{
+	return SPF_dns_lookup(spf_dns_server->layer_below, domain, rr_type, should_cache);
+}
+
+static void
+pfs_spf_cache_layer_free(SPF_dns_server_t *spf_dns_server)
+{
+	free(spf_dns_server);
+}
+
+SPF_dns_server_t *
+pfs_spf_cache_layer_new(SPF_dns_server_t *layer_below,
+				pfs_spf_cache_t *cache, const char *name, int debug)
+{
+	SPF_dns_server_t	*spf_dns_server;
+
+	spf_dns_server = (SPF_dns_server_t *)malloc(sizeof(SPF_dns_server_t));
+	if (spf_dns_server == NULL)
+		return NULL;
+	memset(spf_dns_server, 0, sizeof(SPF_dns_server_t));
+
+	spf_dns_server->destroy = pfs_spf_cache_layer_free;
+	spf_dns_server->lookup = pfs_spf_cache_lookup;
+	spf_dns_server->get_spf = pfs_spf_cache_get_spf;
+	spf_dns_server->get_exp = NULL;
+	spf_dns_server->add_cache = NULL;
+	spf_dns_server->layer_below = layer_below;
+	spf_dns_server->name = name ? name : "record";
+	spf_dns_server->debug = debug;
+	spf_dns_server->hook = cache;
+
+	return spf_dns_server;
+}
+
+pfs_spf_cache_t *
+pfs_spf_cache_new(size_t max_bytes)
+{
+	pfs_spf_cache_t		*cache;
+	int					 i;
+
+	cache = (pfs_spf_cache_t *)malloc(sizeof(pfs_spf_cache_t));
+	memset(cache, 0, sizeof(pfs_spf_cache_t));
+	for (i = 0; i < PFS_SPF_CACHE_STRIPES; i++)
+		pthread_mutex_init(&cache->stripe[i].lock, NULL);
+	cache->stripe_budget = max_bytes / PFS_SPF_CACHE_STRIPES;
+	return cache;
+}
+
+void
+pfs_spf_cache_free(pfs_spf_cache_t *cache)
+{
+	pfs_spf_entry_t		*e;
+	int					 i;
+
+	for (i = 0; i < PFS_SPF_CACHE_BUCKETS; i++) {
+		while ((e = cache->bucket[i]) != NULL) {
+			cache->bucket[i] = e->next;
+			free(e);
+		}
+	}
+	for (i = 0; i < PFS_SPF_CACHE_STRIPES; i++)
+		pthread_mutex_destroy(&cache->stripe[i].lock);
+	free(cache);
+}
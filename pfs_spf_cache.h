@@ -0,0 +1,32 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Cache of compiled SPF records, shared by all evaluation threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_SPF_CACHE_H
+#define PFS_SPF_CACHE_H
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "policyd-spf-fs.h"
+
+pfs_spf_cache_t *pfs_spf_cache_new(size_t max_bytes);
+void pfs_spf_cache_free(pfs_spf_cache_t *cache);
+
+/*
+ * A libspf2 DNS layer which answers SPF_server_get_record: the TXT
+ * record still comes from layer_below (normally the DNS cache), but
+ * a record compiled before from the same text is copied instead of
+ * being parsed and compiled again. Lookups are passed through.
+ */
+SPF_dns_server_t *pfs_spf_cache_layer_new(SPF_dns_server_t *layer_below,
+				pfs_spf_cache_t *cache, const char *name, int debug);
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Response templates. Field i is marked by the byte 2i+1 where it was
+ *  given as is and by 2i+2 where it was URL encoded; the Received-SPF
+ *  text and explanations contain neither. A value is only cut out where
+ *  it stands as a whole: a client may choose its HELO name to be part
+ *  of something else in the text, and a template made of that would
+ *  garble the text for everyone it is given to. Such texts, and values
+ *  too short to tell apart, make no template.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "policyd-spf-fs.h"
+#include "pfs_template.h"
+
+#define PFS_TEMPLATE_RAW(i)	((char)(2 * (i) + 1))
+#define PFS_TEMPLATE_URL(i)	((char)(2 * (i) + 2))
+
+/* Bytes which continue a host name, an address or a URL encoded value */
+#define PFS_TEMPLATE_INNER(c)	(isalnum((unsigned char)(c)) || strchr(".-_@+%", (c)) != NULL)
+
+
+static void
+pfs_template_url_encode(const char *s, char *out, size_t outlen, const char *hex)
+{
+	size_t		 o = 0;
+
+	for (; *s && o + 4 < outlen; s++) {
+		if (isalnum((unsigned char)*s) || strchr("-._~", *s))
+			out[o++] = *s;
+		else {
+			out[o++] = '%';
+			out[o++] = hex[(unsigned char)*s >> 4];
+			out[o++] = hex[(unsigned char)*s & 0xf];
+		}
+	}
+	out[o] = '\0';
+}
+
+/*
+ * How long value is at text, 0 if it is not there. -1 if it is, but as
+ * part of something longer.
+ */
+static int
+pfs_template_match(const char *start, const char *text, const char *value, size_t len)
+{
+	if (len == 0 || strncmp(text, value, len) != 0)
+		return 0;
+	if ((text > start && PFS_TEMPLATE_INNER(text[-1]))
+					|| (text[len] != '\0' && PFS_TEMPLATE_INNER(text[len])))
+		return -1;
+	return len;
+}
+
+int
+pfs_template_make(const char *text, const char **fields, const int *most,
+				int nfields, char *out, size_t outlen)
+{
+	char		 upper[PFS_TEMPLATE_FIELDS][RESULTSIZE];
+	char		 lower[PFS_TEMPLATE_FIELDS][RESULTSIZE];
+	size_t		 len[PFS_TEMPLATE_FIELDS], ulen[PFS_TEMPLATE_FIELDS], llen[PFS_TEMPLATE_FIELDS];
+	int			 uses[PFS_TEMPLATE_FIELDS];
+	const char	*start = text;
+	size_t		 o = 0;
+	int			 i, n = 0;
+
+	for (i = 0; i < nfields; i++) {
+		len[i] = strlen(fields[i]);
+		if (len[i] > 0 && len[i] < PFS_TEMPLATE_MIN)
+			return -1;
+		pfs_template_url_encode(fields[i], upper[i], RESULTSIZE, "0123456789ABCDEF");
+		pfs_template_url_encode(fields[i], lower[i], RESULTSIZE, "0123456789abcdef");
+		ulen[i] = strlen(upper[i]);
+		llen[i] = strlen(lower[i]);
+		uses[i] = 0;
+	}
+
+	while (*text) {
+		if (o + 1 >= outlen)
+			return -1;
+		if ((unsigned char)*text <= 2 * nfields)
+			return -1;
+		for (i = 0; i < nfields; i++) {
+			if ((n = pfs_template_match(start, text, fields[i], len[i])) != 0) {
+				out[o++] = PFS_TEMPLATE_RAW(i);
+				break;
+			}
+			if ((n = pfs_template_match(start, text, upper[i], ulen[i])) != 0
+							|| (n = pfs_template_match(start, text, lower[i], llen[i])) != 0) {
+				out[o++] = PFS_TEMPLATE_URL(i);
+				break;
+			}
+		}
+		if (i == nfields) {
+			out[o++] = *text++;
+			continue;
+		}
+		if (n < 0 || (most && most[i] && ++uses[i] > most[i]))
+			return -1;
+		text += n;
+	}
+	out[o] = '\0';
+	return o;
+}
+
+void
+pfs_template_expand(const char *tmpl, size_t tlen, const char **fields,
+				int nfields, char *out, size_t outlen)
+{
+	char		 url[RESULTSIZE];
+	size_t		 i, o = 0;
+	int			 f, n;
+
+	for (i = 0; i < tlen && o + 1 < outlen; i++) {
+		f = (unsigned char)tmpl[i] - 1;
+		if (f >= 0 && f < 2 * nfields) {
+			if (f & 1) {
+				pfs_template_url_encode(fields[f / 2], url, sizeof(url), "0123456789ABCDEF");
+				n = snprintf(out + o, outlen - o, "%s", url);
+			}
+			else
+				n = snprintf(out + o, outlen - o, "%s", fields[f / 2]);
+			o += n;
+			if (o >= outlen)
+				o = outlen - 1;
+		}
+		else
+			out[o++] = tmpl[i];
+	}
+	out[o] = '\0';
+}
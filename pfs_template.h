@@ -0,0 +1,38 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Response texts with the request's own values cut out, so a result
+ *  cached for one request can be worded for another.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef PFS_TEMPLATE_H
+#define PFS_TEMPLATE_H
+
+#include <stddef.h>
+
+#define PFS_TEMPLATE_FIELDS	3
+/* Shorter values could be anything, they make no template */
+#define PFS_TEMPLATE_MIN	4
+
+/*
+ * Copy text to out replacing every occurrence of one of the nfields
+ * values (also URL encoded, as by the upper case macros) by a marker.
+ * Earlier fields win where two would match. A value must stand on its
+ * own, not within a longer name, and field i may occur at most most[i]
+ * times unless that is 0 or most is NULL. Returns the length, or -1 if
+ * it does not fit, a value is too short or found where it must not be,
+ * or text contains marker bytes itself.
+ */
+int pfs_template_make(const char *text, const char **fields, const int *most,
+				int nfields, char *out, size_t outlen);
+
+/* Fill the fields into a template of tlen bytes, NUL terminated */
+void pfs_template_expand(const char *tmpl, size_t tlen, const char **fields,
+				int nfields, char *out, size_t outlen);
+
+#endif
@@ -62,6 +62,8 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <errno.h>
+#include <sys/uio.h>
 
 extern int h_errno;    /* for netdb */
 
@@ -72,13 +74,52 @@ extern int h_errno;    /* for netdb */
 #include "spf_dns_cache.h"
 #include "spf_dns_resolv.h"
 
+#include "policyd-spf-fs.h"
+#include "pfs_daemon.h"
+#include "pfs_dns_async.h"
+#include "pfs_shm_cache.h"
+#include "pfs_peer.h"
+#include "pfs_profile.h"
+#include "pfs_dns_cache.h"
+#include "pfs_spf_cache.h"
+#include "pfs_iplist.h"
+#include "pfs_metrics.h"
+#include "pfs_log.h"
+#include "pfs_replay.h"
+#include "pfs_config.h"
+#include "pfs_domain_map.h"
+#include "pfs_helo_memo.h"
+#include "pfs_netblock.h"
+#include "pfs_flatten.h"
 
 
-#define TRUE 1
-#define FALSE 0
-
 #define REQUEST_LIMIT 100
-#define RESULTSIZE      1024
+
+/* Requests are read in large blocks and parsed where they lie */
+#define READ_BUFSIZE 65536
+
+typedef
+struct pf_reader_struct {
+	char		 buf[READ_BUFSIZE];
+	size_t		 off;		/* start of the next request */
+	size_t		 len;
+	int			 eof;
+} pf_reader_t;
+
+/* Responses to pipelined requests go out together, in order */
+#define WRITE_BATCH 64
+
+typedef
+struct pf_batch_struct {
+	struct iovec	 iov[WRITE_BATCH];
+	char			 buf[WRITE_BATCH][RESPONSESIZE];
+	int				 count;
+} pf_batch_t;
+
+#define DEFAULT_MAX_INFLIGHT 256
+
+/* Memory for compiled SPF records, shared by all threads */
+#define RECORD_CACHE_SIZE (8 * 1024 * 1024)
 
 #define POSTFIX_DUNNO   "DUNNO"
 #define POSTFIX_REJECT  "REJECT"
@@ -89,50 +130,42 @@ extern int h_errno;    /* for netdb */
 #define FREE_REQUEST(x) FREE((x), SPF_request_free)
 #define FREE_RESPONSE(x) FREE((x), SPF_response_free)
 
-#define CONTINUE_ERROR { \
+#define RETURN_ERROR { \
 	res = 255; \
 	sprintf(pf_result, "450 temporary failure: please contact postmaster if the error remains"); \
-	printf("action=%s\n\n", pf_result); \
-	fflush(stdout); \
+	snprintf(out, outlen, "action=%s\n\n", pf_result); \
+	if (opts->debug) \
+          pfs_log(LOG_INFO, "action=%s (ip=%s from=%s helo=%s to=%s)\n", pf_result, req->ip, req->sender, req->helo, req->rcpt_to); \
+	goto done; \
+}
+
+#define RETURN_DUNNO(s) { \
+	snprintf(out, outlen, "action=PREPEND X-Received-SPF: %s\naction=%s\n\n", s, POSTFIX_DUNNO); \
+	res=255; \
 	if (opts->debug) \
-          syslog(LOG_INFO, "action=%s (ip=%s from=%s helo=%s to=%s)\n", pf_result, req->ip, req->sender, req->helo, req->rcpt_to); \
-	continue; \
+          pfs_log(LOG_INFO, "action=%s %s (ip=%s from=%s helo=%s to=%s)\n", POSTFIX_DUNNO, s, req->ip, req->sender, req->helo, req->rcpt_to); \
+	goto done; \
 }
 
-#define CONTINUE_DUNNO(s) { \
-	printf("action=PREPEND X-Received-SPF: %s\n", s); \
-	printf("action=%s\n\n", POSTFIX_DUNNO); \
-	fflush(stdout); res=255; \
+#define RETURN_REJECT(s) { \
+	snprintf(out, outlen, "action=%s %s\n\n", POSTFIX_REJECT, s); \
+	res=255; \
 	if (opts->debug) \
-          syslog(LOG_INFO, "action=%s %s (ip=%s from=%s helo=%s to=%s)\n", POSTFIX_DUNNO, s, req->ip, req->sender, req->helo, req->rcpt_to); \
-	continue; \
+          pfs_log(LOG_INFO, "action=%s %s (ip=%s from=%s helo=%s to=%s)\n", POSTFIX_REJECT, s, req->ip, req->sender, req->helo, req->rcpt_to); \
+	goto done; \
 }
 
 #define WARN_ERROR do { res = 255; } while(0)
 #define FAIL_ERROR do { res = 255; goto error; } while(0)
 #define EXIT_OK do { res = 0; goto error; } while(0)
 
-#define RESIZE_RESULT(n) do { \
-	if (result == NULL) { \
-		result_len = 256 + n; \
-		result = malloc(result_len); \
-		result[0] = '\0'; \
-	} \
-	else if (strlen(result) + n >= result_len) { \
-		result_len = result_len + (result_len >> 1) + 8 + n; \
-		result = realloc(result, result_len); \
-	} \
-} while(0)
-#define APPEND_RESULT(n) do { \
-	partial_result = SPF_strresult(n); \
-	RESIZE_RESULT(strlen(partial_result)); \
-	strcat(result, partial_result); \
-} while(0)
-
 #define X_OR_EMPTY(x) ((x) ? (x) : "")
+#define X_EQUAL(a, b) ((a) == NULL ? (b) == NULL : ((b) != NULL && strcmp((a), (b)) == 0))
 
                         
 static const char               *progname;
+static pf_reader_t               stdin_reader;
+static pf_batch_t                stdout_batch;
 
 static struct option long_options[] = {
 	{"file", 1, 0, 'f'},
@@ -150,8 +183,30 @@ static struct option long_options[] = {
 	{"max-lookup", 1, 0, 'm'},
 	{"sanitize", 1, 0, 'c'},
 	{"name", 1, 0, 'n'},
+	{"helo-check", 1, 0, 'U'},
 	{"override", 1, 0, 'a'},
 	{"fallback", 1, 0, 'z'},
+	{"listen", 1, 0, 'L'},
+	{"workers", 1, 0, 'W'},
+	{"max-inflight", 1, 0, 'I'},
+	{"dns-server", 1, 0, 'D'},
+	{"shm-cache", 1, 0, 'S'},
+	{"peers", 1, 0, 'E'},
+	{"peer-listen", 1, 0, 'J'},
+	{"peer-timeout-ms", 1, 0, 'O'},
+	{"cache-snapshot", 1, 0, 'C'},
+	{"stats", 1, 0, 'M'},
+	{"top-domains", 2, 0, 'K'},
+	{"allowlist-file", 1, 0, 'A'},
+	{"denylist-file", 1, 0, 'B'},
+	{"deadline-ms", 1, 0, 'T'},
+	{"deadline-action", 1, 0, 'F'},
+	{"shed-inflight", 1, 0, 'N'},
+	{"shed-delay-ms", 1, 0, 'Q'},
+	{"shed-action", 1, 0, 'P'},
+	{"dns-hedge", 1, 0, 'H'},
+	{"async-log", 2, 0, 'G'},
+	{"config", 1, 0, 'R'},
 
 	{"keep-comments", 0, 0, 'k'},
 	{"version", 0, 0, 'v'},
@@ -160,24 +215,6 @@ static struct option long_options[] = {
 	{0, 0, 0, 0}
 };
 
-static void
-unimplemented(const char flag)
-{
-	struct option	*opt;
-	int				 i;
-
-	for (i = 0; (opt = &long_options[i])->name; i++) {
-		if (flag == opt->val) {
-			fprintf(stderr, "Unimplemented option: -%s or -%c\n",
-							opt->name, flag);
-			return;
-		}
-	}
-
-	fprintf(stderr, "Unimplemented option: -%c\n", flag);
-}
-
-
 static void
 help()
 {
@@ -197,8 +234,36 @@ help()
 	"	--sanitize <0|1>			Clean up invalid characters in output?\n"
 	"	--name <domain name>		The name of the system doing the SPF\n"
 	"							   checking\n"
-	"	--override <...>			Override SPF records for domains\n"
-	"	--fallback <...>			Fallback SPF records for domains\n"
+	"	--helo-check <0|1>		  Check null senders by their HELO name?\n"
+	"	--override <file>		   Override SPF records for domains\n"
+	"	--fallback <file>		   Fallback SPF records for domains\n"
+	"	--listen <unix:path|inet:host:port>\n"
+	"							   Run as daemon serving many connections\n"
+	"	--file <file>			   Evaluate recorded requests and exit\n"
+	"	--workers <number>		  Evaluation threads in daemon or\n"
+	"							   batch mode\n"
+	"	--max-inflight <number>	 Concurrent evaluations per thread\n"
+	"	--dns-server <ip[,ip...]>   Name servers instead of resolv.conf\n"
+	"	--shm-cache <file[,size]>   Result cache shared by all instances\n"
+	"	--peers <ip:port[,...]>	 Result cache shared by these daemons\n"
+	"	--peer-listen <ip:port>	 This daemon's address among the peers\n"
+	"	--peer-timeout-ms <ms>	  Time allowed for a peer's answer (20)\n"
+	"	--cache-snapshot <file>	 Keep the DNS cache across restarts\n"
+	"	--stats <unix:path|file>	Publish metrics in daemon mode\n"
+	"	--top-domains [number]	  Log the sender domains costing most\n"
+	"	--allowlist-file <file>	 Client networks answered DUNNO\n"
+	"	--denylist-file <file>	  Client networks answered REJECT\n"
+	"	--deadline-ms <ms>		  Time allowed for one SPF check\n"
+	"	--deadline-action <action>  Answer when it runs out (DUNNO)\n"
+	"	--shed-inflight <number>	Answer right away beyond this many\n"
+	"							   checks in daemon mode\n"
+	"	--shed-delay-ms <ms>		Answer right away while checks have\n"
+	"							   waited this long to start\n"
+	"	--shed-action <action>	  Answer when shedding (DUNNO)\n"
+	"	--dns-hedge <percentile>	Ask the next DNS server after this\n"
+	"							   percentile of round trips\n"
+	"	--async-log [slots]		 Log from a background thread\n"
+	"	--config <file>			 Settings SIGHUP reloads in daemon mode\n"
 	"\n"
 	"	--version				   Print version of spfquery.\n"
 	"	--help					  Print out these options.\n"
@@ -214,17 +279,17 @@ response_print_errors(const char *context,
 	SPF_error_t		*spf_error;;
 	int				 i;
 
-	syslog(LOG_CRIT,"StartError\n");
+	pfs_log(LOG_CRIT,"StartError\n");
 
 	if (context != NULL)
-		syslog(LOG_CRIT,"Context: %s\n", context);
+		pfs_log(LOG_CRIT,"Context: %s\n", context);
 	if (err != SPF_E_SUCCESS)
-		syslog(LOG_CRIT,"ErrorCode: (%d) %s\n", err, SPF_strerror(err));
+		pfs_log(LOG_CRIT,"ErrorCode: (%d) %s\n", err, SPF_strerror(err));
 
 	if (spf_response != NULL) {
 		for (i = 0; i < SPF_response_messages(spf_response); i++) {
 			spf_error = SPF_response_message(spf_response, i);
-			syslog(LOG_CRIT,"%s: %s%s\n",
+			pfs_log(LOG_CRIT,"%s: %s%s\n",
 					SPF_error_errorp(spf_error) ? "Error" : "Warning",
 					// SPF_error_code(spf_error),
 					// SPF_strerror(SPF_error_code(spf_error)),
@@ -235,136 +300,331 @@ response_print_errors(const char *context,
 		}
 	}
 	else {
-		syslog(LOG_CRIT,"libspf2 gave a NULL spf_response\n");
+		pfs_log(LOG_CRIT,"libspf2 gave a NULL spf_response\n");
 	}
-	syslog(LOG_CRIT,"EndError\n");
+	pfs_log(LOG_CRIT,"EndError\n");
 }
 
 static void
 response_print(const char *context, SPF_response_t *spf_response)
 {
-	syslog(LOG_DEBUG,"--vv--\n");
-	syslog(LOG_DEBUG,"Context: %s\n", context);
+	pfs_log(LOG_DEBUG,"--vv--\n");
+	pfs_log(LOG_DEBUG,"Context: %s\n", context);
 	if (spf_response == NULL) {
-		syslog(LOG_DEBUG, "NULL RESPONSE!\n");
+		pfs_log(LOG_DEBUG, "NULL RESPONSE!\n");
 	}
 	else {
-		syslog(LOG_DEBUG, "Response result: %s\n",
+		pfs_log(LOG_DEBUG, "Response result: %s\n",
 					SPF_strresult(SPF_response_result(spf_response)));
-		syslog(LOG_DEBUG, "Response reason: %s\n",
+		pfs_log(LOG_DEBUG, "Response reason: %s\n",
 					SPF_strreason(SPF_response_reason(spf_response)));
-		syslog(LOG_DEBUG, "Response err: %s\n",
+		pfs_log(LOG_DEBUG, "Response err: %s\n",
 					SPF_strerror(SPF_response_errcode(spf_response)));
 		response_print_errors(NULL, spf_response,
 						SPF_response_errcode(spf_response));
 	}
-	syslog(LOG_DEBUG,"--^^--\n");
+	pfs_log(LOG_DEBUG,"--^^--\n");
 }
 
-typedef
-struct SPF_client_options_struct {
-	// void		*hook;
-	char		*localpolicy;
-	const char	*explanation;
-	const char	*fallback;
-	const char	*rec_dom;
-	int 		 use_trusted;
-	int			 max_lookup;
-	int			 sanitize;
-	int			 debug;
-} SPF_client_options_t;
+/*
+ * Forget the values of req. They belong to a read buffer or an arena,
+ * nothing is freed here.
+ */
+void pf_request_reset(SPF_client_request_t *req)
+{
+	memset(req, 0, sizeof(SPF_client_request_t));
+}
 
-typedef
-struct SPF_client_request_struct {
-	char		*ip;
-	char		*sender;
-	char		*helo;
-	char		*rcpt_to;
-} SPF_client_request_t;
+#define COPY_ATTR(x) do { dst->x = src->x ? pfs_arena_strdup(arena, src->x) : NULL; } while(0)
+
+/*
+ * Copy the values of src into arena, for a request which outlives the
+ * buffer it was parsed from.
+ */
+void pf_request_copy(SPF_client_request_t *dst, SPF_client_request_t *src, pfs_arena_t *arena)
+{
+	COPY_ATTR(ip);
+	COPY_ATTR(sender);
+	COPY_ATTR(helo);
+	COPY_ATTR(rcpt_to);
+	COPY_ATTR(instance);
+}
+
+/*
+ * Are a and b recipients of the same message? Only if postfix said which
+ * message they belong to and client and sender are still the same.
+ */
+int pf_request_same_message(SPF_client_request_t *a, SPF_client_request_t *b)
+{
+	return a->instance != NULL && b->instance != NULL
+			&& strcmp(a->instance, b->instance) == 0
+			&& X_EQUAL(a->ip, b->ip)
+			&& X_EQUAL(a->sender, b->sender);
+}
+
+/*
+ * Would a and b get the same answer from pf_evaluate? Everything it
+ * looks at is the client address, the sender and the HELO name.
+ */
+int pf_request_same_evaluation(SPF_client_request_t *a, SPF_client_request_t *b)
+{
+	return X_EQUAL(a->ip, b->ip)
+			&& X_EQUAL(a->sender, b->sender)
+			&& X_EQUAL(a->helo, b->helo);
+}
+
+void pf_memo_init(SPF_client_memo_t *memo)
+{
+	memset(memo, 0, sizeof(SPF_client_memo_t));
+	pfs_arena_init(&memo->arena, memo->space, sizeof(memo->space));
+}
+
+int pf_memo_match(SPF_client_memo_t *memo, SPF_client_request_t *req)
+{
+	return pf_request_same_message(&memo->req, req);
+}
+
+void pf_memo_store(SPF_client_memo_t *memo, SPF_client_request_t *req, const char *response)
+{
+	SPF_client_request_t	 key;
+
+	pf_memo_reset(memo);
+	if (req->instance == NULL)
+		return;
+	memset(&key, 0, sizeof(key));
+	key.instance = req->instance;
+	key.ip = req->ip;
+	key.sender = req->sender;
+	pf_request_copy(&memo->req, &key, &memo->arena);
+	snprintf(memo->response, sizeof(memo->response), "%s", response);
+}
+
+void pf_memo_reset(SPF_client_memo_t *memo)
+{
+	pf_request_reset(&memo->req);
+	pfs_arena_reset(&memo->arena);
+}
+
+#define ATTR_IS(name) (len == sizeof(name) - 1 && strncasecmp(line, name, len) == 0)
+
+/*
+ * Parse one attribute line (NUL terminated, without line terminator) of
+ * a postfix policy request into req. The value is left in place and
+ * req points to it. Returns 1 if the attribute is one we use, else 0.
+ */
+int pf_parse_attr(SPF_client_options_t *opts, SPF_client_request_t *req, char *line)
+{
+	char		*eq = strchr(line, '=');
+	char		**attr = NULL;
+	size_t		 len;
+
+	if (eq == NULL)
+		return(0);
+	len = eq - line;
+
+	/* postfix sends the names in lower case, earlier versions took any */
+	switch (len) {
+		case 6:
+			if (ATTR_IS("sender")) attr = &req->sender;
+			break;
+		case 8:
+			if (ATTR_IS("instance")) attr = &req->instance;
+			break;
+		case 9:
+			if (ATTR_IS("helo_name")) attr = &req->helo;
+			else if (ATTR_IS("recipient")) attr = &req->rcpt_to;
+			break;
+		case 14:
+			if (ATTR_IS("client_address")) attr = &req->ip;
+			break;
+	}
+	/* Ignore line. */
+	if (attr == NULL)
+		return(0);
+
+	*attr = eq + 1;
+	if (opts->debug > 1) pfs_log(LOG_DEBUG, "[%.*s %s]", (int)len, line, eq + 1); /* DBG */
+	return(1);
+}
+
+/*
+ * Parse the next request from buf, which holds len bytes of input.
+ * Nothing is touched until the terminating empty line has arrived; then
+ * the lines are split in place and req points into buf. Returns the
+ * number of bytes the request took, 0 if it is not complete yet. *args
+ * is the number of attributes we use, 0 means there is nothing to check.
+ */
+size_t pf_parse_request(SPF_client_options_t *opts, SPF_client_request_t *req,
+				char *buf, size_t len, int *args)
+{
+	char		*end = buf + len;
+	char		*p, *nl, *line, *eol;
+	int			 lines = 0;
+	uint64_t	 start = pfs_metrics_now();
+
+	for (p = buf; ; p = nl + 1) {
+		if (p >= end || (nl = memchr(p, '\n', end - p)) == NULL)
+			return 0;
+		if (nl == p || (nl == p + 1 && *p == '\r')) {
+			if (lines > 0)
+				break;
+		}
+		else
+			lines++;
+	}
+
+	*args = 0;
+	for (line = buf; line <= nl; line = eol + 1) {
+		eol = memchr(line, '\n', nl + 1 - line);
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r')
+			eol[-1] = '\0';
+		if (opts->debug > 1) pfs_log(LOG_DEBUG, "--> %s", line); /* DBG */
+		if (line[0] != '\0')
+			*args += pf_parse_attr(opts, req, line);
+	}
+
+	if (*args > 0) {
+		pfs_metrics_count(PFS_C_REQUESTS);
+		pfs_metrics_since(PFS_H_PARSE, start);
+	}
+	return nl + 1 - buf;
+}
+
+/* Where the next response is written */
+static char *pf_batch_slot(pf_batch_t *b)
+{
+	return b->buf[b->count];
+}
+
+/* Write every queued response with one writev, unless the pipe is full */
+static void pf_batch_flush(pf_batch_t *b)
+{
+	struct iovec	*iov = b->iov;
+	int				 cnt = b->count;
+	ssize_t			 n;
+
+	while (cnt > 0) {
+		n = writev(STDOUT_FILENO, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			pfs_log(LOG_WARNING, "write: %s\n", strerror(errno));
+			break;
+		}
+		while (cnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	b->count = 0;
+}
 
+/* Queue the response just written to pf_batch_slot */
+static void pf_batch_push(pf_batch_t *b)
+{
+	b->iov[b->count].iov_base = b->buf[b->count];
+	b->iov[b->count].iov_len = strlen(b->buf[b->count]);
+	if (++b->count == WRITE_BATCH)
+		pf_batch_flush(b);
+}
 
-static char read_request_from_pf(SPF_client_options_t *opts, SPF_client_request_t *req)
+/*
+ * Read the next request from stdin into req, which points into rd->buf
+ * until the next call. Requests already in the buffer are returned
+ * without a syscall; only when none is left are the responses in batch
+ * written, before waiting for more input. Returns 1 at end of input.
+ */
+static char read_request_from_pf(SPF_client_options_t *opts, pf_reader_t *rd,
+				SPF_client_request_t *req, pf_batch_t *batch)
 {
-        char    line[BUFSIZ];
-        char	args=0;
-
-        while (fgets(line, BUFSIZ, stdin) != NULL) {
-                line[strcspn(line, "\r\n")] = '\0'; 
-                if (opts->debug > 1) syslog(LOG_DEBUG, "--> %s", line); /* DBG */
-                switch (line[0]) {
-                        case '\0':
-                                if (args > 0) return(0);
-                                break;
-                        case 'c':
-                                if (strncasecmp(line, "client_address=", 15) == 0) {
-                                        req->ip = strdup(&line[15]);
-                                        if (opts->debug > 1) syslog(LOG_DEBUG, "[ip %s]", req->ip); /* DBG */
-                                        args++;
-                                        continue;
-                                }
-                                break;
-                        case 's':
-                                if (strncasecmp(line, "sender=", 7) == 0) {
-                                        req->sender = strdup(&line[7]);
-                                        if (opts->debug > 1) syslog(LOG_DEBUG, "[sender %s]", req->sender); /* DBG */
-                                        args++;
-                                        continue;
-                                }
-                                break;
-                        case 'h':
-                                if (strncasecmp(line, "helo_name=", 10) == 0) {
-                                        req->helo = strdup(&line[10]);
-                                        if (opts->debug > 1) syslog(LOG_DEBUG, "[helo %s]", req->helo); /* DBG */
-                                        args++;
-                                        continue;
-                                }
-                                break;
-			case 'r':
-                                if (strncasecmp(line, "recipient=", 10) == 0) {
-                                        req->rcpt_to = strdup(&line[10]);
-                                        if (opts->debug > 1) syslog(LOG_DEBUG, "[recipient %s]", req->rcpt_to); /* DBG */
-                                        args++;
-                                        continue;
-                                }
-                                break;
+        ssize_t  n;
+        size_t   used;
+        int      args;
+
+        for (;;) {
+                pf_request_reset(req);
+                used = pf_parse_request(opts, req, rd->buf + rd->off, rd->len - rd->off, &args);
+                if (used > 0) {
+                        rd->off += used;
+                        if (args > 0) return(0);
+                        continue;
+                }
+                pf_batch_flush(batch);
+                if (rd->eof)
+                        return(1);
+
+                /* Make room for the rest of the request */
+                if (rd->off > 0) {
+                        memmove(rd->buf, rd->buf + rd->off, rd->len - rd->off);
+                        rd->len -= rd->off;
+                        rd->off = 0;
                 }
-                /* Ignore line. */
+                if (rd->len == sizeof(rd->buf)) {
+                        pfs_log(LOG_WARNING, "Request too large, ignored\n");
+                        rd->len = 0;
+                }
+
+                n = read(STDIN_FILENO, rd->buf + rd->len, sizeof(rd->buf) - rd->len);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        rd->eof = 1;
+                else
+                        rd->len += n;
         }
-        if (feof(stdin)) {
-          return(1);
-        } else {
-          return(0);
+}
+
+/*
+ * The text explaining a result to the client, if pf_response uses one
+ */
+static const char *pf_response_comment(SPF_response_t *spf_response)
+{
+      switch (spf_response->result) {
+                case SPF_RESULT_FAIL:
+                        return (spf_response->smtp_comment
+                                        ? spf_response->smtp_comment
+                                        : (spf_response->header_comment
+                                                ? spf_response->header_comment
+                                                : ""));
+                case SPF_RESULT_TEMPERROR:
+                case SPF_RESULT_PERMERROR:
+                case SPF_RESULT_INVALID:
+                        return (spf_response->smtp_comment
+                                        ? spf_response->smtp_comment
+                                        : "");
+                default:
+                        return "";
         }
 }
 
-static void pf_response(SPF_client_options_t    *opts, SPF_response_t *spf_response, SPF_client_request_t *req)
+static void pf_response(SPF_client_options_t    *opts, int spf_result, const char *received_spf,
+			const char *comment, SPF_client_request_t *req, char *out, size_t outlen)
 {
       char                     result[RESULTSIZE];
       char                     spf_comment[RESULTSIZE];
+      size_t                   len = 0;
 
-      switch (spf_response->result) {
+      switch (spf_result) {
                 case SPF_RESULT_PASS:
                         strcpy(result, POSTFIX_DUNNO);
-                        printf("action=PREPEND X-%s\n",SPF_response_get_received_spf(spf_response));
-                        snprintf(spf_comment, RESULTSIZE, SPF_response_get_received_spf(spf_response));
+                        len = snprintf(out, outlen, "action=PREPEND X-%.*s\n", RESULTSIZE, received_spf);
+                        snprintf(spf_comment, RESULTSIZE, "%s", received_spf);
                         break;
                 case SPF_RESULT_FAIL:
                 	strcpy(result, POSTFIX_REJECT);
-                        snprintf(spf_comment, RESULTSIZE,"SPF Reject: %s",
-                                                        (spf_response->smtp_comment
-                                                                ? spf_response->smtp_comment
-                                                                : (spf_response->header_comment
-                                                                        ? spf_response->header_comment
-                                                                        : "")));
+                        snprintf(spf_comment, RESULTSIZE,"SPF Reject: %s", comment);
                         break;
                 case SPF_RESULT_TEMPERROR:
                 case SPF_RESULT_PERMERROR:
                 case SPF_RESULT_INVALID:
                         snprintf(result, RESULTSIZE,
-                                                        "450 temporary failure: %s",
-                                                        (spf_response->smtp_comment
-                                                                ? spf_response->smtp_comment
-                                                                : ""));
+                                                        "450 temporary failure: %s", comment);
 			spf_comment[0]='\0';
                         break;
                 case SPF_RESULT_SOFTFAIL:
@@ -372,53 +632,420 @@ static void pf_response(SPF_client_options_t    *opts, SPF_response_t *spf_respo
                 case SPF_RESULT_NONE:    
                 default:
                         strcpy(result, POSTFIX_DUNNO);
-                        printf("action=PREPEND X-%s\n",SPF_response_get_received_spf(spf_response));
-                        snprintf(spf_comment, RESULTSIZE, SPF_response_get_received_spf(spf_response));
+                        len = snprintf(out, outlen, "action=PREPEND X-%.*s\n", RESULTSIZE, received_spf);
+                        snprintf(spf_comment, RESULTSIZE, "%s", received_spf);
                         break;
         }
         
         result[RESULTSIZE - 1] = '\0';
 	if (opts->debug > 1)
-		syslog(LOG_DEBUG, "<-- action=%s\n", result);
+		pfs_log(LOG_DEBUG, "<-- action=%s\n", result);
 	if (strcmp(result,POSTFIX_REJECT) == 0) {
-          printf("action=%s %s\n\n", result, spf_comment);
+          snprintf(out + len, outlen - len, "action=%s %s\n\n", result, spf_comment);
         } else {
-          printf("action=%s\n\n", result);
+          snprintf(out + len, outlen - len, "action=%s\n\n", result);
         }
-        fflush(stdout);
         if (opts->debug)
-          syslog(LOG_INFO, "action=%s %s (ip=%s from=%s helo=%s to=%s)\n", result, spf_comment, req->ip, req->sender, req->helo, req->rcpt_to);
+          pfs_log(LOG_INFO, "action=%s %s (ip=%s from=%s helo=%s to=%s)\n", result, spf_comment, req->ip, req->sender, req->helo, req->rcpt_to);
 }
 
-
-int main( int argc, char *argv[] )
+/*
+ * Run the SPF checks for one postfix request and format the complete
+ * policy response (including the terminating empty line) into out.
+ * Returns the SPF result, or 255 if no result could be determined.
+ */
+int pf_evaluate(SPF_client_options_t *opts, SPF_server_t *spf_server,
+				SPF_client_request_t *req, char *out, size_t outlen)
 {
-	SPF_client_options_t	*opts;
-	SPF_client_request_t	*req = NULL;
-
-	SPF_server_t	*spf_server = NULL;
 	SPF_request_t	*spf_request = NULL;
 	SPF_response_t	*spf_response = NULL;
 	SPF_response_t	*spf_response_2mx = NULL;
 	SPF_errcode_t	 err;
 
-	int  			 opt_keep_comments = 0;
-
 #ifdef TO_MX
 	char			*p, *p_end;
 #endif
 
+	int				 res = 0;
+	char			pf_result[100];
+	char			received_spf[RESULTSIZE];
+	char			comment[RESULTSIZE];
+	pfs_metrics_eval_t	 eval;
+	int64_t			 deadline;
+	pfs_helo_t		 helo;
+	int				 helo_known = FALSE;
+	int				 helo_identity = FALSE;
+	int				 shared;
+
+	pfs_metrics_eval_begin(&eval);
+	if (opts->deadline_ms > 0)
+		pfs_dns_deadline_start(&deadline, opts->deadline_ms);
+
+	/* Listed clients are answered without asking libspf2 at all */
+	if (opts->iplist) {
+		switch (pfs_iplist_check(opts->iplist, req->ip)) {
+			case PFS_IPLIST_ALLOW:
+				pfs_metrics_count(PFS_C_ALLOWLISTED);
+				RETURN_DUNNO("client address is on the allow list");
+			case PFS_IPLIST_DENY:
+				pfs_metrics_count(PFS_C_DENYLISTED);
+				RETURN_REJECT("client address is on the deny list");
+		}
+	}
+
+	/* Later requests of an SMTP session reuse what the first one found out */
+	if (opts->helo_memo && req->ip != NULL && req->helo != NULL && *req->helo != '\0')
+		helo_known = pfs_helo_memo_get(opts->helo_memo, req->ip, req->helo, &helo);
+	if (helo_known && !helo.valid) {
+		pfs_log(LOG_WARNING, "Invalid HELO domain.\n" );
+		RETURN_ERROR;
+	}
+	if (helo_known && helo.result >= 0 && opts->helo_check
+					&& X_OR_EMPTY(req->sender)[0] == '\0') {
+		res = helo.result;
+		if (opts->debug > 1)
+			pfs_log(LOG_DEBUG, "HELO memo hit\n");
+		pf_response(opts, res, helo.received_spf, helo.comment, req, out, outlen);
+		goto done;
+	}
+
+	spf_request = SPF_request_new(spf_server);
+
+	if (req->ip == NULL || (SPF_request_set_ipv4_str(spf_request, req->ip) && SPF_request_set_ipv6_str(spf_request, req->ip))) {
+		pfs_log(LOG_WARNING, "Invalid IP address.\n" );
+		RETURN_ERROR;
+	}
+
+	if (req->helo) {
+		if (SPF_request_set_helo_dom( spf_request, req->helo ) ) {
+			pfs_log(LOG_WARNING, "Invalid HELO domain.\n" );
+			if (opts->helo_memo) {
+				helo.valid = FALSE;
+				helo.result = -1;
+				pfs_helo_memo_put(opts->helo_memo, req->ip, req->helo, &helo);
+			}
+			RETURN_ERROR;
+		}
+	}
+
+	if (req->sender != NULL && strchr(req->sender, '@') != NULL) {
+		if (SPF_request_set_env_from( spf_request, req->sender ) ) {
+			pfs_log(LOG_WARNING, "Invalid envelope from address.\n" );
+			RETURN_ERROR;
+		}
+	} else if (opts->helo_check && X_OR_EMPTY(req->sender)[0] == '\0'
+					&& req->helo != NULL && *req->helo != '\0') {
+		/* A bounce: the HELO name is the identity checked (RFC 7208 2.3) */
+		if (SPF_request_set_env_from( spf_request, "" ) ) {
+			pfs_log(LOG_WARNING, "Invalid envelope from address.\n" );
+			RETURN_ERROR;
+		}
+		helo_identity = TRUE;
+	} else { /* This is something we can not check*/ 
+		RETURN_DUNNO("no valid email address found");
+	}
+
+	/* Another instance may have checked the same ip and domain already */
+	if (opts->result_cache && !helo_identity) {
+		res = pfs_shm_cache_get(opts->result_cache, req,
+						received_spf, comment, sizeof(received_spf));
+		if (res >= 0) {
+			pfs_metrics_count(PFS_C_SHM_HITS);
+			if (opts->debug > 1)
+				pfs_log(LOG_DEBUG, "Shared cache hit\n");
+			pf_response(opts, res, received_spf, comment, req, out, outlen);
+			goto done;
+		}
+		pfs_metrics_count(PFS_C_SHM_MISSES);
+		res = 0;
+	}
+
+	/* Or the domain is flattened */
+	if (opts->flatten && !helo_identity) {
+		res = pfs_flatten_get(opts->flatten, req,
+						received_spf, comment, sizeof(received_spf));
+		if (res >= 0) {
+			if (opts->debug > 1)
+				pfs_log(LOG_DEBUG, "Flattened record hit\n");
+			pf_response(opts, res, received_spf, comment, req, out, outlen);
+			goto done;
+		}
+		res = 0;
+	}
+
+	/* Or the result is known for a network the client is in */
+	if (opts->netblock && !helo_identity) {
+		res = pfs_netblock_get(opts->netblock, req,
+						received_spf, comment, sizeof(received_spf));
+		if (res >= 0) {
+			if (opts->debug > 1)
+				pfs_log(LOG_DEBUG, "Netblock cache hit\n");
+			pf_response(opts, res, received_spf, comment, req, out, outlen);
+			goto done;
+		}
+		res = 0;
+	}
+
+	/* Or another node of the cluster has */
+	if (opts->peer && !helo_identity) {
+		res = pfs_peer_get(opts->peer, opts->peer_seed, spf_server->resolver, req,
+						received_spf, comment, sizeof(received_spf));
+		if (res >= 0) {
+			pfs_metrics_count(PFS_C_PEER_HITS);
+			if (opts->debug > 1)
+				pfs_log(LOG_DEBUG, "Peer cache hit\n");
+			pf_response(opts, res, received_spf, comment, req, out, outlen);
+			goto done;
+		}
+		pfs_metrics_count(PFS_C_PEER_MISSES);
+		res = 0;
+	}
+
+	err = SPF_request_query_mailfrom(spf_request, &spf_response);
+	if (opts->debug > 1) 
+		response_print("Main query", spf_response);
+	if (err) {
+		if (opts->debug > 1)
+			response_print_errors("Failed to query MAIL-FROM",
+							spf_response, err);
+
+		RETURN_DUNNO("no SPF record found");
+	}
+
+#ifdef TO_MX /* This code returns usualy neutral and oferwrites a fail from the above spf code
+                which is not what we like. So we disable it for the time deing ... */
+                
+	if (req->rcpt_to != NULL  && *req->rcpt_to != '\0' ) {
+		p = req->rcpt_to;
+		p_end = p + strcspn(p, ",;");
+
+		/* This is some incarnation of 2mx mode. */
+		while (SPF_response_result(spf_response)!=SPF_RESULT_PASS) {
+			if (*p_end)
+				*p_end = '\0';
+			else
+				p_end = NULL;	/* Note this is last rcpt */
+
+			err = SPF_request_query_rcptto(spf_request,
+							&spf_response_2mx, p);
+			if (opts->debug > 1)
+				response_print("2mx query", spf_response_2mx);
+			if (err) {
+				response_print_errors("Failed to query RCPT-TO",
+								spf_response, err);
+				RETURN_ERROR;
+			}
+
+			spf_response = SPF_response_combine(spf_response,
+							spf_response_2mx);
+
+			if (!p_end)
+				break;
+			p = p_end + 1;
+		}
+	}
+#endif /* TO_MX */
+	/* We now have an option to call SPF_request_query_fallback */
+	if (opts->fallback) {
+		err = SPF_request_query_fallback(spf_request,
+						&spf_response_2mx, opts->fallback);
+		if (opts->debug > 1)
+			response_print("fallback query", spf_response_2mx);
+		if (err) {
+			response_print_errors("Failed to query best-guess",
+							spf_response_2mx, err);
+			FREE_RESPONSE(spf_response_2mx);
+			RETURN_ERROR;
+		}
+
+		spf_response = SPF_response_combine(spf_response,
+						spf_response_2mx);
+	}
+
+/*	printf( "R: %s\nSC: %s\nHC: %s\nRS: %s\n",
+		SPF_strresult(SPF_response_result(spf_response)),
+		X_OR_EMPTY(SPF_response_get_smtp_comment(spf_response)),
+		X_OR_EMPTY(SPF_response_get_header_comment(spf_response)),
+		X_OR_EMPTY(SPF_response_get_received_spf(spf_response))
+		);
+*/
+	res = SPF_response_result(spf_response);
+
+	/* Out of time: smtpd gets the configured answer instead of a 450 */
+	if (res == SPF_RESULT_TEMPERROR && pfs_dns_deadline_passed()) {
+		pfs_metrics_count(PFS_C_DEADLINE_EXCEEDED);
+		snprintf(out, outlen, "action=PREPEND X-Received-SPF: temperror (%s: no SPF result within %d ms) client-ip=%s; envelope-from=%s;\naction=%s\n\n",
+						opts->rec_dom, opts->deadline_ms, req->ip, req->sender, opts->deadline_action);
+		if (opts->debug)
+			pfs_log(LOG_INFO, "action=%s deadline exceeded (ip=%s from=%s helo=%s to=%s)\n",
+							opts->deadline_action, req->ip, req->sender, req->helo, req->rcpt_to);
+		goto done;
+	}
+
+	pf_response(opts, res, SPF_response_get_received_spf(spf_response),
+				pf_response_comment(spf_response), req, out, outlen);
+
+	/* A temporary error is worth retrying, anything else is kept a while */
+	if (helo_identity) {
+		if (opts->helo_memo && res != SPF_RESULT_TEMPERROR
+						&& snprintf(helo.received_spf, sizeof(helo.received_spf), "%s",
+								X_OR_EMPTY(SPF_response_get_received_spf(spf_response))) < (int)sizeof(helo.received_spf)
+						&& snprintf(helo.comment, sizeof(helo.comment), "%s",
+								pf_response_comment(spf_response)) < (int)sizeof(helo.comment)) {
+			helo.valid = TRUE;
+			helo.result = res;
+			pfs_helo_memo_put(opts->helo_memo, req->ip, req->helo, &helo);
+		}
+	} else if (res != SPF_RESULT_TEMPERROR) {
+		/* The others only have the domain, a fail may explain itself per sender */
+		shared = (opts->result_cache || opts->peer)
+						&& pfs_netblock_shared(opts, req, res, eval.records);
+		if (opts->result_cache && shared)
+			pfs_shm_cache_put(opts->result_cache, req, res, eval.ttl,
+							SPF_response_get_received_spf(spf_response),
+							pf_response_comment(spf_response));
+		if (opts->peer && shared)
+			pfs_peer_put(opts->peer, opts->peer_seed, req, res, eval.ttl,
+							SPF_response_get_received_spf(spf_response),
+							pf_response_comment(spf_response));
+		if (opts->netblock)
+			pfs_netblock_learn(opts->netblock, opts, spf_server->resolver, req, res,
+							eval.records, SPF_response_get_received_spf(spf_response),
+							pf_response_comment(spf_response));
+		if (opts->flatten)
+			pfs_flatten_learn(opts->flatten, opts, req, res, SPF_response_reason(spf_response),
+							SPF_response_get_received_spf(spf_response),
+							pf_response_comment(spf_response));
+	}
+
+  done:
+	pfs_dns_deadline_stop();
+	FREE_RESPONSE(spf_response);
+	FREE_REQUEST(spf_request);
+	pfs_metrics_result(res);
+	if (opts->profile)
+		pfs_profile_add(opts->profile, req, &eval);
+	pfs_metrics_eval_end(&eval);
+	return res;
+}
+
+/*
+ * stack our shared DNS and compiled record caches on top of resolver;
+ * SPF_dns_free on the result frees resolver as well
+ */
+SPF_dns_server_t *pf_dns_new(SPF_client_options_t *opts, SPF_dns_server_t *resolver)
+{
+	SPF_dns_server_t	*dns, *layer;
+	int				 debug = opts->debug > 2 ? opts->debug-2 : 0;
+
+	dns = pfs_dns_cache_layer_new(resolver, opts->dns_cache, NULL, debug);
+	if (dns == NULL)
+		dns = resolver;
+	if (opts->spf_cache && (layer = pfs_spf_cache_layer_new(dns, opts->spf_cache, NULL, debug)) != NULL)
+		dns = layer;
+	return dns;
+}
+
+/*
+ * set up the SPF configuration on dns, which pf_server_free_dns leaves
+ * to the caller
+ */
+SPF_server_t *pf_server_new_dns(SPF_client_options_t *opts, SPF_dns_server_t *dns)
+{
+	SPF_server_t	*spf_server;
+	SPF_dns_server_t	*layer;
+	SPF_response_t	*spf_response = NULL;
+	SPF_errcode_t	 err;
+	int				 debug = opts->debug > 2 ? opts->debug-2 : 0;
+
+	/* The domain maps belong to the configuration, not to the stack */
+	if (opts->override_map || opts->fallback_map) {
+		layer = pfs_domain_map_layer_new(dns, opts->override_map, opts->fallback_map, NULL, debug);
+		if (layer == NULL)
+			pfs_log(LOG_WARNING, "Running without the domain maps\n");
+		else
+			dns = layer;
+	}
+	spf_server = SPF_server_new_dns(dns, debug);
+
+	if ( opts->rec_dom )
+		SPF_server_set_rec_dom( spf_server, opts->rec_dom );
+	if ( opts->sanitize )
+		SPF_server_set_sanitize( spf_server, opts->sanitize );
+	if ( opts->max_lookup )
+		SPF_server_set_max_dns_mech(spf_server, opts->max_lookup);
+
+	if (opts->localpolicy) {
+		err = SPF_server_set_localpolicy( spf_server, opts->localpolicy, opts->use_trusted, &spf_response);
+		if ( err ) {
+			response_print_errors("Error setting local policy",
+							spf_response, err);
+		}
+		FREE_RESPONSE(spf_response);
+	}
+
+	err = SPF_server_set_explanation( spf_server, opts->explanation, &spf_response );
+	if ( err ) {
+	  response_print_errors("Error setting default explanation",
+	         spf_response, err);
+	}
+	FREE_RESPONSE(spf_response);
+
+	return spf_server;
+}
+
+/*
+ * set up the SPF configuration on top of resolver, which is stacked
+ * below our shared DNS and compiled record caches and freed by
+ * pf_server_free
+ */
+SPF_server_t *pf_server_new(SPF_client_options_t *opts, SPF_dns_server_t *resolver)
+{
+	return pf_server_new_dns(opts, pf_dns_new(opts, resolver));
+}
+
+void pf_server_free_dns(SPF_server_t *spf_server, SPF_dns_server_t *dns)
+{
+	SPF_dns_server_t	*layer = spf_server->resolver, *below;
+
+	SPF_server_free(spf_server);
+	/* Only the layers pf_server_new_dns put on top */
+	for (; layer != dns; layer = below) {
+		below = layer->layer_below;
+		layer->destroy(layer);
+	}
+}
+
+void pf_server_free(SPF_server_t *spf_server)
+{
+	SPF_dns_server_t	*dns = spf_server->resolver;
+
+	SPF_server_free(spf_server);
+	SPF_dns_free(dns);
+}
+
+
+int main( int argc, char *argv[] )
+{
+	SPF_client_options_t	*opts;
+	SPF_client_request_t	 req;
+	SPF_client_memo_t		 memo;
+
+	SPF_server_t	*spf_server = NULL;
+	pfs_config_t	*config = NULL;
+	SPF_dns_server_t	*resolver;
+
+	int  			 opt_keep_comments = 0;
+
 	int 			 request_limit=0;
+	uint64_t		 start;
 	int				 major, minor, patch;
 
 	int				 res = 0;
 	int				 c;
 
-	const char		*partial_result;
-	char			*result = NULL;
-	int				 result_len = 0;
 	char			hostname[255];
-	char			pf_result[100];
+	char			*response;
 	struct hostent		*fullhostname;
 
         /* Figure out our name */
@@ -439,6 +1066,8 @@ int main( int argc, char *argv[] )
 	
 	opts = (SPF_client_options_t *)malloc(sizeof(SPF_client_options_t));
 	memset(opts, 0, sizeof(SPF_client_options_t));
+	memset(&req, 0, sizeof(SPF_client_request_t));
+	pf_memo_init(&memo);
 
 	/*
 	 * check the arguments
@@ -485,12 +1114,110 @@ int main( int argc, char *argv[] )
 				opts->rec_dom = optarg;
 				break;
 
-			case 'a':
-				unimplemented('a');
+			case 'U':		/* postmaster@helo for bounces */
+				opts->helo_check = atoi(optarg);
+				break;
+
+			case 'a':		/* domain -> SPF record, instead of DNS */
+				opts->override_file = optarg;
+				break;
+
+			case 'z':		/* domain -> SPF record, if DNS has none */
+				opts->fallback_file = optarg;
+				break;
+
+			case 'f':		/* evaluate recorded requests */
+				opts->file = optarg;
+				break;
+
+			case 'L':		/* run as daemon on this socket */
+				opts->listen = optarg;
 				break;
 
-			case 'z':
-				unimplemented('z');
+			case 'W':
+				opts->workers = atoi(optarg);
+				break;
+
+			case 'I':
+				opts->max_inflight = atoi(optarg);
+				break;
+
+			case 'D':		/* name servers to query */
+				opts->dns_servers = optarg;
+				break;
+
+			case 'S':
+				opts->shm_cache = optarg;
+				break;
+
+			case 'C':
+				opts->cache_snapshot = optarg;
+				break;
+
+			case 'E':
+				opts->peers = optarg;
+				break;
+
+			case 'J':
+				opts->peer_listen = optarg;
+				break;
+
+			case 'O':
+				opts->peer_timeout_ms = atoi(optarg);
+				break;
+
+			case 'M':
+				opts->stats = optarg;
+				break;
+
+			case 'A':
+				opts->allowlist_file = optarg;
+				break;
+
+			case 'B':
+				opts->denylist_file = optarg;
+				break;
+
+			case 'T':
+				opts->deadline_ms = atoi(optarg);
+				break;
+
+			case 'F':
+				opts->deadline_action = optarg;
+				break;
+
+			case 'N':
+				opts->shed_inflight = atoi(optarg);
+				break;
+
+			case 'Q':
+				opts->shed_delay_ms = atoi(optarg);
+				break;
+
+			case 'P':
+				opts->shed_action = optarg;
+				break;
+
+			case 'H':
+				opts->dns_hedge = atoi(optarg);
+				break;
+
+			case 'G':
+				if (optarg == NULL)
+					opts->async_log = PFS_LOG_SLOTS;
+				else
+					opts->async_log = atoi(optarg);
+				break;
+
+			case 'K':
+				if (optarg == NULL)
+					opts->top_domains = PFS_PROFILE_TOP;
+				else
+					opts->top_domains = atoi(optarg);
+				break;
+
+			case 'R':
+				opts->config_file = optarg;
 				break;
 
 
@@ -537,51 +1264,99 @@ int main( int argc, char *argv[] )
 		FAIL_ERROR;
 	}
 
+	if (opts->workers && !opts->listen && !opts->file)
+		fprintf(stderr, "Warning: --workers is only used together with --listen or --file\n");
+	if (opts->stats && !opts->listen)
+		fprintf(stderr, "Warning: --stats is only used together with --listen\n");
+	if ((opts->shed_inflight || opts->shed_delay_ms) && !opts->listen)
+		fprintf(stderr, "Warning: --shed-inflight and --shed-delay-ms are only used together with --listen\n");
+	if (opts->top_domains && !opts->listen && !opts->file)
+		fprintf(stderr, "Warning: --top-domains is only used together with --listen or --file\n");
+	if (opts->peer_listen && (!opts->listen || !opts->peers))
+		fprintf(stderr, "Warning: --peer-listen is only used together with --listen and --peers\n");
+
+	if (opts->async_log > 0 && pfs_log_start(opts->async_log) < 0)
+		fprintf(stderr, "Can not log asynchronously, see syslog\n");
+
 	if (!opts->rec_dom) {
   	  gethostname(hostname, 255);
 	  fullhostname = gethostbyname(hostname);
 	
 	  if (opts->debug > 1)
-	    syslog(LOG_DEBUG, "Hostname: %s\n",fullhostname->h_name);
+	    pfs_log(LOG_DEBUG, "Hostname: %s\n",fullhostname->h_name);
 
 	  opts->rec_dom = fullhostname->h_name;
 	}
 
-	/*
-	 * set up the SPF configuration
-	 */
+	if ( !opts->explanation ) {
+	  opts->explanation = DEFAULT_EXPLANATION;
+	}
 
-	spf_server = SPF_server_new(SPF_DNS_CACHE, opts->debug > 2 ? opts->debug-2 : 0);
+	if (opts->max_inflight <= 0)
+		opts->max_inflight = DEFAULT_MAX_INFLIGHT;
+	if (!opts->deadline_action)
+		opts->deadline_action = POSTFIX_DUNNO;
+	if (!opts->shed_action)
+		opts->shed_action = POSTFIX_DUNNO;
+	if (opts->dns_hedge < 0 || opts->dns_hedge > 100) {
+		fprintf(stderr, "--dns-hedge must be a percentile between 1 and 100\n");
+		FAIL_ERROR;
+	}
 
-	if ( opts->rec_dom )
-		SPF_server_set_rec_dom( spf_server, opts->rec_dom );
-	if ( opts->sanitize )
-		SPF_server_set_sanitize( spf_server, opts->sanitize );
-	if ( opts->max_lookup )
-		SPF_server_set_max_dns_mech(spf_server, opts->max_lookup);
+	opts->dns_cache = pfs_dns_cache_new();
+	opts->spf_cache = pfs_spf_cache_new(RECORD_CACHE_SIZE);
+	if (opts->cache_snapshot)
+		pfs_dns_cache_load(opts->dns_cache, opts->cache_snapshot);
+	if (opts->top_domains > 0 && (opts->listen || opts->file))
+		opts->profile = pfs_profile_new(opts->top_domains);
+	/* Only a daemon answers the other peers */
+	if (opts->peers && (opts->peer = pfs_peer_new(opts->peers,
+					opts->listen ? opts->peer_listen : NULL, opts->peer_timeout_ms)) == NULL) {
+		fprintf(stderr, "Can not set up the peer cache, see syslog\n");
+		FAIL_ERROR;
+	}
 
-	if (opts->localpolicy) {
-		err = SPF_server_set_localpolicy( spf_server, opts->localpolicy, opts->use_trusted, &spf_response);
-		if ( err ) {
-			response_print_errors("Error setting local policy",
-							spf_response, err);
-			WARN_ERROR;
-		}
-		FREE_RESPONSE(spf_response);
+	if (pfs_config_init(opts) < 0) {
+		fprintf(stderr, "Can not load the configuration, see syslog\n");
+		FAIL_ERROR;
 	}
 
+	/*
+	 * in daemon mode the event loop serves all requests
+	 */
 
-	if ( !opts->explanation ) {
-	  opts->explanation = DEFAULT_EXPLANATION;
+	if (opts->listen) {
+		if (opts->stats && pfs_metrics_start(opts->stats) < 0)
+			fprintf(stderr, "Can not publish metrics on %s\n", opts->stats);
+		if (opts->profile && pfs_profile_start(opts->profile) < 0)
+			fprintf(stderr, "Can not report the sender domains, see syslog\n");
+		res = pfs_daemon_run(opts);
+		goto error;
 	}
-	
-	err = SPF_server_set_explanation( spf_server, opts->explanation, &spf_response );
-	if ( err ) {
-	  response_print_errors("Error setting default explanation",
-	         spf_response, err);
-	  WARN_ERROR;
+
+	if (opts->file) {
+		res = pfs_replay_run(opts, opts->file);
+		goto error;
 	}
-	FREE_RESPONSE(spf_response);
+
+	/*
+	 * one request at a time: libspf2's own resolver does, unless an
+	 * option needs ours
+	 */
+	config = pfs_config_acquire();
+	if (opts->dns_servers || opts->dns_hedge > 0 || config->opts.deadline_ms > 0) {
+		resolver = pfs_dns_async_new(NULL, "async",
+						opts->debug > 2 ? opts->debug-2 : 0, opts->dns_servers);
+		if (resolver != NULL)
+			pfs_dns_async_set_hedge(resolver, opts->dns_hedge);
+	}
+	else
+		resolver = SPF_dns_resolv_new(NULL, "resolv", opts->debug > 2 ? opts->debug-2 : 0);
+	if (resolver == NULL) {
+		fprintf(stderr, "Can not set up the DNS resolver\n");
+		FAIL_ERROR;
+	}
+	spf_server = pf_server_new(&config->opts, resolver);
 
 	/*
 	 * process the SPF request
@@ -589,140 +1364,56 @@ int main( int argc, char *argv[] )
 
 	request_limit=0;
 
-	while ( request_limit < REQUEST_LIMIT ) {
+	/* Never exit with pipelined requests still unanswered in the buffer */
+	while ( request_limit < REQUEST_LIMIT || stdin_reader.off < stdin_reader.len ) {
 		request_limit++;	                                
-	        if (request_limit == 0) {
-  		  free(req);
-  		}
-		req = (SPF_client_request_t *)malloc(sizeof(SPF_client_request_t));
-		memset(req, 0, sizeof(SPF_client_request_t));
+		pf_request_reset(&req);
 		
-		if (read_request_from_pf(opts, req)) {
-		  syslog(LOG_WARNING, "IO Closed while reading, exiting");
+		if (read_request_from_pf(opts, &stdin_reader, &req, &stdout_batch)) {
+		  pfs_log(LOG_WARNING, "IO Closed while reading, exiting");
 		  EXIT_OK;
 		}
 		
 		if (opts->debug > 1)
-			syslog(LOG_DEBUG, "Reincarnation %d\n", request_limit);
+			pfs_log(LOG_DEBUG, "Reincarnation %d\n", request_limit);
 
-
-		/* We have to do this here else we leak on CONTINUE_ERROR */
-		FREE_REQUEST(spf_request);
-		FREE_RESPONSE(spf_response);
-
-		spf_request = SPF_request_new(spf_server);
-
-		if (SPF_request_set_ipv4_str(spf_request, req->ip) && SPF_request_set_ipv6_str(spf_request, req->ip)) {
-			syslog(LOG_WARNING, "Invalid IP address.\n" );
-			CONTINUE_ERROR;
-		}
-
-	  if (req->helo) {
-		if (SPF_request_set_helo_dom( spf_request, req->helo ) ) {
-			syslog(LOG_WARNING, "Invalid HELO domain.\n" );
-			CONTINUE_ERROR;
-		}
-	  }
-
-	  	if (strchr(req->sender, '@') > 0) {
-  		  if (SPF_request_set_env_from( spf_request, req->sender ) ) {
-			syslog(LOG_WARNING, "Invalid envelope from address.\n" );
-			CONTINUE_ERROR;
-		  }
-		} else { /* This is something we can not check*/ 
-                  CONTINUE_DUNNO("no valid email address found");
-                }
-
-		err = SPF_request_query_mailfrom(spf_request, &spf_response);
-		if (opts->debug > 1) 
-			response_print("Main query", spf_response);
-		if (err) {
-		  if (opts->debug > 1)
-			response_print_errors("Failed to query MAIL-FROM",
-							spf_response, err);
-
-			CONTINUE_DUNNO("no SPF record found");
-		}
-
-		if (result != NULL)
-			result[0] = '\0';
-		APPEND_RESULT(SPF_response_result(spf_response));
-		
-#ifdef TO_MX /* This code returns usualy neutral and oferwrites a fail from the above spf code
-                which is not what we like. So we disable it for the time deing ... */
-                
-		if (req->rcpt_to != NULL  && *req->rcpt_to != '\0' ) {
-			p = req->rcpt_to;
-			p_end = p + strcspn(p, ",;");
-
-			/* This is some incarnation of 2mx mode. */
-			while (SPF_response_result(spf_response)!=SPF_RESULT_PASS) {
-				if (*p_end)
-					*p_end = '\0';
-				else
-					p_end = NULL;	/* Note this is last rcpt */
-
-				err = SPF_request_query_rcptto(spf_request,
-								&spf_response_2mx, p);
-				if (opts->debug > 1)
-					response_print("2mx query", spf_response_2mx);
-				if (err) {
-					response_print_errors("Failed to query RCPT-TO",
-									spf_response, err);
-					CONTINUE_ERROR;
-				}
-
-				/* append the result */
-				APPEND_RESULT(SPF_response_result(spf_response_2mx));
-
-				spf_response = SPF_response_combine(spf_response,
-								spf_response_2mx);
-
-				if (!p_end)
-					break;
-				p = p_end + 1;
-			}
-		}
-#endif /* TO_MX */
-		/* We now have an option to call SPF_request_query_fallback */
-		if (opts->fallback) {
-			err = SPF_request_query_fallback(spf_request,
-							&spf_response, opts->fallback);
+		/* Further recipients of the same message get the same answer */
+		start = pfs_metrics_now();
+		if (pf_memo_match(&memo, &req)) {
+			pfs_metrics_count(PFS_C_MEMO_HITS);
 			if (opts->debug > 1)
-				response_print("fallback query", spf_response_2mx);
-			if (err) {
-				response_print_errors("Failed to query best-guess",
-								spf_response, err);
-				CONTINUE_ERROR;
-			}
-
-			/* append the result */
-			APPEND_RESULT(SPF_response_result(spf_response_2mx));
-
-			spf_response = SPF_response_combine(spf_response,
-							spf_response_2mx);
+				pfs_log(LOG_DEBUG, "Answer for instance %s reused\n", req.instance);
+			strcpy(pf_batch_slot(&stdout_batch), memo.response);
+			pf_batch_push(&stdout_batch);
+			pfs_metrics_since(PFS_H_RESPONSE, start);
+			continue;
 		}
 
-/*		printf( "R: %s\nSC: %s\nHC: %s\nRS: %s\n",
-			result,
-			X_OR_EMPTY(SPF_response_get_smtp_comment(spf_response)),
-			X_OR_EMPTY(SPF_response_get_header_comment(spf_response)),
-			X_OR_EMPTY(SPF_response_get_received_spf(spf_response))
-			);
-*/			
-		pf_response(opts, spf_response, req);
-			
-		res = SPF_response_result(spf_response);
-
-		fflush(stdout);
+		response = pf_batch_slot(&stdout_batch);
+		res = pf_evaluate(&config->opts, spf_server, &req, response, RESPONSESIZE);
+		pf_memo_store(&memo, &req, response);
+		pf_batch_push(&stdout_batch);
+		pfs_metrics_since(PFS_H_RESPONSE, start);
 	}
 
   error:
-	FREE(result, free);
-	FREE_RESPONSE(spf_response);
-	FREE_REQUEST(spf_request);
-	FREE(spf_server, SPF_server_free);
-
-	syslog(LOG_INFO, "Terminating with result %d, Reincarnation: %d\n", res, request_limit);
+	pfs_metrics_stop();
+	if (opts->profile)
+		pfs_profile_stop(opts->profile);
+	pf_batch_flush(&stdout_batch);
+	pf_request_reset(&req);
+	pf_memo_reset(&memo);
+	FREE(spf_server, pf_server_free);
+	FREE(config, pfs_config_release);
+	pfs_config_shutdown();
+	if (opts->dns_cache && opts->cache_snapshot)
+		pfs_dns_cache_save(opts->dns_cache, opts->cache_snapshot);
+	FREE(opts->dns_cache, pfs_dns_cache_free);
+	FREE(opts->spf_cache, pfs_spf_cache_free);
+	FREE(opts->peer, pfs_peer_free);
+	FREE(opts->profile, pfs_profile_free);
+
+	pfs_log(LOG_INFO, "Terminating with result %d, Reincarnation: %d\n", res, request_limit);
+	pfs_log_stop();
 	return res;
 }
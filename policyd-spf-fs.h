@@ -0,0 +1,137 @@
+/*
+ * policyd-spf-fs - SPF Policy Deamon for Postfix
+ *
+ *  Shared definitions between the request loop and the daemon mode.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU Lesser General Public License
+ * version 2.1 (or later) or the two-clause BSD license. See
+ * policyd-spf-fs.c for the full text.
+ */
+
+#ifndef POLICYD_SPF_FS_H
+#define POLICYD_SPF_FS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spf.h"
+#include "spf_dns.h"
+
+#include "pfs_arena.h"
+
+#define TRUE 1
+#define FALSE 0
+
+#define RESULTSIZE      1024
+/* A response is at most a PREPEND line, an action line and the blank line */
+#define RESPONSESIZE    (3 * RESULTSIZE)
+
+typedef struct pfs_shm_cache_struct pfs_shm_cache_t;
+typedef struct pfs_dns_cache_struct pfs_dns_cache_t;
+typedef struct pfs_spf_cache_struct pfs_spf_cache_t;
+typedef struct pfs_iplist_struct pfs_iplist_t;
+typedef struct pfs_domain_map_struct pfs_domain_map_t;
+typedef struct pfs_helo_memo_struct pfs_helo_memo_t;
+typedef struct pfs_netblock_struct pfs_netblock_t;
+typedef struct pfs_flatten_struct pfs_flatten_t;
+typedef struct pfs_peer_struct pfs_peer_t;
+typedef struct pfs_profile_struct pfs_profile_t;
+
+typedef
+struct SPF_client_options_struct {
+	// void		*hook;
+	char		*localpolicy;
+	const char	*explanation;
+	const char	*fallback;
+	const char	*rec_dom;
+	const char	*listen;
+	const char	*file;		/* batch mode input */
+	const char	*config_file;
+	const char	*dns_servers;
+	const char	*shm_cache;
+	pfs_shm_cache_t	*result_cache;
+	const char	*cache_snapshot;
+	pfs_dns_cache_t	*dns_cache;
+	pfs_spf_cache_t	*spf_cache;
+	const char	*allowlist_file;
+	const char	*denylist_file;
+	pfs_iplist_t	*iplist;
+	const char	*override_file;
+	const char	*fallback_file;
+	pfs_domain_map_t	*override_map;
+	pfs_domain_map_t	*fallback_map;
+	pfs_helo_memo_t	*helo_memo;
+	pfs_netblock_t	*netblock;
+	pfs_flatten_t	*flatten;
+	const char	*peers;
+	const char	*peer_listen;
+	int			 peer_timeout_ms;
+	pfs_peer_t	*peer;
+	uint64_t	 peer_seed;	/* of the options, per generation */
+	const char	*stats;
+	int			 top_domains;	/* 0: no profile */
+	pfs_profile_t	*profile;
+	const char	*deadline_action;
+	int			 deadline_ms;
+	const char	*shed_action;
+	int			 shed_inflight;	/* 0: no limit */
+	int			 shed_delay_ms;	/* 0: no limit */
+	int			 dns_hedge;
+	int			 async_log;	/* ring slots, 0: log synchronously */
+	int			 workers;
+	int			 max_inflight;
+	int 		 use_trusted;
+	int			 max_lookup;
+	int			 sanitize;
+	int			 helo_check;	/* null senders by their HELO name */
+	int			 debug;
+} SPF_client_options_t;
+
+/*
+ * The attributes point into the buffer the request was read into, or
+ * into an arena when the request has to outlive that buffer.
+ */
+typedef
+struct SPF_client_request_struct {
+	char		*ip;
+	char		*sender;
+	char		*helo;
+	char		*rcpt_to;
+	char		*instance;
+} SPF_client_request_t;
+
+/*
+ * The answer for the message currently being received. Postfix asks
+ * once per recipient with the same instance attribute, all but the
+ * first are answered from here.
+ */
+typedef
+struct SPF_client_memo_struct {
+	SPF_client_request_t req;	/* instance, ip and sender only */
+	char		 response[RESPONSESIZE];
+	pfs_arena_t	 arena;		/* holds the values of req */
+	char		 space[512];
+} SPF_client_memo_t;
+
+/* policyd-spf-fs.c */
+SPF_dns_server_t *pf_dns_new(SPF_client_options_t *opts, SPF_dns_server_t *resolver);
+SPF_server_t *pf_server_new_dns(SPF_client_options_t *opts, SPF_dns_server_t *dns);
+void pf_server_free_dns(SPF_server_t *spf_server, SPF_dns_server_t *dns);
+SPF_server_t *pf_server_new(SPF_client_options_t *opts, SPF_dns_server_t *resolver);
+void pf_server_free(SPF_server_t *spf_server);
+int pf_parse_attr(SPF_client_options_t *opts, SPF_client_request_t *req, char *line);
+size_t pf_parse_request(SPF_client_options_t *opts, SPF_client_request_t *req,
+				char *buf, size_t len, int *args);
+void pf_request_reset(SPF_client_request_t *req);
+void pf_request_copy(SPF_client_request_t *dst, SPF_client_request_t *src, pfs_arena_t *arena);
+int pf_evaluate(SPF_client_options_t *opts, SPF_server_t *spf_server,
+				SPF_client_request_t *req, char *out, size_t outlen);
+int pf_request_same_message(SPF_client_request_t *a, SPF_client_request_t *b);
+int pf_request_same_evaluation(SPF_client_request_t *a, SPF_client_request_t *b);
+int pf_memo_match(SPF_client_memo_t *memo, SPF_client_request_t *req);
+void pf_memo_store(SPF_client_memo_t *memo, SPF_client_request_t *req, const char *response);
+void pf_memo_init(SPF_client_memo_t *memo);
+void pf_memo_reset(SPF_client_memo_t *memo);
+
+#endif